@@ -16,6 +16,7 @@ LOCAL_SRC_FILES := \
     mounts.c \
     extendedcommands.c \
     nandroid.c \
+    nandroid_delta.c \
     nandroid_md5.c \
     reboot.c \
     ../../system/core/toolbox/dynarray.c \
@@ -127,12 +128,21 @@ LOCAL_CFLAGS += -DUSE_F2FS
 LOCAL_STATIC_LIBRARIES += libmake_f2fs libfsck_f2fs libfibmap_f2fs
 endif
 
+# libapplypatch makes and applies the raw image deltas in nandroid_delta.c
+LOCAL_STATIC_LIBRARIES += libapplypatch libbz libminelf
+ifeq ($(BOARD_RECOVERY_USES_ZSTD),true)
+LOCAL_STATIC_LIBRARIES += libzstd
+endif
+
 LOCAL_STATIC_LIBRARIES += libminzip libunz libmincrypt
+ifeq ($(BOARD_RECOVERY_USES_LIBDEFLATE),true)
+LOCAL_STATIC_LIBRARIES += libdeflate
+endif
 
 LOCAL_STATIC_LIBRARIES += libminizip libminadbd libedify libbusybox libmkyaffs2image libunyaffs liberase_image libdump_image libflash_image
 LOCAL_LDFLAGS += -Wl,--no-fatal-warnings
 
-LOCAL_STATIC_LIBRARIES += libfs_mgr libdedupe libcrypto_static libcrecovery libflashutils libmtdutils libmmcutils libbmlutils
+LOCAL_STATIC_LIBRARIES += libfs_mgr libdedupe libcrypto_static libcrecovery libflashutils libmtdutils libmmcutils libbmlutils libblkio
 
 ifeq ($(BOARD_USES_BML_OVER_MTD),true)
 LOCAL_STATIC_LIBRARIES += libbml_over_mtd
@@ -15,12 +15,21 @@
 LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 
-LOCAL_SRC_FILES := applypatch.c bspatch.c freecache.c imgpatch.c utils.c
+LOCAL_SRC_FILES := applypatch.c batchcheck.c bsdiff.c bspatch.c freecache.c imgpatch.c utils.c
 LOCAL_MODULE := libapplypatch
 LOCAL_MODULE_TAGS := eng
 LOCAL_C_INCLUDES += external/bzip2 external/zlib $(LOCAL_PATH)/..
 LOCAL_STATIC_LIBRARIES += libmtdutils libmincrypt libbz libz
 
+# Set BOARD_RECOVERY_USES_ZSTD := true to accept "BSDF2" patches with
+# zstd payloads (and let the host imgdiff write them with -c zstd).
+# Executables linking libapplypatch must then add libzstd to their
+# static libraries.
+ifeq ($(BOARD_RECOVERY_USES_ZSTD),true)
+LOCAL_CFLAGS += -DUSE_ZSTD
+LOCAL_C_INCLUDES += external/zstd/lib
+endif
+
 include $(BUILD_STATIC_LIBRARY)
 
 include $(CLEAR_VARS)
@@ -28,7 +37,13 @@ include $(CLEAR_VARS)
 LOCAL_SRC_FILES := main.c
 LOCAL_MODULE := applypatch
 LOCAL_C_INCLUDES += $(LOCAL_PATH)/..
-LOCAL_STATIC_LIBRARIES += libapplypatch libmtdutils libmincrypt libbz libminelf
+LOCAL_STATIC_LIBRARIES += libapplypatch libmtdutils libmincrypt libbz libminelf libminzip
+ifeq ($(BOARD_RECOVERY_USES_LIBDEFLATE),true)
+LOCAL_STATIC_LIBRARIES += libdeflate
+endif
+ifeq ($(BOARD_RECOVERY_USES_ZSTD),true)
+LOCAL_STATIC_LIBRARIES += libzstd
+endif
 LOCAL_SHARED_LIBRARIES += libz libcutils libstdc++ libc
 
 include $(BUILD_EXECUTABLE)
@@ -40,7 +55,13 @@ LOCAL_MODULE := applypatch_static
 LOCAL_FORCE_STATIC_EXECUTABLE := true
 LOCAL_MODULE_TAGS := eng
 LOCAL_C_INCLUDES += $(LOCAL_PATH)/..
-LOCAL_STATIC_LIBRARIES += libapplypatch libmtdutils libmincrypt libbz libminelf
+LOCAL_STATIC_LIBRARIES += libapplypatch libmtdutils libmincrypt libbz libminelf libminzip
+ifeq ($(BOARD_RECOVERY_USES_LIBDEFLATE),true)
+LOCAL_STATIC_LIBRARIES += libdeflate
+endif
+ifeq ($(BOARD_RECOVERY_USES_ZSTD),true)
+LOCAL_STATIC_LIBRARIES += libzstd
+endif
 LOCAL_STATIC_LIBRARIES += libz libcutils libstdc++ libc
 
 include $(BUILD_EXECUTABLE)
@@ -52,5 +73,11 @@ LOCAL_MODULE := imgdiff
 LOCAL_FORCE_STATIC_EXECUTABLE := true
 LOCAL_C_INCLUDES += external/zlib external/bzip2
 LOCAL_STATIC_LIBRARIES += libz libbz
+ifeq ($(BOARD_RECOVERY_USES_ZSTD),true)
+LOCAL_CFLAGS += -DUSE_ZSTD
+LOCAL_C_INCLUDES += external/zstd/lib
+LOCAL_STATIC_LIBRARIES += libzstd
+endif
+LOCAL_LDLIBS += -lpthread
 
 include $(BUILD_HOST_EXECUTABLE)
@@ -20,13 +20,19 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/statfs.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <linux/fs.h>
 
 #include "mincrypt/sha.h"
 #include "applypatch.h"
+#include "bsdiff.h"
 #include "mtdutils/mtdutils.h"
 #include "edify/expr.h"
 
@@ -44,15 +50,19 @@ static int GenerateTarget(FileContents* source_file,
 
 static int mtd_partitions_scanned = 0;
 
-// Read a file into memory; optionally (retouch_flag == RETOUCH_DO_MASK) mask
-// the retouched entries back to their original value (such that SHA-1 checks
-// don't fail due to randomization); store the file contents and associated
-// metadata in *file.
-//
-// Return 0 on success.
-int LoadFileContents(const char* filename, FileContents* file,
-                     int retouch_flag) {
+// Does this file end in the trailer of a retouched binary (see
+// minelf/Retouch.c)?  Those have to be masked in memory before their
+// SHA-1 is taken.
+static int IsRetouched(const unsigned char* data, ssize_t size) {
+    return size >= 20 &&
+        memcmp(data + size - 20, "RETOUCH ", 8) == 0 &&
+        memcmp(data + size - 4, "PRE ", 4) == 0;
+}
+
+static int ReadFileContents(const char* filename, FileContents* file,
+                            int retouch_flag, int map) {
     file->data = NULL;
+    file->fd = -1;
 
     // A special 'filename' beginning with "MTD:" or "EMMC:" means to
     // load the contents of a partition.
@@ -67,6 +77,32 @@ int LoadFileContents(const char* filename, FileContents* file,
     }
 
     file->size = file->st.st_size;
+
+    if (map && file->size > 0) {
+        int fd = open(filename, O_RDONLY);
+        if (fd < 0) {
+            printf("failed to open \"%s\": %s\n", filename, strerror(errno));
+            return -1;
+        }
+        void* data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            printf("failed to mmap \"%s\": %s\n", filename, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        if (retouch_flag && IsRetouched(data, file->size)) {
+            // Masking writes to the data; read it the ordinary way.
+            munmap(data, file->size);
+            close(fd);
+        } else {
+            madvise(data, file->size, MADV_SEQUENTIAL);
+            file->data = data;
+            file->fd = fd;
+            SHA_hash(file->data, file->size, file->sha1);
+            return 0;
+        }
+    }
+
     file->data = malloc(file->size);
 
     FILE* f = fopen(filename, "rb");
@@ -105,6 +141,38 @@ int LoadFileContents(const char* filename, FileContents* file,
     return 0;
 }
 
+// Read a file into memory; optionally (retouch_flag == RETOUCH_DO_MASK) mask
+// the retouched entries back to their original value (such that SHA-1 checks
+// don't fail due to randomization); store the file contents and associated
+// metadata in *file.  file->data is malloc'ed.
+//
+// Return 0 on success.
+int LoadFileContents(const char* filename, FileContents* file,
+                     int retouch_flag) {
+    return ReadFileContents(filename, file, retouch_flag, 0);
+}
+
+// Like LoadFileContents(), but a regular file is mmapped read-only
+// rather than read into memory (unless it needs masking), so its pages
+// can be dropped and reread as the patch goes instead of all staying
+// resident.  Release the contents with FreeFileContents().
+int MapFileContents(const char* filename, FileContents* file,
+                    int retouch_flag) {
+    return ReadFileContents(filename, file, retouch_flag, 1);
+}
+
+void FreeFileContents(FileContents* file) {
+    if (file->data == NULL) return;
+    if (file->fd >= 0) {
+        munmap(file->data, file->size);
+        close(file->fd);
+    } else {
+        free(file->data);
+    }
+    file->data = NULL;
+    file->fd = -1;
+}
+
 static size_t* size_array;
 // comparison function for qsort()ing an int array of indexes into
 // size_array[].
@@ -225,9 +293,10 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
     SHA_init(&sha_ctx);
     uint8_t parsed_sha[SHA_DIGEST_SIZE];
 
-    // allocate enough memory to hold the largest size.
-    file->data = malloc(size[index[pairs-1]]);
-    char* p = (char*)file->data;
+    // The buffer is grown to each candidate size as we get to it, so
+    // we only ever hold as much as the size that actually matches
+    // rather than the largest one listed.
+    file->data = NULL;
     file->size = 0;                // # bytes read so far
 
     for (i = 0; i < pairs; ++i) {
@@ -237,6 +306,16 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
         size_t next = size[index[i]] - file->size;
         size_t read = 0;
         if (next > 0) {
+            unsigned char* grown = realloc(file->data, size[index[i]]);
+            if (grown == NULL) {
+                printf("failed to alloc %ld bytes for partition \"%s\"\n",
+                       (long)size[index[i]], partition);
+                free(file->data);
+                file->data = NULL;
+                return -1;
+            }
+            file->data = grown;
+            char* p = (char*)file->data + file->size;
             switch (type) {
                 case MTD:
                     read = mtd_read_data(ctx, p, next);
@@ -278,8 +357,6 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
                    size[index[i]], sha1sum[index[i]]);
             break;
         }
-
-        p += read;
     }
 
     switch (type) {
@@ -322,6 +399,39 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
 }
 
 
+// Copy the first 'len' bytes of in_fd to out_fd within the kernel.
+// Return 0 on success, -1 on error, or 1 if neither copy_file_range()
+// nor sendfile() can be used on these files (and nothing was copied).
+static int CopyFileData(int in_fd, int out_fd, size_t len) {
+    size_t done = 0;
+
+#ifdef __NR_copy_file_range
+    while (done < len) {
+        loff_t in_offset = done;
+        ssize_t copied = syscall(__NR_copy_file_range, in_fd, &in_offset,
+                                 out_fd, NULL, len - done, 0);
+        if (copied < 0 && errno == EINTR) continue;
+        if (copied <= 0) break;
+        done += copied;
+    }
+#endif
+
+    while (done < len) {
+        off_t in_offset = done;
+        ssize_t copied = sendfile(out_fd, in_fd, &in_offset, len - done);
+        if (copied < 0 && errno == EINTR) continue;
+        if (copied <= 0) {
+            if (done == 0 && copied < 0 &&
+                (errno == EINVAL || errno == ENOSYS)) {
+                return 1;
+            }
+            return -1;
+        }
+        done += copied;
+    }
+    return 0;
+}
+
 // Save the contents of the given FileContents object under the given
 // filename.  Return 0 on success.
 int SaveFileContents(const char* filename, const FileContents* file) {
@@ -332,7 +442,23 @@ int SaveFileContents(const char* filename, const FileContents* file) {
         return -1;
     }
 
-    ssize_t bytes_written = FileSink(file->data, file->size, &fd);
+    // A mapped file is copied straight from the file it was mapped
+    // from, so none of it has to be paged in here.
+    int copied = 1;
+    if (file->fd >= 0) {
+        copied = CopyFileData(file->fd, fd, file->size);
+        if (copied < 0) {
+            printf("failed to copy to \"%s\": %s\n",
+                   filename, strerror(errno));
+            close(fd);
+            return -1;
+        }
+    }
+
+    ssize_t bytes_written = file->size;
+    if (copied != 0) {
+        bytes_written = FileSink(file->data, file->size, &fd);
+    }
     if (bytes_written != file->size) {
         printf("short write of \"%s\" (%ld bytes of %ld) (%s)\n",
                filename, (long)bytes_written, (long)file->size,
@@ -355,6 +481,164 @@ int SaveFileContents(const char* filename, const FileContents* file) {
     return 0;
 }
 
+// EMMC writes are checked a block of this many bytes at a time: the
+// SHA-1 of each block is taken as it is written, then the partition is
+// read back with the page cache bypassed and each block compared with
+// its digest.  Only the blocks that fail are written again.
+#define VERIFY_BLOCK_SIZE (1 << 20)
+
+// O_DIRECT reads must be aligned to the device's logical block size;
+// this is a multiple of any we expect to see.
+#define VERIFY_ALIGNMENT 4096
+
+typedef struct {
+    size_t count;               // # blocks with digests
+    size_t alloc;
+    uint8_t (*sha1)[SHA_DIGEST_SIZE];
+    unsigned char* bad;         // per block; NULL until a verify fails
+} BlockDigests;
+
+// Record the digest of 'len' bytes of 'data' as that of 'block'.
+// Return 0 on success, or -1 (leaving 'bd' as it was) if the digest
+// array can't be grown.
+static int SetBlockDigest(BlockDigests* bd, size_t block,
+                          const unsigned char* data, size_t len) {
+    if (block >= bd->alloc) {
+        size_t alloc = block < 32 ? 64 : block * 2;
+        uint8_t (*sha1)[SHA_DIGEST_SIZE] =
+            realloc(bd->sha1, alloc * SHA_DIGEST_SIZE);
+        if (sha1 == NULL) {
+            printf("failed to alloc digests for %ld blocks\n", (long)alloc);
+            return -1;
+        }
+        bd->sha1 = sha1;
+        bd->alloc = alloc;
+    }
+    SHA_hash(data, len, bd->sha1[block]);
+    if (block >= bd->count) bd->count = block + 1;
+    return 0;
+}
+
+static void FreeBlockDigests(BlockDigests* bd) {
+    free(bd->sha1);
+    free(bd->bad);
+    memset(bd, 0, sizeof(*bd));
+}
+
+// Should 'block' be written on this pass?  Every block is, until a
+// verification has failed; after that only the blocks that failed are.
+static int BlockNeedsWrite(const BlockDigests* bd, size_t block) {
+    return bd->bad == NULL || block >= bd->count || bd->bad[block];
+}
+
+// Read back the first 'len' bytes of the EMMC partition and check each
+// block written on the last pass against its digest, recording the
+// ones that don't match in bd->bad.  Return the number of bad blocks,
+// or -1 if the partition can't be read at all.
+static int VerifyBlocks(const char* partition, size_t len, BlockDigests* bd) {
+    int direct = 1;
+    int fd = open(partition, O_RDONLY | O_DIRECT);
+    if (fd < 0 && errno == EINVAL) {
+        // No O_DIRECT here; flush the device's buffers before reading
+        // instead.  (A regular file, in tests, is read from the cache.)
+        direct = 0;
+        fd = open(partition, O_RDONLY);
+        if (fd >= 0) {
+            ioctl(fd, BLKFLSBUF, 0);
+        }
+    }
+    if (fd < 0) {
+        printf("failed to open %s: %s\n", partition, strerror(errno));
+        return -1;
+    }
+
+    unsigned char* buffer;
+    if (posix_memalign((void**)&buffer, VERIFY_ALIGNMENT,
+                       VERIFY_BLOCK_SIZE) != 0) {
+        printf("failed to alloc %d bytes for verify\n", VERIFY_BLOCK_SIZE);
+        close(fd);
+        return -1;
+    }
+
+    unsigned char* failed = calloc(bd->count ? bd->count : 1, 1);
+    if (failed == NULL) {
+        printf("failed to alloc %ld bytes for verify\n", (long)bd->count);
+        free(buffer);
+        close(fd);
+        return -1;
+    }
+    int bad = 0;
+    size_t block;
+    for (block = 0; block < bd->count; ++block) {
+        if (!BlockNeedsWrite(bd, block)) continue;
+
+        off_t offset = (off_t)block * VERIFY_BLOCK_SIZE;
+        size_t want = len - offset;
+        if (want > VERIFY_BLOCK_SIZE) want = VERIFY_BLOCK_SIZE;
+        size_t aligned = (want + VERIFY_ALIGNMENT - 1) & ~(VERIFY_ALIGNMENT - 1);
+
+        size_t got = 0;
+        while (got < want) {
+            ssize_t read_count = pread(fd, buffer + got, aligned - got,
+                                       offset + got);
+            if (read_count < 0 && errno == EINTR) continue;
+            if (read_count <= 0) {
+                printf("verify read error %s at %ld: %s\n",
+                       partition, (long)(offset + got),
+                       read_count < 0 ? strerror(errno) : "unexpected EOF");
+                break;
+            }
+            // O_DIRECT needs the buffer and offset of the next read
+            // aligned too, so after a short read go back to the last
+            // aligned boundary and read the rest of the block from
+            // there.
+            size_t next = got + read_count;
+            if (direct && next < want) {
+                next &= ~(size_t)(VERIFY_ALIGNMENT - 1);
+                if (next <= got) {
+                    printf("verify read error %s at %ld: short read\n",
+                           partition, (long)(offset + got));
+                    break;
+                }
+            }
+            got = next;
+        }
+
+        uint8_t sha1[SHA_DIGEST_SIZE];
+        if (got < want ||
+            memcmp(SHA_hash(buffer, want, sha1), bd->sha1[block],
+                   SHA_DIGEST_SIZE) != 0) {
+            printf("verification of %s failed at %ld-%ld\n", partition,
+                   (long)offset, (long)(offset + want));
+            failed[block] = 1;
+            ++bad;
+        }
+    }
+
+    free(buffer);
+    close(fd);
+    free(bd->bad);
+    bd->bad = failed;
+    return bad;
+}
+
+// Write all of 'len' bytes at 'offset' in 'fd'.  Return 0 on success.
+static int WriteBlockAt(int fd, const unsigned char* data, size_t len,
+                        off_t offset, const char* partition) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t written = pwrite(fd, data + done, len - done, offset + done);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            printf("failed write writing to %s (%s)\n",
+                   partition, strerror(errno));
+            return -1;
+        }
+        done += written;
+    }
+    return 0;
+}
+
 // Write a memory buffer to 'target' partition, a string of the form
 // "MTD:<partition>[:...]" or "EMMC:<partition_device>:".  Return 0 on
 // success.
@@ -422,102 +706,275 @@ int WriteToPartition(unsigned char* data, size_t len,
 
         case EMMC:
         {
-            size_t start = 0;
-            int success = 0;
-            int fd = open(partition, O_RDWR);
+            int fd = open(partition, O_WRONLY);
             if (fd < 0) {
                 printf("failed to open %s: %s\n", partition, strerror(errno));
                 return -1;
             }
-            int attempt;
 
+            BlockDigests digests;
+            memset(&digests, 0, sizeof(digests));
+            size_t block;
+            for (block = 0; (size_t)block * VERIFY_BLOCK_SIZE < len; ++block) {
+                size_t start = block * VERIFY_BLOCK_SIZE;
+                size_t to_write = len - start;
+                if (to_write > VERIFY_BLOCK_SIZE) to_write = VERIFY_BLOCK_SIZE;
+                if (SetBlockDigest(&digests, block, data + start,
+                                   to_write) != 0) {
+                    close(fd);
+                    FreeBlockDigests(&digests);
+                    return -1;
+                }
+            }
+
+            int bad = -1;
+            int attempt;
             for (attempt = 0; attempt < 2; ++attempt) {
-                lseek(fd, start, SEEK_SET);
-                while (start < len) {
+                for (block = 0; block < digests.count; ++block) {
+                    if (!BlockNeedsWrite(&digests, block)) continue;
+                    size_t start = block * VERIFY_BLOCK_SIZE;
                     size_t to_write = len - start;
-                    if (to_write > 1<<20) to_write = 1<<20;
-
-                    ssize_t written = write(fd, data+start, to_write);
-                    if (written < 0) {
-                        if (errno == EINTR) {
-                            written = 0;
-                        } else {
-                            printf("failed write writing to %s (%s)\n",
-                                   partition, strerror(errno));
-                            return -1;
-                        }
+                    if (to_write > VERIFY_BLOCK_SIZE) to_write = VERIFY_BLOCK_SIZE;
+                    if (WriteBlockAt(fd, data + start, to_write, start,
+                                     partition) != 0) {
+                        close(fd);
+                        FreeBlockDigests(&digests);
+                        return -1;
                     }
-                    start += written;
                 }
-                fsync(fd);
-
-                // drop caches so our subsequent verification read
-                // won't just be reading the cache.
-                sync();
-                int dc = open("/proc/sys/vm/drop_caches", O_WRONLY);
-                write(dc, "3\n", 2);
-                close(dc);
-                sleep(1);
-                printf("  caches dropped\n");
-
-                // verify
-                lseek(fd, 0, SEEK_SET);
-                unsigned char buffer[4096];
-                start = len;
-                size_t p;
-                for (p = 0; p < len; p += sizeof(buffer)) {
-                    size_t to_read = len - p;
-                    if (to_read > sizeof(buffer)) to_read = sizeof(buffer);
-
-                    size_t so_far = 0;
-                    while (so_far < to_read) {
-                        ssize_t read_count = read(fd, buffer+so_far, to_read-so_far);
-                        if (read_count < 0) {
-                            if (errno == EINTR) {
-                                read_count = 0;
-                            } else {
-                                printf("verify read error %s at %d: %s\n",
-                                       partition, p, strerror(errno));
-                                return -1;
-                            }
-                        }
-                        if ((size_t)read_count < to_read) {
-                            printf("short verify read %s at %d: %d %d %s\n",
-                                   partition, p, read_count, to_read, strerror(errno));
-                        }
-                        so_far += read_count;
-                    }
-
-                    if (memcmp(buffer, data+p, to_read)) {
-                        printf("verification failed starting at %d\n", p);
-                        start = p;
-                        break;
-                    }
+                if (fsync(fd) != 0) {
+                    printf("error syncing %s (%s)\n", partition, strerror(errno));
                 }
 
-                if (start == len) {
-                    printf("verification read succeeded (attempt %d)\n", attempt+1);
-                    success = true;
-                    break;
-                }
+                bad = VerifyBlocks(partition, len, &digests);
+                if (bad <= 0) break;
+                printf("rewriting %d bad block(s) of %s\n", bad, partition);
             }
 
-            if (!success) {
+            close(fd);
+            FreeBlockDigests(&digests);
+            if (bad != 0) {
                 printf("failed to verify after all attempts\n");
                 return -1;
             }
+            printf("verification read succeeded (attempt %d)\n", attempt+1);
+            break;
+        }
+    }
+
+    free(copy);
+    return 0;
+}
+
+// Patched output for a partition target is streamed to the partition
+// through a buffer of this size rather than being assembled in memory
+// in its entirety first.  Each flush of a full buffer is exactly one
+// EMMC verify block.
+#define PARTITION_SINK_BUFFER_SIZE VERIFY_BLOCK_SIZE
+
+typedef struct {
+    enum PartitionType type;
+    char* copy;                 // strdup'ed target; partition points into it
+    const char* partition;
+    MtdWriteContext* mtd;
+    int fd;
+    unsigned char* buffer;
+    size_t used;                // # bytes waiting in buffer
+    size_t written;             // # bytes handed to the partition so far
+    BlockDigests* digests;      // EMMC only
+} PartitionSinkInfo;
+
+// Prepare to stream data to 'target', a string of the form
+// "MTD:<partition>[:...]" or "EMMC:<partition_device>[:...]".  For
+// EMMC, a digest of each block written is kept in 'digests', and
+// blocks that verified good on an earlier pass are skipped.  Return 0
+// on success.
+static int OpenPartitionSink(const char* target, PartitionSinkInfo* psi,
+                             BlockDigests* digests) {
+    memset(psi, 0, sizeof(*psi));
+    psi->fd = -1;
+    psi->digests = digests;
+    psi->copy = strdup(target);
+    const char* magic = strtok(psi->copy, ":");
+
+    if (magic != NULL && strcmp(magic, "MTD") == 0) {
+        psi->type = MTD;
+    } else if (magic != NULL && strcmp(magic, "EMMC") == 0) {
+        psi->type = EMMC;
+    } else {
+        printf("OpenPartitionSink called with bad target (%s)\n", target);
+        free(psi->copy);
+        return -1;
+    }
+    psi->partition = strtok(NULL, ":");
+
+    if (psi->partition == NULL) {
+        printf("bad partition target name \"%s\"\n", target);
+        free(psi->copy);
+        return -1;
+    }
+
+    switch (psi->type) {
+        case MTD:
+            if (!mtd_partitions_scanned) {
+                mtd_scan_partitions();
+                mtd_partitions_scanned = 1;
+            }
+
+            const MtdPartition* mtd = mtd_find_partition_by_name(psi->partition);
+            if (mtd == NULL) {
+                printf("mtd partition \"%s\" not found for writing\n",
+                       psi->partition);
+                free(psi->copy);
+                return -1;
+            }
 
-            if (close(fd) != 0) {
-                printf("error closing %s (%s)\n", partition, strerror(errno));
+            psi->mtd = mtd_write_partition(mtd);
+            if (psi->mtd == NULL) {
+                printf("failed to init mtd partition \"%s\" for writing\n",
+                       psi->partition);
+                free(psi->copy);
                 return -1;
             }
-            sync();
             break;
+
+        case EMMC:
+            psi->fd = open(psi->partition, O_WRONLY);
+            if (psi->fd < 0) {
+                printf("failed to open %s: %s\n",
+                       psi->partition, strerror(errno));
+                free(psi->copy);
+                return -1;
+            }
+            break;
+    }
+
+    psi->buffer = malloc(PARTITION_SINK_BUFFER_SIZE);
+    if (psi->buffer == NULL) {
+        printf("failed to alloc %d bytes for partition output\n",
+               PARTITION_SINK_BUFFER_SIZE);
+        if (psi->mtd != NULL) mtd_write_close(psi->mtd);
+        if (psi->fd >= 0) close(psi->fd);
+        free(psi->copy);
+        return -1;
+    }
+    return 0;
+}
+
+// Write out whatever is waiting in the sink's buffer.  Return 0 on
+// success.
+static int FlushPartitionSink(PartitionSinkInfo* psi) {
+    if (psi->used == 0) return 0;
+
+    int result = 0;
+    switch (psi->type) {
+        case MTD:
+            if (mtd_write_data(psi->mtd, (char*)psi->buffer,
+                               psi->used) != (ssize_t)psi->used) {
+                printf("only wrote part of %ld bytes at %ld to MTD %s\n",
+                       (long)psi->used, (long)psi->written, psi->partition);
+                result = -1;
+            }
+            break;
+
+        case EMMC:
+        {
+            size_t block = psi->written / PARTITION_SINK_BUFFER_SIZE;
+            if (SetBlockDigest(psi->digests, block, psi->buffer,
+                               psi->used) != 0) {
+                result = -1;
+            } else if (BlockNeedsWrite(psi->digests, block)) {
+                result = WriteBlockAt(psi->fd, psi->buffer, psi->used,
+                                      psi->written, psi->partition);
+            }
+            break;
+        }
+    }
+    psi->written += psi->used;
+    psi->used = 0;
+    return result;
+}
+
+static ssize_t PartitionSink(unsigned char* data, ssize_t len, void* token) {
+    PartitionSinkInfo* psi = (PartitionSinkInfo*)token;
+    ssize_t done = 0;
+    while (done < len) {
+        size_t avail = PARTITION_SINK_BUFFER_SIZE - psi->used;
+        size_t copy = (size_t)(len - done) < avail ? (size_t)(len - done) : avail;
+        memcpy(psi->buffer + psi->used, data + done, copy);
+        psi->used += copy;
+        done += copy;
+
+        if (psi->used == PARTITION_SINK_BUFFER_SIZE &&
+            FlushPartitionSink(psi) != 0) {
+            return -1;
         }
     }
+    return done;
+}
+
+// Flush any buffered output and finish the partition write, releasing
+// everything held by the sink whether or not that succeeds.  Return 0
+// on success.
+static int ClosePartitionSink(PartitionSinkInfo* psi) {
+    int result = FlushPartitionSink(psi);
+
+    switch (psi->type) {
+        case MTD:
+            if (result == 0 && mtd_erase_blocks(psi->mtd, -1) < 0) {
+                printf("error finishing mtd write of %s\n", psi->partition);
+                result = -1;
+            }
+            if (mtd_write_close(psi->mtd)) {
+                printf("error closing mtd write of %s\n", psi->partition);
+                result = -1;
+            }
+            break;
+
+        case EMMC:
+            if (fsync(psi->fd) != 0) {
+                printf("error syncing %s (%s)\n",
+                       psi->partition, strerror(errno));
+                result = -1;
+            }
+            if (close(psi->fd) != 0) {
+                printf("error closing %s (%s)\n",
+                       psi->partition, strerror(errno));
+                result = -1;
+            }
+            break;
+    }
+
+    free(psi->buffer);
+    free(psi->copy);
+    psi->buffer = NULL;
+    psi->copy = NULL;
+    return result;
+}
+
+// Read back the first 'len' bytes of the partition a PartitionSink has
+// just written and check each block written against its digest.  MTD
+// writes are already verified block-by-block as they are programmed,
+// so only EMMC partitions are read here.  Return 0 on success; on
+// failure 'digests' records which blocks need writing again.
+static int VerifyPartitionWrite(const char* target, size_t len,
+                                BlockDigests* digests) {
+    if (strncmp(target, "EMMC:", 5) != 0) {
+        return 0;
+    }
+
+    char* copy = strdup(target);
+    strtok(copy, ":");
+    const char* partition = strtok(NULL, ":");
 
+    int bad = VerifyBlocks(partition, len, digests);
+    if (bad == 0) {
+        printf("verification read succeeded\n");
+    } else if (bad > 0) {
+        printf("%d block(s) of %s failed verification\n", bad, partition);
+    }
     free(copy);
-    return 0;
+    return bad == 0 ? 0 : -1;
 }
 
 
@@ -576,10 +1033,10 @@ int applypatch_check(const char* filename,
     file.data = NULL;
 
     // It's okay to specify no sha1s; the check will pass if the
-    // LoadFileContents is successful.  (Useful for reading
+    // MapFileContents is successful.  (Useful for reading
     // partitions, where the filename encodes the sha1s; no need to
     // check them twice.)
-    int filestate = LoadFileContents(filename, &file, RETOUCH_DO_MASK);
+    int filestate = MapFileContents(filename, &file, RETOUCH_DO_MASK);
     if (filestate == -ENOENT) {
         return -ENOENT;
     }
@@ -590,8 +1047,7 @@ int applypatch_check(const char* filename,
         printf("file \"%s\" doesn't have any of expected "
                "sha1 sums; checking cache\n", filename);
 
-        free(file.data);
-        file.data = NULL;
+        FreeFileContents(&file);
 
         // If the source file is missing or corrupted, it might be because
         // we were killed in the middle of patching it.  A copy of it
@@ -599,19 +1055,19 @@ int applypatch_check(const char* filename,
         // exists and matches the sha1 we're looking for, the check still
         // passes.
 
-        if (LoadFileContents(CACHE_TEMP_SOURCE, &file, RETOUCH_DO_MASK) != 0) {
+        if (MapFileContents(CACHE_TEMP_SOURCE, &file, RETOUCH_DO_MASK) != 0) {
             printf("failed to load cache file\n");
             return 1;
         }
 
         if (FindMatchingPatch(file.sha1, patch_sha1_str, num_patches) < 0) {
             printf("cache bits don't match any sha1 for \"%s\"\n", filename);
-            free(file.data);
+            FreeFileContents(&file);
             return 1;
         }
     }
 
-    free(file.data);
+    FreeFileContents(&file);
     return 0;
 }
 
@@ -727,14 +1183,14 @@ int applypatch(const char* source_filename,
     const Value* copy_patch_value = NULL;
 
     // We try to load the target file into the source_file object.
-    if (LoadFileContents(target_filename, &source_file,
+    if (MapFileContents(target_filename, &source_file,
                          RETOUCH_DO_MASK) == 0) {
         if (memcmp(source_file.sha1, target_sha1, SHA_DIGEST_SIZE) == 0) {
             // The early-exit case:  the patch was already applied, this file
             // has the desired hash, nothing for us to do.
             printf("\"%s\" is already target; no patch needed\n",
                    target_filename);
-            free(source_file.data);
+            FreeFileContents(&source_file);
             return 0;
         }
     }
@@ -744,9 +1200,8 @@ int applypatch(const char* source_filename,
          strcmp(target_filename, source_filename) != 0)) {
         // Need to load the source file:  either we failed to load the
         // target file, or we did but it's different from the source file.
-        free(source_file.data);
-        source_file.data = NULL;
-        LoadFileContents(source_filename, &source_file,
+        FreeFileContents(&source_file);
+        MapFileContents(source_filename, &source_file,
                          RETOUCH_DO_MASK);
     }
 
@@ -759,11 +1214,10 @@ int applypatch(const char* source_filename,
     }
 
     if (source_patch_value == NULL) {
-        free(source_file.data);
-        source_file.data = NULL;
+        FreeFileContents(&source_file);
         printf("source file is bad; trying copy\n");
 
-        if (LoadFileContents(CACHE_TEMP_SOURCE, &copy_file,
+        if (MapFileContents(CACHE_TEMP_SOURCE, &copy_file,
                              RETOUCH_DO_MASK) < 0) {
             // fail.
             printf("failed to read copy file\n");
@@ -779,7 +1233,7 @@ int applypatch(const char* source_filename,
         if (copy_patch_value == NULL) {
             // fail.
             printf("copy file doesn't match source SHA-1s either\n");
-            free(copy_file.data);
+            FreeFileContents(&copy_file);
             return 1;
         }
     }
@@ -788,8 +1242,8 @@ int applypatch(const char* source_filename,
                                 &copy_file, copy_patch_value,
                                 source_filename, target_filename,
                                 target_sha1, target_size, bonus_data);
-    free(source_file.data);
-    free(copy_file.data);
+    FreeFileContents(&source_file);
+    FreeFileContents(&copy_file);
 
     return result;
 }
@@ -806,10 +1260,12 @@ static int GenerateTarget(FileContents* source_file,
     int retry = 1;
     SHA_CTX ctx;
     int output;
-    MemorySinkInfo msi;
+    PartitionSinkInfo psi;
+    BlockDigests digests;
     FileContents* source_to_use;
     char* outname;
     int made_copy = 0;
+    int status = 1;
 
     // assume that target_filename (eg "/system/app/Foo.apk") is located
     // on the same filesystem as its top-level directory ("/system").
@@ -824,30 +1280,34 @@ static int GenerateTarget(FileContents* source_file,
         strcpy(target_fs, target_filename);
     }
 
+    memset(&digests, 0, sizeof(digests));
+
     do {
         // Is there enough room in the target filesystem to hold the patched
         // file?
 
         if (strncmp(target_filename, "MTD:", 4) == 0 ||
             strncmp(target_filename, "EMMC:", 5) == 0) {
-            // If the target is a partition, we're actually going to
-            // write the output to /tmp and then copy it to the
-            // partition.  statfs() always returns 0 blocks free for
-            // /tmp, so instead we'll just assume that /tmp has enough
-            // space to hold the file.
-
-            // We still write the original source to cache, in case
-            // the partition write is interrupted.
-            if (MakeFreeSpaceOnCache(source_file->size) < 0) {
-                printf("not enough free space on /cache\n");
-                return 1;
-            }
-            if (SaveFileContents(CACHE_TEMP_SOURCE, source_file) < 0) {
-                printf("failed to back up source file\n");
-                return 1;
+            // If the target is a partition, the output is streamed
+            // straight to it as the patch is applied, so there is no
+            // free space to check.
+
+            // The partition is overwritten before we know the result
+            // is good, so first save the original source to cache; if
+            // the write is interrupted or produces bad data, the next
+            // run patches from that copy instead.  (When the source
+            // is already the cache copy, it is safe where it is.)
+            if (source_patch_value != NULL && !made_copy) {
+                if (MakeFreeSpaceOnCache(source_file->size) < 0) {
+                    printf("not enough free space on /cache\n");
+                    goto done;
+                }
+                if (SaveFileContents(CACHE_TEMP_SOURCE, source_file) < 0) {
+                    printf("failed to back up source file\n");
+                    goto done;
+                }
+                made_copy = 1;
             }
-            made_copy = 1;
-            retry = 0;
         } else {
             int enough_space = 0;
             if (retry > 0) {
@@ -875,21 +1335,38 @@ static int GenerateTarget(FileContents* source_file,
                     // we're ever in a state where we need to do this, fail.
                     printf("not enough free space for target but source "
                            "is partition\n");
-                    return 1;
+                    goto done;
                 }
 
                 if (MakeFreeSpaceOnCache(source_file->size) < 0) {
                     printf("not enough free space on /cache\n");
-                    return 1;
+                    goto done;
                 }
 
                 if (SaveFileContents(CACHE_TEMP_SOURCE, source_file) < 0) {
                     printf("failed to back up source file\n");
-                    return 1;
+                    goto done;
                 }
                 made_copy = 1;
                 unlink(source_filename);
 
+                // A mapping of the source would keep its blocks
+                // allocated; patch from the cache copy instead.
+                if (source_file->fd >= 0) {
+                    FileContents cached;
+                    if (MapFileContents(CACHE_TEMP_SOURCE, &cached,
+                                        RETOUCH_DO_MASK) != 0 ||
+                        memcmp(cached.sha1, source_file->sha1,
+                               SHA_DIGEST_SIZE) != 0) {
+                        printf("cache copy of source doesn't match\n");
+                        FreeFileContents(&cached);
+                        goto done;
+                    }
+                    cached.st = source_file->st;
+                    FreeFileContents(source_file);
+                    *source_file = cached;
+                }
+
                 size_t free_space = FreeSpaceForFile(target_fs);
                 printf("(now %ld bytes free for target)\n", (long)free_space);
             }
@@ -906,7 +1383,7 @@ static int GenerateTarget(FileContents* source_file,
 
         if (patch->type != VAL_BLOB) {
             printf("patch is not a blob\n");
-            return 1;
+            goto done;
         }
 
         SinkFn sink = NULL;
@@ -915,17 +1392,12 @@ static int GenerateTarget(FileContents* source_file,
         outname = NULL;
         if (strncmp(target_filename, "MTD:", 4) == 0 ||
             strncmp(target_filename, "EMMC:", 5) == 0) {
-            // We store the decoded output in memory.
-            msi.buffer = malloc(target_size);
-            if (msi.buffer == NULL) {
-                printf("failed to alloc %ld bytes for output\n",
-                       (long)target_size);
-                return 1;
+            // We stream the decoded output to the partition.
+            if (OpenPartitionSink(target_filename, &psi, &digests) != 0) {
+                goto done;
             }
-            msi.pos = 0;
-            msi.size = target_size;
-            sink = MemorySink;
-            token = &msi;
+            sink = PartitionSink;
+            token = &psi;
         } else {
             // We write the decoded output to "<tgt-file>.patch".
             outname = (char*)malloc(strlen(target_filename) + 10);
@@ -936,7 +1408,7 @@ static int GenerateTarget(FileContents* source_file,
             if (output < 0) {
                 printf("failed to open output file %s: %s\n",
                        outname, strerror(errno));
-                return 1;
+                goto done;
             }
             sink = FileSink;
             token = &output;
@@ -950,7 +1422,8 @@ static int GenerateTarget(FileContents* source_file,
         int result;
 
         if (header_bytes_read >= 8 &&
-            memcmp(header, "BSDIFF40", 8) == 0) {
+            (memcmp(header, BSDIFF40_MAGIC, 8) == 0 ||
+             memcmp(header, BSDF2_MAGIC, BSDF2_MAGIC_LEN) == 0)) {
             result = ApplyBSDiffPatch(source_to_use->data, source_to_use->size,
                                       patch, 0, sink, token, &ctx);
         } else if (header_bytes_read >= 8 &&
@@ -959,7 +1432,8 @@ static int GenerateTarget(FileContents* source_file,
                                      patch, sink, token, &ctx, bonus_data);
         } else {
             printf("Unknown patch file format\n");
-            return 1;
+            if (sink == PartitionSink) ClosePartitionSink(&psi);
+            goto done;
         }
 
         if (output >= 0) {
@@ -967,10 +1441,30 @@ static int GenerateTarget(FileContents* source_file,
             close(output);
         }
 
+        if (sink == PartitionSink) {
+            if (ClosePartitionSink(&psi) != 0) {
+                result = 1;
+            } else if (result == 0) {
+                SHA_CTX temp_ctx;
+                memcpy(&temp_ctx, &ctx, sizeof(SHA_CTX));
+                if (memcmp(SHA_final(&temp_ctx), target_sha1,
+                           SHA_DIGEST_SIZE) != 0) {
+                    // Reapplying the patch won't change this; the
+                    // saved source will be used again on the next run.
+                    printf("patch did not produce expected sha1\n");
+                    goto done;
+                }
+                if (VerifyPartitionWrite(target_filename, target_size,
+                                         &digests) != 0) {
+                    result = 1;
+                }
+            }
+        }
+
         if (result != 0) {
             if (retry == 0) {
                 printf("applying patch failed\n");
-                return result != 0;
+                goto done;
             } else {
                 printf("applying patch failed; retrying\n");
             }
@@ -982,6 +1476,13 @@ static int GenerateTarget(FileContents* source_file,
             break;
         }
     } while (retry-- > 0);
+    status = 0;
+
+done:
+    FreeBlockDigests(&digests);
+    if (status != 0) {
+        return 1;
+    }
 
     const uint8_t* current_target_sha1 = SHA_final(&ctx);
     if (memcmp(current_target_sha1, target_sha1, SHA_DIGEST_SIZE) != 0) {
@@ -989,14 +1490,7 @@ static int GenerateTarget(FileContents* source_file,
         return 1;
     }
 
-    if (output < 0) {
-        // Copy the temp file to the partition.
-        if (WriteToPartition(msi.buffer, msi.pos, target_filename) != 0) {
-            printf("write of patched data to %s failed\n", target_filename);
-            return 1;
-        }
-        free(msi.buffer);
-    } else {
+    if (output >= 0) {
         // Give the .patch file the same owner, group, and mode of the
         // original source file.
         if (chmod(outname, source_to_use->st.st_mode) != 0) {
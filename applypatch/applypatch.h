@@ -32,6 +32,7 @@ typedef struct _FileContents {
   unsigned char* data;
   ssize_t size;
   struct stat st;
+  int fd;                       // >= 0 if data is mmapped from this file
 } FileContents;
 
 // When there isn't enough room on the target filesystem to hold the
@@ -63,11 +64,23 @@ int applypatch_check(const char* filename,
 
 int LoadFileContents(const char* filename, FileContents* file,
                      int retouch_flag);
+int MapFileContents(const char* filename, FileContents* file,
+                    int retouch_flag);
 int SaveFileContents(const char* filename, const FileContents* file);
 void FreeFileContents(FileContents* file);
 int FindMatchingPatch(uint8_t* sha1, char* const * const patch_sha1_str,
                       int num_patches);
 
+// batchcheck.c
+typedef struct {
+  const char* filename;
+  int num_patches;
+  char** patch_sha1_str;
+  int result;                   // set to what applypatch_check() returns
+} CheckEntry;
+
+int applypatch_check_batch(CheckEntry* entries, int count);
+
 // bsdiff.c
 void ShowBSDiffLicense();
 int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
@@ -0,0 +1,229 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Checking many files against their expected sha1s at once, for the
+// verify phase of incremental OTAs.  Files are hashed on a small pool
+// of threads, a buffer at a time, instead of being loaded whole the way
+// applypatch_check() does.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mincrypt/sha.h"
+#include "applypatch.h"
+
+// Hashing is mostly waiting on the flash, so this many threads are
+// worth running even on a single CPU.
+#define MAX_CHECK_THREADS    4
+#define CHECK_BUFFER_SIZE    (256 << 10)
+
+// A prelinked, retouched binary ends with a "RETOUCH " record followed
+// by a "PRE " record (see minelf/Retouch.c); those have to be masked
+// before hashing, which needs the whole file in memory.
+#define RETOUCH_TRAILER_SIZE 20
+
+typedef struct {
+    CheckEntry* entries;
+    int count;
+    int next;                   // next entry to claim
+    pthread_mutex_t lock;
+
+    // Anything that has to go through MapFileContents() (partitions,
+    // retouched binaries, the cache copy) is done one at a time: the
+    // partition and retouch code keep global state.
+    pthread_mutex_t load_lock;
+    int cache_state;            // 0 not loaded, 1 loaded, -1 unusable
+    uint8_t cache_sha1[SHA_DIGEST_SIZE];
+} CheckBatch;
+
+// Hash the regular file 'filename' into 'sha1', reading it through
+// 'buffer'.  Return 0 on success, -ENOENT if it doesn't exist, 1 if it
+// is a retouched binary that must be hashed by MapFileContents()
+// instead, or -1 on any other error.
+static int HashFile(const char* filename, uint8_t sha1[SHA_DIGEST_SIZE],
+                    unsigned char* buffer) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("failed to open \"%s\": %s\n", filename, strerror(errno));
+        return errno == ENOENT ? -ENOENT : -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        printf("failed to stat \"%s\": %s\n", filename, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (st.st_size >= RETOUCH_TRAILER_SIZE) {
+        char trailer[RETOUCH_TRAILER_SIZE];
+        if (pread(fd, trailer, sizeof(trailer),
+                  st.st_size - sizeof(trailer)) == sizeof(trailer) &&
+            memcmp(trailer, "RETOUCH ", 8) == 0 &&
+            memcmp(trailer + 16, "PRE ", 4) == 0) {
+            close(fd);
+            return 1;
+        }
+    }
+
+    SHA_CTX ctx;
+    SHA_init(&ctx);
+    off_t total = 0;
+    while (total < st.st_size) {
+        ssize_t read_count = read(fd, buffer, CHECK_BUFFER_SIZE);
+        if (read_count < 0 && errno == EINTR) continue;
+        if (read_count <= 0) {
+            printf("short read of \"%s\" (%ld bytes of %ld)\n",
+                   filename, (long)total, (long)st.st_size);
+            close(fd);
+            return -1;
+        }
+        SHA_update(&ctx, buffer, read_count);
+        total += read_count;
+    }
+    close(fd);
+
+    memcpy(sha1, SHA_final(&ctx), SHA_DIGEST_SIZE);
+    return 0;
+}
+
+// Does CACHE_TEMP_SOURCE match any of the entry's sha1s?  The cache
+// copy is loaded and hashed at most once per batch.
+static int CacheMatches(CheckBatch* cb, CheckEntry* e) {
+    pthread_mutex_lock(&cb->load_lock);
+    if (cb->cache_state == 0) {
+        FileContents file;
+        if (MapFileContents(CACHE_TEMP_SOURCE, &file, RETOUCH_DO_MASK) == 0) {
+            memcpy(cb->cache_sha1, file.sha1, SHA_DIGEST_SIZE);
+            cb->cache_state = 1;
+        } else {
+            printf("failed to load cache file\n");
+            cb->cache_state = -1;
+        }
+        FreeFileContents(&file);
+    }
+    pthread_mutex_unlock(&cb->load_lock);
+
+    return cb->cache_state == 1 &&
+        FindMatchingPatch(cb->cache_sha1, e->patch_sha1_str,
+                          e->num_patches) >= 0;
+}
+
+// Check one entry, with the same result applypatch_check() would give.
+static int CheckOne(CheckBatch* cb, CheckEntry* e, unsigned char* buffer) {
+    uint8_t sha1[SHA_DIGEST_SIZE];
+    int state;
+
+    if (strncmp(e->filename, "MTD:", 4) == 0 ||
+        strncmp(e->filename, "EMMC:", 5) == 0) {
+        state = 1;
+    } else {
+        state = HashFile(e->filename, sha1, buffer);
+    }
+
+    if (state == 1) {
+        FileContents file;
+        pthread_mutex_lock(&cb->load_lock);
+        state = MapFileContents(e->filename, &file, RETOUCH_DO_MASK);
+        pthread_mutex_unlock(&cb->load_lock);
+        if (state == 0) memcpy(sha1, file.sha1, SHA_DIGEST_SIZE);
+        FreeFileContents(&file);
+    }
+
+    if (state == -ENOENT) {
+        return -ENOENT;
+    }
+
+    // As in applypatch_check(), no sha1s at all means only that the
+    // file has to be readable.
+    if (state == 0 &&
+        (e->num_patches == 0 ||
+         FindMatchingPatch(sha1, e->patch_sha1_str, e->num_patches) >= 0)) {
+        return 0;
+    }
+
+    printf("file \"%s\" doesn't have any of expected "
+           "sha1 sums; checking cache\n", e->filename);
+    if (!CacheMatches(cb, e)) {
+        printf("cache bits don't match any sha1 for \"%s\"\n", e->filename);
+        return 1;
+    }
+    return 0;
+}
+
+static void* CheckWorker(void* cookie) {
+    CheckBatch* cb = (CheckBatch*)cookie;
+    unsigned char* buffer = malloc(CHECK_BUFFER_SIZE);
+    if (buffer == NULL) return NULL;
+
+    while (1) {
+        pthread_mutex_lock(&cb->lock);
+        int i = cb->next++;
+        pthread_mutex_unlock(&cb->lock);
+        if (i >= cb->count) break;
+
+        cb->entries[i].result = CheckOne(cb, cb->entries + i, buffer);
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+// Check every entry as applypatch_check() would, storing each entry's
+// result in its 'result' field.  Return the number of entries that
+// failed (including ones that don't exist).
+int applypatch_check_batch(CheckEntry* entries, int count) {
+    CheckBatch cb;
+    memset(&cb, 0, sizeof(cb));
+    cb.entries = entries;
+    cb.count = count;
+    pthread_mutex_init(&cb.lock, NULL);
+    pthread_mutex_init(&cb.load_lock, NULL);
+
+    int i;
+    for (i = 0; i < count; ++i) {
+        entries[i].result = 1;
+    }
+
+    // The calling thread works through the list too.
+    pthread_t threads[MAX_CHECK_THREADS-1];
+    int started = 0;
+    for (i = 0; i < MAX_CHECK_THREADS-1 && i < count-1; ++i) {
+        if (pthread_create(threads+started, NULL, CheckWorker, &cb) == 0) {
+            ++started;
+        }
+    }
+    CheckWorker(&cb);
+    for (i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&cb.load_lock);
+    pthread_mutex_destroy(&cb.lock);
+
+    int failed = 0;
+    for (i = 0; i < count; ++i) {
+        if (entries[i].result != 0) ++failed;
+    }
+    printf("checked %d files; %d failed\n", count, failed);
+    return failed;
+}
@@ -50,10 +50,16 @@
 #include <bzlib.h>
 #include <err.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "bsdiff.h"
 
 #define MIN(x,y) (((x)<(y)) ? (x) : (y))
 
@@ -156,6 +162,177 @@ static void qsufsort(off_t *I,off_t *V,u_char *old,off_t oldsize)
 	for(i=0;i<oldsize+1;i++) I[V[i]]=i;
 }
 
+/*
+ * Linear-time suffix sorting (SA-IS; Nong, Zhang and Chan, "Two
+ * Efficient Algorithms for Linear Time Suffix Array Construction").
+ *
+ * At the top level T is the 'old' buffer followed by a virtual
+ * sentinel that sorts before every byte, so the result has the same
+ * layout qsufsort() produces: SA[0] is the empty suffix, SA[1..n-1]
+ * the suffixes of old in order.  Recursive levels work on the reduced
+ * string of LMS-substring names, which carries its own sentinel.
+ */
+
+#define SAIS_CHR(i) (cs == sizeof(int32_t) ? ((const int32_t *)T)[i] : \
+		((i) == n - 1 ? 0 : ((const u_char *)T)[i] + 1))
+#define SAIS_TGET(i) ((t[(i) >> 3] >> ((i) & 7)) & 1)
+#define SAIS_TSET(i, b) ((b) ? (t[(i) >> 3] |= 1 << ((i) & 7)) : \
+		(t[(i) >> 3] &= ~(1 << ((i) & 7))))
+#define SAIS_ISLMS(i) ((i) > 0 && SAIS_TGET(i) && !SAIS_TGET((i) - 1))
+
+static void sais_buckets(const void *T, int32_t *bkt, int32_t n, int32_t k,
+		int cs, int end)
+{
+	int32_t i, sum;
+
+	for(i=0;i<k;i++) bkt[i]=0;
+	for(i=0;i<n;i++) bkt[SAIS_CHR(i)]++;
+	for(i=0,sum=0;i<k;i++) {
+		sum+=bkt[i];
+		bkt[i]=end ? sum : sum-bkt[i];
+	};
+}
+
+static void sais_induce(const unsigned char *t, int32_t *SA, const void *T,
+		int32_t *bkt, int32_t n, int32_t k, int cs)
+{
+	int32_t i, j;
+
+	/* L-type suffixes, scanning forward from the bucket heads */
+	sais_buckets(T, bkt, n, k, cs, 0);
+	for(i=0;i<n;i++) {
+		j=SA[i]-1;
+		if(j>=0 && !SAIS_TGET(j)) SA[bkt[SAIS_CHR(j)]++]=j;
+	};
+
+	/* S-type suffixes, scanning backward from the bucket tails */
+	sais_buckets(T, bkt, n, k, cs, 1);
+	for(i=n-1;i>=0;i--) {
+		j=SA[i]-1;
+		if(j>=0 && SAIS_TGET(j)) SA[--bkt[SAIS_CHR(j)]]=j;
+	};
+}
+
+static int sais(const void *T, int32_t *SA, int32_t n, int32_t k, int cs)
+{
+	unsigned char *t;
+	int32_t *bkt, *s1, *SA1;
+	int32_t i, j, d, n1, name, pos, prev;
+	int diff;
+
+	if(n==1) { SA[0]=0; return 0; };
+
+	/* Classify each position as S-type (1) or L-type (0) */
+	if((t=calloc(n/8+1,1))==NULL) return -1;
+	SAIS_TSET(n-1, 1);
+	if(n>1) SAIS_TSET(n-2, 0);
+	for(i=n-3;i>=0;i--)
+		SAIS_TSET(i, SAIS_CHR(i)<SAIS_CHR(i+1) ||
+			(SAIS_CHR(i)==SAIS_CHR(i+1) && SAIS_TGET(i+1)));
+
+	/* Sort the LMS substrings by induction from their unsorted heads */
+	if((bkt=malloc(k*sizeof(int32_t)))==NULL) { free(t); return -1; };
+	sais_buckets(T, bkt, n, k, cs, 1);
+	for(i=0;i<n;i++) SA[i]=-1;
+	for(i=1;i<n;i++) if(SAIS_ISLMS(i)) SA[--bkt[SAIS_CHR(i)]]=i;
+	sais_induce(t, SA, T, bkt, n, k, cs);
+	free(bkt);
+
+	/* Compact the sorted LMS substrings into the front of SA and name
+	 * them, so that equal substrings get equal names */
+	for(i=0,n1=0;i<n;i++) if(SAIS_ISLMS(SA[i])) SA[n1++]=SA[i];
+	for(i=n1;i<n;i++) SA[i]=-1;
+	for(i=0,name=0,prev=-1;i<n1;i++) {
+		pos=SA[i];
+		diff=0;
+		for(d=0;d<n;d++) {
+			if(prev==-1 || SAIS_CHR(pos+d)!=SAIS_CHR(prev+d) ||
+					SAIS_TGET(pos+d)!=SAIS_TGET(prev+d)) {
+				diff=1;
+				break;
+			} else if(d>0 && (SAIS_ISLMS(pos+d) || SAIS_ISLMS(prev+d))) {
+				break;
+			};
+		};
+		if(diff) { name++; prev=pos; };
+		SA[n1+pos/2]=name-1;
+	};
+	for(i=n-1,j=n-1;i>=n1;i--) if(SA[i]>=0) SA[j--]=SA[i];
+
+	/* Sort the reduced string, recursing only if the names collide */
+	s1=SA+n-n1;
+	SA1=SA;
+	if(name<n1) {
+		if(sais(s1, SA1, n1, name, sizeof(int32_t))) { free(t); return -1; };
+	} else {
+		for(i=0;i<n1;i++) SA1[s1[i]]=i;
+	};
+
+	/* Induce the full suffix array from the sorted LMS suffixes */
+	if((bkt=malloc(k*sizeof(int32_t)))==NULL) { free(t); return -1; };
+	sais_buckets(T, bkt, n, k, cs, 1);
+	for(i=1,j=0;i<n;i++) if(SAIS_ISLMS(i)) s1[j++]=i;
+	for(i=0;i<n1;i++) SA1[i]=s1[SA1[i]];
+	for(i=n1;i<n;i++) SA[i]=-1;
+	for(i=n1-1;i>=0;i--) {
+		j=SA[i];
+		SA[i]=-1;
+		SA[--bkt[SAIS_CHR(j)]]=j;
+	};
+	sais_induce(t, SA, T, bkt, n, k, cs);
+
+	free(bkt);
+	free(t);
+	return 0;
+}
+
+/*
+ * Suffix array of an 'old' buffer, as used by search().  Buffers whose
+ * suffix count fits in 32 bits are sorted with SA-IS into 32-bit
+ * indices, which is linear time and a quarter of the memory qsufsort()
+ * needs for I and V; anything larger falls back to qsufsort().
+ */
+struct SuffixArray {
+	int32_t *I32;
+	off_t *I;
+};
+
+SuffixArray *BuildSuffixArray(u_char *old, off_t oldsize)
+{
+	SuffixArray *sa;
+	off_t *V;
+
+	if((sa=calloc(1,sizeof(SuffixArray)))==NULL) err(1,NULL);
+
+	if(oldsize<INT32_MAX) {
+		if((sa->I32=malloc((oldsize+1)*sizeof(int32_t)))==NULL)
+			err(1,NULL);
+		if(sais(old, sa->I32, oldsize+1, 257, sizeof(u_char))==0)
+			return sa;
+		free(sa->I32);
+		sa->I32=NULL;
+	};
+
+	if(((sa->I=malloc((oldsize+1)*sizeof(off_t)))==NULL) ||
+		((V=malloc((oldsize+1)*sizeof(off_t)))==NULL)) err(1,NULL);
+	qsufsort(sa->I, V, old, oldsize);
+	free(V);
+	return sa;
+}
+
+void FreeSuffixArray(SuffixArray *sa)
+{
+	if(sa==NULL) return;
+	free(sa->I32);
+	free(sa->I);
+	free(sa);
+}
+
+static inline off_t sa_get(const SuffixArray *sa, off_t i)
+{
+	return sa->I32 ? sa->I32[i] : sa->I[i];
+}
+
 static off_t matchlen(u_char *old,off_t oldsize,u_char *new,off_t newsize)
 {
 	off_t i;
@@ -166,29 +343,32 @@ static off_t matchlen(u_char *old,off_t oldsize,u_char *new,off_t newsize)
 	return i;
 }
 
-static off_t search(off_t *I,u_char *old,off_t oldsize,
+static off_t search(const SuffixArray *sa,u_char *old,off_t oldsize,
 		u_char *new,off_t newsize,off_t st,off_t en,off_t *pos)
 {
-	off_t x,y;
+	off_t x,y,ist,ien,ix;
 
 	if(en-st<2) {
-		x=matchlen(old+I[st],oldsize-I[st],new,newsize);
-		y=matchlen(old+I[en],oldsize-I[en],new,newsize);
+		ist=sa_get(sa,st);
+		ien=sa_get(sa,en);
+		x=matchlen(old+ist,oldsize-ist,new,newsize);
+		y=matchlen(old+ien,oldsize-ien,new,newsize);
 
 		if(x>y) {
-			*pos=I[st];
+			*pos=ist;
 			return x;
 		} else {
-			*pos=I[en];
+			*pos=ien;
 			return y;
 		}
 	};
 
 	x=st+(en-st)/2;
-	if(memcmp(old+I[x],new,MIN(oldsize-I[x],newsize))<0) {
-		return search(I,old,oldsize,new,newsize,x,en,pos);
+	ix=sa_get(sa,x);
+	if(memcmp(old+ix,new,MIN(oldsize-ix,newsize))<0) {
+		return search(sa,old,oldsize,new,newsize,x,en,pos);
 	} else {
-		return search(I,old,oldsize,new,newsize,st,x,pos);
+		return search(sa,old,oldsize,new,newsize,st,x,pos);
 	};
 }
 
@@ -210,22 +390,129 @@ static void offtout(off_t x,u_char *buf)
 	if(x<0) buf[7]|=0x80;
 }
 
+/*
+ * Compressed payload stream writer.  zstd streams are limited to a
+ * 2 MB window so applypatch can decode all three at once in a bounded
+ * amount of memory.
+ */
+#define ZSTD_PATCH_LEVEL	19
+#define ZSTD_PATCH_WINDOW_LOG	21
+
+typedef struct {
+	int codec;
+	FILE *pf;
+	BZFILE *bz;
+#ifdef USE_ZSTD
+	ZSTD_CCtx *zstd;
+	u_char *out;
+	size_t out_size;
+#endif
+} PayloadWriter;
+
+static void payload_open(PayloadWriter *w, FILE *pf, int codec)
+{
+	int bz2err;
+
+	w->codec=codec;
+	w->pf=pf;
+	switch(codec) {
+	case BSDIFF_CODEC_BZIP2:
+		if ((w->bz = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
+			errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
+		return;
+#ifdef USE_ZSTD
+	case BSDIFF_CODEC_ZSTD:
+		if ((w->zstd = ZSTD_createCCtx()) == NULL)
+			errx(1, "ZSTD_createCCtx");
+		ZSTD_CCtx_setParameter(w->zstd, ZSTD_c_compressionLevel,
+			ZSTD_PATCH_LEVEL);
+		ZSTD_CCtx_setParameter(w->zstd, ZSTD_c_windowLog,
+			ZSTD_PATCH_WINDOW_LOG);
+		w->out_size=ZSTD_CStreamOutSize();
+		if ((w->out = malloc(w->out_size)) == NULL) err(1, NULL);
+		return;
+#endif
+	};
+	errx(1, "unsupported codec %d", codec);
+}
+
+#ifdef USE_ZSTD
+static void payload_zstd(PayloadWriter *w, const void *data, size_t len,
+	ZSTD_EndDirective mode)
+{
+	ZSTD_inBuffer in = { data, len, 0 };
+	ZSTD_outBuffer out;
+	size_t left;
+
+	do {
+		out.dst=w->out;
+		out.size=w->out_size;
+		out.pos=0;
+		left=ZSTD_compressStream2(w->zstd, &out, &in, mode);
+		if (ZSTD_isError(left))
+			errx(1, "ZSTD_compressStream2: %s", ZSTD_getErrorName(left));
+		if (fwrite(w->out, 1, out.pos, w->pf) != out.pos)
+			err(1, "fwrite");
+	} while ((mode == ZSTD_e_end) ? (left != 0) : (in.pos < in.size));
+}
+#endif
+
+static void payload_write(PayloadWriter *w, void *data, size_t len)
+{
+	int bz2err;
+
+#ifdef USE_ZSTD
+	if (w->codec == BSDIFF_CODEC_ZSTD) {
+		payload_zstd(w, data, len, ZSTD_e_continue);
+		return;
+	};
+#endif
+	BZ2_bzWrite(&bz2err, w->bz, data, len);
+	if (bz2err != BZ_OK)
+		errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
+}
+
+static void payload_close(PayloadWriter *w)
+{
+	int bz2err;
+
+#ifdef USE_ZSTD
+	if (w->codec == BSDIFF_CODEC_ZSTD) {
+		payload_zstd(w, NULL, 0, ZSTD_e_end);
+		ZSTD_freeCCtx(w->zstd);
+		free(w->out);
+		return;
+	};
+#endif
+	BZ2_bzWriteClose(&bz2err, w->bz, 0, NULL, NULL);
+	if (bz2err != BZ_OK)
+		errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
+}
+
 // This is main() from bsdiff.c, with the following changes:
 //
 //    - old, oldsize, new, newsize are arguments; we don't load this
 //      data from files.  old and new are owned by the caller; we
 //      don't free them at the end.
 //
-//    - the "I" block of memory is owned by the caller, who passes a
-//      pointer to *I, which can be NULL.  This way if we call
-//      bsdiff() multiple times with the same 'old' data, we only do
-//      the qsufsort() step the first time.
+//    - the suffix array is owned by the caller, who passes a pointer
+//      to it, which can point to NULL.  This way if we call bsdiff()
+//      multiple times with the same 'old' data, we only sort the
+//      suffixes the first time.  Callers running bsdiff() from several
+//      threads must build it up front with BuildSuffixArray().
+//
+//    - suffixes are sorted with SA-IS rather than qsufsort(); see
+//      BuildSuffixArray().
 //
-int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
-           const char* patch_filename)
+//    - 'codec' selects the payload compressor.  BSDIFF_CODEC_BZIP2
+//      writes a classic "BSDIFF40" patch; anything else writes a
+//      "BSDF2" patch using that codec for all three streams.
+//
+int bsdiff(u_char* old, off_t oldsize, SuffixArray** SAP, u_char* new,
+           off_t newsize, const char* patch_filename, int codec)
 {
 	int fd;
-	off_t *I;
+	SuffixArray *sa;
 	off_t scan,pos,len;
 	off_t lastscan,lastpos,lastoffset;
 	off_t oldscore,scsc;
@@ -237,17 +524,12 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
 	u_char buf[8];
 	u_char header[32];
 	FILE * pf;
-	BZFILE * pfbz2;
-	int bz2err;
+	PayloadWriter pw;
 
-        if (*IP == NULL) {
-            off_t* V;
-            *IP = malloc((oldsize+1) * sizeof(off_t));
-            V = malloc((oldsize+1) * sizeof(off_t));
-            qsufsort(*IP, V, old, oldsize);
-            free(V);
+        if (*SAP == NULL) {
+            *SAP = BuildSuffixArray(old, oldsize);
         }
-        I = *IP;
+        sa = *SAP;
 
 	if(((db=malloc(newsize+1))==NULL) ||
 		((eb=malloc(newsize+1))==NULL)) err(1,NULL);
@@ -259,7 +541,7 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
               err(1, "%s", patch_filename);
 
 	/* Header is
-		0	8	 "BSDIFF40"
+		0	8	 "BSDIFF40" (or "BSDF2" + 3 codec bytes)
 		8	8	length of bzip2ed ctrl block
 		16	8	length of bzip2ed diff block
 		24	8	length of new file */
@@ -268,7 +550,14 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
 		32	??	Bzip2ed ctrl block
 		??	??	Bzip2ed diff block
 		??	??	Bzip2ed extra block */
-	memcpy(header,"BSDIFF40",8);
+	if (codec == BSDIFF_CODEC_BZIP2) {
+		memcpy(header,BSDIFF40_MAGIC,8);
+	} else {
+		memcpy(header,BSDF2_MAGIC,BSDF2_MAGIC_LEN);
+		header[BSDF2_MAGIC_LEN]=codec;
+		header[BSDF2_MAGIC_LEN+1]=codec;
+		header[BSDF2_MAGIC_LEN+2]=codec;
+	}
 	offtout(0, header + 8);
 	offtout(0, header + 16);
 	offtout(newsize, header + 24);
@@ -276,15 +565,14 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
 		err(1, "fwrite(%s)", patch_filename);
 
 	/* Compute the differences, writing ctrl as we go */
-	if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
-		errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
+	payload_open(&pw, pf, codec);
 	scan=0;len=0;
 	lastscan=0;lastpos=0;lastoffset=0;
 	while(scan<newsize) {
 		oldscore=0;
 
 		for(scsc=scan+=len;scan<newsize;scan++) {
-			len=search(I,old,oldsize,new+scan,newsize-scan,
+			len=search(sa,old,oldsize,new+scan,newsize-scan,
 					0,oldsize,&pos);
 
 			for(;scsc<scan+len;scsc++)
@@ -341,28 +629,20 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
 			eblen+=(scan-lenb)-(lastscan+lenf);
 
 			offtout(lenf,buf);
-			BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			if (bz2err != BZ_OK)
-				errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
+			payload_write(&pw, buf, 8);
 
 			offtout((scan-lenb)-(lastscan+lenf),buf);
-			BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			if (bz2err != BZ_OK)
-				errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
+			payload_write(&pw, buf, 8);
 
 			offtout((pos-lenb)-(lastpos+lenf),buf);
-			BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			if (bz2err != BZ_OK)
-				errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
+			payload_write(&pw, buf, 8);
 
 			lastscan=scan-lenb;
 			lastpos=pos-lenb;
 			lastoffset=pos-scan;
 		};
 	};
-	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
+	payload_close(&pw);
 
 	/* Compute size of compressed ctrl data */
 	if ((len = ftello(pf)) == -1)
@@ -370,14 +650,9 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
 	offtout(len-32, header + 8);
 
 	/* Write compressed diff data */
-	if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
-		errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
-	BZ2_bzWrite(&bz2err, pfbz2, db, dblen);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
+	payload_open(&pw, pf, codec);
+	payload_write(&pw, db, dblen);
+	payload_close(&pw);
 
 	/* Compute size of compressed diff data */
 	if ((newsize = ftello(pf)) == -1)
@@ -385,14 +660,9 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
 	offtout(newsize - len, header + 16);
 
 	/* Write compressed extra data */
-	if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
-		errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
-	BZ2_bzWrite(&bz2err, pfbz2, eb, eblen);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
+	payload_open(&pw, pf, codec);
+	payload_write(&pw, eb, eblen);
+	payload_close(&pw);
 
 	/* Seek to the beginning, write the header, and close the file */
 	if (fseeko(pf, 0, SEEK_SET))
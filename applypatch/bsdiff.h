@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _BSDIFF_H
+#define _BSDIFF_H
+
+#include <sys/types.h>
+
+// A bsdiff patch carries three compressed payload streams (control,
+// diff and extra).  "BSDIFF40" patches always use bzip2 for all three.
+// "BSDF2" patches have the same layout, but the three bytes after the
+// 5-byte magic name the codec of each stream, in that order.
+#define BSDIFF40_MAGIC       "BSDIFF40"
+#define BSDF2_MAGIC          "BSDF2"
+#define BSDF2_MAGIC_LEN      5
+
+#define BSDIFF_CODEC_BZIP2   1
+// 2 is brotli in other BSDF2 writers; it isn't supported here.
+#define BSDIFF_CODEC_ZSTD    3
+
+// bsdiff.c (imgdiff on the host; nandroid deltas on the device)
+typedef struct SuffixArray SuffixArray;
+SuffixArray* BuildSuffixArray(u_char* old, off_t oldsize);
+void FreeSuffixArray(SuffixArray* sa);
+int bsdiff(u_char* old, off_t oldsize, SuffixArray** SAP, u_char* new,
+           off_t newsize, const char* patch_filename, int codec);
+
+#endif
@@ -21,15 +21,20 @@
 // notice.
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
 
 #include <bzlib.h>
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
 
 #include "mincrypt/sha.h"
 #include "applypatch.h"
+#include "bsdiff.h"
 
 void ShowBSDiffLicense() {
     puts("The bsdiff library used herein is:\n"
@@ -81,125 +86,244 @@ static off_t offtin(u_char *buf)
     return y;
 }
 
-int FillBuffer(unsigned char* buffer, int size, bz_stream* stream) {
-    stream->next_out = (char*)buffer;
-    stream->avail_out = size;
-    while (stream->avail_out > 0) {
-        int bzerr = BZ2_bzDecompress(stream);
-        if (bzerr != BZ_OK && bzerr != BZ_STREAM_END) {
-            printf("bz error %d decompressing\n", bzerr);
-            return -1;
-        }
-        if (stream->avail_out > 0) {
-            printf("need %d more bytes\n", stream->avail_out);
-        }
+// One of the three compressed payload streams of a patch.
+typedef struct {
+    int codec;                  // BSDIFF_CODEC_*
+    bz_stream bz;
+#ifdef USE_ZSTD
+    ZSTD_DStream* zstd;
+    ZSTD_inBuffer zstd_in;
+#endif
+} PayloadStream;
+
+static int SupportedCodec(int codec) {
+    switch (codec) {
+        case BSDIFF_CODEC_BZIP2:
+#ifdef USE_ZSTD
+        case BSDIFF_CODEC_ZSTD:
+#endif
+            return 1;
     }
     return 0;
 }
 
-int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
-                     const Value* patch, ssize_t patch_offset,
-                     SinkFn sink, void* token, SHA_CTX* ctx) {
+static int InitPayloadStream(PayloadStream* stream, int codec,
+                             char* data, ssize_t len, const char* name) {
+    memset(stream, 0, sizeof(*stream));
+    stream->codec = codec;
+
+    switch (codec) {
+        case BSDIFF_CODEC_BZIP2:
+            stream->bz.next_in = data;
+            stream->bz.avail_in = len;
+            stream->bz.bzalloc = NULL;
+            stream->bz.bzfree = NULL;
+            stream->bz.opaque = NULL;
+            int bzerr = BZ2_bzDecompressInit(&stream->bz, 0, 0);
+            if (bzerr != BZ_OK) {
+                printf("failed to bzinit %s stream (%d)\n", name, bzerr);
+                return -1;
+            }
+            return 0;
+
+#ifdef USE_ZSTD
+        case BSDIFF_CODEC_ZSTD:
+            stream->zstd = ZSTD_createDStream();
+            if (stream->zstd == NULL) {
+                printf("failed to init zstd %s stream\n", name);
+                return -1;
+            }
+            stream->zstd_in.src = data;
+            stream->zstd_in.size = len;
+            stream->zstd_in.pos = 0;
+            return 0;
+#endif
+    }
 
-    unsigned char* new_data;
-    ssize_t new_size;
-    if (ApplyBSDiffPatchMem(old_data, old_size, patch, patch_offset,
-                            &new_data, &new_size) != 0) {
-        return -1;
+    printf("unsupported codec %d for %s stream\n", codec, name);
+    return -1;
+}
+
+static void EndPayloadStream(PayloadStream* stream) {
+    switch (stream->codec) {
+        case BSDIFF_CODEC_BZIP2:
+            BZ2_bzDecompressEnd(&stream->bz);
+            break;
+
+#ifdef USE_ZSTD
+        case BSDIFF_CODEC_ZSTD:
+            ZSTD_freeDStream(stream->zstd);
+            break;
+#endif
     }
+}
 
-    if (sink(new_data, new_size, token) < new_size) {
-        printf("short write of output: %d (%s)\n", errno, strerror(errno));
-        return 1;
+static int FillBuffer(unsigned char* buffer, int size, PayloadStream* stream) {
+#ifdef USE_ZSTD
+    if (stream->codec == BSDIFF_CODEC_ZSTD) {
+        ZSTD_outBuffer out = { buffer, size, 0 };
+        while (out.pos < out.size) {
+            size_t before = out.pos;
+            size_t ret = ZSTD_decompressStream(stream->zstd, &out,
+                                               &stream->zstd_in);
+            if (ZSTD_isError(ret)) {
+                printf("zstd error decompressing: %s\n",
+                       ZSTD_getErrorName(ret));
+                return -1;
+            }
+            if (out.pos == before &&
+                stream->zstd_in.pos == stream->zstd_in.size) {
+                // the stream is exhausted; looping would never finish.
+                printf("need %d more bytes\n", (int)(out.size - out.pos));
+                return -1;
+            }
+        }
+        return 0;
     }
-    if (ctx) {
-        SHA_update(ctx, new_data, new_size);
+#endif
+
+    bz_stream* bz = &stream->bz;
+    bz->next_out = (char*)buffer;
+    bz->avail_out = size;
+    while (bz->avail_out > 0) {
+        unsigned int before = bz->avail_out;
+        int bzerr = BZ2_bzDecompress(bz);
+        if (bzerr != BZ_OK && bzerr != BZ_STREAM_END) {
+            printf("bz error %d decompressing\n", bzerr);
+            return -1;
+        }
+        if (bz->avail_out > 0 &&
+            (bzerr == BZ_STREAM_END ||
+             (bz->avail_out == before && bz->avail_in == 0))) {
+            // the stream is exhausted (or truncated); looping would
+            // never finish.
+            printf("need %d more bytes\n", bz->avail_out);
+            return -1;
+        }
     }
-    free(new_data);
-
     return 0;
 }
 
-int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
-                        const Value* patch, ssize_t patch_offset,
-                        unsigned char** new_data, ssize_t* new_size) {
-    // Patch data format:
-    //   0       8       "BSDIFF40"
-    //   8       8       X
-    //   16      8       Y
-    //   24      8       sizeof(newfile)
-    //   32      X       bzip2(control block)
-    //   32+X    Y       bzip2(diff block)
-    //   32+X+Y  ???     bzip2(extra block)
-    // with control block a set of triples (x,y,z) meaning "add x bytes
-    // from oldfile to x bytes from the diff block; copy y bytes from the
-    // extra block; seek forwards in oldfile by z bytes".
+// ApplyBSDiffPatch() produces its output in windows of this size,
+// handing each to the sink as it fills, so it needs memory in
+// proportion to the window rather than to the size of the new file.
+#define BSPATCH_WINDOW_SIZE (1 << 20)
+
+// Patch data format:
+//   0       8       "BSDIFF40"
+//   8       8       X
+//   16      8       Y
+//   24      8       sizeof(newfile)
+//   32      X       bzip2(control block)
+//   32+X    Y       bzip2(diff block)
+//   32+X+Y  ???     bzip2(extra block)
+// with control block a set of triples (x,y,z) meaning "add x bytes
+// from oldfile to x bytes from the diff block; copy y bytes from the
+// extra block; seek forwards in oldfile by z bytes".
+//
+// A "BSDF2" patch has the same layout with "BSDF2" followed by the
+// codec of the control, diff and extra blocks in the first 8 bytes.
+static int ReadBSDiffHeader(const Value* patch, ssize_t patch_offset,
+                            ssize_t* ctrl_len, ssize_t* data_len,
+                            ssize_t* new_size, int codec[3]) {
+    if (patch_offset < 0 || patch_offset + 32 > patch->size) {
+        printf("patch too short to contain bsdiff header\n");
+        return 1;
+    }
 
     unsigned char* header = (unsigned char*) patch->data + patch_offset;
-    if (memcmp(header, "BSDIFF40", 8) != 0) {
+    int i;
+    if (memcmp(header, BSDIFF40_MAGIC, 8) == 0) {
+        codec[0] = codec[1] = codec[2] = BSDIFF_CODEC_BZIP2;
+    } else if (memcmp(header, BSDF2_MAGIC, BSDF2_MAGIC_LEN) == 0) {
+        for (i = 0; i < 3; ++i) {
+            codec[i] = header[BSDF2_MAGIC_LEN + i];
+            if (!SupportedCodec(codec[i])) {
+                printf("unsupported patch payload codec %d\n", codec[i]);
+                return 1;
+            }
+        }
+    } else {
         printf("corrupt bsdiff patch file header (magic number)\n");
         return 1;
     }
 
-    ssize_t ctrl_len, data_len;
-    ctrl_len = offtin(header+8);
-    data_len = offtin(header+16);
+    *ctrl_len = offtin(header+8);
+    *data_len = offtin(header+16);
     *new_size = offtin(header+24);
 
-    if (ctrl_len < 0 || data_len < 0 || *new_size < 0) {
+    if (*ctrl_len < 0 || *data_len < 0 || *new_size < 0 ||
+        patch_offset + 32 + *ctrl_len + *data_len > patch->size) {
         printf("corrupt patch file header (data lengths)\n");
         return 1;
     }
+    return 0;
+}
 
-    int bzerr;
-
-    bz_stream cstream;
-    cstream.next_in = patch->data + patch_offset + 32;
-    cstream.avail_in = ctrl_len;
-    cstream.bzalloc = NULL;
-    cstream.bzfree = NULL;
-    cstream.opaque = NULL;
-    if ((bzerr = BZ2_bzDecompressInit(&cstream, 0, 0)) != BZ_OK) {
-        printf("failed to bzinit control stream (%d)\n", bzerr);
+// Hand the 'used' bytes at the start of 'window' to the sink (if any)
+// and the SHA context (if any).  Return 0 on success.
+static int FlushWindow(unsigned char* window, size_t* used,
+                       SinkFn sink, void* token, SHA_CTX* ctx) {
+    if (sink != NULL) {
+        if (sink(window, *used, token) < (ssize_t)*used) {
+            printf("short write of output: %d (%s)\n", errno, strerror(errno));
+            return 1;
+        }
+        if (ctx) {
+            SHA_update(ctx, window, *used);
+        }
+        *used = 0;
     }
+    return 0;
+}
 
-    bz_stream dstream;
-    dstream.next_in = patch->data + patch_offset + 32 + ctrl_len;
-    dstream.avail_in = data_len;
-    dstream.bzalloc = NULL;
-    dstream.bzfree = NULL;
-    dstream.opaque = NULL;
-    if ((bzerr = BZ2_bzDecompressInit(&dstream, 0, 0)) != BZ_OK) {
-        printf("failed to bzinit diff stream (%d)\n", bzerr);
+// Apply a bsdiff patch, decoding the control, diff and extra streams
+// as we go and assembling the new data in 'window'.  Each time the
+// window fills it is flushed to the sink and reused; with no sink,
+// the window must be big enough to hold the whole new file.
+static int ApplyBSDiffPatchWindowed(const unsigned char* old_data,
+                                    ssize_t old_size,
+                                    const Value* patch, ssize_t patch_offset,
+                                    unsigned char* window, size_t window_size,
+                                    SinkFn sink, void* token, SHA_CTX* ctx) {
+    ssize_t ctrl_len, data_len, new_size;
+    int codec[3];
+    if (ReadBSDiffHeader(patch, patch_offset,
+                         &ctrl_len, &data_len, &new_size, codec) != 0) {
+        return 1;
     }
 
-    bz_stream estream;
-    estream.next_in = patch->data + patch_offset + 32 + ctrl_len + data_len;
-    estream.avail_in = patch->size - (patch_offset + 32 + ctrl_len + data_len);
-    estream.bzalloc = NULL;
-    estream.bzfree = NULL;
-    estream.opaque = NULL;
-    if ((bzerr = BZ2_bzDecompressInit(&estream, 0, 0)) != BZ_OK) {
-        printf("failed to bzinit extra stream (%d)\n", bzerr);
+    char* ctrl_start = patch->data + patch_offset + 32;
+    PayloadStream cstream, dstream, estream;
+    if (InitPayloadStream(&cstream, codec[0], ctrl_start, ctrl_len,
+                          "control") != 0) {
+        return 1;
     }
-
-    *new_data = malloc(*new_size);
-    if (*new_data == NULL) {
-        printf("failed to allocate %ld bytes of memory for output file\n",
-               (long)*new_size);
+    if (InitPayloadStream(&dstream, codec[1], ctrl_start + ctrl_len,
+                          data_len, "diff") != 0) {
+        EndPayloadStream(&cstream);
+        return 1;
+    }
+    if (InitPayloadStream(&estream, codec[2],
+                          ctrl_start + ctrl_len + data_len,
+                          patch->size - (patch_offset + 32 + ctrl_len + data_len),
+                          "extra") != 0) {
+        EndPayloadStream(&cstream);
+        EndPayloadStream(&dstream);
         return 1;
     }
 
+    int result = 1;
     off_t oldpos = 0, newpos = 0;
     off_t ctrl[3];
-    off_t len_read;
+    size_t used = 0;            // bytes of the window filled so far
     int i;
     unsigned char buf[24];
-    while (newpos < *new_size) {
+    while (newpos < new_size) {
         // Read control data
         if (FillBuffer(buf, 24, &cstream) != 0) {
             printf("error while reading control stream\n");
-            return 1;
+            goto done;
         }
         ctrl[0] = offtin(buf);
         ctrl[1] = offtin(buf+8);
@@ -207,51 +331,131 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
 
         if (ctrl[0] < 0 || ctrl[1] < 0) {
             printf("corrupt patch (negative byte counts)\n");
-            return 1;
+            goto done;
         }
 
         // Sanity check
-        if (newpos + ctrl[0] > *new_size) {
+        if (newpos + ctrl[0] + ctrl[1] > new_size) {
             printf("corrupt patch (new file overrun)\n");
-            return 1;
+            goto done;
         }
 
-        // Read diff string
-        if (FillBuffer(*new_data + newpos, ctrl[0], &dstream) != 0) {
-            printf("error while reading diff stream\n");
-            return 1;
-        }
+        // Read diff string and add old data to it, a window at a time
+        off_t left = ctrl[0];
+        while (left > 0) {
+            size_t n = window_size - used;
+            if ((off_t)n > left) n = left;
 
-        // Add old data to diff string
-        for (i = 0; i < ctrl[0]; ++i) {
-            if ((oldpos+i >= 0) && (oldpos+i < old_size)) {
-                (*new_data)[newpos+i] += old_data[oldpos+i];
+            unsigned char* out = window + used;
+            if (FillBuffer(out, n, &dstream) != 0) {
+                printf("error while reading diff stream\n");
+                goto done;
+            }
+            for (i = 0; i < (int)n; ++i) {
+                if ((oldpos+i >= 0) && (oldpos+i < old_size)) {
+                    out[i] += old_data[oldpos+i];
+                }
+            }
+
+            used += n;
+            oldpos += n;
+            newpos += n;
+            left -= n;
+            if (used == window_size &&
+                FlushWindow(window, &used, sink, token, ctx) != 0) {
+                goto done;
             }
         }
 
-        // Adjust pointers
-        newpos += ctrl[0];
-        oldpos += ctrl[0];
+        // Read extra string, a window at a time
+        left = ctrl[1];
+        while (left > 0) {
+            size_t n = window_size - used;
+            if ((off_t)n > left) n = left;
 
-        // Sanity check
-        if (newpos + ctrl[1] > *new_size) {
-            printf("corrupt patch (new file overrun)\n");
-            return 1;
-        }
+            if (FillBuffer(window + used, n, &estream) != 0) {
+                printf("error while reading extra stream\n");
+                goto done;
+            }
 
-        // Read extra string
-        if (FillBuffer(*new_data + newpos, ctrl[1], &estream) != 0) {
-            printf("error while reading extra stream\n");
-            return 1;
+            used += n;
+            newpos += n;
+            left -= n;
+            if (used == window_size &&
+                FlushWindow(window, &used, sink, token, ctx) != 0) {
+                goto done;
+            }
         }
 
         // Adjust pointers
-        newpos += ctrl[1];
         oldpos += ctrl[2];
     }
 
-    BZ2_bzDecompressEnd(&cstream);
-    BZ2_bzDecompressEnd(&dstream);
-    BZ2_bzDecompressEnd(&estream);
+    if (used > 0 && FlushWindow(window, &used, sink, token, ctx) != 0) {
+        goto done;
+    }
+    result = 0;
+
+done:
+    EndPayloadStream(&cstream);
+    EndPayloadStream(&dstream);
+    EndPayloadStream(&estream);
+    return result;
+}
+
+int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
+                     const Value* patch, ssize_t patch_offset,
+                     SinkFn sink, void* token, SHA_CTX* ctx) {
+    ssize_t ctrl_len, data_len, new_size;
+    int codec[3];
+    if (ReadBSDiffHeader(patch, patch_offset,
+                         &ctrl_len, &data_len, &new_size, codec) != 0) {
+        return 1;
+    }
+
+    size_t window_size = BSPATCH_WINDOW_SIZE;
+    if (new_size < (ssize_t)window_size) {
+        window_size = new_size > 0 ? new_size : 1;
+    }
+    unsigned char* window = malloc(window_size);
+    if (window == NULL) {
+        printf("failed to allocate %ld bytes of memory for output window\n",
+               (long)window_size);
+        return 1;
+    }
+
+    int result = ApplyBSDiffPatchWindowed(old_data, old_size,
+                                          patch, patch_offset,
+                                          window, window_size,
+                                          sink, token, ctx);
+    free(window);
+    return result;
+}
+
+int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
+                        const Value* patch, ssize_t patch_offset,
+                        unsigned char** new_data, ssize_t* new_size) {
+    ssize_t ctrl_len, data_len;
+    int codec[3];
+    if (ReadBSDiffHeader(patch, patch_offset,
+                         &ctrl_len, &data_len, new_size, codec) != 0) {
+        return 1;
+    }
+
+    // The whole new file is the window, and is never flushed.
+    *new_data = malloc(*new_size > 0 ? *new_size : 1);
+    if (*new_data == NULL) {
+        printf("failed to allocate %ld bytes of memory for output file\n",
+               (long)*new_size);
+        return 1;
+    }
+
+    if (ApplyBSDiffPatchWindowed(old_data, old_size, patch, patch_offset,
+                                 *new_data, *new_size > 0 ? *new_size : 1,
+                                 NULL, NULL, NULL) != 0) {
+        free(*new_data);
+        *new_data = NULL;
+        return 1;
+    }
     return 0;
 }
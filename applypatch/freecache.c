@@ -125,48 +125,169 @@ int FindExpendableFiles(char*** names, int* entries) {
   return 0;
 }
 
-int MakeFreeSpaceOnCache(size_t bytes_needed) {
-  size_t free_now = FreeSpaceForFile("/cache");
-  printf("%ld bytes free on /cache (%ld needed)\n",
-         (long)free_now, (long)bytes_needed);
+// Index of the files on /cache we may delete, built the first time
+// space has to be freed and kept for the rest of the process (ie, the
+// rest of the install), so that repeated space checks don't rescan
+// /cache and stat every file in it every time.  /proc is still checked
+// before each round of deletions, since files may have been opened
+// since.
+typedef struct {
+  char* path;
+  size_t size;          // space freed by deleting it
+  time_t mtime;
+  int deleted;          // or found open since; path is NULL then
+} CacheFile;
 
-  if (free_now >= bytes_needed) {
+static CacheFile* cache_files = NULL;   // least recently modified first
+static int cache_file_count = 0;
+static size_t cache_deletable = 0;      // total size of files not yet deleted
+static int cache_indexed = 0;
+
+static int compare_cache_mtime(const void* a, const void* b) {
+  time_t am = ((const CacheFile*)a)->mtime;
+  time_t bm = ((const CacheFile*)b)->mtime;
+  if (am < bm) {
+    return -1;
+  } else if (am > bm) {
+    return 1;
+  } else {
     return 0;
   }
+}
+
+static int BuildCacheIndex() {
+  if (cache_indexed) return 0;
 
   char** names;
   int entries;
-
   if (FindExpendableFiles(&names, &entries) < 0) {
     return -1;
   }
 
-  if (entries == 0) {
-    // nothing we can delete to free up space!
-    printf("no files can be deleted to free space on /cache\n");
+  int i;
+  cache_files = malloc((entries ? entries : 1) * sizeof(CacheFile));
+  if (cache_files == NULL) {
+    printf("failed to alloc index of %d files on /cache\n", entries);
+    for (i = 0; i < entries; ++i) {
+      free(names[i]);
+    }
+    free(names);
     return -1;
   }
+  cache_file_count = 0;
+  cache_deletable = 0;
 
-  // We could try to be smarter about which files to delete:  the
-  // biggest ones?  the smallest ones that will free up enough space?
-  // the oldest?  the newest?
-  //
-  // Instead, we'll be dumb.
+  for (i = 0; i < entries; ++i) {
+    struct stat st;
+    if (names[i] == NULL) continue;   // open by some process
+    if (stat(names[i], &st) != 0) {
+      free(names[i]);
+      continue;
+    }
+    CacheFile* cf = cache_files + cache_file_count++;
+    cf->path = names[i];
+    cf->size = (size_t)st.st_blocks * 512;
+    cf->mtime = st.st_mtime;
+    cf->deleted = 0;
+    cache_deletable += cf->size;
+  }
+  free(names);
+
+  qsort(cache_files, cache_file_count, sizeof(CacheFile), compare_cache_mtime);
+  cache_indexed = 1;
+
+  printf("%d deletable files on /cache (%ld bytes)\n",
+         cache_file_count, (long)cache_deletable);
+  return 0;
+}
+
+// Files that weren't open when the index was built may be now; drop
+// any that are from the index so they aren't deleted out from under
+// whoever has them open.  Return 0 on success.
+static int DropOpenCacheFiles() {
+  char** paths = malloc((cache_file_count ? cache_file_count : 1) *
+                        sizeof(char*));
+  if (paths == NULL) {
+    printf("failed to alloc list of %d files on /cache\n", cache_file_count);
+    return -1;
+  }
 
   int i;
-  for (i = 0; i < entries && free_now < bytes_needed; ++i) {
-    if (names[i]) {
-      unlink(names[i]);
-      free_now = FreeSpaceForFile("/cache");
-      printf("deleted %s; now %ld bytes free\n", names[i], (long)free_now);
-      free(names[i]);
+  for (i = 0; i < cache_file_count; ++i) {
+    paths[i] = cache_files[i].deleted ? NULL : cache_files[i].path;
+  }
+  // EliminateOpenFiles frees and clears the entries that are open.
+  if (EliminateOpenFiles(paths, cache_file_count) < 0) {
+    free(paths);
+    return -1;
+  }
+  for (i = 0; i < cache_file_count; ++i) {
+    CacheFile* cf = cache_files + i;
+    if (!cf->deleted && paths[i] == NULL) {
+      cf->path = NULL;
+      cf->deleted = 1;
+      cache_deletable -= cf->size;
     }
   }
+  free(paths);
+  return 0;
+}
 
-  for (; i < entries; ++i) {
-    free(names[i]);
+// Pick the next file to delete to free 'deficit' bytes:  the smallest
+// file that covers the deficit on its own if there is one, otherwise
+// the least recently modified file.
+static CacheFile* PickCacheVictim(size_t deficit) {
+  CacheFile* best = NULL;
+  CacheFile* oldest = NULL;
+  int i;
+  for (i = 0; i < cache_file_count; ++i) {
+    CacheFile* cf = cache_files + i;
+    if (cf->deleted) continue;
+    if (oldest == NULL) oldest = cf;
+    if (cf->size >= deficit && (best == NULL || cf->size < best->size)) {
+      best = cf;
+    }
+  }
+  return best ? best : oldest;
+}
+
+int MakeFreeSpaceOnCache(size_t bytes_needed) {
+  size_t free_now = FreeSpaceForFile("/cache");
+  printf("%ld bytes free on /cache (%ld needed)\n",
+         (long)free_now, (long)bytes_needed);
+
+  if (free_now >= bytes_needed) {
+    return 0;
+  }
+
+  // A new index has only just been checked for open files.
+  int reindexed = !cache_indexed;
+  if (BuildCacheIndex() < 0) {
+    return -1;
+  }
+  if (!reindexed && DropOpenCacheFiles() < 0) {
+    return -1;
+  }
+
+  if (free_now + cache_deletable < bytes_needed) {
+    // nothing we can delete will free up enough space!
+    printf("only %ld bytes can be freed on /cache\n", (long)cache_deletable);
+    return -1;
+  }
+
+  while (free_now < bytes_needed) {
+    CacheFile* cf = PickCacheVictim(bytes_needed - free_now);
+    if (cf == NULL) break;
+
+    cf->deleted = 1;
+    cache_deletable -= cf->size;
+    if (unlink(cf->path) != 0) {
+      printf("failed to delete %s: %s\n", cf->path, strerror(errno));
+      continue;
+    }
+    free_now = FreeSpaceForFile("/cache");
+    printf("deleted %s; now %ld bytes free\n", cf->path, (long)free_now);
   }
-  free(names);
 
   return (free_now >= bytes_needed) ? 0 : -1;
 }
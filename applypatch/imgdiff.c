@@ -122,6 +122,7 @@
  */
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -130,6 +131,7 @@
 #include <sys/types.h>
 
 #include "zlib.h"
+#include "bsdiff.h"
 #include "imgdiff.h"
 #include "utils.h"
 
@@ -143,7 +145,8 @@ typedef struct {
   size_t source_start;
   size_t source_len;
 
-  off_t* I;             // used by bsdiff
+  SuffixArray* I;       // used by bsdiff
+  int bsdiff_users;     // # patches still to be made against I
 
   // --- for CHUNK_DEFLATE chunks only: ---
 
@@ -178,10 +181,6 @@ static int fileentry_compare(const void* a, const void* b) {
   }
 }
 
-// from bsdiff.c
-int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
-           const char* patch_filename);
-
 unsigned char* ReadZip(const char* filename,
                        int* num_chunks, ImageChunk** chunks,
                        int include_pseudo_chunk) {
@@ -604,6 +603,11 @@ int ReconstructDeflateChunk(ImageChunk* chunk) {
  * its length in *size.  Return NULL on failure.  We expect the bsdiff
  * program to be in the path.
  */
+// Payload codec for the bsdiff patches; see bsdiff.h.  Patches using
+// anything but bzip2 can only be applied by an applypatch built with
+// the matching decoder.
+static int patch_codec = BSDIFF_CODEC_BZIP2;
+
 unsigned char* MakePatch(ImageChunk* src, ImageChunk* tgt, size_t* size) {
   if (tgt->type == CHUNK_NORMAL) {
     if (tgt->len <= 160) {
@@ -616,7 +620,8 @@ unsigned char* MakePatch(ImageChunk* src, ImageChunk* tgt, size_t* size) {
   char ptemp[] = "/tmp/imgdiff-patch-XXXXXX";
   mkstemp(ptemp);
 
-  int r = bsdiff(src->data, src->len, &(src->I), tgt->data, tgt->len, ptemp);
+  int r = bsdiff(src->data, src->len, &(src->I), tgt->data, tgt->len, ptemp,
+                 patch_codec);
   if (r != 0) {
     printf("bsdiff() failed: %d\n", r);
     return NULL;
@@ -668,6 +673,159 @@ unsigned char* MakePatch(ImageChunk* src, ImageChunk* tgt, size_t* size) {
   return data;
 }
 
+/*
+ * Patches for different target chunks are independent of each other,
+ * so they are computed on a pool of threads.  Each source chunk's
+ * suffix array is built exactly once, before any patch that uses it,
+ * since several targets may share a source (every normal chunk of a
+ * zip is diffed against the whole source file), and freed as soon as
+ * the last of them is done.
+ */
+typedef struct {
+  ImageChunk** src;           // source chunk for each target chunk
+  ImageChunk* tgt;
+  int* order;                 // work items, in the order to start them
+  int count;
+  int next;                   // next entry of order[] to hand out
+  pthread_mutex_t lock;
+  unsigned char** patch_data;
+  size_t* patch_size;
+} PatchWork;
+
+static int NeedsBsdiff(const ImageChunk* tgt) {
+  return !(tgt->type == CHUNK_NORMAL && tgt->len <= 160);
+}
+
+static int NextWorkItem(PatchWork* work) {
+  int item = -1;
+  pthread_mutex_lock(&work->lock);
+  if (work->next < work->count) {
+    item = work->order[work->next++];
+  }
+  pthread_mutex_unlock(&work->lock);
+  return item;
+}
+
+static void* SuffixArrayWorker(void* cookie) {
+  PatchWork* work = (PatchWork*)cookie;
+  int i;
+  while ((i = NextWorkItem(work)) >= 0) {
+    ImageChunk* src = work->src[i];
+    src->I = BuildSuffixArray(src->data, src->len);
+  }
+  return NULL;
+}
+
+static void* PatchWorker(void* cookie) {
+  PatchWork* work = (PatchWork*)cookie;
+  int i;
+  while ((i = NextWorkItem(work)) >= 0) {
+    ImageChunk* src = work->src[i];
+    work->patch_data[i] = MakePatch(src, work->tgt+i, work->patch_size+i);
+
+    SuffixArray* done = NULL;
+    if (NeedsBsdiff(work->tgt+i)) {
+      pthread_mutex_lock(&work->lock);
+      if (--src->bsdiff_users == 0) {
+        done = src->I;
+        src->I = NULL;
+      }
+      pthread_mutex_unlock(&work->lock);
+    }
+    FreeSuffixArray(done);
+  }
+  return NULL;
+}
+
+static PatchWork* sort_work;
+// comparison function for qsort()ing work items so that the largest
+// target chunks are started first.
+static int compare_work_size(const void* a, const void* b) {
+  size_t la = sort_work->tgt[*(const int*)a].len;
+  size_t lb = sort_work->tgt[*(const int*)b].len;
+  if (la > lb) {
+    return -1;
+  } else if (la < lb) {
+    return 1;
+  } else {
+    return 0;
+  }
+}
+
+static void RunWorkers(PatchWork* work, void* (*worker)(void*),
+                       int num_threads) {
+  pthread_t* threads = malloc(num_threads * sizeof(pthread_t));
+  int started = 0;
+  int i;
+
+  work->next = 0;
+  for (i = 0; i < num_threads && i < work->count; ++i) {
+    if (pthread_create(threads+started, NULL, worker, work) == 0) {
+      ++started;
+    }
+  }
+  // If no thread could be started, do the work on this one.
+  if (started == 0) {
+    worker(work);
+  }
+  for (i = 0; i < started; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+}
+
+/*
+ * Compute patch_data[i] and patch_size[i] for each of the 'count'
+ * target chunks, diffing tgt[i] against src[i], on up to num_threads
+ * threads.
+ */
+void MakePatches(ImageChunk** src, ImageChunk* tgt, int count,
+                 unsigned char** patch_data, size_t* patch_size,
+                 int num_threads) {
+  PatchWork work;
+  int i, j;
+
+  work.src = src;
+  work.tgt = tgt;
+  work.order = malloc(count * sizeof(int));
+  work.patch_data = patch_data;
+  work.patch_size = patch_size;
+  pthread_mutex_init(&work.lock, NULL);
+
+  // Build the suffix array of every distinct source that a bsdiff
+  // will be run against, counting the patches that will use it.
+  for (i = 0; i < count; ++i) {
+    src[i]->bsdiff_users = 0;
+  }
+  for (i = 0; i < count; ++i) {
+    if (NeedsBsdiff(tgt+i)) ++src[i]->bsdiff_users;
+  }
+  work.count = 0;
+  for (i = 0; i < count; ++i) {
+    if (!NeedsBsdiff(tgt+i) || src[i]->I != NULL) continue;
+    for (j = 0; j < work.count; ++j) {
+      if (src[work.order[j]] == src[i]) break;
+    }
+    if (j == work.count) {
+      work.order[work.count++] = i;
+    }
+  }
+  RunWorkers(&work, SuffixArrayWorker, num_threads);
+
+  // Then diff all the chunks, biggest first so that one large chunk
+  // doesn't end up running alone at the end.
+  work.count = count;
+  for (i = 0; i < count; ++i) {
+    work.order[i] = i;
+  }
+  sort_work = &work;
+  qsort(work.order, count, sizeof(int), compare_work_size);
+  RunWorkers(&work, PatchWorker, num_threads);
+
+  pthread_mutex_destroy(&work.lock);
+  free(work.order);
+}
+
 /*
  * Cause a gzip chunk to be treated as a normal chunk (ie, as a blob
  * of uninterpreted data).  The resulting patch will likely be about
@@ -788,6 +946,31 @@ int main(int argc, char** argv) {
     ++argv;
   }
 
+  int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (argc >= 3 && strcmp(argv[1], "-j") == 0) {
+    num_threads = atoi(argv[2]);
+    argc -= 2;
+    argv += 2;
+  }
+  if (num_threads < 1) {
+    num_threads = 1;
+  }
+
+  if (argc >= 3 && strcmp(argv[1], "-c") == 0) {
+    if (strcmp(argv[2], "bzip2") == 0) {
+      patch_codec = BSDIFF_CODEC_BZIP2;
+#ifdef USE_ZSTD
+    } else if (strcmp(argv[2], "zstd") == 0) {
+      patch_codec = BSDIFF_CODEC_ZSTD;
+#endif
+    } else {
+      printf("unsupported patch codec \"%s\"\n", argv[2]);
+      return 2;
+    }
+    argc -= 2;
+    argv += 2;
+  }
+
   size_t bonus_size = 0;
   unsigned char* bonus_data = NULL;
   if (argc >= 3 && strcmp(argv[1], "-b") == 0) {
@@ -815,8 +998,8 @@ int main(int argc, char** argv) {
 
   if (argc != 4) {
     usage:
-    printf("usage: %s [-z] [-b <bonus-file>] <src-img> <tgt-img> <patch-file>\n",
-            argv[0]);
+    printf("usage: %s [-z] [-j <threads>] [-c bzip2|zstd] [-b <bonus-file>] "
+           "<src-img> <tgt-img> <patch-file>\n", argv[0]);
     return 2;
   }
 
@@ -943,18 +1126,20 @@ int main(int argc, char** argv) {
 
   DumpChunks(src_chunks, num_src_chunks);
 
-  printf("Construct patches for %d chunks...\n", num_tgt_chunks);
+  printf("Construct patches for %d chunks on %d threads...\n",
+         num_tgt_chunks, num_threads);
   unsigned char** patch_data = malloc(num_tgt_chunks * sizeof(unsigned char*));
   size_t* patch_size = malloc(num_tgt_chunks * sizeof(size_t));
+  ImageChunk** patch_src = malloc(num_tgt_chunks * sizeof(ImageChunk*));
   for (i = 0; i < num_tgt_chunks; ++i) {
     if (zip_mode) {
       ImageChunk* src;
       if (tgt_chunks[i].type == CHUNK_DEFLATE &&
           (src = FindChunkByName(tgt_chunks[i].filename, src_chunks,
                                  num_src_chunks))) {
-        patch_data[i] = MakePatch(src, tgt_chunks+i, patch_size+i);
+        patch_src[i] = src;
       } else {
-        patch_data[i] = MakePatch(src_chunks, tgt_chunks+i, patch_size+i);
+        patch_src[i] = src_chunks;
       }
     } else {
       if (i == 1 && bonus_data) {
@@ -964,7 +1149,17 @@ int main(int argc, char** argv) {
         src_chunks[i].len += bonus_size;
      }
 
-      patch_data[i] = MakePatch(src_chunks+i, tgt_chunks+i, patch_size+i);
+      patch_src[i] = src_chunks+i;
+    }
+  }
+
+  MakePatches(patch_src, tgt_chunks, num_tgt_chunks,
+              patch_data, patch_size, num_threads);
+
+  for (i = 0; i < num_tgt_chunks; ++i) {
+    if (patch_data[i] == NULL) {
+      printf("failed to make patch for chunk %d\n", i);
+      return 1;
     }
     printf("patch %3d is %d bytes (of %d)\n",
            i, patch_size[i], tgt_chunks[i].source_len);
@@ -18,55 +18,94 @@
 // format.
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "zlib.h"
 #include "mincrypt/sha.h"
+#include "minzip/Inflate.h"
 #include "applypatch.h"
 #include "imgdiff.h"
 #include "utils.h"
 
-/*
- * Apply the patch given in 'patch_filename' to the source data given
- * by (old_data, old_size).  Write the patched output to the 'output'
- * file, and update the SHA context with the output data as well.
- * Return 0 on success.
- */
-int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
-                    const Value* patch,
-                    SinkFn sink, void* token, SHA_CTX* ctx,
-                    const Value* bonus_data) {
-    ssize_t pos = 12;
-    char* header = patch->data;
-    if (patch->size < 12) {
-        printf("patch too short to contain header\n");
-        return -1;
-    }
+// Chunks are decoded (inflated, patched and re-deflated) on a pool of
+// threads, but handed to the sink and the SHA context strictly in
+// order by the calling thread.  The output and working buffers of all
+// chunks that have been started but not yet sunk are limited to about
+// MAX_BYTES_IN_FLIGHT; a chunk bigger than that is decoded on its own.
+//
+// CHUNK_NORMAL chunks need no working memory beyond their output, so
+// they are only decoded ahead when they are small.  Big ones, and any
+// the calling thread reaches before a worker does, are patched by the
+// calling thread straight into the sink through a small window.
+#define MAX_BYTES_IN_FLIGHT  (32 << 20)
+#define MAX_PATCH_THREADS    4
+#define MAX_BUFFERED_NORMAL  (MAX_BYTES_IN_FLIGHT / MAX_PATCH_THREADS)
 
-    // IMGDIFF2 uses CHUNK_NORMAL, CHUNK_DEFLATE, and CHUNK_RAW.
-    // (IMGDIFF1, which is no longer supported, used CHUNK_NORMAL and
-    // CHUNK_GZIP.)
-    if (memcmp(header, "IMGDIFF2", 8) != 0) {
-        printf("corrupt patch file header (magic number)\n");
-        return -1;
-    }
+enum ChunkState { CHUNK_PENDING, CHUNK_DECODING, CHUNK_DONE, CHUNK_FAILED,
+                  CHUNK_STREAM };
+
+typedef struct {
+    int type;
+
+    // CHUNK_NORMAL and CHUNK_DEFLATE
+    size_t src_start;
+    size_t src_len;
+    size_t patch_offset;
+
+    // CHUNK_DEFLATE only
+    size_t expanded_len;
+    size_t target_len;
+    int level, method, windowBits, memLevel, strategy;
+    size_t bonus_size;
+
+    size_t cost;                // estimated bytes needed to decode
 
-    int num_chunks = Read4(header+8);
+    enum ChunkState state;
+    unsigned char* output;      // decoded chunk, ready for the sink
+    ssize_t output_len;
+    int owns_output;            // output is ours to free (not patch data)
+} PatchChunk;
 
+typedef struct {
+    const unsigned char* old_data;
+    ssize_t old_size;
+    const Value* patch;
+    const Value* bonus_data;
+
+    PatchChunk* chunks;
+    int num_chunks;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int next;                   // next chunk to be decoded
+    size_t in_flight;           // sum of cost of chunks started but not sunk
+    int abort;
+} ImagePatch;
+
+// Parse the chunk records of the IMGDIFF2 header into ip->chunks.
+// Return 0 on success.
+static int ParseChunks(ImagePatch* ip) {
+    const Value* patch = ip->patch;
+    ssize_t pos = 12;
     int i;
-    for (i = 0; i < num_chunks; ++i) {
+
+    for (i = 0; i < ip->num_chunks; ++i) {
+        PatchChunk* ch = ip->chunks + i;
+
         // each chunk's header record starts with 4 bytes.
         if (pos + 4 > patch->size) {
             printf("failed to read chunk %d record\n", i);
             return -1;
         }
-        int type = Read4(patch->data + pos);
+        ch->type = Read4(patch->data + pos);
         pos += 4;
 
-        if (type == CHUNK_NORMAL) {
+        if (ch->type == CHUNK_NORMAL) {
             char* normal_header = patch->data + pos;
             pos += 24;
             if (pos > patch->size) {
@@ -74,13 +113,21 @@ int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
                 return -1;
             }
 
-            size_t src_start = Read8(normal_header);
-            size_t src_len = Read8(normal_header+8);
-            size_t patch_offset = Read8(normal_header+16);
+            ch->src_start = Read8(normal_header);
+            ch->src_len = Read8(normal_header+8);
+            ch->patch_offset = Read8(normal_header+16);
 
-            ApplyBSDiffPatch(old_data + src_start, src_len,
-                             patch, patch_offset, sink, token, ctx);
-        } else if (type == CHUNK_RAW) {
+            // The output size is in the chunk's bsdiff header.
+            if (ch->patch_offset + 32 > (size_t)patch->size) {
+                printf("failed to read chunk %d bsdiff header\n", i);
+                return -1;
+            }
+            ch->cost = Read8(patch->data + ch->patch_offset + 24);
+            if (ch->cost > MAX_BUFFERED_NORMAL) {
+                ch->state = CHUNK_STREAM;
+                ch->cost = 0;
+            }
+        } else if (ch->type == CHUNK_RAW) {
             char* raw_header = patch->data + pos;
             pos += 4;
             if (pos > patch->size) {
@@ -94,14 +141,12 @@ int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
                 printf("failed to read chunk %d raw data\n", i);
                 return -1;
             }
-            SHA_update(ctx, patch->data + pos, data_len);
-            if (sink((unsigned char*)patch->data + pos,
-                     data_len, token) != data_len) {
-                printf("failed to write chunk %d raw data\n", i);
-                return -1;
-            }
+            // Raw data is sunk straight out of the patch.
+            ch->output = (unsigned char*)patch->data + pos;
+            ch->output_len = data_len;
+            ch->state = CHUNK_DONE;
             pos += data_len;
-        } else if (type == CHUNK_DEFLATE) {
+        } else if (ch->type == CHUNK_DEFLATE) {
             // deflate chunks have an additional 60 bytes in their chunk header.
             char* deflate_header = patch->data + pos;
             pos += 60;
@@ -110,123 +155,323 @@ int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
                 return -1;
             }
 
-            size_t src_start = Read8(deflate_header);
-            size_t src_len = Read8(deflate_header+8);
-            size_t patch_offset = Read8(deflate_header+16);
-            size_t expanded_len = Read8(deflate_header+24);
-            size_t target_len = Read8(deflate_header+32);
-            int level = Read4(deflate_header+40);
-            int method = Read4(deflate_header+44);
-            int windowBits = Read4(deflate_header+48);
-            int memLevel = Read4(deflate_header+52);
-            int strategy = Read4(deflate_header+56);
-
-            // Decompress the source data; the chunk header tells us exactly
-            // how big we expect it to be when decompressed.
+            ch->src_start = Read8(deflate_header);
+            ch->src_len = Read8(deflate_header+8);
+            ch->patch_offset = Read8(deflate_header+16);
+            ch->expanded_len = Read8(deflate_header+24);
+            ch->target_len = Read8(deflate_header+32);
+            ch->level = Read4(deflate_header+40);
+            ch->method = Read4(deflate_header+44);
+            ch->windowBits = Read4(deflate_header+48);
+            ch->memLevel = Read4(deflate_header+52);
+            ch->strategy = Read4(deflate_header+56);
 
             // Note: expanded_len will include the bonus data size if
             // the patch was constructed with bonus data.  The
             // deflation will come up 'bonus_size' bytes short; these
             // must be appended from the bonus_data value.
-            size_t bonus_size = (i == 1 && bonus_data != NULL) ? bonus_data->size : 0;
+            ch->bonus_size = (i == 1 && ip->bonus_data != NULL) ?
+                ip->bonus_data->size : 0;
 
-            unsigned char* expanded_source = malloc(expanded_len);
-            if (expanded_source == NULL) {
-                printf("failed to allocate %d bytes for expanded_source\n",
-                       expanded_len);
-                return -1;
-            }
+            // expanded source, patched target, and (at most about) the
+            // target again once compressed.
+            ch->cost = ch->expanded_len + 2 * ch->target_len;
+        } else {
+            printf("patch chunk %d is unknown type %d\n", i, ch->type);
+            return -1;
+        }
 
-            z_stream strm;
-            strm.zalloc = Z_NULL;
-            strm.zfree = Z_NULL;
-            strm.opaque = Z_NULL;
-            strm.avail_in = src_len;
-            strm.next_in = (unsigned char*)(old_data + src_start);
-            strm.avail_out = expanded_len;
-            strm.next_out = expanded_source;
-
-            int ret;
-            ret = inflateInit2(&strm, -15);
-            if (ret != Z_OK) {
-                printf("failed to init source inflation: %d\n", ret);
-                return -1;
-            }
+        if (ch->type != CHUNK_RAW &&
+            (ch->src_start > (size_t)ip->old_size ||
+             ch->src_len > (size_t)ip->old_size - ch->src_start)) {
+            printf("chunk %d source range is out of bounds\n", i);
+            return -1;
+        }
+    }
 
-            // Because we've provided enough room to accommodate the output
-            // data, we expect one call to inflate() to suffice.
-            ret = inflate(&strm, Z_SYNC_FLUSH);
-            if (ret != Z_STREAM_END) {
-                printf("source inflation returned %d\n", ret);
-                return -1;
-            }
-            // We should have filled the output buffer exactly, except
-            // for the bonus_size.
-            if (strm.avail_out != bonus_size) {
-                printf("source inflation short by %d bytes\n", strm.avail_out-bonus_size);
-                return -1;
-            }
-            inflateEnd(&strm);
+    return 0;
+}
 
-            if (bonus_size) {
-                memcpy(expanded_source + (expanded_len - bonus_size),
-                       bonus_data->data, bonus_size);
-            }
+// Produce the output of a CHUNK_DEFLATE chunk in ch->output.  Return 0
+// on success.
+static int DecodeDeflateChunk(ImagePatch* ip, int i, PatchChunk* ch) {
+    // Decompress the source data; the chunk header tells us exactly
+    // how big we expect it to be when decompressed.
+    unsigned char* expanded_source = malloc(ch->expanded_len);
+    if (expanded_source == NULL) {
+        printf("failed to allocate %d bytes for expanded_source\n",
+               (int)ch->expanded_len);
+        return -1;
+    }
+
+    // The whole-buffer decoder writes straight into
+    // expanded_source; it uses the fastest engine this build has
+    // and falls back to zlib.
+    size_t inflated_len = 0;
+    if (!mzInflateBuffer(ip->old_data + ch->src_start, ch->src_len,
+                         expanded_source, ch->expanded_len,
+                         &inflated_len)) {
+        printf("source inflation failed\n");
+        free(expanded_source);
+        return -1;
+    }
+    // We should have filled the output buffer exactly, except
+    // for the bonus_size.
+    if (ch->expanded_len - inflated_len != ch->bonus_size) {
+        printf("source inflation short by %d bytes\n",
+               (int)(ch->expanded_len - inflated_len - ch->bonus_size));
+        free(expanded_source);
+        return -1;
+    }
 
-            // Next, apply the bsdiff patch (in memory) to the uncompressed
-            // data.
-            unsigned char* uncompressed_target_data;
-            ssize_t uncompressed_target_size;
-            if (ApplyBSDiffPatchMem(expanded_source, expanded_len,
-                                    patch, patch_offset,
-                                    &uncompressed_target_data,
-                                    &uncompressed_target_size) != 0) {
+    if (ch->bonus_size) {
+        memcpy(expanded_source + (ch->expanded_len - ch->bonus_size),
+               ip->bonus_data->data, ch->bonus_size);
+    }
+
+    // Next, apply the bsdiff patch (in memory) to the uncompressed
+    // data.
+    unsigned char* uncompressed_target_data;
+    ssize_t uncompressed_target_size;
+    if (ApplyBSDiffPatchMem(expanded_source, ch->expanded_len,
+                            ip->patch, ch->patch_offset,
+                            &uncompressed_target_data,
+                            &uncompressed_target_size) != 0) {
+        free(expanded_source);
+        return -1;
+    }
+    free(expanded_source);
+
+    // Now compress the target data, in one go, into a buffer big
+    // enough for the worst case.
+    z_stream strm;
+    int ret;
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    ret = deflateInit2(&strm, ch->level, ch->method, ch->windowBits,
+                       ch->memLevel, ch->strategy);
+    if (ret != Z_OK) {
+        printf("failed to init chunk %d deflate (%d)\n", i, ret);
+        free(uncompressed_target_data);
+        return -1;
+    }
+    uLong bound = deflateBound(&strm, uncompressed_target_size);
+    ch->output = malloc(bound);
+    if (ch->output == NULL) {
+        printf("failed to allocate %ld bytes for chunk %d output\n",
+               (long)bound, i);
+        deflateEnd(&strm);
+        free(uncompressed_target_data);
+        return -1;
+    }
+    strm.avail_in = uncompressed_target_size;
+    strm.next_in = uncompressed_target_data;
+    strm.avail_out = bound;
+    strm.next_out = ch->output;
+    ret = deflate(&strm, Z_FINISH);
+    ch->output_len = bound - strm.avail_out;
+    ch->owns_output = 1;
+    deflateEnd(&strm);
+    free(uncompressed_target_data);
+
+    if (ret != Z_STREAM_END) {
+        printf("failed to deflate chunk %d (%d)\n", i, ret);
+        return -1;
+    }
+    return 0;
+}
+
+// Decode chunk i into its output buffer.  Return 0 on success.
+static int DecodeChunk(ImagePatch* ip, int i) {
+    PatchChunk* ch = ip->chunks + i;
+
+    switch (ch->type) {
+        case CHUNK_NORMAL:
+            if (ApplyBSDiffPatchMem(ip->old_data + ch->src_start, ch->src_len,
+                                    ip->patch, ch->patch_offset,
+                                    &ch->output, &ch->output_len) != 0) {
+                printf("failed to patch chunk %d\n", i);
                 return -1;
             }
+            ch->owns_output = 1;
+            return 0;
+
+        case CHUNK_DEFLATE:
+            return DecodeDeflateChunk(ip, i, ch);
+    }
+    return 0;
+}
+
+// Claim the next chunk to decode, waiting for room under
+// MAX_BYTES_IN_FLIGHT if need be.  Must be called with ip->lock held.
+// Return the chunk index, or -1 if there is nothing left to do.
+static int ClaimChunk(ImagePatch* ip) {
+    while (!ip->abort && ip->next < ip->num_chunks) {
+        PatchChunk* ch = ip->chunks + ip->next;
+        if (ch->state != CHUNK_PENDING) {
+            ++ip->next;
+            continue;
+        }
+        if (ip->in_flight == 0 ||
+            ip->in_flight + ch->cost <= MAX_BYTES_IN_FLIGHT) {
+            ch->state = CHUNK_DECODING;
+            ip->in_flight += ch->cost;
+            return ip->next++;
+        }
+        pthread_cond_wait(&ip->cond, &ip->lock);
+    }
+    return -1;
+}
+
+// Decode chunk i (claimed by the caller, who holds ip->lock) and
+// publish the result.  Returns with ip->lock held again.
+static void RunChunk(ImagePatch* ip, int i) {
+    pthread_mutex_unlock(&ip->lock);
+    int result = DecodeChunk(ip, i);
+    pthread_mutex_lock(&ip->lock);
+    ip->chunks[i].state = (result == 0) ? CHUNK_DONE : CHUNK_FAILED;
+    pthread_cond_broadcast(&ip->cond);
+}
+
+static void* ChunkWorker(void* cookie) {
+    ImagePatch* ip = (ImagePatch*)cookie;
+    int i;
+    pthread_mutex_lock(&ip->lock);
+    while ((i = ClaimChunk(ip)) >= 0) {
+        RunChunk(ip, i);
+    }
+    pthread_mutex_unlock(&ip->lock);
+    return NULL;
+}
+
+/*
+ * Apply the patch given in 'patch_filename' to the source data given
+ * by (old_data, old_size).  Write the patched output to the 'output'
+ * file, and update the SHA context with the output data as well.
+ * Return 0 on success.
+ */
+int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
+                    const Value* patch,
+                    SinkFn sink, void* token, SHA_CTX* ctx,
+                    const Value* bonus_data) {
+    char* header = patch->data;
+    if (patch->size < 12) {
+        printf("patch too short to contain header\n");
+        return -1;
+    }
+
+    // IMGDIFF2 uses CHUNK_NORMAL, CHUNK_DEFLATE, and CHUNK_RAW.
+    // (IMGDIFF1, which is no longer supported, used CHUNK_NORMAL and
+    // CHUNK_GZIP.)
+    if (memcmp(header, "IMGDIFF2", 8) != 0) {
+        printf("corrupt patch file header (magic number)\n");
+        return -1;
+    }
 
-            // Now compress the target data and append it to the output.
-
-            // we're done with the expanded_source data buffer, so we'll
-            // reuse that memory to receive the output of deflate.
-            unsigned char* temp_data = expanded_source;
-            ssize_t temp_size = expanded_len;
-            if (temp_size < 32768) {
-                // ... unless the buffer is too small, in which case we'll
-                // allocate a fresh one.
-                free(temp_data);
-                temp_data = malloc(32768);
-                temp_size = 32768;
+    ImagePatch ip;
+    memset(&ip, 0, sizeof(ip));
+    ip.old_data = old_data;
+    ip.old_size = old_size;
+    ip.patch = patch;
+    ip.bonus_data = bonus_data;
+    ip.num_chunks = Read4(header+8);
+    if (ip.num_chunks < 0) {
+        printf("corrupt patch file header (chunk count)\n");
+        return -1;
+    }
+    ip.chunks = calloc(ip.num_chunks ? ip.num_chunks : 1, sizeof(PatchChunk));
+    if (ip.chunks == NULL) {
+        printf("failed to allocate %d chunk records\n", ip.num_chunks);
+        return -1;
+    }
+    if (ParseChunks(&ip) != 0) {
+        free(ip.chunks);
+        return -1;
+    }
+    pthread_mutex_init(&ip.lock, NULL);
+    pthread_cond_init(&ip.cond, NULL);
+
+    // The calling thread decodes too whenever the chunk it is waiting
+    // to sink hasn't been picked up yet, so with a single CPU no extra
+    // threads are needed at all.
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int num_threads = 0;
+    if (cpus > 1) {
+        num_threads = cpus < MAX_PATCH_THREADS ? cpus : MAX_PATCH_THREADS;
+    }
+    pthread_t threads[MAX_PATCH_THREADS];
+    int started = 0;
+    int i;
+    for (i = 0; i < num_threads && i < ip.num_chunks; ++i) {
+        if (pthread_create(threads+started, NULL, ChunkWorker, &ip) == 0) {
+            ++started;
+        }
+    }
+
+    int result = 0;
+    pthread_mutex_lock(&ip.lock);
+    for (i = 0; i < ip.num_chunks; ++i) {
+        PatchChunk* ch = ip.chunks + i;
+        while (ch->state != CHUNK_DONE && ch->state != CHUNK_FAILED &&
+               ch->state != CHUNK_STREAM) {
+            if (ch->state == CHUNK_PENDING && ch->type == CHUNK_NORMAL) {
+                // Nobody has started it, and it's next: no need to
+                // buffer it.
+                ch->state = CHUNK_STREAM;
+                ch->cost = 0;
+            } else if (ch->state == CHUNK_PENDING && ip.next <= i) {
+                int claimed = ClaimChunk(&ip);
+                RunChunk(&ip, claimed);
+            } else {
+                pthread_cond_wait(&ip.cond, &ip.lock);
             }
+        }
+        if (ch->state == CHUNK_FAILED) {
+            result = -1;
+            break;
+        }
+        pthread_mutex_unlock(&ip.lock);
 
-            // now the deflate stream
-            strm.zalloc = Z_NULL;
-            strm.zfree = Z_NULL;
-            strm.opaque = Z_NULL;
-            strm.avail_in = uncompressed_target_size;
-            strm.next_in = uncompressed_target_data;
-            ret = deflateInit2(&strm, level, method, windowBits, memLevel, strategy);
-            do {
-                strm.avail_out = temp_size;
-                strm.next_out = temp_data;
-                ret = deflate(&strm, Z_FINISH);
-                ssize_t have = temp_size - strm.avail_out;
-
-                if (sink(temp_data, have, token) != have) {
-                    printf("failed to write %ld compressed bytes to output\n",
-                           (long)have);
-                    return -1;
-                }
-                SHA_update(ctx, temp_data, have);
-            } while (ret != Z_STREAM_END);
-            deflateEnd(&strm);
-
-            free(temp_data);
-            free(uncompressed_target_data);
+        if (ch->state == CHUNK_STREAM) {
+            if (ApplyBSDiffPatch(old_data + ch->src_start, ch->src_len,
+                                 patch, ch->patch_offset,
+                                 sink, token, ctx) != 0) {
+                printf("failed to patch chunk %d\n", i);
+                result = -1;
+            }
+        } else if (sink(ch->output, ch->output_len, token) != ch->output_len) {
+            printf("failed to write chunk %d (%ld bytes) to output\n",
+                   i, (long)ch->output_len);
+            result = -1;
         } else {
-            printf("patch chunk %d is unknown type %d\n", i, type);
-            return -1;
+            SHA_update(ctx, ch->output, ch->output_len);
+        }
+        if (ch->owns_output) {
+            free(ch->output);
         }
+        ch->output = NULL;
+
+        pthread_mutex_lock(&ip.lock);
+        ip.in_flight -= ch->cost;
+        pthread_cond_broadcast(&ip.cond);
+        if (result != 0) break;
     }
+    ip.abort = 1;
+    pthread_cond_broadcast(&ip.cond);
+    pthread_mutex_unlock(&ip.lock);
 
-    return 0;
+    for (i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    for (i = 0; i < ip.num_chunks; ++i) {
+        if (ip.chunks[i].owns_output) {
+            free(ip.chunks[i].output);
+        }
+    }
+    pthread_cond_destroy(&ip.cond);
+    pthread_mutex_destroy(&ip.lock);
+    free(ip.chunks);
+
+    return result;
 }
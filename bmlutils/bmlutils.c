@@ -21,6 +21,7 @@
 #include <sys/wait.h>
 
 #include <common.h>
+#include "flashutils/blkio.h"
 
 #define BML_UNLOCK_ALL				0x8A29		///< unlock all partition RO -> RW
 
@@ -34,33 +35,25 @@
 
 static int restore_internal(const char* bml, const char* filename)
 {
-    char buf[4096];
-    int dstfd, srcfd, bytes_read, bytes_written, total_read = 0;
-    if (filename == NULL)
-        srcfd = 0;
-    else {
-        srcfd = open(filename, O_RDONLY | O_LARGEFILE);
-        if (srcfd < 0)
-            return 2;
-    }
-    dstfd = open(bml, O_RDWR | O_LARGEFILE);
+    if (filename == NULL || access(filename, R_OK) != 0)
+        return 2;
+    int dstfd = open(bml, O_RDWR | O_LARGEFILE);
     if (dstfd < 0)
         return 3;
-    if (ioctl(dstfd, BML_UNLOCK_ALL, 0))
+    if (ioctl(dstfd, BML_UNLOCK_ALL, 0)) {
+        close(dstfd);
         return 4;
-    do {
-        total_read += bytes_read = read(srcfd, buf, 4096);
-        if (!bytes_read)
-            break;
-        if (bytes_read < 4096)
-            memset(&buf[bytes_read], 0, 4096 - bytes_read);
-        if (write(dstfd, buf, 4096) < 4096)
-            return 5;
-    } while(bytes_read == 4096);
-    
+    }
     close(dstfd);
-    close(srcfd);
-    
+
+    // BML takes whole 4K pages; the last one is padded with zeros.
+    // Sparse images are expanded on the way.
+    BlkIoCopy opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.pad_to = 4096;
+    opts.flags = BLKIO_IMAGE;
+    if (blkio_copy_file(filename, bml, &opts) != 0)
+        return 5;
     return 0;
 }
 
@@ -104,51 +97,7 @@ int cmd_bml_backup_raw_partition(const char *partition, const char *out_file)
         return -1;
     }
 
-    int ch;
-    FILE *in;
-    FILE *out;
-    int val = 0;
-    char buf[512];
-    unsigned sz = 0;
-    unsigned i;
-    int ret = -1;
-
-    in  = fopen ( bml,  "r" );
-    if (in == NULL)
-        goto ERROR3;
-
-    out = fopen ( out_file,  "w" );
-    if (out == NULL)
-        goto ERROR2;
-
-    fseek(in, 0L, SEEK_END);
-    sz = ftell(in);
-    fseek(in, 0L, SEEK_SET);
-
-    if (sz % 512)
-    {
-        while ( ( ch = fgetc ( in ) ) != EOF )
-            fputc ( ch, out );
-    }
-    else
-    {
-        for (i=0; i< (sz/512); i++)
-        {
-            if ((fread(buf, 512, 1, in)) != 1)
-                goto ERROR1;
-            if ((fwrite(buf, 512, 1, out)) != 1)
-                goto ERROR1;
-        }
-    }
-
-    fsync(fileno(out));
-    ret = 0;
-ERROR1:
-    fclose ( out );
-ERROR2:
-    fclose ( in );
-ERROR3:
-    return ret;
+    return blkio_copy_file(bml, out_file, NULL);
 }
 
 int cmd_bml_erase_raw_partition(const char *partition)
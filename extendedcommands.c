@@ -52,6 +52,7 @@
 #include "mounts.h"
 #include "mtdutils/mtdutils.h"
 #include "nandroid.h"
+#include "nandroid_delta.h"
 #include "recovery_settings.h"
 #include "recovery_ui.h"
 #include "roots.h"
@@ -69,7 +70,7 @@
 // these go on top of menu list
 #define NANDROID_ACTIONS_NUM 3
 // number of fixed bottom entries after volume actions
-#define NANDROID_FIXED_ENTRIES 4
+#define NANDROID_FIXED_ENTRIES 5
 
 #if defined(ENABLE_LOKI) && defined(BOARD_NATIVE_DUALBOOT_SINGLEDATA)
 #define FIXED_ADVANCED_ENTRIES 10
@@ -675,6 +676,10 @@ static void show_nandroid_delete_menu(const char* path) {
     if (file == NULL)
         return;
 
+    int dependents = nandroid_delta_dependents(file);
+    if (dependents > 0)
+        ui_print("%d image(s) in newer backups are deltas against this one\nand can't be restored without it!\n", dependents);
+
     if (confirm_selection("Confirm delete?", "Yes - Delete")) {
         sprintf(tmp, "rm -rf %s", file);
         __system(tmp);
@@ -866,6 +871,8 @@ int format_device(const char *device, const char *path, const char *fs_type) {
     }
 #ifdef USE_F2FS
     if (strcmp(fs_type, "f2fs") == 0) {
+        // make_ext4fs discards the device itself; mkfs.f2fs may not.
+        mmc_discard_device(v->blk_device, v->length);
         char* args[] = { "mkfs.f2fs", v->blk_device };
         if (make_f2fs_main(2, args) != 0) {
             LOGE("format_volume: mkfs.f2fs failed on %s\n", v->blk_device);
@@ -1456,6 +1463,21 @@ static void choose_default_backup_format() {
     }
 }
 
+// Store boot/recovery and other raw images as deltas against the
+// previous backup's copy.  Kept as a flag file so it survives reboots.
+static void toggle_delta_raw_backups() {
+    char path[PATH_MAX];
+    sprintf(path, "%s%s%s", get_primary_storage_path(), (is_data_media() ? "/0/" : "/"), NANDROID_DELTA_RAW_FILE);
+    ensure_path_mounted(path);
+    if (nandroid_delta_enabled()) {
+        unlink(path);
+        ui_print("Raw Image Deltas: Disabled\n");
+    } else {
+        write_string_to_file(path, "1");
+        ui_print("Raw Image Deltas: Enabled\n");
+    }
+}
+
 //=========================================/
 //= Advanced backup/restore, original work=/
 //=             of carliv@xda             =/
@@ -1572,6 +1594,7 @@ int show_nandroid_menu() {
     list[offset + 1] = "Toggle MD5 Verification";
     list[offset + 2] = "Default backup format";
     list[offset + 3] = "Delete unused Old Backup Data";
+    list[offset + 4] = "Toggle Raw Image Deltas";
     offset += NANDROID_FIXED_ENTRIES;
 
 #ifdef RECOVERY_EXTEND_NANDROID_MENU
@@ -1597,6 +1620,8 @@ int show_nandroid_menu() {
             choose_default_backup_format();
         } else if (chosen_item == (action_entries_num + 3)) {
             run_dedupe_gc();
+        } else if (chosen_item == (action_entries_num + 4)) {
+            toggle_delta_raw_backups();
         } else if (chosen_item < action_entries_num) {
             // get nandroid volume actions path
             if (chosen_item < NANDROID_ACTIONS_NUM) {
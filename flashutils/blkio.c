@@ -0,0 +1,1087 @@
+/*
+ * Copyright (C) 2014 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>  // BLKSSZGET
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifdef USE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "blkio.h"
+
+#define BLKIO_MAX_DEPTH         32
+#define BLKIO_ALIGN             4096
+
+/* Older kernel headers predate the discard ioctls. */
+#ifndef BLKDISCARD
+#define BLKDISCARD              _IO(0x12,119)
+#endif
+#ifndef BLKDISCARDZEROES
+#define BLKDISCARDZEROES        _IO(0x12,124)
+#endif
+#ifndef BLKFLSBUF
+#define BLKFLSBUF               _IO(0x12,97)
+#endif
+#ifndef BLKZEROOUT
+#define BLKZEROOUT              _IO(0x12,127)
+#endif
+
+#define BLKIO_THREADS           0
+#define BLKIO_URING             1
+
+/* A request and how much of it is done; there is one per buffer, since a
+ * buffer is in at most one request.
+ */
+typedef struct {
+    BlkIoRequest req;
+    size_t done;
+} BlkIoSlot;
+
+struct BlkIo {
+    int backend;
+    int depth;
+    int buffers;
+    size_t buffer_size;
+    char **buffer;
+    BlkIoSlot *slot;
+    int in_flight;
+
+    /* thread pool: buffer indexes waiting to be picked up or collected */
+    pthread_t *threads;
+    int thread_count;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t finished;
+    int *queued;
+    int queued_head, queued_count;
+    int *completed;
+    int completed_head, completed_count;
+    int stopping;
+
+#ifdef USE_IO_URING
+    int ring_fd;
+    int registered;             // buffers are registered: use *_FIXED ops
+    unsigned pending;           // SQEs queued but not yet entered
+    struct iovec *iov;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+#endif
+};
+
+/* Run the unfinished part of a slot's request once; returns what the
+ * syscall did.
+ */
+static ssize_t
+blkio_do(BlkIo *io, BlkIoSlot *s) {
+    char *data = io->buffer[s->req.buffer] + s->done;
+    size_t len = s->req.len - s->done;
+    off64_t offset = s->req.offset + s->done;
+    if (s->req.op == BLKIO_READ)
+        return pread64(s->req.fd, data, len, offset);
+    return pwrite64(s->req.fd, data, len, offset);
+}
+
+static void *
+blkio_worker(void *cookie) {
+    BlkIo *io = (BlkIo *) cookie;
+
+    pthread_mutex_lock(&io->lock);
+    while (1) {
+        while (io->queued_count == 0 && !io->stopping)
+            pthread_cond_wait(&io->work, &io->lock);
+        if (io->queued_count == 0)
+            break;
+        int b = io->queued[io->queued_head];
+        io->queued_head = (io->queued_head + 1) % io->buffers;
+        io->queued_count--;
+        pthread_mutex_unlock(&io->lock);
+
+        BlkIoSlot *s = &io->slot[b];
+        ssize_t err = 0;
+        while (s->done < s->req.len) {
+            ssize_t r = blkio_do(io, s);
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r < 0)
+                err = -errno;
+            if (r <= 0)
+                break;
+            s->done += r;
+        }
+        if (err != 0)
+            s->done = err;      // reported as the result
+
+        pthread_mutex_lock(&io->lock);
+        io->completed[(io->completed_head + io->completed_count) % io->buffers] = b;
+        io->completed_count++;
+        pthread_cond_signal(&io->finished);
+    }
+    pthread_mutex_unlock(&io->lock);
+    return NULL;
+}
+
+static int
+blkio_start_threads(BlkIo *io) {
+    io->queued = calloc(io->buffers, sizeof(int));
+    io->completed = calloc(io->buffers, sizeof(int));
+    io->threads = calloc(io->depth, sizeof(pthread_t));
+    if (io->queued == NULL || io->completed == NULL || io->threads == NULL)
+        return -1;
+    pthread_mutex_init(&io->lock, NULL);
+    pthread_cond_init(&io->work, NULL);
+    pthread_cond_init(&io->finished, NULL);
+    for (io->thread_count = 0; io->thread_count < io->depth; io->thread_count++) {
+        if (pthread_create(&io->threads[io->thread_count], NULL,
+                           blkio_worker, io) != 0)
+            break;
+    }
+    // One worker still works, just without any overlap.
+    return io->thread_count > 0 ? 0 : -1;
+}
+
+static void
+blkio_stop_threads(BlkIo *io) {
+    int i;
+    if (io->threads == NULL)
+        return;
+    pthread_mutex_lock(&io->lock);
+    io->stopping = 1;
+    pthread_cond_broadcast(&io->work);
+    pthread_mutex_unlock(&io->lock);
+    for (i = 0; i < io->thread_count; i++)
+        pthread_join(io->threads[i], NULL);
+    pthread_cond_destroy(&io->finished);
+    pthread_cond_destroy(&io->work);
+    pthread_mutex_destroy(&io->lock);
+}
+
+#ifdef USE_IO_URING
+
+static int
+blkio_start_uring(BlkIo *io) {
+    struct io_uring_params p;
+    int i;
+
+    memset(&p, 0, sizeof(p));
+    io->ring_fd = syscall(__NR_io_uring_setup, io->depth, &p);
+    if (io->ring_fd < 0)
+        return -1;
+
+    io->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    io->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (io->cq_ring_size > io->sq_ring_size)
+            io->sq_ring_size = io->cq_ring_size;
+        io->cq_ring_size = 0;
+    }
+    io->sq_ring = mmap(NULL, io->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, io->ring_fd, IORING_OFF_SQ_RING);
+    if (io->sq_ring == MAP_FAILED) {
+        io->sq_ring = NULL;
+        return -1;
+    }
+    if (io->cq_ring_size == 0) {
+        io->cq_ring = io->sq_ring;
+    } else {
+        io->cq_ring = mmap(NULL, io->cq_ring_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, io->ring_fd, IORING_OFF_CQ_RING);
+        if (io->cq_ring == MAP_FAILED) {
+            io->cq_ring = NULL;
+            return -1;
+        }
+    }
+    io->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    io->sqes = mmap(NULL, io->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, io->ring_fd, IORING_OFF_SQES);
+    if (io->sqes == MAP_FAILED) {
+        io->sqes = NULL;
+        return -1;
+    }
+
+    char *sq = (char *) io->sq_ring;
+    char *cq = (char *) io->cq_ring;
+    io->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    io->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    io->sq_array = (unsigned *) (sq + p.sq_off.array);
+    io->cq_head = (unsigned *) (cq + p.cq_off.head);
+    io->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    io->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    io->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    io->iov = calloc(io->buffers, sizeof(struct iovec));
+    if (io->iov == NULL)
+        return -1;
+    for (i = 0; i < io->buffers; i++) {
+        io->iov[i].iov_base = io->buffer[i];
+        io->iov[i].iov_len = io->buffer_size;
+    }
+    // Registering pins the buffers, which RLIMIT_MEMLOCK may not allow;
+    // unregistered buffers only cost a page walk per request.
+    io->registered = syscall(__NR_io_uring_register, io->ring_fd,
+                             IORING_REGISTER_BUFFERS, io->iov, io->buffers) == 0;
+    return 0;
+}
+
+static void
+blkio_stop_uring(BlkIo *io) {
+    if (io->sqes != NULL)
+        munmap(io->sqes, io->sqes_size);
+    if (io->cq_ring != NULL && io->cq_ring != io->sq_ring)
+        munmap(io->cq_ring, io->cq_ring_size);
+    if (io->sq_ring != NULL)
+        munmap(io->sq_ring, io->sq_ring_size);
+    if (io->ring_fd >= 0)
+        close(io->ring_fd);
+    free(io->iov);
+}
+
+/* Queue the unfinished part of buffer b's request.  The kernel sees it
+ * at the next io_uring_enter.
+ */
+static void
+blkio_queue_sqe(BlkIo *io, int b) {
+    BlkIoSlot *s = &io->slot[b];
+    unsigned tail = *io->sq_tail;
+    unsigned index = tail & *io->sq_mask;
+    struct io_uring_sqe *sqe = &io->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = s->req.fd;
+    sqe->off = s->req.offset + s->done;
+    sqe->user_data = b;
+    if (io->registered) {
+        sqe->opcode = s->req.op == BLKIO_READ ? IORING_OP_READ_FIXED
+                                              : IORING_OP_WRITE_FIXED;
+        sqe->addr = (unsigned long) (io->buffer[b] + s->done);
+        sqe->len = s->req.len - s->done;
+        sqe->buf_index = b;
+    } else {
+        io->iov[b].iov_base = io->buffer[b] + s->done;
+        io->iov[b].iov_len = s->req.len - s->done;
+        sqe->opcode = s->req.op == BLKIO_READ ? IORING_OP_READV
+                                              : IORING_OP_WRITEV;
+        sqe->addr = (unsigned long) &io->iov[b];
+        sqe->len = 1;
+    }
+    io->sq_array[index] = index;
+    __atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    io->pending++;
+}
+
+/* Hand queued SQEs to the kernel and wait for a completion of a whole
+ * request, resubmitting the rest of any short transfer.
+ */
+static int
+blkio_wait_uring(BlkIo *io) {
+    while (1) {
+        unsigned head = *io->cq_head;
+        if (head != __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &io->cqes[head & *io->cq_mask];
+            int b = (int) cqe->user_data;
+            int res = cqe->res;
+            __atomic_store_n(io->cq_head, head + 1, __ATOMIC_RELEASE);
+
+            BlkIoSlot *s = &io->slot[b];
+            if (res == -EINTR || res == -EAGAIN) {
+                blkio_queue_sqe(io, b);
+                continue;
+            }
+            if (res > 0) {
+                s->done += res;
+                if (s->done < s->req.len) {
+                    blkio_queue_sqe(io, b);
+                    continue;
+                }
+            } else if (res < 0) {
+                s->done = (size_t) (ssize_t) res;
+            }
+            return b;
+        }
+
+        int r = syscall(__NR_io_uring_enter, io->ring_fd, io->pending, 1,
+                        IORING_ENTER_GETEVENTS, NULL, 0);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        io->pending -= r;
+    }
+}
+
+#endif  // USE_IO_URING
+
+BlkIo *
+blkio_open(int depth, int buffers, size_t buffer_size, int flags) {
+    int i;
+
+    if (depth < 1)
+        depth = 1;
+    if (depth > BLKIO_MAX_DEPTH)
+        depth = BLKIO_MAX_DEPTH;
+    if (buffers < 1 || buffer_size == 0)
+        return NULL;
+
+    BlkIo *io = calloc(1, sizeof(BlkIo));
+    if (io == NULL)
+        return NULL;
+    io->depth = depth;
+    io->buffers = buffers;
+    io->buffer_size = buffer_size;
+    io->buffer = calloc(buffers, sizeof(char *));
+    io->slot = calloc(buffers, sizeof(BlkIoSlot));
+    if (io->buffer == NULL || io->slot == NULL)
+        goto fail;
+    for (i = 0; i < buffers; i++) {
+        if (posix_memalign((void **) &io->buffer[i], BLKIO_ALIGN, buffer_size) != 0) {
+            io->buffer[i] = NULL;
+            goto fail;
+        }
+    }
+
+#ifdef USE_IO_URING
+    io->ring_fd = -1;
+    if (!(flags & BLKIO_NO_URING)) {
+        if (blkio_start_uring(io) == 0) {
+            io->backend = BLKIO_URING;
+            return io;
+        }
+        blkio_stop_uring(io);
+        io->ring_fd = -1;
+        io->sq_ring = io->cq_ring = NULL;
+        io->sqes = NULL;
+        io->iov = NULL;
+    }
+#endif
+    io->backend = BLKIO_THREADS;
+    if (blkio_start_threads(io) == 0)
+        return io;
+
+fail:
+    blkio_close(io);
+    return NULL;
+}
+
+void
+blkio_close(BlkIo *io) {
+    BlkIoCompletion done;
+    int i;
+
+    if (io == NULL)
+        return;
+    while (io->in_flight > 0 && blkio_wait(io, &done) == 0)
+        ;
+#ifdef USE_IO_URING
+    if (io->backend == BLKIO_URING)
+        blkio_stop_uring(io);
+#endif
+    if (io->backend == BLKIO_THREADS)
+        blkio_stop_threads(io);
+    free(io->threads);
+    free(io->queued);
+    free(io->completed);
+    for (i = 0; io->buffer != NULL && i < io->buffers; i++)
+        free(io->buffer[i]);
+    free(io->buffer);
+    free(io->slot);
+    free(io);
+}
+
+char *
+blkio_buffer(BlkIo *io, int index) {
+    return io->buffer[index];
+}
+
+const char *
+blkio_backend(const BlkIo *io) {
+    return io->backend == BLKIO_URING ? "io_uring" : "threads";
+}
+
+int
+blkio_submit(BlkIo *io, const BlkIoRequest *req) {
+    if (io->in_flight >= io->depth) {
+        errno = EBUSY;
+        return -1;
+    }
+    if (req->buffer < 0 || req->buffer >= io->buffers ||
+        req->len > io->buffer_size) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    BlkIoSlot *s = &io->slot[req->buffer];
+    s->req = *req;
+    s->done = 0;
+    io->in_flight++;
+
+#ifdef USE_IO_URING
+    if (io->backend == BLKIO_URING) {
+        blkio_queue_sqe(io, req->buffer);
+        return 0;
+    }
+#endif
+    pthread_mutex_lock(&io->lock);
+    io->queued[(io->queued_head + io->queued_count) % io->buffers] = req->buffer;
+    io->queued_count++;
+    pthread_cond_signal(&io->work);
+    pthread_mutex_unlock(&io->lock);
+    return 0;
+}
+
+int
+blkio_wait(BlkIo *io, BlkIoCompletion *done) {
+    int b;
+
+    if (io->in_flight == 0)
+        return -1;
+
+#ifdef USE_IO_URING
+    if (io->backend == BLKIO_URING) {
+        b = blkio_wait_uring(io);
+        if (b < 0)
+            return -1;
+    } else
+#endif
+    {
+        pthread_mutex_lock(&io->lock);
+        while (io->completed_count == 0)
+            pthread_cond_wait(&io->finished, &io->lock);
+        b = io->completed[io->completed_head];
+        io->completed_head = (io->completed_head + 1) % io->buffers;
+        io->completed_count--;
+        pthread_mutex_unlock(&io->lock);
+    }
+
+    io->in_flight--;
+    done->tag = io->slot[b].req.tag;
+    done->buffer = b;
+    done->result = (ssize_t) io->slot[b].done;
+    return 0;
+}
+
+/* ---- images ---- */
+
+/* The Android sparse image format, as libsparse writes it. */
+#define SPARSE_HEADER_MAGIC     0xed26ff3a
+#define CHUNK_TYPE_RAW          0xcac1
+#define CHUNK_TYPE_FILL         0xcac2
+#define CHUNK_TYPE_DONT_CARE    0xcac3
+#define CHUNK_TYPE_CRC32        0xcac4
+
+typedef struct {
+    uint32_t magic;
+    uint16_t major_version;
+    uint16_t minor_version;
+    uint16_t file_hdr_sz;
+    uint16_t chunk_hdr_sz;
+    uint32_t blk_sz;
+    uint32_t total_blks;
+    uint32_t total_chunks;
+    uint32_t image_checksum;
+} SparseHeader;
+
+typedef struct {
+    uint16_t chunk_type;
+    uint16_t reserved1;
+    uint32_t chunk_sz;          // in blocks of the image
+    uint32_t total_sz;          // in bytes of the file, header included
+} SparseChunk;
+
+static int
+blkio_sparse_header(int fd, SparseHeader *h) {
+    return pread64(fd, h, sizeof(*h), 0) == (ssize_t) sizeof(*h) &&
+           h->magic == SPARSE_HEADER_MAGIC;
+}
+
+int
+blkio_image_is_sparse(int fd) {
+    SparseHeader h;
+    return blkio_sparse_header(fd, &h);
+}
+
+int
+blkio_image_extents(int fd, BlkIoExtent **extents, uint64_t *size) {
+    SparseHeader h;
+    BlkIoExtent *e;
+
+    if (!blkio_sparse_header(fd, &h)) {
+        off64_t end = lseek64(fd, 0, SEEK_END);
+        if (end < 0 || (e = calloc(1, sizeof(*e))) == NULL)
+            return -1;
+        e->type = BLKIO_EXTENT_DATA;
+        e->len = end;
+        *extents = e;
+        *size = end;
+        return 1;
+    }
+
+    if (h.major_version != 1 || h.file_hdr_sz < sizeof(SparseHeader) ||
+        h.chunk_hdr_sz < sizeof(SparseChunk) || h.blk_sz == 0 || h.blk_sz % 4) {
+        printf("blkio: unsupported sparse image (version %u.%u, %u byte blocks)\n",
+               h.major_version, h.minor_version, h.blk_sz);
+        return -1;
+    }
+    e = calloc(h.total_chunks > 0 ? h.total_chunks : 1, sizeof(*e));
+    if (e == NULL)
+        return -1;
+
+    uint64_t in = h.file_hdr_sz, out = 0;
+    int count = 0;
+    uint32_t i;
+    for (i = 0; i < h.total_chunks; i++) {
+        SparseChunk c;
+        if (pread64(fd, &c, sizeof(c), in) != (ssize_t) sizeof(c)) {
+            printf("blkio: sparse image ends before chunk %u of %u\n", i, h.total_chunks);
+            goto bad;
+        }
+        BlkIoExtent *x = &e[count];
+        uint64_t len = (uint64_t) c.chunk_sz * h.blk_sz;
+        uint64_t payload = c.total_sz >= h.chunk_hdr_sz ? c.total_sz - h.chunk_hdr_sz : 1;
+        int ok;
+        x->in_offset = in + h.chunk_hdr_sz;
+        x->offset = out;
+        x->len = len;
+        x->fill = 0;
+        switch (c.chunk_type) {
+          case CHUNK_TYPE_RAW:
+            x->type = BLKIO_EXTENT_DATA;
+            ok = c.total_sz >= h.chunk_hdr_sz && payload == len;
+            break;
+          case CHUNK_TYPE_FILL:
+            x->type = BLKIO_EXTENT_FILL;
+            ok = payload == sizeof(x->fill) &&
+                 pread64(fd, &x->fill, sizeof(x->fill), x->in_offset) == sizeof(x->fill);
+            break;
+          case CHUNK_TYPE_DONT_CARE:
+            x->type = BLKIO_EXTENT_DONT_CARE;
+            ok = payload == 0;
+            break;
+          case CHUNK_TYPE_CRC32:
+            // Only a check on what came before; nothing to write.
+            ok = payload == 4 && len == 0;
+            break;
+          default:
+            ok = 0;
+        }
+        if (!ok) {
+            printf("blkio: bad sparse chunk %u (type 0x%04x)\n", i, c.chunk_type);
+            goto bad;
+        }
+        if (c.chunk_type != CHUNK_TYPE_CRC32 && len > 0)
+            count++;
+        out += len;
+        in += c.total_sz;
+    }
+    if (out != (uint64_t) h.total_blks * h.blk_sz) {
+        printf("blkio: sparse image chunks make %llu bytes, not %llu\n",
+               (unsigned long long) out,
+               (unsigned long long) h.total_blks * h.blk_sz);
+        goto bad;
+    }
+    *extents = e;
+    *size = out;
+    return count;
+
+bad:
+    free(e);
+    return -1;
+}
+
+/* Fill 'data' with what a fill extent holds at 'offset' of the image. */
+static void
+blkio_fill(char *data, size_t len, uint32_t fill, uint64_t offset) {
+    const unsigned char *pattern = (const unsigned char *) &fill;
+    size_t i;
+
+    if (pattern[0] == pattern[1] && pattern[0] == pattern[2] &&
+        pattern[0] == pattern[3]) {
+        memset(data, pattern[0], len);
+        return;
+    }
+    for (i = 0; i < len; i++)
+        data[i] = pattern[(offset + i) % 4];
+}
+
+static int
+blkio_is_zero(const char *data, size_t len) {
+    return len == 0 || (data[0] == 0 && memcmp(data, data + 1, len - 1) == 0);
+}
+
+struct BlkIoImage {
+    int fd;
+    BlkIoExtent *extents;
+    int count;
+    int next;                   // extent being read
+    uint64_t pos;               // how far into it
+    int dont_care;
+};
+
+BlkIoImage *
+blkio_image_open(const char *path, int dont_care) {
+    BlkIoImage *img = calloc(1, sizeof(BlkIoImage));
+    uint64_t size;
+
+    if (img == NULL)
+        return NULL;
+    img->dont_care = dont_care;
+    img->fd = open(path, O_RDONLY | O_LARGEFILE);
+    if (img->fd < 0) {
+        printf("blkio: can't open %s: %s\n", path, strerror(errno));
+        free(img);
+        return NULL;
+    }
+    img->count = blkio_image_extents(img->fd, &img->extents, &size);
+    if (img->count < 0) {
+        close(img->fd);
+        free(img);
+        return NULL;
+    }
+    return img;
+}
+
+ssize_t
+blkio_image_read(BlkIoImage *img, char *data, size_t len) {
+    size_t done = 0;
+
+    while (done < len && img->next < img->count) {
+        const BlkIoExtent *e = &img->extents[img->next];
+        uint64_t left = e->len - img->pos;
+        size_t n = len - done < left ? len - done : (size_t) left;
+        if (e->type == BLKIO_EXTENT_DATA) {
+            ssize_t r = pread64(img->fd, data + done, n, e->in_offset + img->pos);
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r <= 0) {
+                if (r == 0) {
+                    printf("blkio: image ends early, at %llu\n",
+                           (unsigned long long) (e->in_offset + img->pos));
+                    errno = EIO;
+                }
+                return -1;
+            }
+            n = r;
+        } else if (e->type == BLKIO_EXTENT_FILL) {
+            blkio_fill(data + done, n, e->fill, e->offset + img->pos);
+        } else {
+            memset(data + done, img->dont_care, n);
+        }
+        done += n;
+        img->pos += n;
+        if (img->pos == e->len) {
+            img->next++;
+            img->pos = 0;
+        }
+    }
+    return done;
+}
+
+void
+blkio_image_close(BlkIoImage *img) {
+    if (img == NULL)
+        return;
+    close(img->fd);
+    free(img->extents);
+    free(img);
+}
+
+/* ---- copying ---- */
+
+#define BLKIO_COPY_DEPTH        4
+#define BLKIO_COPY_CHUNK        (1 << 20)
+
+typedef struct {
+    int fd;
+    int tail_fd;                // buffered fd for transfers O_DIRECT can't do
+    int direct;
+    int block;
+    unsigned align;
+    const char *path;
+    int holes;                  // zeros needn't be written: they read as zero
+    int zeroout;                // try BLKZEROOUT for runs of zeros
+} BlkIoFile;
+
+static int
+blkio_file_open(BlkIoFile *f, const char *path, int flags) {
+    struct stat st;
+
+    f->path = path;
+    f->direct = 0;
+    f->block = 0;
+    f->align = 512;
+    f->tail_fd = -1;
+    f->holes = 0;
+    f->zeroout = 0;
+    f->fd = open(path, flags | O_LARGEFILE, 0666);
+    if (f->fd < 0) {
+        printf("blkio: can't open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (fstat(f->fd, &st) == 0 && S_ISBLK(st.st_mode)) {
+        int sector_size;
+        f->block = 1;
+        if (ioctl(f->fd, BLKSSZGET, &sector_size) == 0 && sector_size > 0)
+            f->align = sector_size;
+        // Not every driver takes O_DIRECT; buffered I/O still works.
+        int fl = fcntl(f->fd, F_GETFL);
+        if (fl != -1 && f->align <= BLKIO_ALIGN &&
+            fcntl(f->fd, F_SETFL, fl | O_DIRECT) == 0)
+            f->direct = 1;
+    }
+    return 0;
+}
+
+/* The fd for a transfer of 'len' bytes at 'offset': O_DIRECT transfers
+ * have to be whole sectors, so anything else goes through the page cache.
+ */
+static int
+blkio_file_fd(BlkIoFile *f, uint64_t offset, size_t len, int flags) {
+    if (!f->direct || ((offset | len) % f->align) == 0)
+        return f->fd;
+    if (f->tail_fd < 0)
+        f->tail_fd = open(f->path, (flags & ~(O_CREAT | O_TRUNC)) | O_LARGEFILE);
+    return f->tail_fd;
+}
+
+/* fsync, where EINVAL only means there is nothing to sync (/dev/null). */
+static int
+blkio_sync(int fd) {
+    return fsync(fd) == 0 || errno == EINVAL ? 0 : -1;
+}
+
+static int
+blkio_file_close(BlkIoFile *f, int sync) {
+    int ret = 0;
+    if (f->fd < 0)
+        return 0;
+    if (sync && f->tail_fd >= 0 && blkio_sync(f->tail_fd) != 0)
+        ret = -1;
+    if (sync && blkio_sync(f->fd) != 0)
+        ret = -1;
+    // Sectors discarded or zeroed behind the buffer cache's back mustn't
+    // be read from it later.
+    if (sync && f->block)
+        ioctl(f->fd, BLKFLSBUF, 0);
+    if (f->tail_fd >= 0)
+        close(f->tail_fd);
+    if (close(f->fd) != 0)
+        ret = -1;
+    if (ret != 0)
+        printf("blkio: can't sync %s: %s\n", f->path, strerror(errno));
+    return ret;
+}
+
+/* Get the first 'size' bytes of the output ready for an image.  A file
+ * was just truncated, so it reads as zeros wherever it isn't written.  A
+ * block device is discarded, which frees the flash and, where the device
+ * reads discarded sectors as zeros, means the same; otherwise runs of
+ * zeros are left to BLKZEROOUT, which often needn't send any data.
+ */
+static void
+blkio_prepare_image(BlkIoFile *f, uint64_t size) {
+    struct stat st;
+
+    if (!f->block) {
+        f->holes = fstat(f->fd, &st) == 0 && S_ISREG(st.st_mode);
+        return;
+    }
+    uint64_t range[2] = { 0, size / f->align * f->align };
+    unsigned int zeroes = 0;
+    if (range[1] > 0 && ioctl(f->fd, BLKDISCARD, &range) == 0 &&
+        ioctl(f->fd, BLKDISCARDZEROES, &zeroes) == 0 && zeroes)
+        f->holes = 1;
+    f->zeroout = !f->holes;
+}
+
+/* Zero 'len' bytes at 'offset' of the output without writing them, if
+ * that can be done.  Returns 0 if so, 1 if they have to be written, or -1
+ * on an error.
+ */
+static int
+blkio_zero(BlkIoFile *f, uint64_t offset, size_t len) {
+    if (f->holes)
+        return 0;
+    if (!f->zeroout || ((offset | len) % f->align) != 0)
+        return 1;
+    uint64_t range[2] = { offset, len };
+    if (ioctl(f->fd, BLKZEROOUT, &range) == 0)
+        return 0;
+    if (errno == ENOTTY || errno == EOPNOTSUPP || errno == EINVAL) {
+        f->zeroout = 0;
+        return 1;
+    }
+    printf("blkio: can't zero %s at %llu: %s\n", f->path,
+           (unsigned long long) offset, strerror(errno));
+    return -1;
+}
+
+/* A request-sized piece of a data or fill extent. */
+typedef struct {
+    int type;
+    uint64_t in_offset;
+    uint64_t offset;
+    size_t len;
+    uint32_t fill;
+} BlkIoPiece;
+
+/* Cut the next piece, of at most 'chunk' bytes, from the extents at
+ * *next and *pos, passing over don't-care extents.
+ */
+static int
+blkio_next_piece(const BlkIoExtent *extents, int count, int *next,
+                 uint64_t *pos, size_t chunk, BlkIoPiece *p) {
+    while (*next < count && (extents[*next].type == BLKIO_EXTENT_DONT_CARE ||
+                             extents[*next].len == 0))
+        (*next)++;
+    if (*next >= count)
+        return 0;
+
+    const BlkIoExtent *e = &extents[*next];
+    uint64_t left = e->len - *pos;
+    p->type = e->type;
+    p->in_offset = e->in_offset + *pos;
+    p->offset = e->offset + *pos;
+    p->len = left < chunk ? left : chunk;
+    p->fill = e->fill;
+    *pos += p->len;
+    if (*pos == e->len) {
+        (*next)++;
+        *pos = 0;
+    }
+    return 1;
+}
+
+#define CHUNK_FREE      0
+#define CHUNK_READING   1
+#define CHUNK_READ      2
+#define CHUNK_WRITING   3
+
+int
+blkio_copy_file(const char *in_file, const char *out_file, const BlkIoCopy *opts) {
+    BlkIoCopy defaults;
+    BlkIoFile in, out;
+    BlkIo *io = NULL;
+    BlkIoExtent whole, *extents = &whole;
+    int count = 1;
+    int ret = -1;
+    int failed = 0;
+    int i;
+
+    if (opts == NULL) {
+        memset(&defaults, 0, sizeof(defaults));
+        opts = &defaults;
+    }
+    int image = (opts->flags & BLKIO_IMAGE) != 0;
+    int depth = opts->depth > 0 ? opts->depth : BLKIO_COPY_DEPTH;
+    size_t chunk = opts->chunk > 0 ? opts->chunk : BLKIO_COPY_CHUNK;
+    chunk = (chunk + BLKIO_ALIGN - 1) & ~(size_t) (BLKIO_ALIGN - 1);
+    if (opts->pad_to > chunk || (opts->pad_to && chunk % opts->pad_to != 0)) {
+        printf("blkio: can't pad to %zu with %zu byte chunks\n", opts->pad_to, chunk);
+        return -1;
+    }
+
+    out.fd = -1;
+    if (blkio_file_open(&in, in_file, O_RDONLY) < 0)
+        return -1;
+    if (blkio_file_open(&out, out_file, O_WRONLY | O_CREAT | O_TRUNC) < 0)
+        goto done;
+
+    uint64_t size = opts->size;
+    if (image && blkio_image_is_sparse(in.fd)) {
+        count = blkio_image_extents(in.fd, &extents, &size);
+        if (count < 0) {
+            extents = &whole;
+            goto done;
+        }
+        printf("blkio: %s is a sparse image of %llu bytes\n", in_file,
+               (unsigned long long) size);
+    } else {
+        if (size == 0) {
+            off64_t end = lseek64(in.fd, 0, SEEK_END);
+            if (end < 0) {
+                printf("blkio: can't size %s: %s\n", in_file, strerror(errno));
+                goto done;
+            }
+            size = end;
+        }
+        memset(&whole, 0, sizeof(whole));
+        whole.type = BLKIO_EXTENT_DATA;
+        whole.len = size;
+    }
+
+    uint64_t end = size;
+    if (opts->pad_to && end % opts->pad_to)
+        end += opts->pad_to - end % opts->pad_to;
+    if (image)
+        blkio_prepare_image(&out, end);
+
+    // Twice as many buffers as requests, so reads can run ahead of writes.
+    int buffers = depth * 2;
+    io = blkio_open(depth, buffers, chunk, opts->flags);
+    if (io == NULL) {
+        printf("blkio: can't set up %d x %zu byte buffers\n", buffers, chunk);
+        goto done;
+    }
+
+    // Piece k always goes through buffer k % buffers.
+    uint64_t pieces = 0;
+    for (i = 0; i < count; i++) {
+        if (extents[i].type != BLKIO_EXTENT_DONT_CARE)
+            pieces += (extents[i].len + chunk - 1) / chunk;
+    }
+    uint64_t next_read = 0, next_write = 0, written = 0, wrote_bytes = 0;
+    int next_extent = 0;
+    uint64_t extent_pos = 0;
+    int state[BLKIO_MAX_DEPTH * 2];
+    size_t io_len[BLKIO_MAX_DEPTH * 2];
+    BlkIoPiece piece[BLKIO_MAX_DEPTH * 2];
+    memset(state, 0, sizeof(state));
+
+    while (written < pieces && !failed) {
+        // Writes first: they free buffers for the next reads.
+        while (next_write < next_read && !failed) {
+            int b = next_write % buffers;
+            if (state[b] != CHUNK_READ || io->in_flight >= depth)
+                break;
+            const BlkIoPiece *p = &piece[b];
+            size_t len = p->len;
+            char *data = blkio_buffer(io, b);
+            if (opts->hash != NULL)
+                opts->hash(opts->cookie, data, len);
+            if (opts->pad_to && len % opts->pad_to) {
+                size_t padded = (len + opts->pad_to - 1) / opts->pad_to * opts->pad_to;
+                memset(data + len, 0, padded - len);
+                len = padded;
+            }
+            next_write++;
+            if (image && blkio_is_zero(data, len)) {
+                int r = blkio_zero(&out, p->offset, len);
+                if (r < 0) {
+                    failed = 1;
+                    break;
+                }
+                if (r == 0) {
+                    state[b] = CHUNK_FREE;
+                    written++;
+                    continue;
+                }
+            }
+            BlkIoRequest req = { BLKIO_WRITE,
+                                 blkio_file_fd(&out, p->offset, len, O_WRONLY),
+                                 b, len, (off64_t) p->offset, next_write - 1 };
+            if (blkio_submit(io, &req) != 0) {
+                failed = 1;
+                break;
+            }
+            io_len[b] = len;
+            state[b] = CHUNK_WRITING;
+        }
+        while (next_read < pieces && io->in_flight < depth && !failed) {
+            int b = next_read % buffers;
+            if (state[b] != CHUNK_FREE)
+                break;
+            BlkIoPiece *p = &piece[b];
+            if (!blkio_next_piece(extents, count, &next_extent, &extent_pos,
+                                  chunk, p))
+                break;
+            next_read++;
+            if (p->type == BLKIO_EXTENT_FILL) {
+                blkio_fill(blkio_buffer(io, b), p->len, p->fill, p->offset);
+                state[b] = CHUNK_READ;
+                continue;
+            }
+            BlkIoRequest req = { BLKIO_READ,
+                                 blkio_file_fd(&in, p->in_offset, p->len, O_RDONLY),
+                                 b, p->len, (off64_t) p->in_offset, next_read - 1 };
+            if (blkio_submit(io, &req) != 0) {
+                failed = 1;
+                break;
+            }
+            io_len[b] = p->len;
+            state[b] = CHUNK_READING;
+        }
+
+        // Fill pieces and skipped zeros don't go through the queue.
+        if (io->in_flight == 0)
+            continue;
+        BlkIoCompletion c;
+        if (blkio_wait(io, &c) != 0)
+            break;
+        int b = c.buffer;
+        const BlkIoPiece *p = &piece[b];
+        if (c.result != (ssize_t) io_len[b]) {
+            if (c.result < 0)
+                printf("blkio: %s error at %llu: %s\n",
+                       state[b] == CHUNK_READING ? "read" : "write",
+                       (unsigned long long) (state[b] == CHUNK_READING ?
+                                             p->in_offset : p->offset),
+                       strerror(-c.result));
+            else if (state[b] == CHUNK_READING)
+                printf("blkio: %s ends early, at %llu\n", in_file,
+                       (unsigned long long) (p->in_offset + c.result));
+            else
+                printf("blkio: short write at %llu\n",
+                       (unsigned long long) p->offset);
+            failed = 1;
+            break;
+        }
+        if (state[b] == CHUNK_READING) {
+            state[b] = CHUNK_READ;
+        } else {
+            state[b] = CHUNK_FREE;
+            written++;
+            wrote_bytes += io_len[b];
+        }
+    }
+
+    if (!failed && written == pieces)
+        ret = 0;
+    if (ret == 0 && image && out.holes && !out.block &&
+        ftruncate64(out.fd, end) != 0) {
+        printf("blkio: can't extend %s: %s\n", out_file, strerror(errno));
+        ret = -1;
+    }
+    if (ret == 0 && image)
+        printf("blkio: wrote %llu of %llu bytes to %s\n",
+               (unsigned long long) wrote_bytes, (unsigned long long) end,
+               out_file);
+
+done:
+    blkio_close(io);    // drains anything still in flight
+    if (blkio_file_close(&out, ret == 0) != 0)
+        ret = -1;
+    blkio_file_close(&in, 0);
+    if (extents != &whole)
+        free(extents);
+    return ret;
+}
@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2014 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BLKIO_H_
+#define BLKIO_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* A small queue of block I/O requests kept in flight at once, so eMMC and
+ * sdcards see more than one command at a time.  Requests go through
+ * io_uring when the kernel has it (and the build enables USE_IO_URING),
+ * otherwise through a pool of threads doing pread/pwrite.
+ *
+ * Data moves only through the queue's own buffers, which are page-aligned
+ * (usable with O_DIRECT) and registered with the kernel where it can.  A
+ * buffer may be in one request at a time.
+ */
+
+typedef struct BlkIo BlkIo;
+
+#define BLKIO_READ      0
+#define BLKIO_WRITE     1
+
+/* blkio_open() flags */
+#define BLKIO_NO_URING  1   /* use the thread pool even if io_uring works */
+
+/* blkio_copy_file() flag: the input is an image to flash (see below) */
+#define BLKIO_IMAGE     2
+
+typedef struct {
+    int op;                 /* BLKIO_READ or BLKIO_WRITE */
+    int fd;                 /* must be seekable */
+    int buffer;             /* index of the queue buffer to use */
+    size_t len;             /* at most the buffer size */
+    off64_t offset;
+    uint64_t tag;           /* handed back with the completion */
+} BlkIoRequest;
+
+typedef struct {
+    uint64_t tag;
+    int buffer;
+    ssize_t result;         /* bytes moved, short only at end of file; or -errno */
+} BlkIoCompletion;
+
+BlkIo *blkio_open(int depth, int buffers, size_t buffer_size, int flags);
+void blkio_close(BlkIo *io);    /* waits for anything still in flight */
+
+char *blkio_buffer(BlkIo *io, int index);
+const char *blkio_backend(const BlkIo *io);     /* "io_uring" or "threads" */
+
+/* Queue a request.  Fails with EBUSY when 'depth' requests are in flight;
+ * collect a completion first.
+ */
+int blkio_submit(BlkIo *io, const BlkIoRequest *req);
+
+/* Wait for the next request to finish, in any order.  Returns 0, or -1
+ * if nothing is in flight.
+ */
+int blkio_wait(BlkIo *io, BlkIoCompletion *done);
+
+/* Copy a file or block device to another through a queue.  Block devices
+ * are opened O_DIRECT where the driver allows it.  Returns 0 once the
+ * output is synced.
+ *
+ * With BLKIO_IMAGE the input may also be an Android sparse image, which
+ * is written out expanded, and only what the image really holds costs a
+ * write: don't-care chunks are skipped, and runs of zeros (whole chunks
+ * of them) become holes in a file, or are discarded or zeroed out by the
+ * kernel on a block device.  The part of a block device the image covers
+ * is discarded first.
+ */
+typedef void (*BlkIoHashFn)(void *cookie, const void *data, size_t len);
+
+typedef struct {
+    uint64_t size;          /* bytes to copy; 0 copies all of the input */
+    size_t pad_to;          /* zero-fill the output to a multiple of this */
+    int depth;              /* requests in flight; 0 for the default */
+    size_t chunk;           /* bytes per request; 0 for the default */
+    int flags;              /* blkio_open() flags, and BLKIO_IMAGE */
+    BlkIoHashFn hash;       /* if set, sees the data in order as it's read */
+    void *cookie;
+} BlkIoCopy;
+
+int blkio_copy_file(const char *in_file, const char *out_file,
+                    const BlkIoCopy *opts);
+
+/* The stretches an image is made of, in order.  An Android sparse image
+ * is mapped from its chunk headers; any other file is one data extent.
+ */
+#define BLKIO_EXTENT_DATA       0   /* the file's bytes from 'in_offset' */
+#define BLKIO_EXTENT_FILL       1   /* the 4 bytes of 'fill', repeated */
+#define BLKIO_EXTENT_DONT_CARE  2   /* anything at all */
+
+typedef struct {
+    int type;
+    uint64_t in_offset;
+    uint64_t offset;        /* in the image, as flashed */
+    uint64_t len;
+    uint32_t fill;
+} BlkIoExtent;
+
+int blkio_image_is_sparse(int fd);
+
+/* Map the image in 'fd'.  Returns the number of extents, with *extents
+ * malloc'd and *size set to the flashed size, or -1 if a sparse image
+ * is damaged.
+ */
+int blkio_image_extents(int fd, BlkIoExtent **extents, uint64_t *size);
+
+/* Read an image as the bytes it stands for, for writers that take their
+ * data in order (MTD).  Don't-care chunks read as 'dont_care' bytes.
+ */
+typedef struct BlkIoImage BlkIoImage;
+
+BlkIoImage *blkio_image_open(const char *path, int dont_care);
+ssize_t blkio_image_read(BlkIoImage *img, char *data, size_t len);  /* 0 at the end */
+void blkio_image_close(BlkIoImage *img);
+
+#endif  // BLKIO_H_
@@ -0,0 +1,159 @@
+/*
+ * Copyright (C) 2014 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Copy a partition (or any file) through blkio_copy_file() at several
+ * queue depths and report the throughput of each, e.g.
+ *
+ *   blkio_bench -q 1,2,4,8 -c 256 /dev/block/mmcblk0p12
+ *   blkio_bench -t /sdcard/boot.img /dev/block/mmcblk0p8
+ *   blkio_bench -i -q 4 -r 1 /sdcard/system.img /dev/block/mmcblk0p9
+ *
+ * -i copies as flashing does (BLKIO_IMAGE), so a sparse or mostly empty
+ * image costs only its real data.
+ *
+ * The output defaults to /dev/null, which measures reading alone.  Each
+ * depth is run a few times with the input's page cache dropped, and the
+ * best run is reported.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>  // BLKFLSBUF
+#include <sys/stat.h>
+
+#include "blkio.h"
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Drop the input's cached pages so every run reads the device: a block
+// device's own buffers, or for a file, the whole page cache.
+static void drop_cache(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISBLK(st.st_mode)) {
+        ioctl(fd, BLKFLSBUF, 0);
+    } else {
+        fdatasync(fd);
+        int drop = open("/proc/sys/vm/drop_caches", O_WRONLY);
+        if (drop >= 0) {
+            write(drop, "1", 1);
+            close(drop);
+        }
+    }
+    close(fd);
+}
+
+static void usage(const char* me) {
+    fprintf(stderr,
+            "usage: %s [-q depth,...] [-c chunk_kb] [-n bytes] [-r runs] [-t] [-i] in [out]\n"
+            "  -q  queue depths to try (default 1,2,4,8)\n"
+            "  -c  bytes per request, in KB (default 1024)\n"
+            "  -n  bytes to copy (default all of in)\n"
+            "  -r  runs per depth; the best is reported (default 3)\n"
+            "  -t  use the thread pool even where io_uring works\n"
+            "  -i  in is an image to flash: expand it if sparse, skip zeros\n"
+            "  out defaults to /dev/null\n", me);
+}
+
+int main(int argc, char** argv) {
+    const char* depths = "1,2,4,8";
+    BlkIoCopy opts;
+    int runs = 3;
+    int c;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.chunk = 1 << 20;
+    while ((c = getopt(argc, argv, "q:c:n:r:ti")) != -1) {
+        switch (c) {
+          case 'q': depths = optarg; break;
+          case 'c': opts.chunk = strtoul(optarg, NULL, 0) << 10; break;
+          case 'n': opts.size = strtoull(optarg, NULL, 0); break;
+          case 'r': runs = atoi(optarg); break;
+          case 't': opts.flags |= BLKIO_NO_URING; break;
+          case 'i': opts.flags |= BLKIO_IMAGE; break;
+          default: usage(argv[0]); return 2;
+        }
+    }
+    if (optind >= argc || argc - optind > 2 || runs < 1 || opts.chunk == 0) {
+        usage(argv[0]);
+        return 2;
+    }
+    const char* in = argv[optind];
+    const char* out = optind + 1 < argc ? argv[optind + 1] : "/dev/null";
+
+    uint64_t size = opts.size;
+    if (size == 0) {
+        int fd = open(in, O_RDONLY);
+        if (fd < 0) {
+            fprintf(stderr, "can't open %s: %s\n", in, strerror(errno));
+            return 1;
+        }
+        size = lseek64(fd, 0, SEEK_END);
+        // Rate an image by the size it flashes to.
+        BlkIoExtent* extents;
+        if ((opts.flags & BLKIO_IMAGE) && blkio_image_extents(fd, &extents, &size) >= 0)
+            free(extents);
+        close(fd);
+    }
+
+    BlkIo* probe = blkio_open(1, 1, 4096, opts.flags);
+    if (probe == NULL) {
+        fprintf(stderr, "can't set up a queue\n");
+        return 1;
+    }
+    printf("%s -> %s: %llu bytes, %zu KB requests, %s\n", in, out,
+           (unsigned long long) size, opts.chunk >> 10, blkio_backend(probe));
+    blkio_close(probe);
+
+    const char* p = depths;
+    while (*p) {
+        char* end;
+        opts.depth = strtol(p, &end, 10);
+        if (end == p) {
+            usage(argv[0]);
+            return 2;
+        }
+        p = *end == ',' ? end + 1 : end;
+        if (opts.depth < 1) continue;
+
+        double best = 0;
+        int r;
+        for (r = 0; r < runs; ++r) {
+            drop_cache(in);
+            double start = now();
+            if (blkio_copy_file(in, out, &opts) != 0) {
+                fprintf(stderr, "copy at depth %d failed\n", opts.depth);
+                return 1;
+            }
+            double t = now() - start;
+            if (best == 0 || t < best) best = t;
+        }
+        printf("depth %2d: %8.3f s  %8.1f MB/s\n", opts.depth, best,
+               size / best / (1 << 20));
+    }
+    return 0;
+}
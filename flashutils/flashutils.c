@@ -5,6 +5,8 @@
 #include <stdio.h>
 
 #include "flashutils/flashutils.h"
+#include "flashutils/blkio.h"
+#include "mtdutils/mtdutils.h"
 
 #ifndef BOARD_BML_BOOT
 #define BOARD_BML_BOOT              "/dev/block/bml7"
@@ -64,12 +66,30 @@ static int detect_partition(const char *partitionType, const char *partition)
 
     return type;
 }
+static ssize_t read_image(void *cookie, char *data, size_t len)
+{
+    return blkio_image_read((BlkIoImage *) cookie, data, len);
+}
+
+// MTD takes its data in order, so a sparse image is expanded as it's
+// written, with don't-care chunks as erased blocks that mtdutils only
+// has to erase.
+static int restore_mtd_image(const char *partition, const char *filename)
+{
+    BlkIoImage *img = blkio_image_open(filename, 0xff);
+    if (img == NULL)
+        return -1;
+    int ret = mtd_restore_partition(partition, read_image, img);
+    blkio_image_close(img);
+    return ret;
+}
+
 int restore_raw_partition(const char* partitionType, const char *partition, const char *filename)
 {
     int type = detect_partition(partitionType, partition);
     switch (type) {
         case MTD:
-            return cmd_mtd_restore_raw_partition(partition, filename);
+            return restore_mtd_image(partition, filename);
         case MMC:
             return cmd_mmc_restore_raw_partition(partition, filename);
         case BML:
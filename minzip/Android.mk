@@ -5,6 +5,7 @@ LOCAL_SRC_FILES := \
 	Hash.c \
 	SysUtil.c \
 	DirUtil.c \
+	Inflate.c \
 	Inlines.c \
 	Zip.c
 
@@ -12,6 +13,14 @@ LOCAL_C_INCLUDES := \
 	external/zlib \
 	external/safe-iop/include
 
+# Set BOARD_RECOVERY_USES_LIBDEFLATE := true to decode whole zip entries
+# and imgdiff deflate chunks with libdeflate instead of zlib.  Executables
+# linking libminzip must then add libdeflate to their static libraries.
+ifeq ($(BOARD_RECOVERY_USES_LIBDEFLATE),true)
+LOCAL_CFLAGS += -DUSE_LIBDEFLATE
+LOCAL_C_INCLUDES += external/libdeflate
+endif
+
 LOCAL_STATIC_LIBRARIES := libselinux
 
 LOCAL_MODULE := libminzip
@@ -19,3 +28,22 @@ LOCAL_MODULE := libminzip
 LOCAL_CFLAGS += -Wall
 
 include $(BUILD_STATIC_LIBRARY)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := inflate_bench.c
+
+LOCAL_C_INCLUDES := external/zlib
+
+LOCAL_MODULE := minzip_inflate_bench
+
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+
+LOCAL_MODULE_TAGS := tests
+
+LOCAL_STATIC_LIBRARIES := libminzip libz libselinux libcutils libstdc++ libc
+ifeq ($(BOARD_RECOVERY_USES_LIBDEFLATE),true)
+LOCAL_STATIC_LIBRARIES += libdeflate
+endif
+
+include $(BUILD_EXECUTABLE)
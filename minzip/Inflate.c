@@ -0,0 +1,132 @@
+/*
+ * Copyright 2014 The CyanogenMod Project
+ *
+ * Raw DEFLATE decoding backends.
+ */
+#include "zlib.h"
+
+#ifdef USE_LIBDEFLATE
+#include "libdeflate.h"
+#endif
+
+#include <limits.h>
+#include <string.h>
+
+#define LOG_TAG "minzip"
+#include "Inflate.h"
+#include "Log.h"
+
+/*
+ * zlib: decode in as few inflate() calls as the 32-bit avail_in/avail_out
+ * fields allow.  With the output buffer already sized this is normally a
+ * single call.
+ */
+static bool zlibInflateBuffer(const unsigned char* src, size_t srcLen,
+        unsigned char* dst, size_t dstLen, size_t* pActualLen)
+{
+    z_stream zstream;
+    int zerr;
+
+    memset(&zstream, 0, sizeof(zstream));
+    zstream.zalloc = Z_NULL;
+    zstream.zfree = Z_NULL;
+    zstream.opaque = Z_NULL;
+
+    /*
+     * Use the undocumented "negative window bits" feature to tell zlib
+     * that there's no zlib header waiting for it.
+     */
+    zerr = inflateInit2(&zstream, -MAX_WBITS);
+    if (zerr != Z_OK) {
+        LOGE("Call to inflateInit2 failed (zerr=%d)\n", zerr);
+        return false;
+    }
+
+    zstream.next_in = (Bytef*) src;
+    zstream.next_out = (Bytef*) dst;
+    do {
+        size_t inChunk = srcLen - (zstream.next_in - src);
+        size_t outChunk = dstLen - (zstream.next_out - dst);
+        if (zstream.avail_in == 0) {
+            zstream.avail_in = (inChunk > UINT_MAX) ? UINT_MAX : inChunk;
+        }
+        if (zstream.avail_out == 0) {
+            zstream.avail_out = (outChunk > UINT_MAX) ? UINT_MAX : outChunk;
+        }
+        zerr = inflate(&zstream, Z_SYNC_FLUSH);
+    } while (zerr == Z_OK &&
+            (zstream.avail_in == 0 || zstream.avail_out == 0) &&
+            (size_t)(zstream.next_in - src) < srcLen &&
+            (size_t)(zstream.next_out - dst) < dstLen);
+
+    *pActualLen = zstream.next_out - dst;
+    inflateEnd(&zstream);
+
+    if (zerr != Z_STREAM_END) {
+        LOGW("zlib inflate call failed (zerr=%d)\n", zerr);
+        return false;
+    }
+    return true;
+}
+
+static const InflateEngine gZlibEngine = { "zlib", zlibInflateBuffer };
+
+const InflateEngine* mzZlibInflateEngine(void)
+{
+    return &gZlibEngine;
+}
+
+#ifdef USE_LIBDEFLATE
+/*
+ * libdeflate: a whole-buffer decoder that doesn't have to maintain a
+ * sliding window or resumable state, which makes it substantially faster
+ * than zlib when the output size is known.
+ */
+static bool libdeflateInflateBuffer(const unsigned char* src, size_t srcLen,
+        unsigned char* dst, size_t dstLen, size_t* pActualLen)
+{
+    struct libdeflate_decompressor* d;
+    enum libdeflate_result result;
+
+    d = libdeflate_alloc_decompressor();
+    if (d == NULL) {
+        LOGW("Can't allocate libdeflate decompressor\n");
+        return false;
+    }
+    result = libdeflate_deflate_decompress(d, src, srcLen, dst, dstLen,
+            pActualLen);
+    libdeflate_free_decompressor(d);
+
+    if (result != LIBDEFLATE_SUCCESS) {
+        LOGW("libdeflate decompress failed (%d)\n", (int) result);
+        return false;
+    }
+    return true;
+}
+
+static const InflateEngine gLibdeflateEngine =
+        { "libdeflate", libdeflateInflateBuffer };
+#endif
+
+const InflateEngine* mzDefaultInflateEngine(void)
+{
+#ifdef USE_LIBDEFLATE
+    return &gLibdeflateEngine;
+#else
+    return &gZlibEngine;
+#endif
+}
+
+bool mzInflateBuffer(const unsigned char* src, size_t srcLen,
+        unsigned char* dst, size_t dstLen, size_t* pActualLen)
+{
+    const InflateEngine* engine = mzDefaultInflateEngine();
+
+    if (engine->inflateBuffer(src, srcLen, dst, dstLen, pActualLen))
+        return true;
+    if (engine == &gZlibEngine)
+        return false;
+
+    LOGW("%s failed; retrying with zlib\n", engine->name);
+    return gZlibEngine.inflateBuffer(src, srcLen, dst, dstLen, pActualLen);
+}
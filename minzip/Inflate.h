@@ -0,0 +1,57 @@
+/*
+ * Copyright 2014 The CyanogenMod Project
+ *
+ * Raw DEFLATE decoding backends.
+ */
+#ifndef _MINZIP_INFLATE
+#define _MINZIP_INFLATE
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A raw (headerless) DEFLATE decoder that works on whole buffers.  This is
+ * the common case for both zip entries and imgdiff deflate chunks: the
+ * uncompressed size is known up front, so a decoder can write straight
+ * into the final buffer instead of streaming through a small window.
+ *
+ * inflateBuffer() decodes all of "src" into "dst", which has room for
+ * "dstLen" bytes, and stores the number of bytes produced in
+ * *pActualLen.  The stream may legitimately come up short of dstLen
+ * (imgpatch relies on this for bonus data); it is an error for it to need
+ * more room than that.  Returns true on success.
+ */
+typedef struct InflateEngine {
+    const char* name;
+    bool (*inflateBuffer)(const unsigned char* src, size_t srcLen,
+            unsigned char* dst, size_t dstLen, size_t* pActualLen);
+} InflateEngine;
+
+/*
+ * The stock zlib engine.  Always available; also what a zlib-ng build
+ * gets, since zlib-ng is a drop-in replacement for libz.
+ */
+const InflateEngine* mzZlibInflateEngine(void);
+
+/*
+ * The fastest engine this build was configured with (libdeflate when
+ * BOARD_RECOVERY_USES_LIBDEFLATE is set, zlib otherwise).
+ */
+const InflateEngine* mzDefaultInflateEngine(void);
+
+/*
+ * Decode a whole buffer with the default engine, falling back to zlib if
+ * the default engine can't handle it.
+ */
+bool mzInflateBuffer(const unsigned char* src, size_t srcLen,
+        unsigned char* dst, size_t dstLen, size_t* pActualLen);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*_MINZIP_INFLATE*/
@@ -8,6 +8,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <limits.h>
 #include <errno.h>
 #include <assert.h>
@@ -140,29 +141,32 @@ int sysMapFileInShmem(int fd, MemMapping* pMap)
 }
 
 /*
- * Map part of a file (from fd's current offset) into a shared, read-only
- * memory segment.
+ * Map part of a file into a shared, read-only memory segment.  The start
+ * offset need not be page-aligned.
  *
  * On success, returns 0 and fills out "pMap".  On failure, returns a nonzero
  * value and does not disturb "pMap".
  */
-int sysMapFileSegmentInShmem(int fd, off_t start, long length,
+int sysMapFileSegmentInShmem(int fd, off64_t start, size_t length,
     MemMapping* pMap)
 {
-    off_t dummy;
-    size_t fileLength, actualLength;
-    off_t actualStart;
+    struct stat64 st;
+    size_t actualLength;
+    off64_t actualStart;
     int adjust;
     void* memPtr;
 
     assert(pMap != NULL);
 
-    if (getFileStartAndLength(fd, &dummy, &fileLength) < 0)
+    if (fstat64(fd, &st) < 0) {
+        LOGE("could not determine length of file: %s\n", strerror(errno));
         return -1;
+    }
 
-    if (start + length > (long)fileLength) {
-        LOGW("bad segment: st=%d len=%ld flen=%d\n",
-            (int) start, length, (int) fileLength);
+    if (start < 0 || start > st.st_size ||
+            (off64_t) length > st.st_size - start) {
+        LOGW("bad segment: st=%lld len=%zu flen=%lld\n",
+            (long long) start, length, (long long) st.st_size);
         return -1;
     }
 
@@ -171,11 +175,11 @@ int sysMapFileSegmentInShmem(int fd, off_t start, long length,
     actualStart = start - adjust;
     actualLength = length + adjust;
 
-    memPtr = mmap(NULL, actualLength, PROT_READ, MAP_FILE | MAP_SHARED,
+    memPtr = mmap64(NULL, actualLength, PROT_READ, MAP_FILE | MAP_SHARED,
                 fd, actualStart);
     if (memPtr == MAP_FAILED) {
-        LOGW("mmap(%d, R, FILE|SHARED, %d, %d) failed: %s\n",
-            (int) actualLength, fd, (int) actualStart, strerror(errno));
+        LOGW("mmap(%zu, R, FILE|SHARED, %d, %lld) failed: %s\n",
+            actualLength, fd, (long long) actualStart, strerror(errno));
         return -1;
     }
 
@@ -184,10 +188,10 @@ int sysMapFileSegmentInShmem(int fd, off_t start, long length,
     pMap->addr = (char*)memPtr + adjust;
     pMap->length = length;
 
-    LOGVV("mmap seg (st=%d ln=%d): bp=%p bl=%d ad=%p ln=%d\n",
-        (int) start, (int) length,
-        pMap->baseAddr, (int) pMap->baseLength,
-        pMap->addr, (int) pMap->length);
+    LOGVV("mmap seg (st=%lld ln=%zu): bp=%p bl=%zu ad=%p ln=%zu\n",
+        (long long) start, length,
+        pMap->baseAddr, pMap->baseLength,
+        pMap->addr, pMap->length);
 
     return 0;
 }
@@ -46,9 +46,11 @@ int sysLoadFileInShmem(int fd, MemMapping* pMap);
 int sysMapFileInShmem(int fd, MemMapping* pMap);
 
 /*
- * Like sysMapFileInShmem, but on only part of a file.
+ * Like sysMapFileInShmem, but on only part of a file.  Does not use or
+ * change fd's file position, so several threads may map segments of the
+ * same fd at once.
  */
-int sysMapFileSegmentInShmem(int fd, off_t start, long length,
+int sysMapFileSegmentInShmem(int fd, off64_t start, size_t length,
     MemMapping* pMap);
 
 /*
@@ -11,23 +11,30 @@
 #include <limits.h>
 #include <stdint.h>     // for uintptr_t
 #include <stdlib.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>   // for S_ISLNK()
+#include <sys/syscall.h>
 #include <unistd.h>
 
 #define LOG_TAG "minzip"
 #include "Zip.h"
 #include "Bits.h"
+#include "Inflate.h"
 #include "Log.h"
 #include "DirUtil.h"
 
 #undef NDEBUG   // do this after including Log.h
 #include <assert.h>
 
-#define SORT_ENTRIES 1
-
 /*
  * Offset and length constants (java.util.zip naming convention).
  */
+/*
+ * Field values meaning "look in the zip64 record/extra field instead".
+ */
+#define ZIP64_MAGIC16   0xffffU
+#define ZIP64_MAGIC32   0xffffffffULL
+
 enum {
     CENSIG = 0x02014b50,      // PK12
     CENHDR = 46,
@@ -77,6 +84,22 @@ enum {
     LOCNAM = 26,
     LOCEXT = 28,
 
+    ZIP64_LOCSIG = 0x07064b50,  // PK67, zip64 end of central dir locator
+    ZIP64_LOCHDR = 20,
+
+    ZIP64_LOCOFF =  8,
+
+    ZIP64_ENDSIG = 0x06064b50,  // PK66, zip64 end of central dir record
+    ZIP64_ENDHDR = 56,
+
+    ZIP64_ENDSUB = 24,
+    ZIP64_ENDSIZ = 40,
+    ZIP64_ENDOFF = 48,
+
+    ZIP64_EXTID = 0x0001,       // zip64 extended information extra field
+
+    MAX_COMMENT_LEN = 0xffff,
+
     STORED = 0,
     DEFLATED = 8,
 
@@ -91,70 +114,129 @@ enum {
 static void dumpEntry(const ZipEntry* pEntry)
 {
     LOGI(" %p '%.*s'\n", pEntry->fileName,pEntry->fileNameLen,pEntry->fileName);
-    LOGI("   off=%ld comp=%ld uncomp=%ld how=%d\n", pEntry->offset,
-        pEntry->compLen, pEntry->uncompLen, pEntry->compression);
+    LOGI("   off=%lld comp=%lld uncomp=%lld how=%d\n",
+        (long long) pEntry->offset, (long long) pEntry->compLen,
+        (long long) pEntry->uncompLen, pEntry->compression);
 }
 #endif
 
 /*
- * (This is a mzHashTableLookup callback.)
- *
- * Compare two ZipEntry structs, by name.
+ * Compare two names the way the entry index orders them: bytewise, with
+ * a name sorting before any longer name it is a prefix of.  This keeps
+ * every name sharing a given prefix in one contiguous run.
  */
-static int hashcmpZipEntry(const void* ventry1, const void* ventry2)
+static int compareNames(const char* name1, unsigned int len1,
+    const char* name2, unsigned int len2)
 {
-    const ZipEntry* entry1 = (const ZipEntry*) ventry1;
-    const ZipEntry* entry2 = (const ZipEntry*) ventry2;
-
-    if (entry1->fileNameLen != entry2->fileNameLen)
-        return entry1->fileNameLen - entry2->fileNameLen;
-    return memcmp(entry1->fileName, entry2->fileName, entry1->fileNameLen);
+    int diff = memcmp(name1, name2, (len1 < len2) ? len1 : len2);
+    if (diff != 0)
+        return diff;
+    if (len1 != len2)
+        return (len1 < len2) ? -1 : 1;
+    return 0;
 }
 
 /*
- * (This is a mzHashTableLookup callback.)
+ * (This is a qsort callback.)
  *
- * find a ZipEntry struct by name.
+ * Order two ZipEntry structs by name.  Duplicate names are ordered by
+ * position in the file, so lookups find the first one consistently.
  */
-static int hashcmpZipName(const void* ventry, const void* vname)
+static int sortcmpZipEntry(const void* ventry1, const void* ventry2)
 {
-    const ZipEntry* entry = (const ZipEntry*) ventry;
-    const char* name = (const char*) vname;
-    unsigned int nameLen = strlen(name);
-
-    if (entry->fileNameLen != nameLen)
-        return entry->fileNameLen - nameLen;
-    return memcmp(entry->fileName, name, nameLen);
+    const ZipEntry* entry1 = (const ZipEntry*) ventry1;
+    const ZipEntry* entry2 = (const ZipEntry*) ventry2;
+    int diff;
+
+    diff = compareNames(entry1->fileName, entry1->fileNameLen,
+            entry2->fileName, entry2->fileNameLen);
+    if (diff != 0)
+        return diff;
+    if (entry1->offset != entry2->offset)
+        return (entry1->offset < entry2->offset) ? -1 : 1;
+    return 0;
 }
 
 /*
- * Compute the hash code for a ZipEntry filename.
- *
- * Not expected to be compatible with any other hash function, so we init
- * to 2 to ensure it doesn't happen to match.
+ * Sort the entries by name and build the lookup index: a string arena
+ * holding every name back to back in sorted order, and an array of
+ * numEntries+1 offsets into it.  Entry i's name is
+ * pNames[pNameOffsets[i] .. pNameOffsets[i+1]), so lookups only ever
+ * touch the two compact arrays.  The entries' fileName pointers are
+ * moved into the arena as well.
  */
-static unsigned int computeHash(const char* name, int nameLen)
+static bool buildEntryIndex(ZipArchive* pArchive)
 {
-    unsigned int hash = 2;
+    unsigned int i, numEntries = pArchive->numEntries;
+    size_t namesLen = 0;
 
-    while (nameLen--)
-        hash = hash * 31 + *name++;
+    qsort(pArchive->pEntries, numEntries, sizeof(ZipEntry), sortcmpZipEntry);
 
-    return hash;
+    for (i = 0; i < numEntries; i++) {
+        namesLen += pArchive->pEntries[i].fileNameLen;
+    }
+    if (namesLen > UINT_MAX) {
+        LOGW("Zip entry names too large to index (%zu)\n", namesLen);
+        return false;
+    }
+
+    pArchive->pNames = (char*) malloc(namesLen > 0 ? namesLen : 1);
+    pArchive->pNameOffsets =
+        (unsigned int*) malloc((numEntries + 1) * sizeof(unsigned int));
+    if (pArchive->pNames == NULL || pArchive->pNameOffsets == NULL)
+        return false;
+
+    namesLen = 0;
+    for (i = 0; i < numEntries; i++) {
+        ZipEntry* pEntry = &pArchive->pEntries[i];
+
+        if (i > 0 && compareNames(pEntry[-1].fileName, pEntry[-1].fileNameLen,
+                    pEntry->fileName, pEntry->fileNameLen) == 0) {
+            LOGW("WARNING: duplicate entry '%.*s' in Zip\n",
+                pEntry->fileNameLen, pEntry->fileName);
+            /* keep going */
+        }
+
+        pArchive->pNameOffsets[i] = namesLen;
+        memcpy(pArchive->pNames + namesLen, pEntry->fileName,
+                pEntry->fileNameLen);
+        pEntry->fileName = pArchive->pNames + namesLen;
+        namesLen += pEntry->fileNameLen;
+    }
+    pArchive->pNameOffsets[numEntries] = namesLen;
+
+    return true;
 }
 
-static void addEntryToHashTable(HashTable* pHash, ZipEntry* pEntry)
+/*
+ * Binary search the index.  Returns the index of the first entry whose
+ * name is not less than "name", or numEntries if there is none.  With
+ * "pastPrefix" set, only the first nameLen bytes of each entry name are
+ * compared and equal names are skipped, which yields the end of the run
+ * of entries that start with "name".
+ */
+static unsigned int searchIndex(const ZipArchive* pArchive,
+    const char* name, unsigned int nameLen, bool pastPrefix)
 {
-    unsigned int itemHash = computeHash(pEntry->fileName, pEntry->fileNameLen);
-    const ZipEntry* found;
-
-    found = (const ZipEntry*)mzHashTableLookup(pHash,
-                itemHash, pEntry, hashcmpZipEntry, true);
-    if (found != pEntry) {
-        LOGW("WARNING: duplicate entry '%.*s' in Zip\n",
-            found->fileNameLen, found->fileName);
-        /* keep going */
+    const unsigned int* offsets = pArchive->pNameOffsets;
+    unsigned int low = 0, high = pArchive->numEntries;
+
+    while (low < high) {
+        unsigned int mid = low + (high - low) / 2;
+        const char* midName = pArchive->pNames + offsets[mid];
+        unsigned int midLen = offsets[mid + 1] - offsets[mid];
+        int diff;
+
+        if (pastPrefix && midLen > nameLen)
+            midLen = nameLen;
+        diff = compareNames(midName, midLen, name, nameLen);
+        if (diff < 0 || (pastPrefix && diff == 0)) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
     }
+    return low;
 }
 
 static int validFilename(const char *fileName, unsigned int fileNameLen)
@@ -177,26 +259,146 @@ static int validFilename(const char *fileName, unsigned int fileNameLen)
     return 1;
 }
 
+/*
+ * Read exactly "length" bytes at "offset" without moving the file
+ * position.  Returns true on success.
+ */
+static bool readFully(int fd, off64_t offset, void* buf, size_t length)
+{
+    unsigned char* p = (unsigned char*) buf;
+    while (length > 0) {
+        ssize_t n = TEMP_FAILURE_RETRY(pread64(fd, p, length, offset));
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        offset += n;
+        length -= n;
+    }
+    return true;
+}
+
+/*
+ * Replace any saturated EOCD fields with the values from the zip64 end of
+ * central directory record.  "eocdOffset" is the file offset of the
+ * regular EOCD; the zip64 locator sits immediately before it.
+ */
+static bool parseZip64EndOfCentralDir(const ZipArchive* pArchive,
+    off64_t eocdOffset, unsigned long long* pNumEntries,
+    unsigned long long* pCdSize, unsigned long long* pCdOffset)
+{
+    unsigned char locator[ZIP64_LOCHDR];
+    unsigned char record[ZIP64_ENDHDR];
+    unsigned long long recordOffset;
+
+    if (eocdOffset < ZIP64_LOCHDR ||
+            !readFully(pArchive->fd, eocdOffset - ZIP64_LOCHDR,
+                locator, sizeof(locator)) ||
+            get4LE(locator) != ZIP64_LOCSIG) {
+        LOGW("Zip64 end of central directory locator not found\n");
+        return false;
+    }
+
+    recordOffset = get8LE(locator + ZIP64_LOCOFF);
+    if (recordOffset > (unsigned long long)(eocdOffset - ZIP64_LOCHDR) ||
+            !readFully(pArchive->fd, recordOffset, record, sizeof(record)) ||
+            get4LE(record) != ZIP64_ENDSIG) {
+        LOGW("Bad zip64 end of central directory record at %llu\n",
+            recordOffset);
+        return false;
+    }
+
+    *pNumEntries = get8LE(record + ZIP64_ENDSUB);
+    *pCdSize = get8LE(record + ZIP64_ENDSIZ);
+    *pCdOffset = get8LE(record + ZIP64_ENDOFF);
+    return true;
+}
+
+/*
+ * Pull the 64-bit sizes and local header offset out of an entry's zip64
+ * extra field.  Only the values whose central directory fields were
+ * saturated are present, in the order uncompressed size, compressed size,
+ * local header offset.
+ */
+static bool parseZip64ExtraField(const unsigned char* extra,
+    unsigned int extraLen, ZipEntry* pEntry, unsigned long long* pLocalHdrOffset,
+    bool needUncompLen, bool needCompLen, bool needLocalHdrOffset)
+{
+    while (extraLen >= 4) {
+        unsigned int headerId = get2LE(extra);
+        unsigned int dataLen = get2LE(extra + 2);
+        const unsigned char* data = extra + 4;
+
+        if (dataLen > extraLen - 4)
+            break;
+
+        if (headerId == ZIP64_EXTID) {
+            unsigned int need = 8 * (needUncompLen + needCompLen +
+                    needLocalHdrOffset);
+            if (dataLen < need) {
+                LOGW("Zip64 extra field too short (%u < %u)\n", dataLen, need);
+                return false;
+            }
+            if (needUncompLen) {
+                pEntry->uncompLen = get8LE(data);
+                data += 8;
+            }
+            if (needCompLen) {
+                pEntry->compLen = get8LE(data);
+                data += 8;
+            }
+            if (needLocalHdrOffset) {
+                *pLocalHdrOffset = get8LE(data);
+            }
+            return true;
+        }
+
+        extra += 4 + dataLen;
+        extraLen -= 4 + dataLen;
+    }
+
+    LOGW("Missing zip64 extra field\n");
+    return false;
+}
+
 /*
  * Parse the contents of a Zip archive.  After confirming that the file
  * is in fact a Zip, we scan out the contents of the central directory and
- * store it in a hash table.
+ * build a sorted index of the entry names.
+ *
+ * Only the tail of the file (to find the EOCD) and the central directory
+ * itself are mapped, and both are released before returning; entry data
+ * is mapped on demand when it is read.  Zip64 archives are supported.
  *
  * Returns "true" on success.
  */
-static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
+static bool parseZipArchive(ZipArchive* pArchive)
 {
     bool result = false;
+    MemMapping tailMap, cdMap;
     const unsigned char* ptr;
-    unsigned int i, numEntries, cdOffset;
+    const unsigned char* tailEnd;
+    const unsigned char* cdEnd;
+    unsigned char sig[4];
+    unsigned long long numEntries, cdSize, cdOffset;
+    off64_t tailStart, eocdOffset;
+    size_t tailLen;
+    unsigned int i;
     unsigned int val;
 
+    memset(&tailMap, 0, sizeof(tailMap));
+    memset(&cdMap, 0, sizeof(cdMap));
+
     /*
      * The first 4 bytes of the file will either be the local header
      * signature for the first file (LOCSIG) or, if the archive doesn't
      * have any files in it, the end-of-central-directory signature (ENDSIG).
      */
-    val = get4LE(pMap->addr);
+    if (!readFully(pArchive->fd, 0, sig, sizeof(sig))) {
+        LOGV("Unable to read Zip signature\n");
+        goto bail;
+    }
+    val = get4LE(sig);
     if (val == ENDSIG) {
         LOGI("Found Zip archive, but it looks empty\n");
         goto bail;
@@ -207,32 +409,58 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
 
     /*
      * Find the EOCD.  We'll find it immediately unless they have a file
-     * comment.
+     * comment, and it can't be further back than the longest possible
+     * comment, so that's all we map.
      */
-    ptr = pMap->addr + pMap->length - ENDHDR;
+    tailLen = ENDHDR + MAX_COMMENT_LEN;
+    if ((off64_t) tailLen > pArchive->length)
+        tailLen = pArchive->length;
+    tailStart = pArchive->length - tailLen;
+    if (sysMapFileSegmentInShmem(pArchive->fd, tailStart, tailLen,
+            &tailMap) != 0) {
+        LOGW("Unable to map end of Zip archive\n");
+        goto bail;
+    }
+    tailEnd = (const unsigned char*) tailMap.addr + tailMap.length;
 
-    while (ptr >= (const unsigned char*) pMap->addr) {
+    ptr = tailEnd - ENDHDR;
+    while (ptr >= (const unsigned char*) tailMap.addr) {
         if (*ptr == (ENDSIG & 0xff) && get4LE(ptr) == ENDSIG)
             break;
         ptr--;
     }
-    if (ptr < (const unsigned char*) pMap->addr) {
+    if (ptr < (const unsigned char*) tailMap.addr) {
         LOGI("Could not find end-of-central-directory in Zip\n");
         goto bail;
     }
+    eocdOffset = tailStart + (ptr - (const unsigned char*) tailMap.addr);
 
     /*
-     * There are two interesting items in the EOCD block: the number of
-     * entries in the file, and the file offset of the start of the
-     * central directory.
+     * There are three interesting items in the EOCD block: the number of
+     * entries in the file, and the size and file offset of the central
+     * directory.  If any of them overflowed, the real values are in the
+     * zip64 EOCD record.
      */
     numEntries = get2LE(ptr + ENDSUB);
+    cdSize = get4LE(ptr + ENDSIZ);
     cdOffset = get4LE(ptr + ENDOFF);
+    sysReleaseShmem(&tailMap);
+
+    if (numEntries == ZIP64_MAGIC16 || cdSize == ZIP64_MAGIC32 ||
+            cdOffset == ZIP64_MAGIC32) {
+        if (!parseZip64EndOfCentralDir(pArchive, eocdOffset,
+                &numEntries, &cdSize, &cdOffset))
+            goto bail;
+    }
 
-    LOGVV("numEntries=%d cdOffset=%d\n", numEntries, cdOffset);
-    if (numEntries == 0 || cdOffset >= pMap->length) {
-        LOGW("Invalid entries=%d offset=%d (len=%zd)\n",
-            numEntries, cdOffset, pMap->length);
+    LOGVV("numEntries=%llu cdSize=%llu cdOffset=%llu\n",
+        numEntries, cdSize, cdOffset);
+    if (numEntries == 0 || cdOffset > (unsigned long long) eocdOffset ||
+            cdSize > (unsigned long long) eocdOffset - cdOffset ||
+            numEntries > cdSize / CENHDR || numEntries > UINT_MAX ||
+            cdSize > SIZE_MAX) {
+        LOGW("Invalid entries=%llu size=%llu offset=%llu (len=%lld)\n",
+            numEntries, cdSize, cdOffset, (long long) pArchive->length);
         goto bail;
     }
 
@@ -241,18 +469,25 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
      */
     pArchive->numEntries = numEntries;
     pArchive->pEntries = (ZipEntry*) calloc(numEntries, sizeof(ZipEntry));
-    pArchive->pHash = mzHashTableCreate(mzHashSize(numEntries), NULL);
-    if (pArchive->pEntries == NULL || pArchive->pHash == NULL)
+    if (pArchive->pEntries == NULL)
+        goto bail;
+
+    if (sysMapFileSegmentInShmem(pArchive->fd, cdOffset, cdSize,
+            &cdMap) != 0) {
+        LOGW("Unable to map Zip central directory\n");
         goto bail;
+    }
+    cdEnd = (const unsigned char*) cdMap.addr + cdMap.length;
 
-    ptr = pMap->addr + cdOffset;
+    ptr = (const unsigned char*) cdMap.addr;
     for (i = 0; i < numEntries; i++) {
         ZipEntry* pEntry;
-        unsigned int fileNameLen, extraLen, commentLen, localHdrOffset;
-        const unsigned char* localHdr;
+        unsigned int fileNameLen, extraLen, commentLen;
+        unsigned long long localHdrOffset;
+        unsigned char localHdr[LOCHDR];
         const char *fileName;
 
-        if (ptr + CENHDR > (const unsigned char*)pMap->addr + pMap->length) {
+        if (ptr + CENHDR > cdEnd) {
             LOGW("Ran off the end (at %d)\n", i);
             goto bail;
         }
@@ -266,7 +501,7 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
         extraLen = get2LE(ptr + CENEXT);
         commentLen = get2LE(ptr + CENCOM);
         fileName = (const char*)ptr + CENHDR;
-        if (fileName + fileNameLen > (const char*)pMap->addr + pMap->length) {
+        if ((const unsigned char*)fileName + fileNameLen + extraLen > cdEnd) {
             LOGW("Filename ran off the end (at %d)\n", i);
             goto bail;
         }
@@ -275,60 +510,9 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
             goto bail;
         }
 
-#if SORT_ENTRIES
-        /* Figure out where this entry should go (binary search).
-         */
-        if (i > 0) {
-            int low, high;
-
-            low = 0;
-            high = i - 1;
-            while (low <= high) {
-                int mid;
-                int diff;
-                int diffLen;
-
-                mid = low + ((high - low) / 2); // avoid overflow
-
-                if (pArchive->pEntries[mid].fileNameLen < fileNameLen) {
-                    diffLen = pArchive->pEntries[mid].fileNameLen;
-                } else {
-                    diffLen = fileNameLen;
-                }
-                diff = strncmp(pArchive->pEntries[mid].fileName, fileName,
-                        diffLen);
-                if (diff == 0) {
-                    diff = pArchive->pEntries[mid].fileNameLen - fileNameLen;
-                }
-                if (diff < 0) {
-                    low = mid + 1;
-                } else if (diff > 0) {
-                    high = mid - 1;
-                } else {
-                    high = mid;
-                    break;
-                }
-            }
-
-            unsigned int target = high + 1;
-            assert(target <= i);
-            if (target != i) {
-                /* It belongs somewhere other than at the end of
-                 * the list.  Make some room at [target].
-                 */
-                memmove(pArchive->pEntries + target + 1,
-                        pArchive->pEntries + target,
-                        (i - target) * sizeof(ZipEntry));
-            }
-            pEntry = &pArchive->pEntries[target];
-        } else {
-            pEntry = &pArchive->pEntries[0];
-        }
-#else
         pEntry = &pArchive->pEntries[i];
-#endif
 
-        //LOGI("%d: localHdr=%d fnl=%d el=%d cl=%d\n",
+        //LOGI("%d: localHdr=%llu fnl=%d el=%d cl=%d\n",
         //    i, localHdrOffset, fileNameLen, extraLen, commentLen);
 
         pEntry->fileNameLen = fileNameLen;
@@ -340,6 +524,23 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
         pEntry->modTime = get4LE(ptr + CENTIM);
         pEntry->crc32 = get4LE(ptr + CENCRC);
 
+        if (pEntry->uncompLen == ZIP64_MAGIC32 ||
+                pEntry->compLen == ZIP64_MAGIC32 ||
+                localHdrOffset == ZIP64_MAGIC32) {
+            if (!parseZip64ExtraField(ptr + CENHDR + fileNameLen, extraLen,
+                    pEntry, &localHdrOffset,
+                    pEntry->uncompLen == ZIP64_MAGIC32,
+                    pEntry->compLen == ZIP64_MAGIC32,
+                    localHdrOffset == ZIP64_MAGIC32)) {
+                LOGW("Bad zip64 extra field (at %d)\n", i);
+                goto bail;
+            }
+        }
+        if (pEntry->compLen < 0 || pEntry->uncompLen < 0) {
+            LOGW("Invalid entry sizes (at %d)\n", i);
+            goto bail;
+        }
+
         /* These two are necessary for finding the mode of the file.
          */
         pEntry->versionMadeBy = get2LE(ptr + CENVEM);
@@ -352,16 +553,12 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
         }
         pEntry->externalFileAttributes = get4LE(ptr + CENATX);
 
-        // Perform pMap->addr + localHdrOffset, ensuring that it won't
-        // overflow. This is needed because localHdrOffset is untrusted.
-        if (!safe_add((uintptr_t *)&localHdr, (uintptr_t)pMap->addr,
-            (uintptr_t)localHdrOffset)) {
-            LOGW("Integer overflow adding in parseZipArchive\n");
-            goto bail;
-        }
-        if ((uintptr_t)localHdr + LOCHDR >
-            (uintptr_t)pMap->addr + pMap->length) {
-            LOGW("Bad offset to local header: %d (at %d)\n", localHdrOffset, i);
+        // localHdrOffset is untrusted; make sure the local header is
+        // actually inside the file before reading it.
+        if (localHdrOffset > (unsigned long long)(pArchive->length - LOCHDR) ||
+                !readFully(pArchive->fd, localHdrOffset, localHdr, LOCHDR)) {
+            LOGW("Bad offset to local header: %llu (at %d)\n",
+                localHdrOffset, i);
             goto bail;
         }
         if (get4LE(localHdr) != LOCSIG) {
@@ -370,56 +567,44 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
         }
         pEntry->offset = localHdrOffset + LOCHDR
             + get2LE(localHdr + LOCNAM) + get2LE(localHdr + LOCEXT);
-        if (!safe_add(NULL, pEntry->offset, pEntry->compLen)) {
-            LOGW("Integer overflow adding in parseZipArchive\n");
-            goto bail;
-        }
-        if ((size_t)pEntry->offset + pEntry->compLen > pMap->length) {
+        if (pEntry->offset > pArchive->length ||
+                pEntry->compLen > pArchive->length - pEntry->offset) {
             LOGW("Data ran off the end (at %d)\n", i);
             goto bail;
         }
 
-#if !SORT_ENTRIES
-        /* Add to hash table; no need to lock here.
-         * Can't do this now if we're sorting, because entries
-         * will move around.
-         */
-        addEntryToHashTable(pArchive->pHash, pEntry);
-#endif
-
         //dumpEntry(pEntry);
         ptr += CENHDR + fileNameLen + extraLen + commentLen;
     }
 
-#if SORT_ENTRIES
-    /* If we're sorting, we have to wait until all entries
-     * are in their final places, otherwise the pointers will
-     * probably point to the wrong things.
+    /* Now that all of the entries have been read, sort them and
+     * build the name index in one O(n log n) pass.  This also copies
+     * the names out of the central directory mapping.
      */
-    for (i = 0; i < numEntries; i++) {
-        /* Add to hash table; no need to lock here.
-         */
-        addEntryToHashTable(pArchive->pHash, &pArchive->pEntries[i]);
-    }
-#endif
+    if (!buildEntryIndex(pArchive))
+        goto bail;
 
     result = true;
 
 bail:
     if (!result) {
-        mzHashTableFree(pArchive->pHash);
-        pArchive->pHash = NULL;
+        free(pArchive->pNameOffsets);
+        pArchive->pNameOffsets = NULL;
+        free(pArchive->pNames);
+        pArchive->pNames = NULL;
     }
+    sysReleaseShmem(&tailMap);
+    sysReleaseShmem(&cdMap);
     return result;
 }
 
 /*
  * Open a Zip archive and scan out the contents.
  *
- * The easiest way to do this is to mmap() the whole thing and do the
- * traditional backward scan for central directory.  Since the EOCD is
- * a relatively small bit at the end, we should end up only touching a
- * small set of pages.
+ * Rather than mapping the whole file, which doesn't fit in a 32-bit
+ * address space for multi-gigabyte packages, we map just the tail to
+ * find the EOCD and then the central directory.  Entry data is mapped
+ * a window at a time when it is read.
  *
  * This will be called on non-Zip files, especially during startup, so
  * we don't want to be too noisy about failures.  (Do we want a "quiet"
@@ -429,48 +614,45 @@ bail:
  */
 int mzOpenZipArchive(const char* fileName, ZipArchive* pArchive)
 {
-    MemMapping map;
+    struct stat64 st;
     int err;
 
     LOGV("Opening archive '%s' %p\n", fileName, pArchive);
 
-    map.addr = NULL;
     memset(pArchive, 0, sizeof(*pArchive));
 
-    pArchive->fd = open(fileName, O_RDONLY, 0);
+    pArchive->fd = open(fileName, O_RDONLY | O_LARGEFILE, 0);
     if (pArchive->fd < 0) {
         err = errno ? errno : -1;
         LOGV("Unable to open '%s': %s\n", fileName, strerror(err));
         goto bail;
     }
 
-    if (sysMapFileInShmem(pArchive->fd, &map) != 0) {
-        err = -1;
-        LOGW("Map of '%s' failed\n", fileName);
+    if (fstat64(pArchive->fd, &st) != 0) {
+        err = errno ? errno : -1;
+        LOGW("Unable to stat '%s': %s\n", fileName, strerror(err));
         goto bail;
     }
+    pArchive->length = st.st_size;
 
-    if (map.length < ENDHDR) {
+    if (pArchive->length < ENDHDR) {
         err = -1;
-        LOGV("File '%s' too small to be zip (%zd)\n", fileName, map.length);
+        LOGV("File '%s' too small to be zip (%lld)\n", fileName,
+            (long long) pArchive->length);
         goto bail;
     }
 
-    if (!parseZipArchive(pArchive, &map)) {
+    if (!parseZipArchive(pArchive)) {
         err = -1;
         LOGV("Parsing '%s' failed\n", fileName);
         goto bail;
     }
 
     err = 0;
-    sysCopyMap(&pArchive->map, &map);
-    map.addr = NULL;
 
 bail:
     if (err != 0)
         mzCloseZipArchive(pArchive);
-    if (map.addr != NULL)
-        sysReleaseShmem(&map);
     return err;
 }
 
@@ -485,16 +667,15 @@ void mzCloseZipArchive(ZipArchive* pArchive)
 
     if (pArchive->fd >= 0)
         close(pArchive->fd);
-    if (pArchive->map.addr != NULL)
-        sysReleaseShmem(&pArchive->map);
 
     free(pArchive->pEntries);
-
-    mzHashTableFree(pArchive->pHash);
+    free(pArchive->pNameOffsets);
+    free(pArchive->pNames);
 
     pArchive->fd = -1;
-    pArchive->pHash = NULL;
     pArchive->pEntries = NULL;
+    pArchive->pNameOffsets = NULL;
+    pArchive->pNames = NULL;
 }
 
 /*
@@ -505,10 +686,43 @@ void mzCloseZipArchive(ZipArchive* pArchive)
 const ZipEntry* mzFindZipEntry(const ZipArchive* pArchive,
         const char* entryName)
 {
-    unsigned int itemHash = computeHash(entryName, strlen(entryName));
+    unsigned int nameLen = strlen(entryName);
+    unsigned int index;
+
+    if (pArchive->pNameOffsets == NULL)
+        return NULL;
+
+    index = searchIndex(pArchive, entryName, nameLen, false);
+    if (index < pArchive->numEntries &&
+            pArchive->pNameOffsets[index + 1] -
+                pArchive->pNameOffsets[index] == nameLen &&
+            memcmp(pArchive->pNames + pArchive->pNameOffsets[index],
+                entryName, nameLen) == 0) {
+        return pArchive->pEntries + index;
+    }
+    return NULL;
+}
+
+/*
+ * Find the run of entries whose names begin with "prefix".
+ *
+ * Returns the number of matching entries, and sets *pFirst to the index
+ * of the first one.
+ */
+unsigned int mzFindZipEntriesWithPrefix(const ZipArchive* pArchive,
+        const char* prefix, unsigned int* pFirst)
+{
+    unsigned int prefixLen = strlen(prefix);
+    unsigned int first, end;
 
-    return (const ZipEntry*)mzHashTableLookup(pArchive->pHash,
-                itemHash, (char*) entryName, hashcmpZipName, false);
+    *pFirst = 0;
+    if (pArchive->pNameOffsets == NULL)
+        return 0;
+
+    first = searchIndex(pArchive, prefix, prefixLen, false);
+    end = searchIndex(pArchive, prefix, prefixLen, true);
+    *pFirst = first;
+    return end - first;
 }
 
 /*
@@ -522,68 +736,209 @@ bool mzIsZipEntrySymlink(const ZipEntry* pEntry)
     return false;
 }
 
-/* Call processFunction on the uncompressed data of a STORED entry.
+/*
+ * Largest amount of mapped data handed to a processFunction in one call.
+ * Entries are read straight out of the archive mapping, so this only
+ * bounds how much a callback sees at once (and keeps dataLen in an int).
  */
-static bool processStoredEntry(const ZipArchive *pArchive,
-    const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
-    void *cookie)
+#define MAX_PROCESS_CHUNK   (1024 * 1024)
+
+/*
+ * Entry data is mapped at most this much at a time, so even multi-GB
+ * entries only ever occupy a bounded piece of the address space.
+ */
+#define ENTRY_WINDOW_SIZE   (32 * 1024 * 1024)
+
+typedef bool (*EntryWindowFunction)(const unsigned char *data, size_t dataLen,
+    void *cookie);
+
+/*
+ * Map "pEntry"'s compressed data one window at a time and pass each
+ * window to windowFunction.  Only one window is mapped at any moment.
+ * The archive fd's file position is never used, so this is safe to call
+ * from several threads at once.
+ */
+static bool processEntryWindows(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, EntryWindowFunction windowFunction, void *cookie)
 {
-    size_t bytesLeft = pEntry->compLen;
+    off64_t start = pEntry->offset;
+    off64_t bytesLeft = pEntry->compLen;
+
     while (bytesLeft > 0) {
-        unsigned char buf[32 * 1024];
-        ssize_t n;
+        MemMapping map;
         size_t count;
         bool ret;
 
-        count = bytesLeft;
-        if (count > sizeof(buf)) {
-            count = sizeof(buf);
-        }
-        n = read(pArchive->fd, buf, count);
-        if (n < 0 || (size_t)n != count) {
-            LOGE("Can't read %zu bytes from zip file: %ld\n", count, n);
+        count = (bytesLeft > ENTRY_WINDOW_SIZE) ?
+                ENTRY_WINDOW_SIZE : (size_t) bytesLeft;
+        if (sysMapFileSegmentInShmem(pArchive->fd, start, count, &map) != 0) {
+            LOGE("Can't map %zu bytes of zip file at %lld\n",
+                count, (long long) start);
             return false;
         }
-        ret = processFunction(buf, n, cookie);
+        ret = windowFunction((const unsigned char*) map.addr, count, cookie);
+        sysReleaseShmem(&map);
         if (!ret) {
             return false;
         }
+        start += count;
         bytesLeft -= count;
     }
     return true;
 }
 
-static bool processDeflatedEntry(const ZipArchive *pArchive,
+typedef struct {
+    ProcessZipEntryContentsFunction processFunction;
+    void *cookie;
+} StoredWindowArgs;
+
+static bool storedWindowFunction(const unsigned char *data, size_t dataLen,
+    void *cookie)
+{
+    StoredWindowArgs *args = (StoredWindowArgs *)cookie;
+    while (dataLen > 0) {
+        size_t count = dataLen;
+        if (count > MAX_PROCESS_CHUNK) {
+            count = MAX_PROCESS_CHUNK;
+        }
+        if (!args->processFunction(data, count, args->cookie)) {
+            return false;
+        }
+        data += count;
+        dataLen -= count;
+    }
+    return true;
+}
+
+/* Call processFunction on the uncompressed data of a STORED entry.
+ *
+ * The data is passed directly out of the archive mapping; nothing is
+ * copied.
+ */
+static bool processStoredEntry(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
     void *cookie)
 {
-    long result = -1;
-    unsigned char readBuf[32 * 1024];
-    unsigned char procBuf[32 * 1024];
+    StoredWindowArgs args;
+
+    args.processFunction = processFunction;
+    args.cookie = cookie;
+    return processEntryWindows(pArchive, pEntry, storedWindowFunction, &args);
+}
+
+/*
+ * Size of the inflate output buffer.  Each full buffer is one call to the
+ * process function, and so one write() when extracting to a file; small
+ * writes amplify badly on flash filesystems, so keep this generous.
+ */
+#define INFLATE_OUTPUT_SIZE (256 * 1024)
+
+typedef struct {
     z_stream zstream;
     int zerr;
-    long compRemaining;
+    off64_t totalOut;   /* zstream.total_out is a uLong, 32 bits on ARM */
+    unsigned char procBuf[INFLATE_OUTPUT_SIZE];
+    ProcessZipEntryContentsFunction processFunction;
+    void *cookie;
+} InflateWindowArgs;
+
+/*
+ * Inflate one mapped window of compressed data, handing every full (or
+ * final) output buffer to the process function.
+ */
+static bool inflateWindowFunction(const unsigned char *data, size_t dataLen,
+    void *cookie)
+{
+    InflateWindowArgs *args = (InflateWindowArgs *)cookie;
+    z_stream *zstream = &args->zstream;
+
+    if (args->zerr == Z_STREAM_END) {
+        /* trailing data after the end of the deflate stream; ignore it */
+        return true;
+    }
+
+    while (dataLen > 0 || zstream->avail_in > 0) {
+        if (zstream->avail_in == 0) {
+            size_t getSize = (dataLen > MAX_PROCESS_CHUNK) ?
+                    MAX_PROCESS_CHUNK : dataLen;
+            LOGVV("+++ feeding %zu bytes\n", getSize);
+            zstream->next_in = (Bytef*) data;
+            zstream->avail_in = getSize;
+            data += getSize;
+            dataLen -= getSize;
+        }
 
-    compRemaining = pEntry->compLen;
+        /* uncompress the data */
+        uInt availOut = zstream->avail_out;
+        args->zerr = inflate(zstream, Z_NO_FLUSH);
+        args->totalOut += availOut - zstream->avail_out;
+        if (args->zerr != Z_OK && args->zerr != Z_STREAM_END) {
+            LOGD("zlib inflate call failed (zerr=%d)\n", args->zerr);
+            return false;
+        }
+
+        /* write when we're full or when we're done */
+        if (zstream->avail_out == 0 ||
+            (args->zerr == Z_STREAM_END &&
+                zstream->avail_out != sizeof(args->procBuf)))
+        {
+            long procSize = zstream->next_out - args->procBuf;
+            LOGVV("+++ processing %d bytes\n", (int) procSize);
+            bool ret = args->processFunction(args->procBuf, procSize,
+                    args->cookie);
+            if (!ret) {
+                LOGW("Process function elected to fail (in inflate)\n");
+                return false;
+            }
+
+            zstream->next_out = args->procBuf;
+            zstream->avail_out = sizeof(args->procBuf);
+        }
+
+        if (args->zerr == Z_STREAM_END) {
+            break;
+        }
+    }
+    return true;
+}
+
+static bool processDeflatedEntry(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
+    void *cookie)
+{
+    long long result = -1;
+    InflateWindowArgs *args;
+    int zerr;
+
+    /* Keep the output buffer off the stack; this may run on a thread. */
+    args = (InflateWindowArgs *) malloc(sizeof(*args));
+    if (args == NULL) {
+        LOGE("Can't allocate inflate state\n");
+        return false;
+    }
 
     /*
      * Initialize the zlib stream.
      */
-    memset(&zstream, 0, sizeof(zstream));
-    zstream.zalloc = Z_NULL;
-    zstream.zfree = Z_NULL;
-    zstream.opaque = Z_NULL;
-    zstream.next_in = NULL;
-    zstream.avail_in = 0;
-    zstream.next_out = (Bytef*) procBuf;
-    zstream.avail_out = sizeof(procBuf);
-    zstream.data_type = Z_UNKNOWN;
+    memset(&args->zstream, 0, sizeof(args->zstream));
+    args->zstream.zalloc = Z_NULL;
+    args->zstream.zfree = Z_NULL;
+    args->zstream.opaque = Z_NULL;
+    args->zstream.next_in = NULL;
+    args->zstream.avail_in = 0;
+    args->zstream.next_out = (Bytef*) args->procBuf;
+    args->zstream.avail_out = sizeof(args->procBuf);
+    args->zstream.data_type = Z_UNKNOWN;
+    args->zerr = Z_OK;
+    args->totalOut = 0;
+    args->processFunction = processFunction;
+    args->cookie = cookie;
 
     /*
      * Use the undocumented "negative window bits" feature to tell zlib
      * that there's no zlib header waiting for it.
      */
-    zerr = inflateInit2(&zstream, -MAX_WBITS);
+    zerr = inflateInit2(&args->zstream, -MAX_WBITS);
     if (zerr != Z_OK) {
         if (zerr == Z_VERSION_ERROR) {
             LOGE("Installed zlib is not compatible with linked version (%s)\n",
@@ -594,71 +949,73 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
         goto bail;
     }
 
-    /*
-     * Loop while we have data.
-     */
-    do {
-        /* read as much as we can */
-        if (zstream.avail_in == 0) {
-            long getSize = (compRemaining > (long)sizeof(readBuf)) ?
-                        (long)sizeof(readBuf) : compRemaining;
-            LOGVV("+++ reading %ld bytes (%ld left)\n",
-                getSize, compRemaining);
-
-            int cc = read(pArchive->fd, readBuf, getSize);
-            if (cc != (int) getSize) {
-                LOGW("inflate read failed (%d vs %ld)\n", cc, getSize);
-                goto z_bail;
-            }
-
-            compRemaining -= getSize;
-
-            zstream.next_in = readBuf;
-            zstream.avail_in = getSize;
-        }
-
-        /* uncompress the data */
-        zerr = inflate(&zstream, Z_NO_FLUSH);
-        if (zerr != Z_OK && zerr != Z_STREAM_END) {
-            LOGD("zlib inflate call failed (zerr=%d)\n", zerr);
-            goto z_bail;
-        }
-
-        /* write when we're full or when we're done */
-        if (zstream.avail_out == 0 ||
-            (zerr == Z_STREAM_END && zstream.avail_out != sizeof(procBuf)))
-        {
-            long procSize = zstream.next_out - procBuf;
-            LOGVV("+++ processing %d bytes\n", (int) procSize);
-            bool ret = processFunction(procBuf, procSize, cookie);
-            if (!ret) {
-                LOGW("Process function elected to fail (in inflate)\n");
-                goto z_bail;
-            }
-
-            zstream.next_out = procBuf;
-            zstream.avail_out = sizeof(procBuf);
-        }
-    } while (zerr == Z_OK);
-
-    assert(zerr == Z_STREAM_END);       /* other errors should've been caught */
+    if (!processEntryWindows(pArchive, pEntry, inflateWindowFunction, args)) {
+        goto z_bail;
+    }
+    if (args->zerr != Z_STREAM_END) {
+        LOGW("inflate ran out of compressed data\n");
+        goto z_bail;
+    }
 
     // success!
-    result = zstream.total_out;
+    result = args->totalOut;
 
 z_bail:
-    inflateEnd(&zstream);        /* free up any allocated structures */
+    inflateEnd(&args->zstream);  /* free up any allocated structures */
 
 bail:
+    free(args);
     if (result != pEntry->uncompLen) {
         if (result != -1)        // error already shown?
-            LOGW("Size mismatch on inflated file (%ld vs %ld)\n",
-                result, pEntry->uncompLen);
+            LOGW("Size mismatch on inflated file (%lld vs %lld)\n",
+                result, (long long) pEntry->uncompLen);
         return false;
     }
     return true;
 }
 
+/*
+ * Inflate a DEFLATED entry straight into "buffer" with the whole-buffer
+ * decoder, which is considerably faster than streaming through zlib when
+ * the output size is known.  "bufLen" must be at least the entry's
+ * uncompressed length.
+ *
+ * Returns 0 on success, -1 on error, and 1 if the compressed data is too
+ * big to map in one window and the caller should stream it instead.
+ */
+static int inflateEntryToBuffer(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, unsigned char *buffer, size_t bufLen)
+{
+    MemMapping map;
+    size_t actualLen = 0;
+    bool ok;
+
+    if (pEntry->compLen > ENTRY_WINDOW_SIZE ||
+            (off64_t)(size_t) pEntry->uncompLen != pEntry->uncompLen ||
+            bufLen < (size_t) pEntry->uncompLen) {
+        return 1;
+    }
+    if (sysMapFileSegmentInShmem(pArchive->fd, pEntry->offset,
+            pEntry->compLen, &map) != 0) {
+        LOGE("Can't map %lld bytes of zip file at %lld\n",
+            (long long) pEntry->compLen, (long long) pEntry->offset);
+        return -1;
+    }
+    ok = mzInflateBuffer((const unsigned char*) map.addr, pEntry->compLen,
+            buffer, pEntry->uncompLen, &actualLen);
+    sysReleaseShmem(&map);
+
+    if (!ok) {
+        return -1;
+    }
+    if ((off64_t) actualLen != pEntry->uncompLen) {
+        LOGW("Size mismatch on inflated file (%zu vs %lld)\n",
+            actualLen, (long long) pEntry->uncompLen);
+        return -1;
+    }
+    return 0;
+}
+
 /*
  * Stream the uncompressed data through the supplied function,
  * passing cookie to it each time it gets called.  processFunction
@@ -667,6 +1024,10 @@ bail:
  * If processFunction returns false, the operation is abandoned and
  * mzProcessZipEntryContents() immediately returns false.
  *
+ * The entry is read through on-demand mappings rather than the archive
+ * fd's file position, so this may be called on the same archive from
+ * several threads at once.
+ *
  * This is useful for calculating the hash of an entry's uncompressed contents.
  */
 bool mzProcessZipEntryContents(const ZipArchive *pArchive,
@@ -674,13 +1035,6 @@ bool mzProcessZipEntryContents(const ZipArchive *pArchive,
     void *cookie)
 {
     bool ret = false;
-    off_t oldOff;
-
-    /* save current offset */
-    oldOff = lseek(pArchive->fd, 0, SEEK_CUR);
-
-    /* Seek to the beginning of the entry's compressed data. */
-    lseek(pArchive->fd, pEntry->offset, SEEK_SET);
 
     switch (pEntry->compression) {
     case STORED:
@@ -690,13 +1044,11 @@ bool mzProcessZipEntryContents(const ZipArchive *pArchive,
         ret = processDeflatedEntry(pArchive, pEntry, processFunction, cookie);
         break;
     default:
-        LOGE("Unsupported compression type %d for entry '%s'\n",
-                pEntry->compression, pEntry->fileName);
+        LOGE("Unsupported compression type %d for entry '%.*s'\n",
+                pEntry->compression, pEntry->fileNameLen, pEntry->fileName);
         break;
     }
 
-    /* restore file offset */
-    lseek(pArchive->fd, oldOff, SEEK_SET);
     return ret;
 }
 
@@ -758,6 +1110,17 @@ bool mzReadZipEntry(const ZipArchive* pArchive, const ZipEntry* pEntry,
     CopyProcessArgs args;
     bool ret;
 
+    if (pEntry->compression == DEFLATED && bufLen >= 0) {
+        int r = inflateEntryToBuffer(pArchive, pEntry,
+                (unsigned char*) buf, bufLen);
+        if (r == 0) {
+            return true;
+        } else if (r < 0) {
+            LOGE("Can't extract entry to buffer.\n");
+            return false;
+        }
+    }
+
     args.buf = buf;
     args.bufLen = bufLen;
     ret = mzProcessZipEntryContents(pArchive, pEntry, copyProcessFunction,
@@ -795,12 +1158,182 @@ static bool writeProcessFunction(const unsigned char *data, int dataLen,
     }
 }
 
+/*
+ * Copy a STORED entry to "fd" with sendfile(), so the data goes from the
+ * page cache to the target without passing through user space.  The
+ * offset is passed explicitly, so the archive fd's position is untouched.
+ *
+ * Returns 0 on success, -1 on error, and 1 if sendfile() isn't usable
+ * for this target and the caller should fall back to plain writes.
+ */
+static int sendStoredEntry(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, int fd)
+{
+    off_t offset = pEntry->offset;
+    size_t bytesLeft = pEntry->compLen;
+
+    /* sendfile() takes an off_t; leave anything past that to write() */
+    if ((off64_t) offset != pEntry->offset ||
+            (off64_t) bytesLeft != pEntry->compLen ||
+            (off64_t)(off_t)(pEntry->offset + pEntry->compLen) !=
+                pEntry->offset + pEntry->compLen) {
+        return 1;
+    }
+
+    while (bytesLeft > 0) {
+        ssize_t n = sendfile(fd, pArchive->fd, &offset, bytesLeft);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno == EINVAL || errno == ENOSYS) &&
+                    bytesLeft == (size_t)pEntry->compLen) {
+                return 1;
+            }
+            LOGE("Error sending %zu bytes from zip file: %s\n",
+                 bytesLeft, strerror(errno));
+            return -1;
+        }
+        if (n == 0) {
+            LOGE("Unexpected EOF sending zip entry (%zu bytes left)\n",
+                 bytesLeft);
+            return -1;
+        }
+        bytesLeft -= n;
+    }
+    return 0;
+}
+
+/*
+ * DEFLATED entries up to this size are inflated into one heap buffer and
+ * written with a single write() call.
+ */
+#define MAX_BUFFERED_EXTRACT (1024 * 1024)
+
+/*
+ * Inflate a small DEFLATED entry in one piece and write it out at once.
+ *
+ * Returns 0 on success, -1 on error, and 1 if the entry should be
+ * streamed instead.
+ */
+static int writeBufferedEntry(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, int fd)
+{
+    unsigned char *buf;
+    int r;
+
+    if (pEntry->uncompLen > MAX_BUFFERED_EXTRACT) {
+        return 1;
+    }
+    buf = (unsigned char *) malloc(pEntry->uncompLen + 1);
+    if (buf == NULL) {
+        return 1;
+    }
+    r = inflateEntryToBuffer(pArchive, pEntry, buf, pEntry->uncompLen);
+    if (r == 0 && pEntry->uncompLen > 0 &&
+            !writeProcessFunction(buf, pEntry->uncompLen,
+                (void*)(intptr_t)fd)) {
+        r = -1;
+    }
+    free(buf);
+    return r;
+}
+
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 0x01
+#endif
+
+/*
+ * Reserve "length" bytes past fd's current offset so the filesystem can
+ * allocate the whole file at once instead of growing it write by write.
+ * This is only a hint: filesystems without fallocate() support (UBIFS,
+ * vfat), non-regular files and libcs without the syscall just skip it.
+ */
+static void preallocateFile(int fd, off64_t length)
+{
+#ifdef __NR_fallocate
+    struct stat64 st;
+    off64_t offset;
+    long ret;
+
+    if (length <= 0 || fstat64(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return;
+    }
+    offset = lseek64(fd, 0, SEEK_CUR);
+    if (offset < 0) {
+        return;
+    }
+#ifdef __LP64__
+    ret = syscall(__NR_fallocate, fd, FALLOC_FL_KEEP_SIZE, offset, length);
+#else
+    /* 64-bit arguments go to the kernel as 32-bit halves, low first. */
+    ret = syscall(__NR_fallocate, fd, FALLOC_FL_KEEP_SIZE,
+            (uint32_t) offset, (uint32_t) (offset >> 32),
+            (uint32_t) length, (uint32_t) (length >> 32));
+#endif
+    if (ret != 0) {
+        LOGV("fallocate(%lld) not supported: %s\n",
+            (long long) length, strerror(errno));
+    }
+#endif
+}
+
+/*
+ * Flush everything written under "path" to storage with one syncfs() on
+ * its filesystem, rather than syncing each extracted file.  Without the
+ * syscall, everything is synced.
+ */
+static bool syncFilesystem(const char *path)
+{
+#ifdef __NR_syncfs
+    int fd = open(path, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        LOGE("Can't open \"%s\" to sync: %s\n", path, strerror(errno));
+        return false;
+    }
+    int ret = syscall(__NR_syncfs, fd);
+    if (ret != 0) {
+        LOGE("syncfs(\"%s\") failed: %s\n", path, strerror(errno));
+    }
+    close(fd);
+    return ret == 0;
+#else
+    sync();
+    return true;
+#endif
+}
+
 /*
  * Uncompress "pEntry" in "pArchive" to "fd" at the current offset.
+ *
+ * The output space is preallocated, and output is written in large
+ * chunks.  Nothing is synced; callers extracting many files should sync
+ * the filesystem once when they are done (mzExtractRecursive does).
  */
 bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
     const ZipEntry *pEntry, int fd)
 {
+    preallocateFile(fd, pEntry->uncompLen);
+
+    if (pEntry->compression == DEFLATED) {
+        int r = writeBufferedEntry(pArchive, pEntry, fd);
+        if (r == 0) {
+            return true;
+        } else if (r < 0) {
+            LOGE("Can't extract entry to file.\n");
+            return false;
+        }
+    } else if (pEntry->compression == STORED) {
+        int r = sendStoredEntry(pArchive, pEntry, fd);
+        if (r == 0) {
+            return true;
+        } else if (r < 0) {
+            LOGE("Can't extract entry to file.\n");
+            return false;
+        }
+        /* sendfile() can't handle this fd; fall back to write() */
+    }
+
     bool ret = mzProcessZipEntryContents(pArchive, pEntry, writeProcessFunction,
                                          (void*)(intptr_t)fd);
     if (!ret) {
@@ -812,7 +1345,7 @@ bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
 
 typedef struct {
     unsigned char* buffer;
-    long len;
+    off64_t len;
 } BufferExtractCookie;
 
 static bool bufferProcessFunction(const unsigned char *data, int dataLen,
@@ -837,6 +1370,16 @@ bool mzExtractZipEntryToBuffer(const ZipArchive *pArchive,
     bec.buffer = buffer;
     bec.len = mzGetZipEntryUncompLen(pEntry);
 
+    if (pEntry->compression == DEFLATED) {
+        int r = inflateEntryToBuffer(pArchive, pEntry, buffer, bec.len);
+        if (r == 0) {
+            return true;
+        } else if (r < 0) {
+            LOGE("Can't extract entry to memory buffer.\n");
+            return false;
+        }
+    }
+
     bool ret = mzProcessZipEntryContents(pArchive, pEntry,
         bufferProcessFunction, (void*)&bec);
     if (!ret || bec.len != 0) {
@@ -977,50 +1520,20 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
     helper.buf = NULL;
     helper.bufLen = 0;
 
-    /* Walk through the entries and extract anything whose path begins
-     * with zpath.
-//TODO: since the entries are sorted, binary search for the first match
-//      and stop after the first non-match.
-     */
-    unsigned int i;
-    bool seenMatch = false;
-    int ok = true;
-    for (i = 0; i < pArchive->numEntries; i++) {
-        ZipEntry *pEntry = pArchive->pEntries + i;
-        if (pEntry->fileNameLen < zipDirLen) {
+    /* Look up the run of entries whose path begins with zpath and
+     * extract them.  If zpath is empty, this matches everything,
+     * which is what we want.
 //TODO: look out for a single empty directory entry that matches zpath, but
 //      missing the trailing slash.  Most zip files seem to include
 //      the trailing slash, but I think it's legal to leave it off.
 //      e.g., zpath "a/b/", entry "a/b", with no children of the entry.
-            /* No chance of matching.
-             */
-#if SORT_ENTRIES
-            if (seenMatch) {
-                /* Since the entries are sorted, we can give up
-                 * on the first mismatch after the first match.
-                 */
-                break;
-            }
-#endif
-            continue;
-        }
-        /* If zpath is empty, this strncmp() will match everything,
-         * which is what we want.
-         */
-        if (strncmp(pEntry->fileName, zpath, zipDirLen) != 0) {
-#if SORT_ENTRIES
-            if (seenMatch) {
-                /* Since the entries are sorted, we can give up
-                 * on the first mismatch after the first match.
-                 */
-                break;
-            }
-#endif
-            continue;
-        }
-        /* This entry begins with zipDir, so we'll extract it.
-         */
-        seenMatch = true;
+     */
+    unsigned int i, first, count;
+    int ok = true;
+    bool extractedAny = false;
+    count = mzFindZipEntriesWithPrefix(pArchive, zpath, &first);
+    for (i = first; i < first + count; i++) {
+        ZipEntry *pEntry = pArchive->pEntries + i;
 
         /* Find the target location of the entry.
          */
@@ -1150,6 +1663,7 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
                     break;
                 }
 
+                extractedAny = true;
                 LOGD("Extracted file \"%s\"\n", targetFile);
             }
         }
@@ -1160,5 +1674,11 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
     free(helper.buf);
     free(zpath);
 
+    /* One sync for the whole target filesystem instead of one per file.
+     */
+    if (ok && extractedAny && !syncFilesystem(targetDir)) {
+        ok = false;
+    }
+
     return ok;
 }
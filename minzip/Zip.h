@@ -8,10 +8,11 @@
 
 #include "inline_magic.h"
 
+#include <stdbool.h>
 #include <stdlib.h>
+#include <sys/types.h>
 #include <utime.h>
 
-#include "Hash.h"
 #include "SysUtil.h"
 
 #ifdef __cplusplus
@@ -24,17 +25,14 @@ extern "C" {
 /*
  * One entry in the Zip archive.  Treat this as opaque -- use accessors below.
  *
- * TODO: we're now keeping the pages mapped so we don't have to copy the
- * filename.  We can change the accessors to retrieve the various pieces
- * directly from the source file instead of copying them out, for a very
- * slight speed hit and a modest reduction in memory usage.
+ * The filename points into the archive's name arena (see ZipArchive).
  */
 typedef struct ZipEntry {
     unsigned int fileNameLen;
     const char*  fileName;       // not null-terminated
-    long         offset;
-    long         compLen;
-    long         uncompLen;
+    off64_t      offset;
+    off64_t      compLen;
+    off64_t      uncompLen;
     int          compression;
     long         modTime;
     long         crc32;
@@ -44,13 +42,22 @@ typedef struct ZipEntry {
 
 /*
  * One Zip archive.  Treat as opaque.
+ *
+ * pEntries is sorted by name.  pNames holds all of the names back to back
+ * in the same order, and entry i's name runs from pNameOffsets[i] up to
+ * pNameOffsets[i+1], so name lookups are binary searches over two compact
+ * arrays.
+ *
+ * The file is not kept mapped; entry data is mapped in bounded windows
+ * while it is being read (see mzProcessZipEntryContents).
  */
 typedef struct ZipArchive {
     int         fd;
+    off64_t     length;         // size of the archive file
     unsigned int numEntries;
     ZipEntry*   pEntries;
-    HashTable*  pHash;          // maps file name to ZipEntry
-    MemMapping  map;
+    char*       pNames;         // name arena, sorted
+    unsigned int* pNameOffsets; // numEntries+1 offsets into pNames
 } ZipArchive;
 
 /*
@@ -85,6 +92,14 @@ void mzCloseZipArchive(ZipArchive* pArchive);
 const ZipEntry* mzFindZipEntry(const ZipArchive* pArchive,
         const char* entryName);
 
+/*
+ * Find all entries whose names begin with "prefix".  Entries are sorted
+ * by name, so the matches are consecutive; returns the number of matches
+ * and sets *pFirst to the index of the first one (see mzGetZipEntryAt).
+ */
+unsigned int mzFindZipEntriesWithPrefix(const ZipArchive* pArchive,
+        const char* prefix, unsigned int* pFirst);
+
 /*
  * Get the number of entries in the Zip archive.
  */
@@ -121,10 +136,10 @@ INLINE UnterminatedString mzGetZipEntryFileName(const ZipEntry* pEntry) {
     ret.len = pEntry->fileNameLen;
     return ret;
 }
-INLINE long mzGetZipEntryOffset(const ZipEntry* pEntry) {
+INLINE off64_t mzGetZipEntryOffset(const ZipEntry* pEntry) {
     return pEntry->offset;
 }
-INLINE long mzGetZipEntryUncompLen(const ZipEntry* pEntry) {
+INLINE off64_t mzGetZipEntryUncompLen(const ZipEntry* pEntry) {
     return pEntry->uncompLen;
 }
 INLINE long mzGetZipEntryModTime(const ZipEntry* pEntry) {
@@ -0,0 +1,144 @@
+/*
+ * Copyright 2014 The CyanogenMod Project
+ *
+ * Compare the inflate engines on the DEFLATED entries of one or more
+ * zip packages, e.g.
+ *
+ *   minzip_inflate_bench /sdcard/update.zip /sdcard/gapps.zip
+ *
+ * For each package, every DEFLATED entry is decoded "iterations" times
+ * with each engine, and the total uncompressed throughput is reported.
+ * The "zlib-stream" row is the streaming path that
+ * mzProcessZipEntryContents() uses for file extraction.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "Inflate.h"
+#include "Zip.h"
+
+#define DEFAULT_ITERATIONS 20
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool countProcessFunction(const unsigned char *data, int dataLen,
+        void *cookie)
+{
+    *(size_t *)cookie += dataLen;
+    return true;
+}
+
+/*
+ * Decode every DEFLATED entry of the archive "iterations" times with
+ * "engine" (or the streaming path if engine is NULL).  Returns the number
+ * of uncompressed bytes produced, or -1 on a decode failure.
+ */
+static long long runEngine(const ZipArchive* za, const InflateEngine* engine,
+        int iterations)
+{
+    long long total = 0;
+    unsigned int i;
+    int n;
+
+    for (i = 0; i < mzZipEntryCount(za); i++) {
+        const ZipEntry* entry = mzGetZipEntryAt(za, i);
+        unsigned char* comp;
+        unsigned char* out;
+
+        if (entry->compression != 8 /* DEFLATED */ || entry->uncompLen == 0)
+            continue;
+
+        comp = malloc(entry->compLen);
+        out = malloc(entry->uncompLen);
+        if (comp == NULL || out == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        if (pread64(za->fd, comp, entry->compLen, entry->offset) !=
+                entry->compLen) {
+            fprintf(stderr, "can't read entry %u\n", i);
+            exit(1);
+        }
+
+        for (n = 0; n < iterations; n++) {
+            size_t actual = 0;
+            bool ok;
+            if (engine == NULL) {
+                ok = mzProcessZipEntryContents(za, entry,
+                        countProcessFunction, &actual);
+            } else {
+                ok = engine->inflateBuffer(comp, entry->compLen,
+                        out, entry->uncompLen, &actual);
+            }
+            if (!ok || (long long) actual != entry->uncompLen) {
+                free(comp);
+                free(out);
+                return -1;
+            }
+            total += actual;
+        }
+
+        free(comp);
+        free(out);
+    }
+    return total;
+}
+
+static void report(const char* name, const ZipArchive* za,
+        const InflateEngine* engine, int iterations)
+{
+    double start = now();
+    long long bytes = runEngine(za, engine, iterations);
+    double elapsed = now() - start;
+
+    if (bytes < 0) {
+        printf("  %-12s  FAILED\n", name);
+    } else {
+        printf("  %-12s  %10lld bytes  %8.3f s  %8.1f MB/s\n", name, bytes,
+                elapsed, elapsed > 0 ? bytes / elapsed / (1024 * 1024) : 0);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    int iterations = DEFAULT_ITERATIONS;
+    int i;
+
+    if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+        iterations = atoi(argv[2]);
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc < 2 || iterations <= 0) {
+        fprintf(stderr, "usage: %s [-n iterations] package.zip...\n", argv[0]);
+        return 2;
+    }
+
+    for (i = 1; i < argc; i++) {
+        ZipArchive za;
+
+        if (mzOpenZipArchive(argv[i], &za) != 0) {
+            printf("%s: not a zip archive, skipped\n", argv[i]);
+            continue;
+        }
+        printf("%s (%u entries, %d iterations)\n", argv[i],
+                mzZipEntryCount(&za), iterations);
+        report("zlib-stream", &za, NULL, iterations);
+        report(mzZlibInflateEngine()->name, &za, mzZlibInflateEngine(),
+                iterations);
+        if (mzDefaultInflateEngine() != mzZlibInflateEngine()) {
+            report(mzDefaultInflateEngine()->name, &za,
+                    mzDefaultInflateEngine(), iterations);
+        }
+        mzCloseZipArchive(&za);
+    }
+    return 0;
+}
@@ -3,7 +3,10 @@ ifneq ($(TARGET_SIMULATOR),true)
 LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 
-BOARD_RECOVERY_DEFINES := BOARD_HAS_MTK
+# Set BOARD_RECOVERY_SECURE_DISCARD := true to erase eMMC partitions with
+# BLKSECDISCARD (before falling back to BLKDISCARD), so wiped data can't
+# be recovered from the flash.  Secure discard is much slower on some parts.
+BOARD_RECOVERY_DEFINES := BOARD_HAS_MTK BOARD_RECOVERY_SECURE_DISCARD
 
 $(foreach board_define,$(BOARD_RECOVERY_DEFINES), \
   $(if $($(board_define)), \
@@ -15,6 +18,8 @@ $(foreach board_define,$(BOARD_RECOVERY_DEFINES), \
 LOCAL_SRC_FILES := \
 	mmcutils.c
 
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/..
+
 LOCAL_MODULE := libmmcutils
 LOCAL_MODULE_TAGS := eng
 
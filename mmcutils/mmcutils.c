@@ -33,6 +33,9 @@
 #include <dirent.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/reboot.h>
 #include <sys/stat.h>
@@ -40,6 +43,7 @@
 #include <sys/mount.h>  // for _IOW, _IOR, mount()
 
 #include "mmcutils.h"
+#include "flashutils/blkio.h"
 
 #ifdef BOARD_HAS_MTK
 #include "../mounts.h"
@@ -75,6 +79,17 @@ static MmcState g_mmc_state = {
 
 #define MMC_DEVICENAME "/dev/block/mmcblk0"
 
+/* Older kernel headers predate the discard ioctls. */
+#ifndef BLKDISCARD
+#define BLKDISCARD      _IO(0x12,119)
+#endif
+#ifndef BLKSECDISCARD
+#define BLKSECDISCARD   _IO(0x12,125)
+#endif
+#ifndef BLKZEROOUT
+#define BLKZEROOUT      _IO(0x12,127)
+#endif
+
 static void
 mmc_partition_name (MmcPartition *mbr, unsigned int type) {
     switch(type)
@@ -342,10 +357,84 @@ run_exec_process ( char **argv) {
     return 0;
 }
 
+/* Drop everything on 'device' with a discard, which eMMC finishes in
+ * seconds where writing the whole partition takes minutes and wears the
+ * flash.  'length' reads like fstab's length=: 0 for the whole device,
+ * > 0 for the first 'length' bytes, < 0 to spare the last -length bytes
+ * (a crypto footer).  Devices that can't discard get BLKZEROOUT, which
+ * the kernel does with write-zeroes or plain writes.  Nodes that aren't
+ * block devices (MTK's /dev/bootimg and friends) are left alone, and
+ * count as done.
+ */
+int
+mmc_discard_device (const char *device, int64_t length) {
+    struct stat st;
+    uint64_t size;
+    uint64_t range[2];
+    int ret = -1;
+
+    int fd = open(device, O_WRONLY);
+    if (fd < 0) {
+        printf("mmc: can't open %s: %s\n", device, strerror(errno));
+        return -1;
+    }
+    if (fstat(fd, &st) != 0 || !S_ISBLK(st.st_mode)) {
+        printf("mmc: %s isn't a block device; not discarding it\n", device);
+        ret = 0;
+        goto done;
+    }
+    if (ioctl(fd, BLKGETSIZE64, &size) != 0) {
+        printf("mmc: can't get the size of %s: %s\n", device, strerror(errno));
+        if (errno == ENOTTY || errno == EOPNOTSUPP)
+            ret = 0;
+        goto done;
+    }
+
+    if (length > 0 && (uint64_t) length < size)
+        size = length;
+    else if (length < 0 && (uint64_t) -length < size)
+        size += length;
+    else if (length < 0) {
+        printf("mmc: %s is too small to keep %lld bytes\n", device,
+               (long long) -length);
+        goto done;
+    }
+    range[0] = 0;
+    range[1] = size & ~(uint64_t) (BLOCK_SIZE - 1);
+    if (range[1] == 0) {
+        ret = 0;
+        goto done;
+    }
+
+#ifdef BOARD_RECOVERY_SECURE_DISCARD
+    if (ioctl(fd, BLKSECDISCARD, &range) == 0) {
+        ret = 0;
+        goto done;
+    }
+#endif
+    if (ioctl(fd, BLKDISCARD, &range) == 0) {
+        ret = 0;
+        goto done;
+    }
+    printf("mmc: discard of %s failed (%s); zeroing it\n", device,
+           strerror(errno));
+    if (ioctl(fd, BLKZEROOUT, &range) == 0)
+        ret = 0;
+    else
+        printf("mmc: can't zero %s: %s\n", device, strerror(errno));
+
+done:
+    close(fd);
+    return ret;
+}
+
 int
 format_ext3_device (const char *device) {
     char *const mke2fs[] = {MKE2FS_BIN, "-j", "-q", device, NULL};
     char *const tune2fs[] = {TUNE2FS_BIN, "-C", "1", device, NULL};
+    // mke2fs may not discard on its own; the old data is dead either way.
+    mmc_discard_device(device, 0);
+
     // Run mke2fs
     if(run_exec_process(mke2fs)) {
         printf("failure while running mke2fs\n");
@@ -370,6 +459,8 @@ format_ext3_device (const char *device) {
 
 int
 format_ext2_device (const char *device) {
+    mmc_discard_device(device, 0);
+
     // Run mke2fs
     char *const mke2fs[] = {MKE2FS_BIN, device, NULL};
     if(run_exec_process(mke2fs))
@@ -422,178 +513,87 @@ mmc_mount_partition(const MmcPartition *partition, const char *mount_point,
     return rv;
 }
 
-int
-mmc_raw_copy (const MmcPartition *partition, char *in_file) {
-    int ch;
-    FILE *in;
-    FILE *out;
-    int val = 0;
-    char buf[512];
-    unsigned sz = 0;
-    unsigned i;
-    int ret = -1;
-    char *out_file = partition->device_index;
-
-    in  = fopen ( in_file,  "r" );
-    if (in == NULL)
-        goto ERROR3;
-
-    out = fopen ( out_file,  "w" );
-    if (out == NULL)
-        goto ERROR2;
-
-    fseek(in, 0L, SEEK_END);
-    sz = ftell(in);
-    fseek(in, 0L, SEEK_SET);
+/* Whole partitions are copied by blkio_copy_file(), which keeps several
+ * large O_DIRECT requests in flight on the eMMC and the sdcard; these are
+ * for mmc_raw_read() and mmc_raw_write()'s small transfers.
+ */
 
-    if (sz % 512)
-    {
-        while ( ( ch = fgetc ( in ) ) != EOF )
-            fputc ( ch, out );
-    }
-    else
-    {
-        for (i=0; i< (sz/512); i++)
-        {
-            if ((fread(buf, 512, 1, in)) != 1)
-                goto ERROR1;
-            if ((fwrite(buf, 512, 1, out)) != 1)
-                goto ERROR1;
-        }
+static ssize_t
+mmc_read_full (int fd, char *data, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t r = read(fd, data + done, len - done);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0)
+            return -1;
+        if (r == 0)
+            break;
+        done += r;
     }
-
-    fsync(out);
-    ret = 0;
-ERROR1:
-    fclose ( out );
-ERROR2:
-    fclose ( in );
-ERROR3:
-    return ret;
-
+    return done;
 }
 
-
-int
-mmc_raw_dump_internal (const char* in_file, const char *out_file, unsigned sz) {
-    int ch;
-    FILE *in;
-    FILE *out;
-    int val = 0;
-    char buf[512];
-    unsigned i;
-    int ret = -1;
-
-    in  = fopen ( in_file,  "r" );
-    if (in == NULL)
-        goto ERROR3;
-
-    out = fopen ( out_file,  "w" );
-    if (out == NULL)
-        goto ERROR2;
-
-    if (sz == 0)
-    {
-        fseek(in, 0L, SEEK_END);
-        sz = ftell(in);
-        fseek(in, 0L, SEEK_SET);
-    }
-
-    if (sz % 512)
-    {
-        unsigned counter = 0;
-        while ( ( ch = fgetc ( in ) ) != EOF )
-        {
-            fputc ( ch, out );
-#ifdef BOARD_HAS_MTK
-            if (++counter == sz)
-                break;
-#endif
-        }
-    }
-    else
-    {
-        for (i=0; i< (sz/512); i++)
-        {
-            if ((fread(buf, 512, 1, in)) != 1)
-                goto ERROR1;
-            if ((fwrite(buf, 512, 1, out)) != 1)
-                goto ERROR1;
-        }
+static ssize_t
+mmc_write_full (int fd, const char *data, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t r = write(fd, data + done, len - done);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        done += r;
     }
+    return done;
+}
 
-    fsync(out);
-    ret = 0;
-ERROR1:
-    fclose ( out );
-ERROR2:
-    fclose ( in );
-ERROR3:
-    return ret;
+/* Images may be sparse, and only what they really hold is written: the
+ * partition is discarded first and runs of zeros aren't sent.
+ */
+static int
+mmc_write_image (const char *in_file, const char *device) {
+    BlkIoCopy opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.flags = BLKIO_IMAGE;
+    return blkio_copy_file(in_file, device, &opts);
+}
 
+int
+mmc_raw_copy (const MmcPartition *partition, char *in_file) {
+    return mmc_write_image(in_file, partition->device_index);
 }
 
-// TODO: refactor this to not be a giant copy paste mess
 int
 mmc_raw_dump (const MmcPartition *partition, char *out_file) {
-    return mmc_raw_dump_internal(partition->device_index, out_file, 0);
+    return blkio_copy_file(partition->device_index, out_file, NULL);
 }
 
-
 int
 mmc_raw_read (const MmcPartition *partition, char *data, int data_size) {
-    int ch;
-    FILE *in;
-    int val = 0;
-    char buf[512];
-    unsigned sz = 0;
-    unsigned i;
     int ret = -1;
-    char *in_file = partition->device_index;
-
-    in  = fopen ( in_file,  "r" );
-    if (in == NULL)
-        goto ERROR3;
-
-    fseek(in, 0L, SEEK_END);
-    sz = ftell(in);
-    fseek(in, 0L, SEEK_SET);
-
-    fread(data, data_size, 1, in);
+    int fd = open(partition->device_index, O_RDONLY);
+    if (fd < 0)
+        return -1;
 
-    ret = 0;
-ERROR1:
-ERROR2:
-    fclose ( in );
-ERROR3:
+    if (mmc_read_full(fd, data, data_size) == data_size)
+        ret = 0;
+    close(fd);
     return ret;
-
 }
 
 int
 mmc_raw_write (const MmcPartition *partition, char *data, int data_size) {
-    int ch;
-    FILE *out;
-    int val = 0;
-    char buf[512];
-    unsigned sz = 0;
-    unsigned i;
     int ret = -1;
-    char *out_file = partition->device_index;
-
-    out  = fopen ( out_file,  "w" );
-    if (out == NULL)
-        goto ERROR3;
-
-    fwrite(data, data_size, 1, out);
+    int fd = open(partition->device_index, O_WRONLY);
+    if (fd < 0)
+        return -1;
 
-    ret = 0;
-ERROR1:
-ERROR2:
-    fclose ( out );
-ERROR3:
+    if (mmc_write_full(fd, data, data_size) == data_size && fsync(fd) == 0)
+        ret = 0;
+    if (close(fd) != 0)
+        ret = -1;
     return ret;
-
 }
 
 int cmd_mmc_restore_raw_partition(const char *partition, const char *filename)
@@ -607,7 +607,7 @@ int cmd_mmc_restore_raw_partition(const char *partition, const char *filename)
         return mmc_raw_copy(p, filename);
     }
     else {
-        return mmc_raw_dump_internal(filename, partition, 0);
+        return mmc_write_image(filename, partition);
     }
 }
 
@@ -623,7 +623,7 @@ int cmd_mmc_backup_raw_partition(const char *partition, const char *filename)
     }
     else 
     {
-        unsigned sz = 0;
+        uint64_t sz = 0;
 
 //=========================================/
 //=   dynamic get size of MTK partitions  =/
@@ -636,39 +636,50 @@ int cmd_mmc_backup_raw_partition(const char *partition, const char *filename)
         if (strstr(partition, "/boot") != NULL) {
             if (mtk_p_size("/boot") != 0)
                 return -1;
-            sz = (unsigned)mtk_size;
-            printf("Boot: %s (%u)\n", partition, sz);
+            sz = mtk_size;
+            printf("Boot: %s (%llu)\n", partition, (unsigned long long)sz);
         }
 
         if (strstr(partition, "/recovery") != NULL) {
             if (mtk_p_size("/recovery") != 0)
                 return -1;
-            sz = (unsigned)mtk_size;
-            printf("Recovery: %s (%u)\n", partition, sz);
+            sz = mtk_size;
+            printf("Recovery: %s (%llu)\n", partition, (unsigned long long)sz);
         }
 
         if (strstr(partition, "/uboot") != NULL) {
             if (mtk_p_size("/uboot") != 0)
                 return -1;
-            sz = (unsigned)mtk_size;
-            printf("Uboot: %s (%u)\n", partition, sz);
+            sz = mtk_size;
+            printf("Uboot: %s (%llu)\n", partition, (unsigned long long)sz);
         }
         
         if (strstr(partition, "/nvram") != NULL) {
             if (mtk_p_size("/nvram") != 0)
                 return -1;
-            sz = (unsigned)mtk_size;
-            printf("Nvram: %s (%u)\n", partition, sz);
+            sz = mtk_size;
+            printf("Nvram: %s (%llu)\n", partition, (unsigned long long)sz);
         }
 #endif
        
-        return mmc_raw_dump_internal(partition, filename, sz);
+        BlkIoCopy opts;
+        memset(&opts, 0, sizeof(opts));
+        opts.size = sz;
+        return blkio_copy_file(partition, filename, &opts);
     }
 }
 
 int cmd_mmc_erase_raw_partition(const char *partition)
 {
-    return 0;
+    if (partition[0] != '/') {
+        mmc_scan_partitions();
+        const MmcPartition *p;
+        p = mmc_find_partition_by_name(partition);
+        if (p == NULL)
+            return -1;
+        return mmc_discard_device(p->device_index, 0);
+    }
+    return mmc_discard_device(partition, 0);
 }
 
 int cmd_mmc_erase_partition(const char *partition, const char *filesystem)
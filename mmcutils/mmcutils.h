@@ -30,6 +30,8 @@
 #ifndef MMCUTILS_H_
 #define MMCUTILS_H_
 
+#include <stdint.h>
+
 /* Some useful define used to access the MBR/EBR table */
 #define BLOCK_SIZE                0x200
 #define TABLE_ENTRY_0             0x1BE
@@ -83,6 +85,8 @@ int mmc_raw_copy (const MmcPartition *partition, char *in_file);
 int mmc_raw_read (const MmcPartition *partition, char *data, int data_size);
 int mmc_raw_write (const MmcPartition *partition, char *data, int data_size);
 
+int mmc_discard_device (const char *device, int64_t length);
+
 int format_ext2_device(const char *device);
 int format_ext3_device(const char *device);
 
@@ -5,6 +5,27 @@ LOCAL_SRC_FILES := mtdutils.c
 LOCAL_MODULE := libmtdutils
 include $(BUILD_STATIC_LIBRARY)
 
+# Erase/write/read benchmark and regression cases, run against a fake
+# MTD device (see mtd_bench.c) or a real partition such as nandsim's.
+mtd_bench_ldflags := -Wl,--wrap=read,--wrap=pread64,--wrap=write,--wrap=ioctl
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := mtd_bench.c mtdutils.c
+LOCAL_MODULE := mtdutils_bench
+LOCAL_MODULE_TAGS := tests
+LOCAL_LDFLAGS := $(mtd_bench_ldflags)
+LOCAL_LDLIBS += -lpthread
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := mtd_bench.c mtdutils.c
+LOCAL_MODULE := mtdutils_bench
+LOCAL_MODULE_TAGS := tests
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+LOCAL_LDFLAGS := $(mtd_bench_ldflags)
+LOCAL_STATIC_LIBRARIES := libcutils libc
+include $(BUILD_EXECUTABLE)
+
 ifeq ($(BOARD_USES_BML_OVER_MTD),true)
 include $(CLEAR_VARS)
 LOCAL_SRC_FILES := bml_over_mtd.c
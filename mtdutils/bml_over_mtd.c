@@ -171,172 +171,220 @@ static unsigned short* CreateEmptyBlockMapping(const MtdPartition* pSrcPart)
 	return pMapping;
 }
 
-static const unsigned short* CreateBlockMapping(const MtdPartition* pSrcPart, int srcPartStartBlock,
-		const MtdPartition *pReservoirPart, int reservoirPartStartBlock)
+//The mapping table block starts with an "UPCH" mark; the table itself is at 0x1000.
+#define MAPPING_HEADER_SIZE 0x2000
+#define MAPPING_TABLE_OFFSET 0x1000
+#define MAPPING_MAX_ENTRIES 50
+
+//Where the mapping table was last found in a reservoir partition, so later
+//dumps and flashes in this boot don't have to search for it again.
+#define MAPPING_CACHE_FORMAT "/tmp/bml_over_mtd.%s.map"
+#define MAPPING_CACHE_MAGIC 0x504d4c42
+
+typedef struct MappingCache {
+	unsigned int magic;
+	int deviceIndex;
+	unsigned long long totalSize;
+	unsigned int eraseSize;
+	int tableOffset;
+	unsigned int checksum;      //of the block's first MAPPING_HEADER_SIZE bytes
+} MappingCache;
+
+static unsigned int MappingChecksum(const char* buf)
 {
-	size_t srcTotal, srcErase, srcWrite;
-	if (mtd_partition_info(pSrcPart, &srcTotal, &srcErase, &srcWrite) != 0)
+	//FNV-1a
+	unsigned int h = 2166136261u;
+	int i;
+	for (i = 0; i < MAPPING_HEADER_SIZE; ++i)
 	{
-		fprintf(stderr, "Failed to access partition.\n");
-		return NULL;
+		h ^= (unsigned char)buf[i];
+		h *= 16777619u;
 	}
+	return h;
+}
 
-	int numSrcBlocks = srcTotal/srcErase;
+//Read the start of the reservoir block at 'offset' into 'buf'.
+//Returns 0, 1 if the block is bad, or -1 on a read error.
+static int ReadMappingHeader(int fd, int offset, char* buf)
+{
+	loff_t pos = offset;
+	if (ioctl(fd, MEMGETBADBLOCK, &pos) != 0)
+		return 1;
+	if (pread64(fd, buf, MAPPING_HEADER_SIZE, offset) != MAPPING_HEADER_SIZE)
+		return -1;
+	return 0;
+}
 
-	unsigned short* pMapping = malloc(numSrcBlocks * sizeof(unsigned short));
-	if (pMapping == NULL)
-	{
-		fprintf(stderr, "Failed to allocate block mapping memory.\n");
-		return NULL;
-	}
-	memset(pMapping, 0xFF, numSrcBlocks * sizeof(unsigned short));
+static int IsMappingTable(const char* buf)
+{
+	const unsigned short* mappings = (const unsigned short*) &buf[MAPPING_TABLE_OFFSET];
+	return buf[0]=='U' && buf[1]=='P' && buf[2]=='C' && buf[3]=='H'
+			&& mappings[0]==0 && mappings[1]==0xffff;
+}
 
-	size_t total, erase, write;
-	if (mtd_partition_info(pReservoirPart, &total, &erase, &write) != 0)
+//Fill pMapping from the table in 'buf', found at reservoir offset 'tableOffset'.
+//Returns 0 if an entry points outside the reservoir area in use.
+static int ParseMappingTable(const char* buf, unsigned short* pMapping, int numSrcBlocks,
+		int srcPartStartBlock, int reservoirPartStartBlock, int tableOffset, size_t erase)
+{
+	const unsigned short* mappings = (const unsigned short*) &buf[MAPPING_TABLE_OFFSET];
+	//Skip first entry (dummy)
+	const unsigned short* mappingEntry = mappings + 2;
+	while (mappingEntry - mappings < MAPPING_MAX_ENTRIES*2
+			&& mappingEntry[0] != 0xffff)
 	{
-		fprintf(stderr, "Failed to access reservoir partition.\n");
-		free(pMapping);
-		return NULL;
-	}
+		unsigned short rawSrcBlk = mappingEntry[0];
+		unsigned short rawDstBlk = mappingEntry[1];
 
-	if (erase != srcErase || write != srcWrite)
-	{
-		fprintf(stderr, "Source partition and reservoir partition differ in size properties.\n");
-		free(pMapping);
-		return NULL;
-	}
+		printf("Found raw block mapping %d -> %d\n", rawSrcBlk,
+				rawDstBlk);
 
-	printf("Partition info: Total %d, Erase %d, write %d\n", total, erase, write);
+		unsigned int srcAbsoluteStartAddress = srcPartStartBlock * erase;
+		unsigned int resAbsoluteStartAddress = reservoirPartStartBlock * erase;
 
-	BmlOverMtdReadContext *readctx = bml_over_mtd_read_partition(pReservoirPart);
-	if (readctx == NULL)
-	{
-		fprintf(stderr, "Failed to open reservoir partition for reading.\n");
-		free(pMapping);
-		return NULL;
-	}
+		if (rawDstBlk < reservoirPartStartBlock
+				|| rawDstBlk*erase >= resAbsoluteStartAddress+tableOffset)
+		{
+			fprintf(stderr, "Mapped block not within reasonable reservoir area.\n");
+			return 0;
+		}
 
-	if (total < erase || total > INT_MAX)
-	{
-		fprintf(stderr, "Unsuitable reservoir partition properties.\n");
-		free(pMapping);
-		bml_over_mtd_read_close(readctx);
-		return NULL;
-	}
+		int srcLastBlock = srcPartStartBlock + numSrcBlocks - 1;
+		if (rawSrcBlk >= srcPartStartBlock && rawSrcBlk <= srcLastBlock)
+		{
+
+			unsigned short relSrcBlk = rawSrcBlk - srcPartStartBlock;
+			unsigned short relDstBlk = rawDstBlk - reservoirPartStartBlock;
+			printf("Partition relative block mapping %d -> %d\n",relSrcBlk, relDstBlk);
 
-	int foundMappingTable = 0;
+			printf("Absolute mapped start addresses 0x%x -> 0x%x\n",
+					srcAbsoluteStartAddress+relSrcBlk*erase,
+					resAbsoluteStartAddress+relDstBlk*erase);
+			printf("Partition relative mapped start addresses 0x%x -> 0x%x\n",
+					relSrcBlk*erase, relDstBlk*erase);
 
+			//Set mapping entry. For duplicate entries, later entries replace former ones.
+			//*Assumption*: Bad blocks in reservoir area will not be mapped themselves in
+			//the mapping table. User partition blocks will not be mapped to bad blocks
+			//(only) in the reservoir area. This has to be confirmed on a wider range of
+			//devices.
+			pMapping[relSrcBlk] = relDstBlk;
+
+		}
+		mappingEntry+=2;
+	}
+	return 1;
+}
+
+//Search the reservoir backwards for the mapping table, leaving its header in
+//'buf'. Returns the table's offset, -1 if there is none, or -2 on a read error.
+static int FindMappingTable(int fd, size_t total, size_t erase, char* buf)
+{
 	int currOffset = total; //Offset *behind* the last byte
 	while (currOffset > 0)
 	{
 		currOffset -= erase;
-		loff_t pos = lseek64(readctx->fd, currOffset, SEEK_SET);
-		int mgbb = ioctl(readctx->fd, MEMGETBADBLOCK, &pos);
-		if (mgbb != 0)
+		int r = ReadMappingHeader(fd, currOffset, buf);
+		if (r > 0)
 		{
 			printf("Bad block %d in reservoir area, skipping.\n", currOffset/erase);
 			continue;
 		}
-		ssize_t readBytes = read(readctx->fd, readctx->buffer, erase);
-		if (readBytes != (ssize_t)erase)
+		if (r < 0)
 		{
 			fprintf(stderr, "Failed to read good block in reservoir area (%s).\n",
 					strerror(errno));
-			free(pMapping);
-			bml_over_mtd_read_close(readctx);
-			return NULL;
+			return -2;
 		}
-		if (readBytes >= 0x2000)
+		if (buf[0]=='U' && buf[1]=='P' && buf[2]=='C' && buf[3]=='H')
 		{
-			char* buf = readctx->buffer;
-			if (buf[0]=='U' && buf[1]=='P' && buf[2]=='C' && buf[3]=='H')
+			printf ("Found mapping block mark at 0x%x (block %d).\n", currOffset, currOffset/erase);
+			if (IsMappingTable(buf))
 			{
-				printf ("Found mapping block mark at 0x%x (block %d).\n", currOffset, currOffset/erase);
-
-				unsigned short* mappings = (unsigned short*) &buf[0x1000];
-				if (mappings[0]==0 && mappings[1]==0xffff)
-				{
-					printf("Found start of mapping table.\n");
-					foundMappingTable = 1;
-					//Skip first entry (dummy)
-					unsigned short* mappingEntry = mappings + 2;
-					while (mappingEntry - mappings < 100
-							&& mappingEntry[0] != 0xffff)
-					{
-						unsigned short rawSrcBlk = mappingEntry[0];
-						unsigned short rawDstBlk = mappingEntry[1];
-
-						printf("Found raw block mapping %d -> %d\n", rawSrcBlk,
-								rawDstBlk);
-
-						unsigned int srcAbsoluteStartAddress = srcPartStartBlock * erase;
-						unsigned int resAbsoluteStartAddress = reservoirPartStartBlock * erase;
-
-						int reservoirLastBlock = reservoirPartStartBlock + numSrcBlocks - 1;
-						if (rawDstBlk < reservoirPartStartBlock
-								|| rawDstBlk*erase >= resAbsoluteStartAddress+currOffset)
-						{
-							fprintf(stderr, "Mapped block not within reasonable reservoir area.\n");
-							foundMappingTable = 0;
-							break;
-						}
-
-						int srcLastBlock = srcPartStartBlock + numSrcBlocks - 1;
-						if (rawSrcBlk >= srcPartStartBlock && rawSrcBlk <= srcLastBlock)
-						{
-
-							unsigned short relSrcBlk = rawSrcBlk - srcPartStartBlock;
-							unsigned short relDstBlk = rawDstBlk - reservoirPartStartBlock;
-							printf("Partition relative block mapping %d -> %d\n",relSrcBlk, relDstBlk);
-
-							printf("Absolute mapped start addresses 0x%x -> 0x%x\n",
-									srcAbsoluteStartAddress+relSrcBlk*erase,
-									resAbsoluteStartAddress+relDstBlk*erase);
-							printf("Partition relative mapped start addresses 0x%x -> 0x%x\n",
-									relSrcBlk*erase, relDstBlk*erase);
-
-							//Set mapping entry. For duplicate entries, later entries replace former ones.
-							//*Assumption*: Bad blocks in reservoir area will not be mapped themselves in
-							//the mapping table. User partition blocks will not be mapped to bad blocks
-							//(only) in the reservoir area. This has to be confirmed on a wider range of
-							//devices.
-							pMapping[relSrcBlk] = relDstBlk;
-
-						}
-						mappingEntry+=2;
-					}
-					break; //We found the mapping table, no need to search further
-				}
-
-
+				printf("Found start of mapping table.\n");
+				return currOffset;
 			}
 		}
-
 	}
-	bml_over_mtd_read_close(readctx);
+	return -1;
+}
+
+static void MappingCachePath(char* path, size_t len, const MtdPartition* pReservoirPart)
+{
+	snprintf(path, len, MAPPING_CACHE_FORMAT, pReservoirPart->name);
+}
 
-	if (foundMappingTable == 0)
+//Is the table still where the cache says, unchanged? If so its header is left in 'buf'.
+static int LoadCachedMappingTable(const MtdPartition* pReservoirPart, int fd,
+		size_t total, size_t erase, char* buf)
+{
+	char path[PATH_MAX];
+	MappingCache cache;
+	MappingCachePath(path, sizeof(path), pReservoirPart);
+	int cfd = open(path, O_RDONLY);
+	if (cfd < 0)
+		return -1;
+	ssize_t len = read(cfd, &cache, sizeof(cache));
+	close(cfd);
+
+	if (len != sizeof(cache) || cache.magic != MAPPING_CACHE_MAGIC
+			|| cache.deviceIndex != pReservoirPart->device_index
+			|| cache.totalSize != total || cache.eraseSize != erase
+			|| cache.tableOffset < 0 || cache.tableOffset % erase != 0
+			|| (size_t)cache.tableOffset >= total)
+		return -1;
+
+	if (ReadMappingHeader(fd, cache.tableOffset, buf) != 0
+			|| !IsMappingTable(buf) || MappingChecksum(buf) != cache.checksum)
 	{
-		fprintf(stderr, "Cannot find mapping table in reservoir partition.\n");
-		free(pMapping);
-		return NULL;
+		printf("Cached mapping table location is stale, searching again.\n");
+		return -1;
 	}
+	printf("Found mapping table at cached location 0x%x (block %d).\n",
+			cache.tableOffset, cache.tableOffset/erase);
+	return cache.tableOffset;
+}
+
+static void StoreCachedMappingTable(const MtdPartition* pReservoirPart,
+		size_t total, size_t erase, int tableOffset, const char* buf)
+{
+	char path[PATH_MAX];
+	MappingCache cache;
+	memset(&cache, 0, sizeof(cache));
+	cache.magic = MAPPING_CACHE_MAGIC;
+	cache.deviceIndex = pReservoirPart->device_index;
+	cache.totalSize = total;
+	cache.eraseSize = erase;
+	cache.tableOffset = tableOffset;
+	cache.checksum = MappingChecksum(buf);
+
+	MappingCachePath(path, sizeof(path), pReservoirPart);
+	int cfd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	if (cfd < 0)
+		return;
+	if (write(cfd, &cache, sizeof(cache)) != sizeof(cache))
+		unlink(path);
+	close(cfd);
+}
 
-	//Consistency and validity check
+static void ForgetCachedMappingTable(const MtdPartition* pReservoirPart)
+{
+	char path[PATH_MAX];
+	MappingCachePath(path, sizeof(path), pReservoirPart);
+	unlink(path);
+}
+
+//Check the mapping against the source partition's bad blocks, as found by
+//scan_partition().
+static int CheckBlockMapping(const unsigned short* pMapping, int numSrcBlocks,
+		const unsigned char* srcBadBlocks, const MtdPartition *pReservoirPart, size_t erase)
+{
 	int mappingValid = 1;
-	readctx = bml_over_mtd_read_partition(pSrcPart);
-	if (readctx == NULL)
-	{
-		fprintf(stderr, "Cannot open source partition for reading.\n");
-		free(pMapping);
-		return NULL;
-	}
+	BmlOverMtdReadContext* reservoirReadCtx = NULL;
 	int currBlock = 0;
 	for (;currBlock < numSrcBlocks; ++currBlock)
 	{
-		loff_t pos = lseek64(readctx->fd, currBlock*erase, SEEK_SET);
-		int mgbb = ioctl(readctx->fd, MEMGETBADBLOCK, &pos);
-		if (mgbb == 0)
+		if (!srcBadBlocks[currBlock])
 		{
 			if (pMapping[currBlock]!=0xffff)
 			{
@@ -350,39 +398,131 @@ static const unsigned short* CreateBlockMapping(const MtdPartition* pSrcPart, in
 			{
 				fprintf(stderr, "Consistency error: Bad block has no mapping entry \n");
 				mappingValid = 0;
-			} else
+				continue;
+			}
+			if (reservoirReadCtx == NULL)
+				reservoirReadCtx = bml_over_mtd_read_partition(pReservoirPart);
+			if (reservoirReadCtx == NULL)
 			{
-				BmlOverMtdReadContext* reservoirReadCtx = bml_over_mtd_read_partition(pReservoirPart);
-				if (reservoirReadCtx == 0)
-				{
-					fprintf(stderr, "Reservoir partition cannot be opened for reading in consistency check.\n");
-					mappingValid = 0;
-				} else
-				{
-					pos = lseek64(reservoirReadCtx->fd, pMapping[currBlock]*erase, SEEK_SET);
-					mgbb = ioctl(reservoirReadCtx->fd, MEMGETBADBLOCK, &pos);
-					if (mgbb == 0)
-					{
-						printf("Bad block has properly mapped reservoir block %d -> %d\n",currBlock, pMapping[currBlock]);
-					}
-					else
-					{
-						fprintf(stderr, "Consistency error: Mapped block is bad, too. (%d -> %d)\n",currBlock, pMapping[currBlock]);
-						mappingValid = 0;
-					}
-
-				}
-				bml_over_mtd_read_close(reservoirReadCtx);
+				fprintf(stderr, "Reservoir partition cannot be opened for reading in consistency check.\n");
+				mappingValid = 0;
+				break;
 			}
+			loff_t pos = (loff_t)pMapping[currBlock]*erase;
+			int mgbb = ioctl(reservoirReadCtx->fd, MEMGETBADBLOCK, &pos);
+			if (mgbb == 0)
+			{
+				printf("Bad block has properly mapped reservoir block %d -> %d\n",currBlock, pMapping[currBlock]);
+			}
+			else
+			{
+				fprintf(stderr, "Consistency error: Mapped block is bad, too. (%d -> %d)\n",currBlock, pMapping[currBlock]);
+				mappingValid = 0;
+			}
+		}
+	}
+	if (reservoirReadCtx != NULL)
+		bml_over_mtd_read_close(reservoirReadCtx);
+	return mappingValid;
+}
 
+static const unsigned short* CreateBlockMapping(const MtdPartition* pSrcPart, int srcPartStartBlock,
+		const unsigned char* srcBadBlocks, const MtdPartition *pReservoirPart, int reservoirPartStartBlock)
+{
+	size_t srcTotal, srcErase, srcWrite;
+	if (mtd_partition_info(pSrcPart, &srcTotal, &srcErase, &srcWrite) != 0)
+	{
+		fprintf(stderr, "Failed to access partition.\n");
+		return NULL;
+	}
+
+	int numSrcBlocks = srcTotal/srcErase;
+
+	unsigned short* pMapping = malloc(numSrcBlocks * sizeof(unsigned short));
+	if (pMapping == NULL)
+	{
+		fprintf(stderr, "Failed to allocate block mapping memory.\n");
+		return NULL;
+	}
+
+	size_t total, erase, write;
+	if (mtd_partition_info(pReservoirPart, &total, &erase, &write) != 0)
+	{
+		fprintf(stderr, "Failed to access reservoir partition.\n");
+		free(pMapping);
+		return NULL;
+	}
+
+	if (erase != srcErase || write != srcWrite)
+	{
+		fprintf(stderr, "Source partition and reservoir partition differ in size properties.\n");
+		free(pMapping);
+		return NULL;
+	}
+
+	printf("Partition info: Total %d, Erase %d, write %d\n", total, erase, write);
+
+	if (total < erase || total > INT_MAX || erase < MAPPING_HEADER_SIZE)
+	{
+		fprintf(stderr, "Unsuitable reservoir partition properties.\n");
+		free(pMapping);
+		return NULL;
+	}
+
+	BmlOverMtdReadContext *readctx = bml_over_mtd_read_partition(pReservoirPart);
+	if (readctx == NULL)
+	{
+		fprintf(stderr, "Failed to open reservoir partition for reading.\n");
+		free(pMapping);
+		return NULL;
+	}
+
+	//Try the table's last known location first; search the whole reservoir
+	//only if the block there changed or the table no longer fits the bad blocks.
+	int pass;
+	int mappingValid = 0;
+	for (pass = 0; pass < 2 && !mappingValid; ++pass)
+	{
+		int tableOffset;
+		if (pass == 0)
+		{
+			tableOffset = LoadCachedMappingTable(pReservoirPart, readctx->fd,
+					total, erase, readctx->buffer);
+			if (tableOffset < 0)
+				continue;
+		} else
+		{
+			tableOffset = FindMappingTable(readctx->fd, total, erase, readctx->buffer);
+			if (tableOffset < 0)
+			{
+				if (tableOffset == -1)
+					fprintf(stderr, "Cannot find mapping table in reservoir partition.\n");
+				break;
+			}
 		}
 
+		memset(pMapping, 0xFF, numSrcBlocks * sizeof(unsigned short));
+		if (!ParseMappingTable(readctx->buffer, pMapping, numSrcBlocks,
+				srcPartStartBlock, reservoirPartStartBlock, tableOffset, erase))
+		{
+			if (pass == 0)
+				continue;
+			fprintf(stderr, "Cannot find mapping table in reservoir partition.\n");
+			break;
+		}
+
+		//Consistency and validity check
+		mappingValid = CheckBlockMapping(pMapping, numSrcBlocks, srcBadBlocks,
+				pReservoirPart, erase);
+		if (mappingValid && pass == 1)
+			StoreCachedMappingTable(pReservoirPart, total, erase, tableOffset,
+					readctx->buffer);
 	}
 	bml_over_mtd_read_close(readctx);
 
-
 	if (!mappingValid)
 	{
+		ForgetCachedMappingTable(pReservoirPart);
 		free(pMapping);
 		return NULL;
 	}
@@ -699,8 +839,11 @@ static int flash_bml_partition(const MtdPartition* pSrcPart, const MtdPartition*
 	return 0;
 }
 
-static int scan_partition(const MtdPartition* pPart)
+//Check every block of the partition, noting bad ones in *pBadBlocks
+//(one byte per erase block) for the consistency check.
+static int scan_partition(const MtdPartition* pPart, unsigned char** pBadBlocks)
 {
+	*pBadBlocks = NULL;
 	BmlOverMtdReadContext* readCtx = bml_over_mtd_read_partition(pPart);
 	if (readCtx == NULL)
 	{
@@ -710,6 +853,13 @@ static int scan_partition(const MtdPartition* pPart)
 
 	int numBadBlocks = 0;
 	size_t numBlocks = pPart->size / pPart->erase_size;
+	unsigned char* badBlocks = calloc(numBlocks, 1);
+	if (badBlocks == NULL)
+	{
+		fprintf(stderr, "Failed to allocate bad block list.\n");
+		bml_over_mtd_read_close(readCtx);
+		return -1;
+	}
 	size_t currBlock;
 	for (currBlock = 0; currBlock < numBlocks; ++currBlock)
 	{
@@ -719,11 +869,13 @@ static int scan_partition(const MtdPartition* pPart)
 		if (mgbb != 0)
 		{
 			printf("Bad block %d at 0x%x.\n", currBlock, (unsigned int)pos);
+			badBlocks[currBlock] = 1;
 			numBadBlocks++;
 		}
 	}
 
 	bml_over_mtd_read_close(readCtx);
+	*pBadBlocks = badBlocks;
 	if (numBadBlocks == 0)
 	{
 		printf("No bad blocks.\n");
@@ -745,22 +897,30 @@ int main(int argc, char **argv)
 	if (pSrcPart == NULL)
 		return die("Cannot find partition %s", argv[2]);
 
-	int scanResult = scan_partition(pSrcPart);
+	unsigned char* srcBadBlocks;
+	int scanResult = scan_partition(pSrcPart, &srcBadBlocks);
 
 	if (argc == 3 && strcmp(argv[1],"scan")==0)
 	{
+		free(srcBadBlocks);
 		return (scanResult == 0 ? 0 : EXIT_CODE_BAD_BLOCKS);
 	}
+	if (srcBadBlocks == NULL)
+		return die("Failed to scan partition %s", argv[2]);
 
 	int retVal = 0;
 	const MtdPartition* pReservoirPart = mtd_find_partition_by_name(argv[4]);
 	if (pReservoirPart == NULL)
+	{
+		free(srcBadBlocks);
 		return die("Cannot find partition %s", argv[4]);
+	}
 
 	int srcPartStartBlock = atoi(argv[3]);
 	int reservoirPartStartBlock = atoi(argv[5]);
 	const unsigned short* pMapping = CreateBlockMapping(pSrcPart, srcPartStartBlock,
-			pReservoirPart, reservoirPartStartBlock);
+			srcBadBlocks, pReservoirPart, reservoirPartStartBlock);
+	free(srcBadBlocks);
 
 	if (pMapping == NULL && scanResult == 0)
 	{
@@ -0,0 +1,918 @@
+/*
+ * Copyright (C) 2014 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Measure mtdutils erase, write and read throughput, and check that the
+ * data read back is what the library's bad-block handling should give.
+ *
+ * By default the partition is an in-process fake: a file behind a fake
+ * /proc/mtd, with read(), pread64(), write() and ioctl() wrapped at link
+ * time so
+ * that MEMGETINFO, MEMERASE, MEMGETBADBLOCK, MEMSETBADBLOCK and
+ * ECCGETSTATS behave like NAND (programming only clears bits, erased
+ * blocks read as 0xff).  Bad blocks, ECC errors and program failures
+ * can be injected, and per-erase-block latencies simulated:
+ *
+ *   mtdutils_bench -s 64 -e 128 -b 3 -c 4 -f 1 -t 1600,16000,2000
+ *
+ * With -d, a real partition from /proc/mtd is used instead, e.g. one
+ * made by nandsim on a desktop kernel.  Its whole contents are
+ * destroyed:
+ *
+ *   modprobe nandsim first_id_byte=0x20 second_id_byte=0xaa \
+ *       third_id_byte=0x00 fourth_id_byte=0x15 parts=256
+ *   mtdutils_bench -D /dev/mtd%d -d NAND\ simulator\ partition\ 0
+ *
+ * ECC errors can't be injected into a real device from here; use
+ * nandsim's bitflips= and badblocks= parameters for that.
+ *
+ * mtdutils_bench -T runs a fixed set of fake-device cases and exits
+ * non-zero if any of them reads back the wrong data.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <mtd/mtd-user.h>
+
+#include "mtdutils.h"
+
+// Declared in flashutils/flashutils.h.
+extern int cmd_mtd_backup_raw_partition(const char *partition, const char *filename);
+
+#define FAKE_NAME           "bench"
+
+// Per-block state of the fake device.
+#define BLOCK_BAD           0x01
+#define BLOCK_ECC_SOFT      0x02    // every read reports a corrected bitflip
+#define BLOCK_ECC_HARD      0x04    // every read reports an uncorrectable error
+#define BLOCK_PROG_FAIL     0x08    // programming corrupts the data
+
+typedef struct {
+    int active;
+    char dir[PATH_MAX / 2];
+    char image[PATH_MAX];
+    dev_t dev;
+    ino_t ino;
+
+    size_t size;
+    size_t erase_size;
+    size_t write_size;
+    unsigned char *flags;           // one per erase block
+    struct mtd_ecc_stats ecc;
+
+    // Simulated time per erase block, in microseconds.
+    unsigned read_us;
+    unsigned prog_us;
+    unsigned erase_us;
+} FakeMtd;
+
+// Syscalls made against the partition, fake or real.
+typedef struct {
+    unsigned long reads;
+    unsigned long writes;
+    unsigned long erases;
+    unsigned long getbadblock;
+    unsigned long eccstats;
+} OpCounts;
+
+static FakeMtd g_fake;
+static OpCounts g_ops;
+
+// The simulated latencies hold this, like the one chip behind an MTD
+// device: an erase can't overlap a program, but the CPU can keep busy.
+static pthread_mutex_t g_chip = PTHREAD_MUTEX_INITIALIZER;
+
+ssize_t __real_read(int fd, void *buf, size_t count);
+ssize_t __real_pread64(int fd, void *buf, size_t count, off64_t offset);
+ssize_t __real_write(int fd, const void *buf, size_t count);
+int __real_ioctl(int fd, unsigned long request, void *arg);
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fake_delay(unsigned us_per_block, size_t bytes)
+{
+    if (us_per_block == 0) return;
+    unsigned long long ns =
+        (unsigned long long) us_per_block * 1000 * bytes / g_fake.erase_size;
+    struct timespec ts = { ns / 1000000000, ns % 1000000000 };
+    pthread_mutex_lock(&g_chip);
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+    pthread_mutex_unlock(&g_chip);
+}
+
+// Stand in for the caller's own work between writes (reading or
+// inflating the image), which the flash can overlap.
+static void caller_delay(unsigned us)
+{
+    struct timespec ts = { us / 1000000, (us % 1000000) * 1000 };
+    while (us > 0 && nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+}
+
+static int is_fake(int fd)
+{
+    struct stat st;
+    return g_fake.active && fstat(fd, &st) == 0 &&
+            st.st_dev == g_fake.dev && st.st_ino == g_fake.ino;
+}
+
+// Steps b through each erase block that [pos, pos+len) touches.
+#define FOR_EACH_BLOCK(pos, len, b) \
+    for (b = (pos) / g_fake.erase_size; \
+         (len) > 0 && b <= ((pos) + (len) - 1) / g_fake.erase_size; ++b)
+
+static void fake_read_done(off64_t pos, ssize_t r)
+{
+    ++g_ops.reads;
+    if (r > 0) {
+        size_t b;
+        FOR_EACH_BLOCK((size_t) pos, (size_t) r, b) {
+            if (g_fake.flags[b] & BLOCK_ECC_HARD) ++g_fake.ecc.failed;
+            if (g_fake.flags[b] & BLOCK_ECC_SOFT) ++g_fake.ecc.corrected;
+        }
+        fake_delay(g_fake.read_us, r);
+    }
+}
+
+ssize_t __wrap_read(int fd, void *buf, size_t count)
+{
+    if (!is_fake(fd)) return __real_read(fd, buf, count);
+
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    ssize_t r = __real_read(fd, buf, count);
+    fake_read_done(pos, r);
+    return r;
+}
+
+ssize_t __wrap_pread64(int fd, void *buf, size_t count, off64_t offset)
+{
+    if (!is_fake(fd)) return __real_pread64(fd, buf, count, offset);
+
+    ssize_t r = __real_pread64(fd, buf, count, offset);
+    fake_read_done(offset, r);
+    return r;
+}
+
+// NAND programming can only clear bits; a block has to be erased to
+// get them back.
+ssize_t __wrap_write(int fd, const void *buf, size_t count)
+{
+    if (!is_fake(fd)) return __real_write(fd, buf, count);
+
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    if (pos < 0 || (size_t) pos + count > g_fake.size) {
+        errno = ENOSPC;
+        return -1;
+    }
+    ++g_ops.writes;
+
+    unsigned char *merged = malloc(count);
+    if (merged == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (pread(fd, merged, count, pos) != (ssize_t) count) {
+        free(merged);
+        errno = EIO;
+        return -1;
+    }
+    size_t i;
+    for (i = 0; i < count; ++i) {
+        merged[i] &= ((const unsigned char *) buf)[i];
+    }
+    size_t b;
+    FOR_EACH_BLOCK((size_t) pos, count, b) {
+        if (g_fake.flags[b] & BLOCK_PROG_FAIL) {
+            size_t off = b * g_fake.erase_size > (size_t) pos ?
+                    b * g_fake.erase_size - pos : 0;
+            merged[off] ^= 0x01;
+        }
+    }
+    ssize_t r = __real_write(fd, merged, count);
+    free(merged);
+    fake_delay(g_fake.prog_us, count);
+    return r;
+}
+
+static int fake_erase(int fd, const struct erase_info_user *ei)
+{
+    ++g_ops.erases;
+    if (ei->start % g_fake.erase_size || ei->length % g_fake.erase_size ||
+        (size_t) ei->start + ei->length > g_fake.size) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    unsigned char *ff = malloc(g_fake.erase_size);
+    if (ff == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(ff, 0xff, g_fake.erase_size);
+
+    size_t pos;
+    int ret = 0;
+    for (pos = ei->start; pos < ei->start + ei->length;
+         pos += g_fake.erase_size) {
+        if (g_fake.flags[pos / g_fake.erase_size] & BLOCK_BAD) {
+            errno = EIO;
+            ret = -1;
+            break;
+        }
+        if (pwrite(fd, ff, g_fake.erase_size, pos) !=
+                (ssize_t) g_fake.erase_size) {
+            errno = EIO;
+            ret = -1;
+            break;
+        }
+        fake_delay(g_fake.erase_us, g_fake.erase_size);
+    }
+    free(ff);
+    return ret;
+}
+
+static int fake_block_index(const loff_t *ofs, size_t *b)
+{
+    if (*ofs < 0 || (size_t) *ofs >= g_fake.size) {
+        errno = EINVAL;
+        return -1;
+    }
+    *b = *ofs / g_fake.erase_size;
+    return 0;
+}
+
+int __wrap_ioctl(int fd, unsigned long request, void *arg)
+{
+    if (request == MEMGETBADBLOCK) ++g_ops.getbadblock;
+    if (request == ECCGETSTATS) ++g_ops.eccstats;
+    if (request == MEMERASE && !is_fake(fd)) ++g_ops.erases;
+    if (!is_fake(fd)) return __real_ioctl(fd, request, arg);
+
+    size_t b;
+    switch (request) {
+        case MEMGETINFO: {
+            struct mtd_info_user *info = arg;
+            memset(info, 0, sizeof(*info));
+            info->type = MTD_NANDFLASH;
+            info->flags = MTD_CAP_NANDFLASH;
+            info->size = g_fake.size;
+            info->erasesize = g_fake.erase_size;
+            info->writesize = g_fake.write_size;
+            info->oobsize = g_fake.write_size / 32;
+            return 0;
+        }
+        case MEMERASE:
+            return fake_erase(fd, arg);
+        case MEMGETBADBLOCK:
+            if (fake_block_index(arg, &b)) return -1;
+            return (g_fake.flags[b] & BLOCK_BAD) ? 1 : 0;
+        case MEMSETBADBLOCK:
+            if (fake_block_index(arg, &b)) return -1;
+            g_fake.flags[b] |= BLOCK_BAD;
+            return 0;
+        case ECCGETSTATS:
+            memcpy(arg, &g_fake.ecc, sizeof(g_fake.ecc));
+            return 0;
+    }
+    errno = ENOTTY;
+    return -1;
+}
+
+// Create the fake device and point mtdutils at it.  Its blocks start
+// out erased.
+static int fake_create(size_t size, size_t erase_size, size_t write_size)
+{
+    const char *tmp = getenv("TMPDIR");
+    snprintf(g_fake.dir, sizeof(g_fake.dir), "%s/mtdbench.XXXXXX",
+            tmp ? tmp : "/tmp");
+    if (mkdtemp(g_fake.dir) == NULL) {
+        fprintf(stderr, "can't create %s: %s\n", g_fake.dir, strerror(errno));
+        return -1;
+    }
+
+    char proc[PATH_MAX];
+    snprintf(proc, sizeof(proc), "%s/mtd", g_fake.dir);
+    FILE *f = fopen(proc, "w");
+    if (f == NULL) return -1;
+    fprintf(f, "dev:    size   erasesize  name\n");
+    fprintf(f, "mtd0: %08zx %08zx \"%s\"\n", size, erase_size, FAKE_NAME);
+    fclose(f);
+
+    snprintf(g_fake.image, sizeof(g_fake.image), "%s/mtd0", g_fake.dir);
+    int fd = open(g_fake.image, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) return -1;
+    unsigned char *ff = malloc(erase_size);
+    memset(ff, 0xff, erase_size);
+    size_t pos;
+    for (pos = 0; pos < size; pos += erase_size) {
+        if (write(fd, ff, erase_size) != (ssize_t) erase_size) {
+            fprintf(stderr, "can't write %s: %s\n", g_fake.image,
+                    strerror(errno));
+            free(ff);
+            close(fd);
+            return -1;
+        }
+    }
+    free(ff);
+
+    struct stat st;
+    fstat(fd, &st);
+    close(fd);
+
+    g_fake.dev = st.st_dev;
+    g_fake.ino = st.st_ino;
+    g_fake.size = size;
+    g_fake.erase_size = erase_size;
+    g_fake.write_size = write_size;
+    g_fake.flags = calloc(size / erase_size, 1);
+    memset(&g_fake.ecc, 0, sizeof(g_fake.ecc));
+    g_fake.active = 1;
+
+    char device_format[PATH_MAX];
+    snprintf(device_format, sizeof(device_format), "%s/mtd%%d", g_fake.dir);
+    mtd_set_paths(strdup(proc), strdup(device_format));
+    return 0;
+}
+
+static void fake_destroy(void)
+{
+    char path[PATH_MAX];
+    unlink(g_fake.image);
+    snprintf(path, sizeof(path), "%s/mtd", g_fake.dir);
+    unlink(path);
+    rmdir(g_fake.dir);
+    free(g_fake.flags);
+    memset(&g_fake, 0, sizeof(g_fake));
+    mtd_set_paths(NULL, NULL);
+}
+
+// Set 'flag' on 'count' blocks that have no injected state yet.
+static void fake_inject(unsigned char flag, int count)
+{
+    size_t blocks = g_fake.size / g_fake.erase_size;
+    while (count-- > 0) {
+        size_t b;
+        do {
+            b = rand() % blocks;
+        } while (g_fake.flags[b] != 0);
+        g_fake.flags[b] = flag;
+    }
+}
+
+typedef struct {
+    const char *partition;
+    const char *device_format;
+    size_t chunk;           // bytes per mtd_read_data/mtd_write_data call
+    size_t tail;            // leave the last block this many bytes short
+    int bad;                // blocks to mark bad with MEMSETBADBLOCK
+    int no_verify;          // mtd_write_set_verify(ctx, 0)
+    size_t read_window;     // mtd_read_set_window(), if not 0
+    unsigned caller_us;     // simulated caller work per write call
+    int erased;             // percent of the data's blocks left all 0xff
+} BenchConfig;
+
+static void report(const char *name, size_t bytes, double elapsed,
+        const OpCounts *before)
+{
+    printf("  %-6s %10zu bytes %8.3f s %8.1f MB/s   "
+            "read %lu write %lu erase %lu getbad %lu eccstats %lu\n",
+            name, bytes, elapsed,
+            elapsed > 0 ? bytes / elapsed / (1024 * 1024) : 0,
+            g_ops.reads - before->reads, g_ops.writes - before->writes,
+            g_ops.erases - before->erases,
+            g_ops.getbadblock - before->getbadblock,
+            g_ops.eccstats - before->eccstats);
+}
+
+static int is_erased(const char *data, size_t len)
+{
+    size_t i;
+    for (i = 0; i < len; ++i) {
+        if ((unsigned char) data[i] != 0xff) return 0;
+    }
+    return 1;
+}
+
+// What mtd_read_data() should return after 'data' was written with
+// write_block()'s rules: bad blocks and blocks that failed to program
+// are skipped (the latter left erased and remembered as bad; erased
+// data is never programmed, so can't fail), and the read then skips
+// those and blocks whose reads fail ECC.  *readable is set to the
+// number of blocks a read of the whole partition returns.
+static char *expected_read(const unsigned char *state, size_t blocks,
+        size_t erase_size, const char *data, size_t len, size_t *readable)
+{
+    char *expect = malloc(len);
+    char *block = malloc(erase_size);
+    size_t logical = 0;     // next block of 'data' to place
+    size_t out = 0;
+    size_t b;
+    *readable = 0;
+    for (b = 0; b < blocks; ++b) {
+        if (state[b] & BLOCK_BAD) continue;
+
+        int placed = logical * erase_size < len;
+        if (placed) {
+            size_t n = len - logical * erase_size;
+            if (n > erase_size) n = erase_size;
+            memcpy(block, data + logical * erase_size, n);
+            memset(block + n, 0, erase_size - n);   // mtd_write_close() pad
+        } else {
+            memset(block, 0xff, erase_size);
+        }
+        int prog_failed = (state[b] & BLOCK_PROG_FAIL) &&
+                !is_erased(block, erase_size);
+        if (prog_failed) {
+            memset(block, 0xff, erase_size);
+        } else if (placed) {
+            ++logical;
+        }
+
+        if ((state[b] & BLOCK_ECC_HARD) || prog_failed) continue;
+        ++*readable;
+        if (out == len) continue;
+        size_t n = len - out < erase_size ? len - out : erase_size;
+        memcpy(expect + out, block, n);
+        out += n;
+    }
+    free(block);
+    if (out < len) {
+        free(expect);
+        return NULL;
+    }
+    return expect;
+}
+
+// Mark cfg->bad more blocks bad, and return each block's state: whether
+// the driver says it's bad, plus whatever was injected into the fake.
+static unsigned char *probe_blocks(const BenchConfig *cfg,
+        const MtdPartition *p, size_t blocks, size_t erase_size)
+{
+    char devname[PATH_MAX];
+    snprintf(devname, sizeof(devname), cfg->device_format,
+            mtd_get_index_by_name(cfg->partition));
+    int fd = open(devname, O_RDWR);
+    if (fd < 0) {
+        fprintf(stderr, "can't open %s: %s\n", devname, strerror(errno));
+        return NULL;
+    }
+
+    unsigned char *state = calloc(blocks, 1);
+    size_t b;
+    for (b = 0; b < blocks; ++b) {
+        loff_t pos = (loff_t) b * erase_size;
+        if (ioctl(fd, MEMGETBADBLOCK, &pos) > 0) state[b] |= BLOCK_BAD;
+        if (g_fake.active) state[b] |= g_fake.flags[b];
+    }
+
+    int bad = cfg->bad;
+    while (bad > 0) {
+        b = rand() % blocks;
+        if (state[b] != 0) continue;
+        loff_t pos = (loff_t) b * erase_size;
+        if (ioctl(fd, MEMSETBADBLOCK, &pos) < 0) {
+            fprintf(stderr, "can't mark block %zu bad: %s\n", b,
+                    strerror(errno));
+            break;
+        }
+        state[b] |= BLOCK_BAD;
+        --bad;
+    }
+    close(fd);
+    return state;
+}
+
+// Check that every good block of the fake reads back erased.
+static int fake_check_erased(const unsigned char *state)
+{
+    int fd = open(g_fake.image, O_RDONLY);
+    unsigned char *buf = malloc(g_fake.erase_size);
+    size_t b, i;
+    int ret = 0;
+    for (b = 0; b < g_fake.size / g_fake.erase_size && ret == 0; ++b) {
+        if (state[b] & BLOCK_BAD) continue;
+        pread(fd, buf, g_fake.erase_size, b * g_fake.erase_size);
+        for (i = 0; i < g_fake.erase_size; ++i) {
+            if (buf[i] != 0xff) {
+                printf("  block %zu not erased\n", b);
+                ret = 1;
+                break;
+            }
+        }
+    }
+    free(buf);
+    close(fd);
+    return ret;
+}
+
+// Back the partition up with cmd_mtd_backup_raw_partition() (as
+// dump_image does) and check the image against what was read back: the
+// same data, followed by the rest of the readable blocks.
+static int check_backup(const char *partition, const char *expect,
+        size_t len, size_t readable_size)
+{
+    char image[PATH_MAX];
+    snprintf(image, sizeof(image), "%s/backup.img", g_fake.dir);
+    OpCounts before = g_ops;
+    double start = now();
+    if (cmd_mtd_backup_raw_partition(partition, image) != 0) {
+        printf("  backup failed\n");
+        return 1;
+    }
+    report("backup", readable_size, now() - start, &before);
+
+    int ret = 0;
+    char *got = malloc(len);
+    int fd = open(image, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || got == NULL) {
+        printf("  can't read %s\n", image);
+        ret = 1;
+    } else if ((size_t) st.st_size != readable_size) {
+        printf("  backup is %lld bytes, expected %zu\n",
+                (long long) st.st_size, readable_size);
+        ret = 1;
+    } else if (read(fd, got, len) != (ssize_t) len ||
+            memcmp(got, expect, len) != 0) {
+        printf("  backup differs from the data read back\n");
+        ret = 1;
+    }
+    if (fd >= 0) close(fd);
+    free(got);
+    unlink(image);
+    return ret;
+}
+
+// Erase, write and read back the whole partition, reporting the speed
+// of each.  Return 0 if everything worked and the data read back is
+// what expected_read() predicts.
+static int run_bench(const BenchConfig *cfg)
+{
+    if (mtd_scan_partitions() <= 0) {
+        fprintf(stderr, "error scanning partitions\n");
+        return -1;
+    }
+    const MtdPartition *p = mtd_find_partition_by_name(cfg->partition);
+    if (p == NULL) {
+        fprintf(stderr, "can't find %s partition\n", cfg->partition);
+        return -1;
+    }
+    size_t total_size, erase_size, write_size;
+    if (mtd_partition_info(p, &total_size, &erase_size, &write_size)) {
+        fprintf(stderr, "can't get info of partition %s\n", cfg->partition);
+        return -1;
+    }
+    size_t blocks = total_size / erase_size;
+    size_t chunk = cfg->chunk ? cfg->chunk : erase_size;
+
+    unsigned char *state = probe_blocks(cfg, p, blocks, erase_size);
+    if (state == NULL) return -1;
+
+    // Write as much as will certainly fit and read back.
+    size_t writable = 0, readable = 0, b;
+    for (b = 0; b < blocks; ++b) {
+        if (!(state[b] & (BLOCK_BAD | BLOCK_PROG_FAIL))) ++writable;
+        if (!(state[b] & (BLOCK_BAD | BLOCK_ECC_HARD | BLOCK_PROG_FAIL))) {
+            ++readable;
+        }
+    }
+    size_t len = (writable < readable ? writable : readable) * erase_size;
+    len = len > cfg->tail ? len - cfg->tail : 0;
+
+    char *data = malloc(len);
+    char *back = malloc(len);
+    for (b = 0; b < len; ++b) {
+        data[b] = rand();
+    }
+    for (b = 0; b < len; b += erase_size) {
+        if (rand() % 100 < cfg->erased) {
+            memset(data + b, 0xff, len - b < erase_size ? len - b : erase_size);
+        }
+    }
+
+    printf("%s: %zu blocks of %zu bytes (page %zu), %zu bytes in %zu-byte "
+            "calls\n", cfg->partition, blocks, erase_size, write_size,
+            len, chunk);
+
+    int ret = 0;
+    OpCounts before;
+    double start;
+    size_t done;
+
+    MtdWriteContext *out = mtd_write_partition(p);
+    before = g_ops;
+    start = now();
+    if (out == NULL || mtd_erase_blocks(out, -1) == (off_t) -1 ||
+        mtd_write_close(out) != 0) {
+        printf("  erase failed\n");
+        ret = 1;
+        goto done;
+    }
+    report("erase", total_size, now() - start, &before);
+    if (g_fake.active && fake_check_erased(state)) {
+        ret = 1;
+        goto done;
+    }
+
+    out = mtd_write_partition(p);
+    if (out != NULL && cfg->no_verify) mtd_write_set_verify(out, 0);
+    before = g_ops;
+    start = now();
+    for (done = 0; out != NULL && done < len; done += chunk) {
+        size_t n = len - done < chunk ? len - done : chunk;
+        caller_delay(cfg->caller_us);
+        if (mtd_write_data(out, data + done, n) != (ssize_t) n) break;
+    }
+    if (out == NULL || done < len || mtd_write_close(out) != 0) {
+        printf("  write failed at %zu\n", done);
+        ret = 1;
+        goto done;
+    }
+    report("write", len, now() - start, &before);
+
+    MtdReadContext *in = mtd_read_partition(p);
+    if (in != NULL && cfg->read_window) {
+        mtd_read_set_window(in, cfg->read_window);
+    }
+    before = g_ops;
+    start = now();
+    for (done = 0; in != NULL && done < len; done += chunk) {
+        size_t n = len - done < chunk ? len - done : chunk;
+        if (mtd_read_data(in, back + done, n) != (ssize_t) n) break;
+    }
+    if (in != NULL) mtd_read_close(in);
+    if (in == NULL || done < len) {
+        printf("  read failed at %zu\n", done);
+        ret = 1;
+        goto done;
+    }
+    report("read", len, now() - start, &before);
+
+    size_t readable_blocks;
+    char *expect = expected_read(state, blocks, erase_size, data, len,
+            &readable_blocks);
+    if (expect == NULL || memcmp(expect, back, len) != 0) {
+        for (done = 0; expect != NULL && expect[done] == back[done]; ++done)
+            ;
+        printf("  data read back differs at %zu\n", done);
+        ret = 1;
+    }
+    if (ret == 0 && g_fake.active &&
+        check_backup(cfg->partition, back, len, readable_blocks * erase_size)) {
+        ret = 1;
+    }
+    free(expect);
+
+done:
+    free(data);
+    free(back);
+    free(state);
+    return ret;
+}
+
+typedef struct {
+    const char *name;
+    size_t chunk;
+    size_t tail;
+    int bad, soft, hard, prog;
+    int no_verify;
+    size_t read_window;
+    int erased;
+} RegressionCase;
+
+static const RegressionCase regression_cases[] = {
+    { "clean",              0,     0,   0, 0, 0, 0 },
+    { "partial calls",      3000,  1000, 0, 0, 0, 0 },
+    { "bad blocks",         8192,  0,   3, 0, 0, 0 },
+    { "corrected bitflips", 0,     0,   0, 4, 0, 0 },
+    { "ECC failures",       8192,  0,   0, 0, 2, 0 },
+    { "program failures",   0,     0,   0, 0, 0, 2 },
+    { "all of the above",   5000,  777, 2, 2, 2, 2 },
+    { "unverified writes",  8192,  0,   2, 2, 2, 0, 1 },
+    { "one-block reads",    0,     0,   2, 0, 2, 1, 0, 1 },
+    { "big reads",          3 << 20, 5, 2, 0, 3, 0, 0, 4 << 20 },
+    { "erased blocks",      0,     0,   2, 0, 1, 3, 0, 0, 50 },
+};
+
+typedef struct {
+    size_t left;
+    size_t most;            // bytes per call, if nonzero
+    size_t pos;
+} FillSource;
+
+static char fill_byte(size_t pos)
+{
+    return pos % 251;
+}
+
+static ssize_t fill_source(void *cookie, char *data, size_t len)
+{
+    FillSource *src = (FillSource *) cookie;
+    if (len > src->left) len = src->left;
+    if (src->most && len > src->most) len = src->most;
+    size_t i;
+    for (i = 0; i < len; ++i) {
+        data[i] = fill_byte(src->pos + i);
+    }
+    src->pos += len;
+    src->left -= len;
+    return len;
+}
+
+// A restore from a source returning odd-sized pieces must write them
+// all, in order, and pad the last block with zeros.
+static int check_restore_short_reads(void)
+{
+    if (fake_create(4 << 20, 128 << 10, 2048)) return 1;
+
+    printf("[restore in short reads]\n");
+    size_t len = 2 * g_fake.erase_size + g_fake.erase_size / 2;
+    size_t padded = 3 * g_fake.erase_size;
+    FillSource src = { len, 5000 };
+    int r = mtd_restore_partition(FAKE_NAME, fill_source, &src) != 0;
+
+    char *back = malloc(padded);
+    const MtdPartition *p = mtd_find_partition_by_name(FAKE_NAME);
+    MtdReadContext *in = p != NULL ? mtd_read_partition(p) : NULL;
+    if (back == NULL || in == NULL ||
+        mtd_read_data(in, back, padded) != (ssize_t) padded) {
+        printf("  read failed\n");
+        r = 1;
+    }
+    if (in != NULL) mtd_read_close(in);
+    size_t i;
+    for (i = 0; r == 0 && i < padded; ++i) {
+        if (back[i] != (i < len ? fill_byte(i) : 0)) {
+            printf("  data read back differs at %zu\n", i);
+            r = 1;
+        }
+    }
+    free(back);
+    printf("%s restore in short reads\n", r == 0 ? "PASS" : "FAIL");
+    fake_destroy();
+    return r;
+}
+
+// A restore onto a partition with no good blocks must fail, though the
+// writer thread reports that only when the write is closed.
+static int check_restore_all_bad(void)
+{
+    if (fake_create(4 << 20, 128 << 10, 2048)) return 1;
+    memset(g_fake.flags, BLOCK_BAD, g_fake.size / g_fake.erase_size);
+
+    printf("[restore onto bad blocks]\n");
+    FillSource src = { 2 * g_fake.erase_size };
+    int r = mtd_restore_partition(FAKE_NAME, fill_source, &src) != 0 ? 0 : 1;
+    printf("%s restore onto bad blocks\n", r == 0 ? "PASS" : "FAIL");
+    fake_destroy();
+    return r;
+}
+
+static int run_regression(void)
+{
+    int failed = 0;
+    size_t i;
+    for (i = 0; i < sizeof(regression_cases) / sizeof(regression_cases[0]);
+         ++i) {
+        const RegressionCase *rc = regression_cases + i;
+        srand(i + 1);
+        if (fake_create(4 << 20, 128 << 10, 2048)) return 1;
+        fake_inject(BLOCK_ECC_SOFT, rc->soft);
+        fake_inject(BLOCK_ECC_HARD, rc->hard);
+        fake_inject(BLOCK_PROG_FAIL, rc->prog);
+
+        BenchConfig cfg = { FAKE_NAME, "", rc->chunk, rc->tail, rc->bad,
+                            rc->no_verify, rc->read_window, 0, rc->erased };
+        char device_format[PATH_MAX];
+        snprintf(device_format, sizeof(device_format), "%s/mtd%%d",
+                g_fake.dir);
+        cfg.device_format = device_format;
+
+        printf("[%s]\n", rc->name);
+        int r = run_bench(&cfg);
+        printf("%s %s\n", r == 0 ? "PASS" : "FAIL", rc->name);
+        if (r != 0) ++failed;
+        fake_destroy();
+    }
+    failed += check_restore_all_bad();
+    failed += check_restore_short_reads();
+    printf("%d of %zu cases failed\n", failed,
+            sizeof(regression_cases) / sizeof(regression_cases[0]) + 2);
+    return failed != 0;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -d NAME      use the real MTD partition NAME (destroys it)\n"
+            "  -D FORMAT    device node format for -d (default /dev/mtd/mtd%%d)\n"
+            "  -s MB        fake device size (default 64)\n"
+            "  -e KB        fake erase block size (default 128)\n"
+            "  -w BYTES     fake page size (default 2048)\n"
+            "  -k BYTES     bytes per read/write call (default: erase block)\n"
+            "  -b N         mark N blocks bad before the run\n"
+            "  -c N         fake: N blocks report corrected bitflips\n"
+            "  -f N         fake: N blocks report uncorrectable ECC errors\n"
+            "  -p N         fake: N blocks fail to program\n"
+            "  -t R,P,E     fake: read/program/erase time per block in us\n"
+            "  -u US        caller work per write call in us\n"
+            "  -V           don't read back written blocks\n"
+            "  -r BYTES     read window (default 1 MB)\n"
+            "  -E PCT       leave this percentage of the data's blocks erased\n"
+            "  -S SEED      seed for picking injected blocks\n"
+            "  -T           run the regression cases and exit\n",
+            argv0);
+}
+
+int main(int argc, char **argv)
+{
+    BenchConfig cfg = { FAKE_NAME, "/dev/mtd/mtd%d", 0, 0, 0, 0, 0, 0, 0 };
+    const char *partition = NULL;
+    size_t size = 64 << 20, erase_size = 128 << 10, write_size = 2048;
+    int soft = 0, hard = 0, prog = 0;
+    unsigned read_us = 0, prog_us = 0, erase_us = 0;
+    int opt;
+
+    srand(1);
+    while ((opt = getopt(argc, argv, "d:D:s:e:w:k:b:c:f:p:t:u:Vr:E:S:T")) != -1) {
+        switch (opt) {
+            case 'd': partition = optarg; break;
+            case 'D': cfg.device_format = optarg; break;
+            case 's': size = strtoul(optarg, NULL, 0) << 20; break;
+            case 'e': erase_size = strtoul(optarg, NULL, 0) << 10; break;
+            case 'w': write_size = strtoul(optarg, NULL, 0); break;
+            case 'k': cfg.chunk = strtoul(optarg, NULL, 0); break;
+            case 'b': cfg.bad = atoi(optarg); break;
+            case 'c': soft = atoi(optarg); break;
+            case 'f': hard = atoi(optarg); break;
+            case 'p': prog = atoi(optarg); break;
+            case 't':
+                if (sscanf(optarg, "%u,%u,%u",
+                           &read_us, &prog_us, &erase_us) != 3) {
+                    usage(argv[0]);
+                    return 2;
+                }
+                break;
+            case 'u': cfg.caller_us = strtoul(optarg, NULL, 0); break;
+            case 'V': cfg.no_verify = 1; break;
+            case 'r': cfg.read_window = strtoul(optarg, NULL, 0); break;
+            case 'E': cfg.erased = atoi(optarg); break;
+            case 'S': srand(strtoul(optarg, NULL, 0)); break;
+            case 'T': return run_regression();
+            default: usage(argv[0]); return 2;
+        }
+    }
+    if (optind != argc || erase_size == 0 || size < erase_size ||
+        size % erase_size != 0 || (partition && (soft || hard || prog))) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    if (partition != NULL) {
+        cfg.partition = partition;
+        return run_bench(&cfg) != 0;
+    }
+
+    if (fake_create(size, erase_size, write_size)) return 1;
+    g_fake.read_us = read_us;
+    g_fake.prog_us = prog_us;
+    g_fake.erase_us = erase_us;
+    fake_inject(BLOCK_ECC_SOFT, soft);
+    fake_inject(BLOCK_ECC_HARD, hard);
+    fake_inject(BLOCK_PROG_FAIL, prog);
+
+    char device_format[PATH_MAX];
+    snprintf(device_format, sizeof(device_format), "%s/mtd%%d", g_fake.dir);
+    cfg.device_format = device_format;
+    int ret = run_bench(&cfg);
+    fake_destroy();
+    return ret != 0;
+}
@@ -20,6 +20,8 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
 #include <sys/mount.h>  // for _IOW, _IOR, mount()
 #include <sys/stat.h>
 #include <mtd/mtd-user.h>
@@ -28,85 +30,315 @@
 
 #include "mtdutils.h"
 
+// Reads of several good blocks in a row are done with one pread and
+// one ECCGETSTATS, up to this many bytes at a time by default.
+#define MTD_READ_WINDOW     (1 << 20)
+
 struct MtdReadContext {
     const MtdPartition *partition;
     char *buffer;
+    size_t buffer_len;          // bytes of buffer holding data
     size_t consumed;
     int fd;
+    loff_t pos;                 // next block to read
+    struct mtd_ecc_stats ecc;   // as of the end of the last block read
+
+    int window;                 // most blocks to read at once
+    int ahead;                  // blocks to read into buffer next time
+    int buffer_blocks;          // blocks buffer has room for
 };
 
+// Blocks that can be waiting for the flash at once.
+#define MTD_WRITE_QUEUE     2
+
 struct MtdWriteContext {
     const MtdPartition *partition;
     char *buffer;
     size_t stored;
     int fd;
 
-    off_t* bad_block_offsets;
+    loff_t* bad_block_offsets;
     int bad_block_alloc;
     int bad_block_count;
+
+    char *verify;           // read-back buffer, reused for every block
+    int verify_writes;
+
+    // Complete blocks are queued for a writer thread, which erases,
+    // programs and verifies them while the caller gets the next ones
+    // ready.  Only the writer touches the fd while blocks are queued.
+    char *queue[MTD_WRITE_QUEUE];
+    int queue_head;         // next block the writer takes
+    int queue_count;
+    int writer_error;       // errno of the first block that failed, or 0
+    int writer_state;       // 0 not started, 1 running, -1 unavailable
+    int writer_stop;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
 };
 
+/* The partition table only changes when the MTD drivers do, so
+ * /proc/mtd is parsed once; later scans just report what was found.
+ * Partitions stay at the same address until mtd_set_paths() is called.
+ */
 typedef struct {
-    MtdPartition *partitions;
+    MtdPartition *partitions;   // in /proc/mtd order
     int partitions_allocd;
-    int partition_count;
+    int partition_count;        // -1 until /proc/mtd has been read
+    int *name_hash;             // index into partitions, or -1 if empty
+    unsigned int name_hash_size;    // a power of two
 } MtdState;
 
 static MtdState g_mtd_state = {
     NULL,   // partitions
     0,      // partitions_allocd
-    -1      // partition_count
+    -1,     // partition_count
+    NULL,   // name_hash
+    0       // name_hash_size
 };
 
+static pthread_mutex_t g_mtd_lock = PTHREAD_MUTEX_INITIALIZER;
+
 #define MTD_PROC_FILENAME   "/proc/mtd"
+#define MTD_DEVICE_FORMAT   "/dev/mtd/mtd%d"
 
-int
-mtd_scan_partitions()
+static const char *g_mtd_proc_filename = MTD_PROC_FILENAME;
+static const char *g_mtd_device_format = MTD_DEVICE_FORMAT;
+
+static void mtd_forget_partitions(void);
+
+void
+mtd_set_paths(const char *proc_filename, const char *device_format)
+{
+    pthread_mutex_lock(&g_mtd_lock);
+    g_mtd_proc_filename = proc_filename ? proc_filename : MTD_PROC_FILENAME;
+    g_mtd_device_format = device_format ? device_format : MTD_DEVICE_FORMAT;
+    mtd_forget_partitions();
+    pthread_mutex_unlock(&g_mtd_lock);
+}
+
+static void
+mtd_device_name(char *buf, size_t len, const MtdPartition *partition)
+{
+    snprintf(buf, len, g_mtd_device_format, partition->device_index);
+}
+
+/* Each partition's bad blocks are looked up once, the first time any
+ * of them is needed, and kept in partition->bad_block_map (one bit per
+ * erase block) for as long as the partition table itself: /proc/mtd is
+ * only read once, so that's until mtd_set_paths() drops the table.
+ * Blocks that go bad after that are added by mtd_mark_block_bad().
+ */
+static pthread_mutex_t g_bad_block_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The kernel keeps a count of bad blocks in sysfs; when it says zero,
+ * there's nothing to ask about block by block.  Returns -1 if unknown.
+ */
+static int
+mtd_sysfs_bad_block_count(const MtdPartition *partition)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/class/mtd/mtd%d/bad_blocks",
+            partition->device_index);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return -1;
+    int count;
+    if (fscanf(f, "%d", &count) != 1) count = -1;
+    fclose(f);
+    return count;
+}
+
+static unsigned char *
+mtd_load_bad_block_map(MtdPartition *partition, int fd)
+{
+    const size_t blocks = partition->size / partition->erase_size;
+    unsigned char *map = calloc((blocks + 7) / 8, 1);
+    if (map == NULL) return NULL;
+
+    // sysfs only describes the partitions in the real /proc/mtd.
+    if (strcmp(g_mtd_proc_filename, MTD_PROC_FILENAME) == 0 &&
+        mtd_sysfs_bad_block_count(partition) == 0) {
+        return map;
+    }
+
+    size_t b;
+    for (b = 0; b < blocks; ++b) {
+        loff_t pos = (loff_t) b * partition->erase_size;
+        int ret = ioctl(fd, MEMGETBADBLOCK, &pos);
+        if (ret == -1 && errno == EOPNOTSUPP) break;  // NOR; never bad
+        if (ret != 0) {
+            fprintf(stderr,
+                    "mtd: MEMGETBADBLOCK returned %d at 0x%08llx (errno=%d)\n",
+                    ret, (long long) pos, errno);
+            map[b / 8] |= 1 << (b % 8);
+        }
+    }
+    return map;
+}
+
+static int
+mtd_block_is_bad(const MtdPartition *partition, int fd, loff_t pos)
+{
+    MtdPartition *p = (MtdPartition *) partition;
+    size_t b = pos / partition->erase_size;
+
+    pthread_mutex_lock(&g_bad_block_lock);
+    if (p->bad_block_map == NULL) {
+        p->bad_block_map = mtd_load_bad_block_map(p, fd);
+    }
+    int bad = p->bad_block_map != NULL &&
+            (p->bad_block_map[b / 8] & (1 << (b % 8)));
+    pthread_mutex_unlock(&g_bad_block_lock);
+    return bad;
+}
+
+/* Remember a block that failed to erase or program, so that later
+ * reads and writes through this partition skip it too.
+ */
+static void
+mtd_mark_block_bad(const MtdPartition *partition, loff_t pos)
+{
+    size_t b = pos / partition->erase_size;
+
+    pthread_mutex_lock(&g_bad_block_lock);
+    if (partition->bad_block_map != NULL) {
+        partition->bad_block_map[b / 8] |= 1 << (b % 8);
+    }
+    pthread_mutex_unlock(&g_bad_block_lock);
+}
+
+static unsigned int
+mtd_name_hash(const char *name)
+{
+    unsigned int h = 2166136261u;   // FNV-1a
+    while (*name) {
+        h = (h ^ (unsigned char) *name++) * 16777619u;
+    }
+    return h;
+}
+
+static void
+mtd_forget_partitions(void)
 {
-    char buf[2048];
-    const char *bufp;
-    int fd;
     int i;
-    ssize_t nbytes;
+    for (i = 0; i < g_mtd_state.partition_count; i++) {
+        free(g_mtd_state.partitions[i].name);
+        free(g_mtd_state.partitions[i].bad_block_map);
+    }
+    free(g_mtd_state.partitions);
+    free(g_mtd_state.name_hash);
+    g_mtd_state.partitions = NULL;
+    g_mtd_state.partitions_allocd = 0;
+    g_mtd_state.partition_count = -1;
+    g_mtd_state.name_hash = NULL;
+    g_mtd_state.name_hash_size = 0;
+}
 
-    if (g_mtd_state.partitions == NULL) {
-        const int nump = 32;
-        MtdPartition *partitions = malloc(nump * sizeof(*partitions));
-        if (partitions == NULL) {
-            errno = ENOMEM;
-            return -1;
+/* Read all of a /proc file, however long it is.  Returns a
+ * NUL-terminated buffer, or NULL.
+ */
+static char *
+mtd_read_proc(const char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    size_t alloc = 2048, len = 0;
+    char *buf = malloc(alloc);
+    while (buf != NULL) {
+        if (len + 1 == alloc) {
+            char *bigger = realloc(buf, alloc *= 2);
+            if (bigger == NULL) {
+                free(buf);
+                buf = NULL;
+                break;
+            }
+            buf = bigger;
         }
+        ssize_t nbytes = read(fd, buf + len, alloc - len - 1);
+        if (nbytes < 0 && errno == EINTR) continue;
+        if (nbytes < 0) {
+            free(buf);
+            buf = NULL;
+        } else if (nbytes == 0) {
+            buf[len] = '\0';
+            break;
+        }
+        len += nbytes;
+    }
+    close(fd);
+    return buf;
+}
+
+static int
+mtd_add_partition(int mtdnum, uint64_t size, unsigned int erase_size,
+        const char *name)
+{
+    if (g_mtd_state.partition_count == g_mtd_state.partitions_allocd) {
+        int nump = g_mtd_state.partitions_allocd ?
+                g_mtd_state.partitions_allocd * 2 : 32;
+        MtdPartition *partitions = realloc(g_mtd_state.partitions,
+                nump * sizeof(*partitions));
+        if (partitions == NULL) return -1;
         g_mtd_state.partitions = partitions;
         g_mtd_state.partitions_allocd = nump;
-        memset(partitions, 0, nump * sizeof(*partitions));
     }
-    g_mtd_state.partition_count = 0;
 
-    /* Initialize all of the entries to make things easier later.
-     * (Lets us handle sparsely-numbered partitions, which
-     * may not even be possible.)
-     */
-    for (i = 0; i < g_mtd_state.partitions_allocd; i++) {
-        MtdPartition *p = &g_mtd_state.partitions[i];
-        if (p->name != NULL) {
-            free(p->name);
-            p->name = NULL;
+    MtdPartition *p = &g_mtd_state.partitions[g_mtd_state.partition_count];
+    memset(p, 0, sizeof(*p));
+    p->device_index = mtdnum;
+    p->size = size;
+    p->erase_size = erase_size;
+    p->name = strdup(name);
+    if (p->name == NULL) return -1;
+    g_mtd_state.partition_count++;
+    return 0;
+}
+
+static int
+mtd_build_name_hash(void)
+{
+    unsigned int size = 16;
+    while (size < 2 * (unsigned int) g_mtd_state.partition_count) size *= 2;
+    int *hash = malloc(size * sizeof(*hash));
+    if (hash == NULL) return -1;
+    memset(hash, 0xff, size * sizeof(*hash));
+
+    int i;
+    for (i = 0; i < g_mtd_state.partition_count; i++) {
+        unsigned int h = mtd_name_hash(g_mtd_state.partitions[i].name);
+        while (hash[h & (size - 1)] >= 0) {
+            // Keep the first of any duplicate names, as the old linear
+            // search did.
+            if (strcmp(g_mtd_state.partitions[hash[h & (size - 1)]].name,
+                       g_mtd_state.partitions[i].name) == 0) {
+                break;
+            }
+            h++;
         }
-        p->device_index = -1;
+        if (hash[h & (size - 1)] < 0) hash[h & (size - 1)] = i;
     }
+    g_mtd_state.name_hash = hash;
+    g_mtd_state.name_hash_size = size;
+    return 0;
+}
 
-    /* Open and read the file contents.
-     */
-    fd = open(MTD_PROC_FILENAME, O_RDONLY);
-    if (fd < 0) {
-        goto bail;
+int
+mtd_scan_partitions()
+{
+    pthread_mutex_lock(&g_mtd_lock);
+    if (g_mtd_state.partition_count >= 0) {
+        int count = g_mtd_state.partition_count;
+        pthread_mutex_unlock(&g_mtd_lock);
+        return count;
     }
-    nbytes = read(fd, buf, sizeof(buf) - 1);
-    close(fd);
-    if (nbytes < 0) {
+
+    char *buf = mtd_read_proc(g_mtd_proc_filename);
+    if (buf == NULL) {
         goto bail;
     }
-    buf[nbytes] = '\0';
+    g_mtd_state.partition_count = 0;
 
     /* Parse the contents of the file, which looks like:
      *
@@ -118,85 +350,79 @@ mtd_scan_partitions()
      *     mtd3: 00200000 00020000 "0000000d"
      *     mtd4: 04000000 00020000 "system"
      *     mtd5: 03280000 00020000 "userdata"
+     *
+     * Sizes of 4 GB and up just get more digits.
      */
-    bufp = buf;
-    while (nbytes > 0) {
-        int mtdnum, mtdsize, mtderasesize;
-        int matches;
+    const char *bufp = buf;
+    while (*bufp != '\0') {
+        int mtdnum = -1;
+        unsigned long long mtdsize;
+        unsigned int mtderasesize;
         char mtdname[64];
         mtdname[0] = '\0';
-        mtdnum = -1;
 
-        matches = sscanf(bufp, "mtd%d: %x %x \"%63[^\"]",
+        int matches = sscanf(bufp, "mtd%d: %llx %x \"%63[^\"]",
                 &mtdnum, &mtdsize, &mtderasesize, mtdname);
         /* This will fail on the first line, which just contains
          * column headers.
          */
-        if (matches == 4) {
-            MtdPartition *p = &g_mtd_state.partitions[mtdnum];
-            p->device_index = mtdnum;
-            p->size = mtdsize;
-            p->erase_size = mtderasesize;
-            p->name = strdup(mtdname);
-            if (p->name == NULL) {
+        if (matches == 4 && mtderasesize != 0) {
+            if (mtd_add_partition(mtdnum, mtdsize, mtderasesize, mtdname)) {
                 errno = ENOMEM;
                 goto bail;
             }
-            g_mtd_state.partition_count++;
         }
 
         /* Eat the line.
          */
-        while (nbytes > 0 && *bufp != '\n') {
-            bufp++;
-            nbytes--;
-        }
-        if (nbytes > 0) {
-            bufp++;
-            nbytes--;
-        }
+        bufp = strchr(bufp, '\n');
+        if (bufp == NULL) break;
+        bufp++;
+    }
+    if (mtd_build_name_hash()) {
+        errno = ENOMEM;
+        goto bail;
     }
+    free(buf);
 
-    return g_mtd_state.partition_count;
+    int count = g_mtd_state.partition_count;
+    pthread_mutex_unlock(&g_mtd_lock);
+    return count;
 
 bail:
-    // keep "partitions" around so we can free the names on a rescan.
-    g_mtd_state.partition_count = -1;
+    free(buf);
+    mtd_forget_partitions();
+    pthread_mutex_unlock(&g_mtd_lock);
     return -1;
 }
 
 const MtdPartition *
 mtd_find_partition_by_name(const char *name)
 {
-    if (g_mtd_state.partitions != NULL) {
+    const MtdPartition *found = NULL;
+
+    pthread_mutex_lock(&g_mtd_lock);
+    if (g_mtd_state.name_hash != NULL) {
+        unsigned int mask = g_mtd_state.name_hash_size - 1;
+        unsigned int h = mtd_name_hash(name);
         int i;
-        for (i = 0; i < g_mtd_state.partitions_allocd; i++) {
-            MtdPartition *p = &g_mtd_state.partitions[i];
-            if (p->device_index >= 0 && p->name != NULL) {
-                if (strcmp(p->name, name) == 0) {
-                    return p;
-                }
+        while ((i = g_mtd_state.name_hash[h & mask]) >= 0) {
+            if (strcmp(g_mtd_state.partitions[i].name, name) == 0) {
+                found = &g_mtd_state.partitions[i];
+                break;
             }
+            h++;
         }
     }
-    return NULL;
+    pthread_mutex_unlock(&g_mtd_lock);
+    return found;
 }
 
 int
 mtd_get_index_by_name(const char *name)
 {
-    if (g_mtd_state.partitions != NULL) {
-        int i;
-        for (i = 0; i < g_mtd_state.partitions_allocd; i++) {
-            MtdPartition *p = &g_mtd_state.partitions[i];
-            if (p->device_index >= 0 && p->name != NULL) {
-                if (strcmp(p->name, name) == 0) {
-                    return p->device_index;
-                }
-            }
-        }
-    }
-    return -1;
+    const MtdPartition *p = mtd_find_partition_by_name(name);
+    return p != NULL ? p->device_index : -1;
 }
 
 int
@@ -248,8 +474,8 @@ int
 mtd_partition_info(const MtdPartition *partition,
         size_t *total_size, size_t *erase_size, size_t *write_size)
 {
-    char mtddevname[32];
-    sprintf(mtddevname, "/dev/mtd/mtd%d", partition->device_index);
+    char mtddevname[PATH_MAX];
+    mtd_device_name(mtddevname, sizeof(mtddevname), partition);
     int fd = open(mtddevname, O_RDONLY);
     if (fd < 0) return -1;
 
@@ -275,8 +501,8 @@ MtdReadContext *mtd_read_partition(const MtdPartition *partition)
         return NULL;
     }
 
-    char mtddevname[32];
-    sprintf(mtddevname, "/dev/mtd/mtd%d", partition->device_index);
+    char mtddevname[PATH_MAX];
+    mtd_device_name(mtddevname, sizeof(mtddevname), partition);
     ctx->fd = open(mtddevname, O_RDONLY);
     if (ctx->fd < 0) {
         free(ctx->buffer);
@@ -284,64 +510,149 @@ MtdReadContext *mtd_read_partition(const MtdPartition *partition)
         return NULL;
     }
 
+    if (ioctl(ctx->fd, ECCGETSTATS, &ctx->ecc)) {
+        fprintf(stderr, "mtd: ECCGETSTATS error (%s)\n", strerror(errno));
+        close(ctx->fd);
+        free(ctx->buffer);
+        free(ctx);
+        return NULL;
+    }
+
     ctx->partition = partition;
-    ctx->consumed = partition->erase_size;
+    ctx->buffer_len = 0;
+    ctx->consumed = 0;
+    ctx->pos = 0;
+    ctx->buffer_blocks = 1;
+    ctx->ahead = 1;
+    mtd_read_set_window(ctx, MTD_READ_WINDOW);
     return ctx;
 }
 
+void mtd_read_set_window(MtdReadContext *ctx, size_t bytes)
+{
+    ctx->window = bytes / ctx->partition->erase_size;
+    if (ctx->window < 1) ctx->window = 1;
+    if (ctx->ahead > ctx->window) ctx->ahead = ctx->window;
+}
+
 // Seeks to a location in the partition.  Don't mix with reads of
 // anything other than whole blocks; unpredictable things will result.
-void mtd_read_skip_to(const MtdReadContext* ctx, size_t offset) {
-    lseek64(ctx->fd, offset, SEEK_SET);
+void mtd_read_skip_to(MtdReadContext* ctx, off64_t offset) {
+    ctx->pos = offset;
+    ctx->buffer_len = ctx->consumed = 0;
 }
 
-static int read_block(const MtdPartition *partition, int fd, char *data)
+static int read_block(MtdReadContext *ctx, char *data)
 {
-    struct mtd_ecc_stats before, after;
-    if (ioctl(fd, ECCGETSTATS, &before)) {
-        fprintf(stderr, "mtd: ECCGETSTATS error (%s)\n", strerror(errno));
-        return -1;
-    }
-
-    loff_t pos = lseek64(fd, 0, SEEK_CUR);
+    const MtdPartition *partition = ctx->partition;
+    int fd = ctx->fd;
+    struct mtd_ecc_stats after;
 
     ssize_t size = partition->erase_size;
-    int mgbb;
 
-    while (pos + size <= (int) partition->size) {
-        if (lseek64(fd, pos, SEEK_SET) != pos || read(fd, data, size) != size) {
+    while (ctx->pos + size <= (loff_t) partition->size) {
+        loff_t pos = ctx->pos;
+        ctx->pos += size;
+
+        if (mtd_block_is_bad(partition, fd, pos)) {
+            fprintf(stderr, "mtd: skipping bad block at 0x%08llx\n", pos);
+        } else if (pread64(fd, data, size, pos) != size) {
             fprintf(stderr, "mtd: read error at 0x%08llx (%s)\n",
                     pos, strerror(errno));
         } else if (ioctl(fd, ECCGETSTATS, &after)) {
             fprintf(stderr, "mtd: ECCGETSTATS error (%s)\n", strerror(errno));
             return -1;
-        } else if (after.failed != before.failed) {
+        } else if (after.failed != ctx->ecc.failed) {
             fprintf(stderr, "mtd: ECC errors (%d soft, %d hard) at 0x%08llx\n",
-                    after.corrected - before.corrected,
-                    after.failed - before.failed, pos);
+                    after.corrected - ctx->ecc.corrected,
+                    after.failed - ctx->ecc.failed, pos);
             // copy the comparison baseline for the next read.
-            memcpy(&before, &after, sizeof(struct mtd_ecc_stats));
-        } else if ((mgbb = ioctl(fd, MEMGETBADBLOCK, &pos))) {
-            fprintf(stderr,
-                    "mtd: MEMGETBADBLOCK returned %d at 0x%08llx (errno=%d)\n",
-                    mgbb, pos, errno);
+            memcpy(&ctx->ecc, &after, sizeof(struct mtd_ecc_stats));
         } else {
+            memcpy(&ctx->ecc, &after, sizeof(struct mtd_ecc_stats));
             return 0;  // Success!
         }
-
-        pos += partition->erase_size;
     }
 
     errno = ENOSPC;
     return -1;
 }
 
+// Read up to 'max' blocks into 'data', skipping bad ones.  A run of
+// good blocks is read with one pread and checked with one ECCGETSTATS;
+// if the run had an ECC failure it is read again a block at a time, so
+// the failing block is skipped as read_block() always has.  Returns the
+// number of blocks read (at least one), or -1.
+static int read_blocks(MtdReadContext *ctx, char *data, int max)
+{
+    const MtdPartition *partition = ctx->partition;
+    const loff_t size = partition->erase_size;
+
+    while (ctx->pos + size <= (loff_t) partition->size &&
+           mtd_block_is_bad(partition, ctx->fd, ctx->pos)) {
+        fprintf(stderr, "mtd: skipping bad block at 0x%08llx\n", ctx->pos);
+        ctx->pos += size;
+    }
+
+    int n = 0;
+    while (n < max && ctx->pos + (n + 1) * size <= (loff_t) partition->size &&
+           !mtd_block_is_bad(partition, ctx->fd, ctx->pos + n * size)) {
+        ++n;
+    }
+
+    if (n > 1) {
+        struct mtd_ecc_stats after;
+        ssize_t want = n * size;
+        if (pread64(ctx->fd, data, want, ctx->pos) == want &&
+            ioctl(ctx->fd, ECCGETSTATS, &after) == 0) {
+            int failed = after.failed != ctx->ecc.failed;
+            memcpy(&ctx->ecc, &after, sizeof(struct mtd_ecc_stats));
+            if (!failed) {
+                ctx->pos += want;
+                return n;
+            }
+        }
+    }
+
+    int i;
+    for (i = 0; i < n || i == 0; ++i) {
+        if (read_block(ctx, data + i * size)) return i > 0 ? i : -1;
+    }
+    return i;
+}
+
+// Refill the buffer, reading further ahead each time the caller keeps
+// reading sequentially, so a short read near the start of a partition
+// (flash_image's header check) doesn't pull in a whole window.
+static int fill_buffer(MtdReadContext *ctx)
+{
+    if (ctx->ahead > ctx->buffer_blocks) {
+        char *buffer = realloc(ctx->buffer,
+                (size_t) ctx->ahead * ctx->partition->erase_size);
+        if (buffer != NULL) {
+            ctx->buffer = buffer;
+            ctx->buffer_blocks = ctx->ahead;
+        }
+    }
+
+    int n = read_blocks(ctx, ctx->buffer, ctx->buffer_blocks < ctx->ahead ?
+            ctx->buffer_blocks : ctx->ahead);
+    if (n < 0) return -1;
+    ctx->buffer_len = (size_t) n * ctx->partition->erase_size;
+    ctx->consumed = 0;
+
+    ctx->ahead *= 2;
+    if (ctx->ahead > ctx->window) ctx->ahead = ctx->window;
+    return 0;
+}
+
 ssize_t mtd_read_data(MtdReadContext *ctx, char *data, size_t len)
 {
-    ssize_t read = 0;
-    while (read < (int) len) {
-        if (ctx->consumed < ctx->partition->erase_size) {
-            size_t avail = ctx->partition->erase_size - ctx->consumed;
+    const size_t erase_size = ctx->partition->erase_size;
+    size_t read = 0;
+    while (read < len) {
+        if (ctx->consumed < ctx->buffer_len) {
+            size_t avail = ctx->buffer_len - ctx->consumed;
             size_t copy = len - read < avail ? len - read : avail;
             memcpy(data + read, ctx->buffer + ctx->consumed, copy);
             ctx->consumed += copy;
@@ -349,20 +660,24 @@ ssize_t mtd_read_data(MtdReadContext *ctx, char *data, size_t len)
         }
 
         // Read complete blocks directly into the user's buffer
-        while (ctx->consumed == ctx->partition->erase_size &&
-               len - read >= ctx->partition->erase_size) {
-            if (read_block(ctx->partition, ctx->fd, data + read)) return -1;
-            read += ctx->partition->erase_size;
+        while (ctx->consumed == ctx->buffer_len &&
+               len - read >= erase_size) {
+            size_t blocks = (len - read) / erase_size;
+            int n = read_blocks(ctx, data + read,
+                    blocks < (size_t) ctx->window ? (int) blocks : ctx->window);
+            if (n < 0) return read > 0 ? (ssize_t) read : -1;
+            read += n * erase_size;
         }
 
-        if (read >= (int)len) {
+        if (read >= len) {
             return read;
         }
 
-        // Read the next block into the buffer
-        if (ctx->consumed == ctx->partition->erase_size && read < (int) len) {
-            if (read_block(ctx->partition, ctx->fd, ctx->buffer)) return -1;
-            ctx->consumed = 0;
+        // Read the next blocks into the buffer.  A failure after some
+        // data (the end of the partition, usually) hands back what was
+        // read; the next call returns -1.
+        if (ctx->consumed == ctx->buffer_len) {
+            if (fill_buffer(ctx)) return read > 0 ? (ssize_t) read : -1;
         }
     }
 
@@ -381,115 +696,237 @@ MtdWriteContext *mtd_write_partition(const MtdPartition *partition)
     MtdWriteContext *ctx = (MtdWriteContext*) malloc(sizeof(MtdWriteContext));
     if (ctx == NULL) return NULL;
 
-    ctx->bad_block_offsets = NULL;
-    ctx->bad_block_alloc = 0;
-    ctx->bad_block_count = 0;
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->verify_writes = 1;
 
+    int i;
     ctx->buffer = malloc(partition->erase_size);
-    if (ctx->buffer == NULL) {
-        free(ctx);
-        return NULL;
+    ctx->verify = malloc(partition->erase_size);
+    for (i = 0; i < MTD_WRITE_QUEUE; ++i) {
+        ctx->queue[i] = malloc(partition->erase_size);
+        if (ctx->queue[i] == NULL) break;
+    }
+    if (ctx->buffer == NULL || ctx->verify == NULL || i < MTD_WRITE_QUEUE) {
+        goto fail;
     }
 
-    char mtddevname[32];
-    sprintf(mtddevname, "/dev/mtd/mtd%d", partition->device_index);
+    char mtddevname[PATH_MAX];
+    mtd_device_name(mtddevname, sizeof(mtddevname), partition);
     ctx->fd = open(mtddevname, O_RDWR);
     if (ctx->fd < 0) {
-        free(ctx->buffer);
-        free(ctx);
-        return NULL;
+        goto fail;
     }
 
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_cond_init(&ctx->cond, NULL);
     ctx->partition = partition;
     ctx->stored = 0;
     return ctx;
+
+fail:
+    for (i = 0; i < MTD_WRITE_QUEUE; ++i) free(ctx->queue[i]);
+    free(ctx->verify);
+    free(ctx->buffer);
+    free(ctx);
+    return NULL;
+}
+
+void mtd_write_set_verify(MtdWriteContext *ctx, int verify)
+{
+    ctx->verify_writes = verify;
 }
 
-static void add_bad_block_offset(MtdWriteContext *ctx, off_t pos) {
+static void add_bad_block_offset(MtdWriteContext *ctx, loff_t pos) {
     if (ctx->bad_block_count + 1 > ctx->bad_block_alloc) {
         ctx->bad_block_alloc = (ctx->bad_block_alloc*2) + 1;
         ctx->bad_block_offsets = realloc(ctx->bad_block_offsets,
-                                         ctx->bad_block_alloc * sizeof(off_t));
+                                         ctx->bad_block_alloc * sizeof(loff_t));
     }
     ctx->bad_block_offsets[ctx->bad_block_count++] = pos;
 }
 
+/* MEMERASE only takes 32-bit offsets.
+ */
+static int erase_block(int fd, loff_t pos, size_t size)
+{
+#ifdef MEMERASE64
+    if ((uint64_t) pos + size > 0xffffffffULL) {
+        struct erase_info_user64 erase_info;
+        erase_info.start = pos;
+        erase_info.length = size;
+        return ioctl(fd, MEMERASE64, &erase_info);
+    }
+#endif
+    struct erase_info_user erase_info;
+    erase_info.start = pos;
+    erase_info.length = size;
+    return ioctl(fd, MEMERASE, &erase_info);
+}
+
+// An erased block reads as all 0xff, so a block of nothing else is
+// written by the erase alone.
+static int block_is_erased(const char *data, size_t size)
+{
+    return (unsigned char) data[0] == 0xff &&
+           memcmp(data, data + 1, size - 1) == 0;
+}
+
 static int write_block(MtdWriteContext *ctx, const char *data)
 {
     const MtdPartition *partition = ctx->partition;
     int fd = ctx->fd;
 
-    off_t pos = lseek(fd, 0, SEEK_CUR);
-    if (pos == (off_t) -1) return 1;
+    loff_t pos = lseek64(fd, 0, SEEK_CUR);
+    if (pos == (loff_t) -1) return 1;
 
     ssize_t size = partition->erase_size;
+    char *verify = ctx->verify;
+    int erased = block_is_erased(data, size);
 
-    char *verify = malloc(size);
-    if (verify == NULL)
-        return 1;
-
-    while (pos + size <= (int) partition->size) {
-        loff_t bpos = pos;
-        int ret = ioctl(fd, MEMGETBADBLOCK, &bpos);
-        if (ret != 0 && !(ret == -1 && errno == EOPNOTSUPP)) {
+    while (pos + size <= (loff_t) partition->size) {
+        if (mtd_block_is_bad(partition, fd, pos)) {
             add_bad_block_offset(ctx, pos);
-            fprintf(stderr,
-                    "mtd: not writing bad block at 0x%08lx (ret %d errno %d)\n",
-                    pos, ret, errno);
+            fprintf(stderr, "mtd: not writing bad block at 0x%08llx\n", pos);
             pos += partition->erase_size;
             continue;  // Don't try to erase known factory-bad blocks.
         }
 
-        struct erase_info_user erase_info;
-        erase_info.start = pos;
-        erase_info.length = size;
         int retry;
         for (retry = 0; retry < 2; ++retry) {
-            if (ioctl(fd, MEMERASE, &erase_info) < 0) {
-                fprintf(stderr, "mtd: erase failure at 0x%08lx (%s)\n",
+            if (erase_block(fd, pos, size) < 0) {
+                fprintf(stderr, "mtd: erase failure at 0x%08llx (%s)\n",
                         pos, strerror(errno));
                 continue;
             }
-            if (lseek(fd, pos, SEEK_SET) != pos ||
+            if (erased) {
+                if (lseek64(fd, pos + size, SEEK_SET) != pos + size) continue;
+                return 0;
+            }
+            if (lseek64(fd, pos, SEEK_SET) != pos ||
                 write(fd, data, size) != size) {
-                fprintf(stderr, "mtd: write error at 0x%08lx (%s)\n",
+                fprintf(stderr, "mtd: write error at 0x%08llx (%s)\n",
                         pos, strerror(errno));
+                if (!ctx->verify_writes) continue;
             }
 
-            if (lseek(fd, pos, SEEK_SET) != pos ||
-                read(fd, verify, size) != size) {
-                fprintf(stderr, "mtd: re-read error at 0x%08lx (%s)\n",
-                        pos, strerror(errno));
-                continue;
-            }
-            if (memcmp(data, verify, size) != 0) {
-                fprintf(stderr, "mtd: verification error at 0x%08lx (%s)\n",
-                        pos, strerror(errno));
-                continue;
+            if (ctx->verify_writes) {
+                if (lseek64(fd, pos, SEEK_SET) != pos ||
+                    read(fd, verify, size) != size) {
+                    fprintf(stderr, "mtd: re-read error at 0x%08llx (%s)\n",
+                            pos, strerror(errno));
+                    continue;
+                }
+                if (memcmp(data, verify, size) != 0) {
+                    fprintf(stderr, "mtd: verification error at 0x%08llx (%s)\n",
+                            pos, strerror(errno));
+                    continue;
+                }
             }
 
             if (retry > 0) {
                 fprintf(stderr, "mtd: wrote block after %d retries\n", retry);
             }
             fprintf(stderr, "mtd: successfully wrote block at %llx\n", pos);
-            free(verify);
             return 0;  // Success!
         }
 
         // Try to erase it once more as we give up on this block
         add_bad_block_offset(ctx, pos);
-        fprintf(stderr, "mtd: skipping write block at 0x%08lx\n", pos);
-        ioctl(fd, MEMERASE, &erase_info);
+        mtd_mark_block_bad(partition, pos);
+        fprintf(stderr, "mtd: skipping write block at 0x%08llx\n", pos);
+        erase_block(fd, pos, size);
         pos += partition->erase_size;
     }
 
-    free(verify);
-
     // Ran out of space on the device
     errno = ENOSPC;
     return -1;
 }
 
+static void *writer_thread(void *cookie)
+{
+    MtdWriteContext *ctx = (MtdWriteContext *) cookie;
+
+    pthread_mutex_lock(&ctx->lock);
+    while (1) {
+        while (ctx->queue_count == 0 && !ctx->writer_stop) {
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
+        }
+        if (ctx->queue_count == 0) break;
+
+        // After a failure the rest of the queue is dropped; the caller
+        // sees the error on its next call.
+        const char *data = ctx->queue[ctx->queue_head];
+        int failed = ctx->writer_error;
+        pthread_mutex_unlock(&ctx->lock);
+        if (!failed && write_block(ctx, data)) {
+            failed = errno ? errno : EIO;
+        }
+        pthread_mutex_lock(&ctx->lock);
+
+        if (failed && !ctx->writer_error) ctx->writer_error = failed;
+        ctx->queue_head = (ctx->queue_head + 1) % MTD_WRITE_QUEUE;
+        ctx->queue_count--;
+        pthread_cond_broadcast(&ctx->cond);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return NULL;
+}
+
+// Hand a complete block to the writer thread, waiting for a free slot.
+// ctx->buffer is swapped into the queue rather than copied.  Without a
+// writer thread the block is written before returning.
+static int queue_block(MtdWriteContext *ctx, const char *data)
+{
+    if (ctx->writer_state == 0) {
+        ctx->writer_state =
+            pthread_create(&ctx->writer, NULL, writer_thread, ctx) == 0 ? 1 : -1;
+    }
+    if (ctx->writer_state < 0) {
+        return write_block(ctx, data);
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    while (ctx->queue_count == MTD_WRITE_QUEUE && !ctx->writer_error) {
+        pthread_cond_wait(&ctx->cond, &ctx->lock);
+    }
+    if (ctx->writer_error) {
+        errno = ctx->writer_error;
+        pthread_mutex_unlock(&ctx->lock);
+        return -1;
+    }
+    int tail = (ctx->queue_head + ctx->queue_count) % MTD_WRITE_QUEUE;
+    if (data == ctx->buffer) {
+        ctx->buffer = ctx->queue[tail];
+        ctx->queue[tail] = (char *) data;
+    } else {
+        memcpy(ctx->queue[tail], data, ctx->partition->erase_size);
+    }
+    ctx->queue_count++;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+    return 0;
+}
+
+// Wait for every queued block to reach the flash.  Return -1 (with
+// errno set) if any of them couldn't be written.
+static int drain_writes(MtdWriteContext *ctx)
+{
+    if (ctx->writer_state <= 0) return 0;
+
+    pthread_mutex_lock(&ctx->lock);
+    while (ctx->queue_count > 0) {
+        pthread_cond_wait(&ctx->cond, &ctx->lock);
+    }
+    int err = ctx->writer_error;
+    pthread_mutex_unlock(&ctx->lock);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
 ssize_t mtd_write_data(MtdWriteContext *ctx, const char *data, size_t len)
 {
     size_t wrote = 0;
@@ -505,13 +942,13 @@ ssize_t mtd_write_data(MtdWriteContext *ctx, const char *data, size_t len)
 
         // If a complete block was accumulated, write it
         if (ctx->stored == ctx->partition->erase_size) {
-            if (write_block(ctx, ctx->buffer)) return -1;
+            if (queue_block(ctx, ctx->buffer)) return -1;
             ctx->stored = 0;
         }
 
         // Write complete blocks directly from the user's buffer
         while (ctx->stored == 0 && len - wrote >= ctx->partition->erase_size) {
-            if (write_block(ctx, data + wrote)) return -1;
+            if (queue_block(ctx, data + wrote)) return -1;
             wrote += ctx->partition->erase_size;
         }
     }
@@ -519,18 +956,19 @@ ssize_t mtd_write_data(MtdWriteContext *ctx, const char *data, size_t len)
     return wrote;
 }
 
-off_t mtd_erase_blocks(MtdWriteContext *ctx, int blocks)
+off64_t mtd_erase_blocks(MtdWriteContext *ctx, int blocks)
 {
     // Zero-pad and write any pending data to get us to a block boundary
     if (ctx->stored > 0) {
         size_t zero = ctx->partition->erase_size - ctx->stored;
         memset(ctx->buffer + ctx->stored, 0, zero);
-        if (write_block(ctx, ctx->buffer)) return -1;
+        if (queue_block(ctx, ctx->buffer)) return -1;
         ctx->stored = 0;
     }
+    if (drain_writes(ctx)) return -1;
 
-    off_t pos = lseek(ctx->fd, 0, SEEK_CUR);
-    if ((off_t) pos == (off_t) -1) return pos;
+    loff_t pos = lseek64(ctx->fd, 0, SEEK_CUR);
+    if (pos == (loff_t) -1) return pos;
 
     const int total = (ctx->partition->size - pos) / ctx->partition->erase_size;
     if (blocks < 0) blocks = total;
@@ -541,18 +979,14 @@ off_t mtd_erase_blocks(MtdWriteContext *ctx, int blocks)
 
     // Erase the specified number of blocks
     while (blocks-- > 0) {
-        loff_t bpos = pos;
-        if (ioctl(ctx->fd, MEMGETBADBLOCK, &bpos) > 0) {
-            fprintf(stderr, "mtd: not erasing bad block at 0x%08lx\n", pos);
+        if (mtd_block_is_bad(ctx->partition, ctx->fd, pos)) {
+            fprintf(stderr, "mtd: not erasing bad block at 0x%08llx\n", pos);
             pos += ctx->partition->erase_size;
             continue;  // Don't try to erase known factory-bad blocks.
         }
 
-        struct erase_info_user erase_info;
-        erase_info.start = pos;
-        erase_info.length = ctx->partition->erase_size;
-        if (ioctl(ctx->fd, MEMERASE, &erase_info) < 0) {
-            fprintf(stderr, "mtd: erase failure at 0x%08lx\n", pos);
+        if (erase_block(ctx->fd, pos, ctx->partition->erase_size) < 0) {
+            fprintf(stderr, "mtd: erase failure at 0x%08llx\n", pos);
         }
         pos += ctx->partition->erase_size;
     }
@@ -564,9 +998,22 @@ int mtd_write_close(MtdWriteContext *ctx)
 {
     int r = 0;
     // Make sure any pending data gets written
-    if (mtd_erase_blocks(ctx, 0) == (off_t) -1) r = -1;
+    if (mtd_erase_blocks(ctx, 0) == (off64_t) -1) r = -1;
+    if (ctx->writer_state > 0) {
+        drain_writes(ctx);
+        pthread_mutex_lock(&ctx->lock);
+        ctx->writer_stop = 1;
+        pthread_cond_broadcast(&ctx->cond);
+        pthread_mutex_unlock(&ctx->lock);
+        pthread_join(ctx->writer, NULL);
+    }
+    pthread_cond_destroy(&ctx->cond);
+    pthread_mutex_destroy(&ctx->lock);
     if (close(ctx->fd)) r = -1;
+    int i;
+    for (i = 0; i < MTD_WRITE_QUEUE; ++i) free(ctx->queue[i]);
     free(ctx->bad_block_offsets);
+    free(ctx->verify);
     free(ctx->buffer);
     free(ctx);
     return r;
@@ -575,7 +1022,8 @@ int mtd_write_close(MtdWriteContext *ctx)
 /* Return the offset of the first good block at or after pos (which
  * might be pos itself).
  */
-off_t mtd_find_write_start(MtdWriteContext *ctx, off_t pos) {
+off64_t mtd_find_write_start(MtdWriteContext *ctx, off64_t pos) {
+    drain_writes(ctx);
     int i;
     for (i = 0; i < ctx->bad_block_count; ++i) {
         if (ctx->bad_block_offsets[i] == pos) {
@@ -587,22 +1035,10 @@ off_t mtd_find_write_start(MtdWriteContext *ctx, off_t pos) {
     return pos;
 }
 
-#define BLOCK_SIZE    2048
-#define SPARE_SIZE    (BLOCK_SIZE >> 5)
 #define HEADER_SIZE 2048
 
-int cmd_mtd_restore_raw_partition(const char *partition_name, const char *filename)
+int mtd_restore_partition(const char *partition_name, MtdSourceFn source, void *cookie)
 {
-    const MtdPartition *ptn;
-    MtdWriteContext *write;
-    void *data;
-
-    FILE* f = fopen(filename, "rb");
-    if (f == NULL) {
-        fprintf(stderr, "error opening %s", filename);
-        return -1;
-    }
-
     if (mtd_scan_partitions() <= 0)
     {
         fprintf(stderr, "error scanning partitions");
@@ -615,42 +1051,70 @@ int cmd_mtd_restore_raw_partition(const char *partition_name, const char *filena
         return -1;
     }
 
-    int fd = open(filename, O_RDONLY);
-    if (fd < 0)
-    {
-        printf("error opening %s", filename);
-        return -1;
-    }
-    
     MtdWriteContext* ctx = mtd_write_partition(mtd);
     if (ctx == NULL) {
         printf("error writing %s", partition_name);
         return -1;
     }
 
+    // Read straight into the context's block buffer; queue_block()
+    // hands a full one to the writer thread by swapping in an empty
+    // one, so the data is never copied.
     int success = 1;
-    char* buffer = malloc(BUFSIZ);
-    int read;
-    while (success && (read = fread(buffer, 1, BUFSIZ, f)) > 0) {
-        int wrote = mtd_write_data(ctx, buffer, read);
-        success = success && (wrote == read);
+    ssize_t len;
+    while ((len = source(cookie, ctx->buffer + ctx->stored,
+                         mtd->erase_size - ctx->stored)) != 0) {
+        if (len < 0) {
+            success = 0;
+            break;
+        }
+        ctx->stored += len;
+        if (ctx->stored == mtd->erase_size) {
+            if (queue_block(ctx, ctx->buffer)) {
+                success = 0;
+                break;
+            }
+            ctx->stored = 0;
+        }
     }
-    free(buffer);
-    fclose(f);
 
     if (!success) {
         fprintf(stderr, "error writing %s", partition_name);
+        mtd_write_close(ctx);
         return -1;
     }
 
+    // Blocks still queued for the writer thread only report their
+    // failures here.
     if (mtd_erase_blocks(ctx, -1) == -1) {
         fprintf(stderr, "error erasing blocks of %s\n", partition_name);
+        success = 0;
     }
     if (mtd_write_close(ctx) != 0) {
         fprintf(stderr, "error closing write of %s\n", partition_name);
+        success = 0;
     }
     printf("%s %s partition\n", success ? "wrote" : "failed to write", partition_name);
-    return 0;
+    return success ? 0 : -1;
+}
+
+static ssize_t read_file(void *cookie, char *data, size_t len)
+{
+    FILE *f = (FILE *) cookie;
+    size_t n = fread(data, 1, len, f);
+    return n == 0 && ferror(f) ? -1 : (ssize_t) n;
+}
+
+int cmd_mtd_restore_raw_partition(const char *partition_name, const char *filename)
+{
+    FILE* f = fopen(filename, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "error opening %s", filename);
+        return -1;
+    }
+    int ret = mtd_restore_partition(partition_name, read_file, f);
+    fclose(f);
+    return ret;
 }
 
 
@@ -658,13 +1122,14 @@ int cmd_mtd_backup_raw_partition(const char *partition_name, const char *filenam
 {
     MtdReadContext *in;
     const MtdPartition *partition;
-    char buf[BLOCK_SIZE + SPARE_SIZE];
+    char *buf;
     size_t partition_size;
-    size_t read_size;
+    size_t erase_size;
+    size_t chunk;
     size_t total;
     int fd;
-    int wrote;
-    int len;
+    ssize_t wrote;
+    ssize_t len;
 
     if (mtd_scan_partitions() <= 0)
     {
@@ -679,11 +1144,20 @@ int cmd_mtd_backup_raw_partition(const char *partition_name, const char *filenam
         return -1;
     }
 
-    if (mtd_partition_info(partition, &partition_size, NULL, NULL)) {
+    if (mtd_partition_info(partition, &partition_size, &erase_size, NULL)) {
         printf("can't get info of partition %s", partition_name);
         return -1;
     }
 
+    // Whole erase blocks go straight from the chip into 'buf' (see
+    // mtd_read_data()) and out in one write each.
+    chunk = erase_size * 8;
+    buf = malloc(chunk);
+    if (buf == NULL) {
+        printf("can't allocate %zu bytes", chunk);
+        return -1;
+    }
+
     if (!strcmp(filename, "-")) {
         fd = fileno(stdout);
     }
@@ -694,6 +1168,7 @@ int cmd_mtd_backup_raw_partition(const char *partition_name, const char *filenam
     if (fd < 0)
     {
        printf("error opening %s", filename);
+       free(buf);
        return -1;
     }
 
@@ -701,23 +1176,27 @@ int cmd_mtd_backup_raw_partition(const char *partition_name, const char *filenam
     if (in == NULL) {
         close(fd);
         unlink(filename);
+        free(buf);
         printf("error opening %s: %s\n", partition_name, strerror(errno));
         return -1;
     }
 
     total = 0;
-    while ((len = mtd_read_data(in, buf, BLOCK_SIZE)) > 0) {
+    while ((len = mtd_read_data(in, buf, chunk)) > 0) {
         wrote = write(fd, buf, len);
         if (wrote != len) {
+            mtd_read_close(in);
             close(fd);
             unlink(filename);
+            free(buf);
             printf("error writing %s", filename);
             return -1;
         }
-        total += BLOCK_SIZE;
+        total += len;
     }
 
     mtd_read_close(in);
+    free(buf);
 
     if (close(fd)) {
         unlink(filename);
@@ -730,9 +1209,7 @@ int cmd_mtd_backup_raw_partition(const char *partition_name, const char *filenam
 int cmd_mtd_erase_raw_partition(const char *partition_name)
 {
     MtdWriteContext *out;
-    size_t erased;
-    size_t total_size;
-    size_t erase_size;
+    off64_t erased;
 
     if (mtd_scan_partitions() <= 0)
     {
@@ -756,10 +1233,16 @@ int cmd_mtd_erase_raw_partition(const char *partition_name)
     // do the actual erase, -1 = full partition erase
     erased = mtd_erase_blocks(out, -1);
 
-    // erased = bytes erased, if zero, something borked
-    if (!erased)
+    // erased = end of the erase, or -1 if something borked
+    if (erased == (off64_t) -1)
     {
         printf("error erasing %s", partition_name);
+        mtd_write_close(out);
+        return -1;
+    }
+    if (mtd_write_close(out))
+    {
+        printf("error closing %s", partition_name);
         return -1;
     }
 
@@ -17,12 +17,23 @@
 #ifndef MTDUTILS_H_
 #define MTDUTILS_H_
 
+#include <stdint.h>
 #include <sys/types.h>  // for size_t, etc.
 
 typedef struct MtdPartition MtdPartition;
 
+/* Returns the number of partitions, or -1.  /proc/mtd is only read the
+ * first time; after that this is cheap, and the MtdPartitions found stay
+ * valid.
+ */
 int mtd_scan_partitions(void);
 
+/* Use another /proc/mtd and device node pattern (default "/dev/mtd/mtd%d"),
+ * e.g. "/dev/mtd%d" for nandsim on a desktop kernel.  NULL restores the
+ * default.  Forgets the partitions found so far; scan again afterwards.
+ */
+void mtd_set_paths(const char *proc_filename, const char *device_format);
+
 const MtdPartition *mtd_find_partition_by_name(const char *name);
 int mtd_get_index_by_name(const char *name);
 
@@ -46,19 +57,38 @@ typedef struct MtdWriteContext MtdWriteContext;
 MtdReadContext *mtd_read_partition(const MtdPartition *);
 ssize_t mtd_read_data(MtdReadContext *, char *data, size_t data_len);
 void mtd_read_close(MtdReadContext *);
-void mtd_read_skip_to(const MtdReadContext *, size_t offset);
+void mtd_read_skip_to(MtdReadContext *, off64_t offset);
+
+/* Read up to this many bytes of consecutive good blocks with one call
+ * (1 MB by default; at least one block).
+ */
+void mtd_read_set_window(MtdReadContext *, size_t bytes);
 
 MtdWriteContext *mtd_write_partition(const MtdPartition *);
 ssize_t mtd_write_data(MtdWriteContext *, const char *data, size_t data_len);
-off_t mtd_erase_blocks(MtdWriteContext *, int blocks);  /* 0 ok, -1 for all */
-off_t mtd_find_write_start(MtdWriteContext *ctx, off_t pos);
+off64_t mtd_erase_blocks(MtdWriteContext *, int blocks);  /* 0 ok, -1 for all */
+off64_t mtd_find_write_start(MtdWriteContext *ctx, off64_t pos);
 int mtd_write_close(MtdWriteContext *);
 
+/* Write a partition from the start with what 'source' returns (0 at the
+ * end, -1 on an error), then erase the rest of it.  Blocks of all 0xff
+ * are only erased, never programmed.
+ */
+typedef ssize_t (*MtdSourceFn)(void *cookie, char *data, size_t len);
+int mtd_restore_partition(const char *partition_name, MtdSourceFn source, void *cookie);
+
+/* Read back and compare each block after writing it (the default), or
+ * trust the driver's own status.  Blocks are written by a helper
+ * thread, so a failure may be reported by a later write or erase call.
+ */
+void mtd_write_set_verify(MtdWriteContext *, int verify);
+
 struct MtdPartition {
     int device_index;
-    unsigned int size;
+    uint64_t size;
     unsigned int erase_size;
     char *name;
+    unsigned char *bad_block_map;   /* one bit per erase block; internal */
 };
 
 #endif  // MTDUTILS_H_
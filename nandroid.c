@@ -47,6 +47,7 @@
 #include "minzip/DirUtil.h"
 #include "mounts.h"
 #include "nandroid.h"
+#include "nandroid_delta.h"
 #include "nandroid_md5.h"
 #include "recovery_settings.h"
 #include "recovery_ui.h"
@@ -398,6 +399,10 @@ static int nandroid_backup_partition(const char* backup_path, const char* root)
             return ret;
         }
 
+        // the full image stays in place if no delta can be made
+        if (strcmp(backup_path, "-") != 0 && nandroid_delta_enabled())
+            nandroid_delta_backup_raw(backup_path, name);
+
         ui_print("Backup of %s image completed.\n", name);
         return 0;
     }
@@ -932,19 +937,38 @@ static int nandroid_restore_partition(const char* backup_path, const char* root)
 		ui_print("\n[*] Restoring %s...\nUsing raw mode...\n", root);
         int ret;
         const char* name = basename(root);
-        ui_print("[*] Erasing %s before restore...\n", name);
-        if (0 != (ret = format_volume(root))) {
-            ui_print("Error while erasing %s image!", name);
-            return ret;
-        }
+        int from_delta = 0;
+        struct stat st;
 
         if (strcmp(backup_path, "-") == 0)
             strcpy(tmp, backup_path);
         else
             sprintf(tmp, "%s%s.img", backup_path, root);
 
+        // rebuild an image stored as a delta before anything is erased
+        if (strcmp(backup_path, "-") != 0 && 0 != stat(tmp, &st) &&
+                nandroid_delta_exists(backup_path, name)) {
+            sprintf(tmp, "/tmp/%s.img", name);
+            if (0 != nandroid_delta_restore_raw(backup_path, name, tmp)) {
+                ui_print("Error while rebuilding %s image!\n", name);
+                return -1;
+            }
+            from_delta = 1;
+        }
+
+        ui_print("[*] Erasing %s before restore...\n", name);
+        if (0 != (ret = format_volume(root))) {
+            ui_print("Error while erasing %s image!", name);
+            if (from_delta)
+                unlink(tmp);
+            return ret;
+        }
+
         ui_print("[*] Restoring %s image...\n", name);
-        if (0 != (ret = restore_raw_partition(vol->fs_type, vol->blk_device, tmp))) {
+        ret = restore_raw_partition(vol->fs_type, vol->blk_device, tmp);
+        if (from_delta)
+            unlink(tmp);
+        if (0 != ret) {
             ui_print("Error while flashing %s image!\n", name);
             return ret;
         }
@@ -0,0 +1,411 @@
+/*
+ * Copyright (C) 2014 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "applypatch/applypatch.h"
+#include "applypatch/bsdiff.h"
+#include "common.h"
+#include "mincrypt/sha.h"
+#include "nandroid_delta.h"
+#include "recovery_settings.h"
+#include "roots.h"
+
+// A delta is only kept if it is at most this fraction of the full
+// image; otherwise the full image is cheaper to keep around.
+#define DELTA_MAX_PERCENT 75
+
+int nandroid_delta_enabled() {
+    char path[PATH_MAX];
+    struct stat st;
+    snprintf(path, PATH_MAX, "%s%s%s", get_primary_storage_path(), (is_data_media() ? "/0/" : "/"), NANDROID_DELTA_RAW_FILE);
+    return stat(path, &st) == 0;
+}
+
+// Split "/sdcard/clockworkmod/backup/<name>[/]" into its parent
+// directory and the backup's own directory name.
+static int split_backup_path(const char *backup_path, char *parent, char *self) {
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s", backup_path);
+    int len = strlen(path);
+    while (len > 1 && path[len-1] == '/')
+        path[--len] = '\0';
+
+    char *slash = strrchr(path, '/');
+    if (slash == NULL || slash == path)
+        return -1;
+    *slash = '\0';
+    strcpy(parent, path);
+    strcpy(self, slash + 1);
+    return 0;
+}
+
+static unsigned char *read_file(const char *path, size_t *size) {
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return NULL;
+
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+        return NULL;
+    // one extra byte so an empty file still gets a buffer
+    unsigned char *data = malloc(st.st_size + 1);
+    if (data == NULL || fread(data, 1, st.st_size, f) != (size_t)st.st_size) {
+        LOGE("Failed to read %s\n", path);
+        free(data);
+        fclose(f);
+        return NULL;
+    }
+    fclose(f);
+    *size = st.st_size;
+    return data;
+}
+
+static void sha1_to_hex(const uint8_t *sha1, char *str) {
+    int i;
+    for (i = 0; i < SHA_DIGEST_SIZE; i++)
+        sprintf(&str[2*i], "%02x", (unsigned int)sha1[i]);
+}
+
+// Find the most recent other backup in 'parent' that holds a full copy
+// of 'image_name'.  Deltas are always made against a full image, so a
+// restore never needs more than one base.
+static int find_delta_base(const char *parent, const char *self,
+                           const char *image_name, char *base) {
+    DIR *dp = opendir(parent);
+    if (dp == NULL)
+        return -1;
+
+    time_t newest = 0;
+    base[0] = '\0';
+    struct dirent *ep;
+    while ((ep = readdir(dp)) != NULL) {
+        if (ep->d_name[0] == '.' || strcmp(ep->d_name, self) == 0)
+            continue;
+
+        char path[PATH_MAX];
+        struct stat st;
+        snprintf(path, PATH_MAX, "%s/%s/%s", parent, ep->d_name, image_name);
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+                (base[0] == '\0' || st.st_mtime > newest)) {
+            newest = st.st_mtime;
+            strcpy(base, ep->d_name);
+        }
+    }
+    closedir(dp);
+
+    return base[0] != '\0' ? 0 : -1;
+}
+
+// bsdiff() exits the process on any error, so it runs in a child.
+static int run_bsdiff(unsigned char *old_data, size_t old_size,
+                      unsigned char *new_data, size_t new_size,
+                      const char *patch_file) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        LOGE("Failed to fork for bsdiff: %s\n", strerror(errno));
+        return -1;
+    }
+    if (pid == 0) {
+        SuffixArray *sa = NULL;
+        _exit(bsdiff(old_data, old_size, &sa, new_data, new_size,
+                     patch_file, BSDIFF_CODEC_BZIP2) == 0 ? 0 : 1);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != 0) {
+        LOGE("bsdiff failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Replace <backup_path>/<name>.img, just backed up in full, with a
+// delta against the newest full copy of the same image in a sibling
+// backup.  The full image is kept if there is no such copy or the delta
+// wouldn't save enough; that isn't an error.
+int nandroid_delta_backup_raw(const char *backup_path, const char *name) {
+    char parent[PATH_MAX], self[PATH_MAX], base[PATH_MAX];
+    char image_name[PATH_MAX], image[PATH_MAX], base_image[PATH_MAX];
+    char patch_file[PATH_MAX], delta_file[PATH_MAX];
+
+    if (split_backup_path(backup_path, parent, self) != 0)
+        return 0;
+    snprintf(image_name, PATH_MAX, "%s.img", name);
+    snprintf(image, PATH_MAX, "%s/%s/%s", parent, self, image_name);
+
+    if (find_delta_base(parent, self, image_name, base) != 0) {
+        ui_print("No earlier full %s; keeping full image.\n", image_name);
+        return 0;
+    }
+    snprintf(base_image, PATH_MAX, "%s/%s/%s", parent, base, image_name);
+
+    size_t base_size, image_size, patch_size;
+    unsigned char *base_data = read_file(base_image, &base_size);
+    unsigned char *image_data = read_file(image, &image_size);
+    unsigned char *patch_data = NULL;
+    unsigned char *check_data = NULL;
+    FILE *f = NULL;
+    int ret = -1;
+    if (base_data == NULL || image_data == NULL)
+        goto out;
+
+    ui_print("Making %s delta against %s...\n", image_name, base);
+    snprintf(patch_file, PATH_MAX, "%s.delta.tmp", image);
+    snprintf(delta_file, PATH_MAX, "%s.delta", image);
+    if (run_bsdiff(base_data, base_size, image_data, image_size, patch_file) != 0)
+        goto out;
+    patch_data = read_file(patch_file, &patch_size);
+    unlink(patch_file);
+    if (patch_data == NULL)
+        goto out;
+
+    if (patch_size * 100 > image_size * DELTA_MAX_PERCENT) {
+        ui_print("%s delta saves too little; keeping full image.\n", image_name);
+        ret = 0;
+        goto out;
+    }
+
+    // Make sure the patch really rebuilds the image before dropping it.
+    uint8_t base_sha1[SHA_DIGEST_SIZE], image_sha1[SHA_DIGEST_SIZE];
+    uint8_t check_sha1[SHA_DIGEST_SIZE];
+    ssize_t check_size;
+    Value patch = { VAL_BLOB, patch_size, (char *)patch_data };
+    SHA_hash(base_data, base_size, base_sha1);
+    SHA_hash(image_data, image_size, image_sha1);
+    if (ApplyBSDiffPatchMem(base_data, base_size, &patch, 0,
+                            &check_data, &check_size) != 0 ||
+            check_size != (ssize_t)image_size ||
+            memcmp(SHA_hash(check_data, check_size, check_sha1),
+                   image_sha1, SHA_DIGEST_SIZE) != 0) {
+        LOGE("%s delta doesn't rebuild the image; keeping full image.\n", image_name);
+        ret = 0;
+        goto out;
+    }
+
+    char base_hex[SHA_DIGEST_SIZE*2+1], image_hex[SHA_DIGEST_SIZE*2+1];
+    sha1_to_hex(base_sha1, base_hex);
+    sha1_to_hex(image_sha1, image_hex);
+
+    f = fopen(delta_file, "wb");
+    if (f == NULL) {
+        LOGE("Can't create %s\n", delta_file);
+        goto out;
+    }
+    fprintf(f, "%s\nbase %s\nbase-sha1 %s\nsize %llu\nsha1 %s\n\n",
+            NANDROID_DELTA_MAGIC, base, base_hex,
+            (unsigned long long)image_size, image_hex);
+    if (fwrite(patch_data, 1, patch_size, f) != patch_size || fclose(f) != 0) {
+        f = NULL;
+        LOGE("Failed to write %s\n", delta_file);
+        unlink(delta_file);
+        goto out;
+    }
+    f = NULL;
+
+    unlink(image);
+    ui_print("%s stored as a %lu byte delta (full image %lu bytes).\n",
+             image_name, (unsigned long)patch_size, (unsigned long)image_size);
+    ret = 0;
+
+out:
+    if (f != NULL)
+        fclose(f);
+    free(base_data);
+    free(image_data);
+    free(patch_data);
+    free(check_data);
+    return ret;
+}
+
+int nandroid_delta_exists(const char *backup_path, const char *name) {
+    char path[PATH_MAX];
+    struct stat st;
+    snprintf(path, PATH_MAX, "%s/%s.img.delta", backup_path, name);
+    return stat(path, &st) == 0;
+}
+
+// Count the raw image deltas in other backups that were made against
+// full images in 'backup_path', and so can't be restored without it.
+int nandroid_delta_dependents(const char *backup_path) {
+    char parent[PATH_MAX], self[PATH_MAX];
+    if (split_backup_path(backup_path, parent, self) != 0)
+        return 0;
+
+    DIR *dp = opendir(parent);
+    if (dp == NULL)
+        return 0;
+
+    int count = 0;
+    struct dirent *ep;
+    while ((ep = readdir(dp)) != NULL) {
+        if (ep->d_name[0] == '.' || strcmp(ep->d_name, self) == 0)
+            continue;
+
+        char dir[PATH_MAX];
+        snprintf(dir, PATH_MAX, "%s/%s", parent, ep->d_name);
+        DIR *bp = opendir(dir);
+        if (bp == NULL)
+            continue;
+        struct dirent *fp;
+        while ((fp = readdir(bp)) != NULL) {
+            int len = strlen(fp->d_name);
+            if (len < 10 || strcmp(fp->d_name + len - 10, ".img.delta") != 0)
+                continue;
+
+            char path[PATH_MAX], line[PATH_MAX], base[PATH_MAX];
+            snprintf(path, PATH_MAX, "%s/%s", dir, fp->d_name);
+            FILE *f = fopen(path, "rb");
+            if (f == NULL)
+                continue;
+            // magic line, then "base <name>"
+            if (fgets(line, sizeof(line), f) != NULL &&
+                    fgets(line, sizeof(line), f) != NULL &&
+                    sscanf(line, "base %4095s", base) == 1 &&
+                    strcmp(base, self) == 0)
+                count++;
+            fclose(f);
+        }
+        closedir(bp);
+    }
+    closedir(dp);
+    return count;
+}
+
+static ssize_t delta_file_sink(unsigned char *data, ssize_t len, void *token) {
+    int fd = *(int *)token;
+    ssize_t done = 0;
+    while (done < len) {
+        ssize_t wrote = write(fd, data + done, len - done);
+        if (wrote < 0 && errno == EINTR)
+            continue;
+        if (wrote <= 0)
+            return done;
+        done += wrote;
+    }
+    return done;
+}
+
+// Rebuild the full image for a <name>.img.delta in 'backup_path' into
+// 'out_file'.  Returns 0 on success.
+int nandroid_delta_restore_raw(const char *backup_path, const char *name,
+                               const char *out_file) {
+    char parent[PATH_MAX], self[PATH_MAX], base[PATH_MAX];
+    char delta_file[PATH_MAX], base_image[PATH_MAX];
+    char base_hex[SHA_DIGEST_SIZE*2+1], image_hex[SHA_DIGEST_SIZE*2+1];
+    unsigned long long image_size;
+
+    if (split_backup_path(backup_path, parent, self) != 0)
+        return -1;
+    snprintf(delta_file, PATH_MAX, "%s/%s/%s.img.delta", parent, self, name);
+
+    size_t delta_size, base_size;
+    unsigned char *delta = read_file(delta_file, &delta_size);
+    unsigned char *base_data = NULL;
+    int fd = -1;
+    int ret = -1;
+    if (delta == NULL) {
+        LOGE("Can't read %s\n", delta_file);
+        return -1;
+    }
+
+    // The header is text, ended by an empty line.  Field widths are
+    // PATH_MAX - 1 and SHA_DIGEST_SIZE*2; anything longer fails to match,
+    // and the last field has to end the header.
+    delta[delta_size] = '\0';
+    char *end = strstr((char *)delta, "\n\n");
+    char *fields = (char *)delta + strlen(NANDROID_DELTA_MAGIC) + 1;
+    int fields_len = -1;
+    if (end == NULL ||
+            strncmp((char *)delta, NANDROID_DELTA_MAGIC "\n", strlen(NANDROID_DELTA_MAGIC) + 1) != 0 ||
+            sscanf(fields, "base %4095s\nbase-sha1 %40s\nsize %llu\nsha1 %40s%n",
+                   base, base_hex, &image_size, image_hex, &fields_len) != 4 ||
+            fields + fields_len != end) {
+        LOGE("%s is not a nandroid delta\n", delta_file);
+        goto out;
+    }
+    size_t header_size = end + 2 - (char *)delta;
+
+    uint8_t base_sha1[SHA_DIGEST_SIZE], image_sha1[SHA_DIGEST_SIZE];
+    uint8_t sha1[SHA_DIGEST_SIZE];
+    if (ParseSha1(base_hex, base_sha1) != 0 || ParseSha1(image_hex, image_sha1) != 0) {
+        LOGE("%s has a bad header\n", delta_file);
+        goto out;
+    }
+
+    snprintf(base_image, PATH_MAX, "%s/%s/%s.img", parent, base, name);
+    base_data = read_file(base_image, &base_size);
+    if (base_data == NULL) {
+        LOGE("%s.img delta needs the backup %s, which is missing\n", name, base);
+        goto out;
+    }
+    if (memcmp(SHA_hash(base_data, base_size, sha1), base_sha1, SHA_DIGEST_SIZE) != 0) {
+        LOGE("%s/%s.img has changed since the delta was made\n", base, name);
+        goto out;
+    }
+
+    ui_print("Rebuilding %s.img from delta against %s...\n", name, base);
+    fd = open(out_file, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        LOGE("Can't create %s\n", out_file);
+        goto out;
+    }
+
+    Value patch = { VAL_BLOB, delta_size - header_size, (char *)delta + header_size };
+    SHA_CTX ctx;
+    SHA_init(&ctx);
+    int result;
+    if (patch.size >= 8 && (memcmp(patch.data, BSDIFF40_MAGIC, 8) == 0 ||
+                            memcmp(patch.data, BSDF2_MAGIC, BSDF2_MAGIC_LEN) == 0)) {
+        result = ApplyBSDiffPatch(base_data, base_size, &patch, 0,
+                                  delta_file_sink, &fd, &ctx);
+    } else if (patch.size >= 8 && memcmp(patch.data, "IMGDIFF2", 8) == 0) {
+        result = ApplyImagePatch(base_data, base_size, &patch,
+                                 delta_file_sink, &fd, &ctx, NULL);
+    } else {
+        LOGE("%s: unknown patch format\n", delta_file);
+        goto out;
+    }
+
+    struct stat st;
+    if (result != 0 || fsync(fd) != 0 || fstat(fd, &st) != 0 ||
+            (unsigned long long)st.st_size != image_size ||
+            memcmp(SHA_final(&ctx), image_sha1, SHA_DIGEST_SIZE) != 0) {
+        LOGE("Failed to rebuild %s.img from delta\n", name);
+        goto out;
+    }
+    ret = 0;
+
+out:
+    if (fd >= 0)
+        close(fd);
+    if (ret != 0)
+        unlink(out_file);
+    free(delta);
+    free(base_data);
+    return ret;
+}
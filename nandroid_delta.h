@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2014 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _NANDROID_DELTA_H
+#define _NANDROID_DELTA_H
+
+// Raw partition images (boot.img, recovery.img, ...) may be stored as
+// <name>.img.delta: a short text header naming the sibling backup that
+// holds the full <name>.img it was made against, followed by a bsdiff
+// or imgdiff patch.
+#define NANDROID_DELTA_MAGIC "NANDROID-DELTA1"
+
+int nandroid_delta_enabled();
+int nandroid_delta_backup_raw(const char *backup_path, const char *name);
+int nandroid_delta_exists(const char *backup_path, const char *name);
+int nandroid_delta_dependents(const char *backup_path);
+int nandroid_delta_restore_raw(const char *backup_path, const char *name,
+                               const char *out_file);
+
+#endif
@@ -25,5 +25,6 @@
 // nandroid settings
 #define NANDROID_HIDE_PROGRESS_FILE  "clockworkmod/.hidenandroidprogress"
 #define NANDROID_BACKUP_FORMAT_FILE  "clockworkmod/.default_backup_format"
+#define NANDROID_DELTA_RAW_FILE      "clockworkmod/.delta_raw_backups"
 
 #endif // _RECOVERY_SETTINGS_H
\ No newline at end of file
@@ -36,6 +36,7 @@
 
 #include "extendedcommands.h"
 #include "flashutils/flashutils.h"
+#include "mmcutils/mmcutils.h"
 #include "recovery_ui.h"
 #include "voldclient/voldclient.h"
 
@@ -593,6 +594,8 @@ int format_volume(const char* volume) {
 
 #ifdef USE_F2FS
     if (strcmp(v->fs_type, "f2fs") == 0) {
+        // make_ext4fs discards the device itself; mkfs.f2fs may not.
+        mmc_discard_device(v->blk_device, v->length);
         char* args[] = { "mkfs.f2fs", v->blk_device };
         if (make_f2fs_main(2, args) != 0) {
             LOGE("format_volume: mkfs.f2fs failed on %s\n", v->blk_device);
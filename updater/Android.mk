@@ -28,9 +28,15 @@ LOCAL_STATIC_LIBRARIES += \
     libz
 endif
 
-LOCAL_STATIC_LIBRARIES += libflashutils libmtdutils libmmcutils libbmlutils
+LOCAL_STATIC_LIBRARIES += libflashutils libmtdutils libmmcutils libbmlutils libblkio
 LOCAL_STATIC_LIBRARIES += $(TARGET_RECOVERY_UPDATER_LIBS) $(TARGET_RECOVERY_UPDATER_EXTRA_LIBS)
 LOCAL_STATIC_LIBRARIES += libapplypatch libedify libmtdutils libminzip libz
+ifeq ($(BOARD_RECOVERY_USES_LIBDEFLATE),true)
+LOCAL_STATIC_LIBRARIES += libdeflate
+endif
+ifeq ($(BOARD_RECOVERY_USES_ZSTD),true)
+LOCAL_STATIC_LIBRARIES += libzstd
+endif
 LOCAL_STATIC_LIBRARIES += libmincrypt libbz
 LOCAL_STATIC_LIBRARIES += libminelf
 LOCAL_STATIC_LIBRARIES += libcutils libstdc++ libc
@@ -41,6 +41,8 @@
 #include "minzip/DirUtil.h"
 #include "mounts.h"
 #include "mtdutils/mtdutils.h"
+#include "flashutils/blkio.h"
+#include "flashutils/flashutils.h"
 #include "updater.h"
 #include "applypatch/applypatch.h"
 #include "libubi.h"
@@ -1514,25 +1516,13 @@ char * block_write_data( Value* contents, char * name)
 
 		if (contents->type == VAL_STRING){
 			
-			printf( "###here");	
+			// Flash the file as an image: sparse ones are expanded,
+			// and only the data it really holds is written.
 			char* filename = contents->data;
-			FILE* f = fopen(filename, "rb");
-			if (f == NULL) {
-				fprintf(stderr, "%s: can't open %s: %s\n",
-						name, filename, strerror(errno));
-				result = strdup("");
-				goto done;
-			}
-
-			success = true;
-			char* buffer = malloc(BUFSIZ);
-			int read;
-			while (success && (read = fread(buffer, 1, BUFSIZ, f)) > 0) {
-				int wrote = write_data(fd, buffer, read);
-				success = success && (wrote == read);
-			}
-			free(buffer);
-			fclose(f);
+			BlkIoCopy opts;
+			memset(&opts, 0, sizeof(opts));
+			opts.flags = BLKIO_IMAGE;
+			success = blkio_copy_file(filename, devname, &opts) == 0;
 		} else {
 			printf( "@@@here");
 			ssize_t wrote = write_data(fd, contents->data, contents->size);
@@ -1558,6 +1548,47 @@ done:
 	return result;
 }
 
+// Write an eMMC partition, named or given as a device path, from an
+// image file (which may be sparse) or a blob.  Returns 0 on success.
+static int emmc_write_image(const char* name, const char* partition,
+                            Value* contents) {
+    if (contents->type == VAL_STRING) {
+        return cmd_mmc_restore_raw_partition(partition, contents->data);
+    }
+
+    char device[PATH_MAX];
+    if (partition[0] == '/') {
+        snprintf(device, sizeof(device), "%s", partition);
+    } else if (cmd_mmc_get_partition_device(partition, device) != 0) {
+        fprintf(stderr, "%s: can't find eMMC partition \"%s\"\n",
+                name, partition);
+        return -1;
+    }
+    int fd = open(device, O_WRONLY);
+    if (fd < 0) {
+        fprintf(stderr, "%s: can't open %s: %s\n",
+                name, device, strerror(errno));
+        return -1;
+    }
+
+    const char* data = contents->data;
+    ssize_t left = contents->size;
+    while (left > 0) {
+        ssize_t wrote = write(fd, data, left);
+        if (wrote < 0 && errno == EINTR) continue;
+        if (wrote <= 0) break;
+        data += wrote;
+        left -= wrote;
+    }
+    if (left != 0 || fsync(fd) != 0) {
+        fprintf(stderr, "%s: error writing %s: %s\n",
+                name, device, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return close(fd);
+}
+
 // write_raw_image(filename_or_blob, partition)
 Value* WriteRawImageFn(const char* name, State* state, int argc, Expr* argv[]) {
     char* result = NULL;
@@ -1590,47 +1621,45 @@ Value* WriteRawImageFn(const char* name, State* state, int argc, Expr* argv[]) {
     	
     mtd_scan_partitions();
     const MtdPartition* mtd = mtd_find_partition_by_name(partition);
-	if(mtd != NULL){
-	    ctx = mtd_write_partition(mtd);
-	    if (ctx == NULL) {
-	        fprintf(stderr, "%s: can't write mtd partition \"%s\"\n",
-	                name, partition);
-	        result = strdup("");
-	        goto done;
-	    }
-	}else{
+	if (mtd == NULL) {
         fprintf(stderr, "access emmc partition %s\n", partition);
-		ctx = emmc_write_partition(partition);
-	    if (ctx == NULL) {
-	        fprintf(stderr, "%s: can't write eMMC partition \"%s\"\n",
-	                name, partition);
-	        result = strdup("");
-	        goto done;
-	    }
+        result = emmc_write_image(name, partition, contents) == 0 ?
+                 partition : strdup("");
+        goto done;
 	}
+    ctx = mtd_write_partition(mtd);
+    if (ctx == NULL) {
+        fprintf(stderr, "%s: can't write mtd partition \"%s\"\n",
+                name, partition);
+        result = strdup("");
+        goto done;
+    }
 
     bool success;
 
     if (contents->type == VAL_STRING) {
-        // we're given a filename as the contents
+        // we're given a filename as the contents.  A sparse image is
+        // expanded, with don't-care chunks read as erased flash, which
+        // mtd_write_data() erases without programming.
         char* filename = contents->data;
-        FILE* f = fopen(filename, "rb");
-        if (f == NULL) {
-            fprintf(stderr, "%s: can't open %s: %s\n",
-                    name, filename, strerror(errno));
+        BlkIoImage* img = blkio_image_open(filename, 0xff);
+        if (img == NULL) {
+            fprintf(stderr, "%s: can't open %s\n", name, filename);
+            mtd_write_close(ctx);
             result = strdup("");
             goto done;
         }
 
         success = true;
         char* buffer = malloc(BUFSIZ);
-        int read;
-        while (success && (read = fread(buffer, 1, BUFSIZ, f)) > 0) {
-            int wrote = mtd_write_data(ctx, buffer, read);
+        ssize_t read;
+        while (success && (read = blkio_image_read(img, buffer, BUFSIZ)) > 0) {
+            ssize_t wrote = mtd_write_data(ctx, buffer, read);
             success = success && (wrote == read);
         }
+        if (read < 0) success = false;
         free(buffer);
-        fclose(f);
+        blkio_image_close(img);
     } else {
         // we're given a blob as the contents
         ssize_t wrote = mtd_write_data(ctx, contents->data, contents->size);
@@ -1641,11 +1670,14 @@ Value* WriteRawImageFn(const char* name, State* state, int argc, Expr* argv[]) {
                 partition, strerror(errno));
     }
 
+    // The writer thread's failures on the last blocks surface here.
     if (mtd_erase_blocks(ctx, -1) == -1) {
         fprintf(stderr, "%s: error erasing blocks of %s\n", name, partition);
+        success = false;
     }
     if (mtd_write_close(ctx) != 0) {
         fprintf(stderr, "%s: error closing write of %s\n", name, partition);
+        success = false;
     }
 
     printf("%s %s partition\n",
@@ -1815,6 +1847,96 @@ Value* ApplyPatchCheckFn(const char* name, State* state,
     return StringValue(strdup(result == 0 ? "t" : ""));
 }
 
+// apply_patch_check_batch(file_1, sha1s_1, file_2, sha1s_2, ...)
+//
+// Check each file as apply_patch_check() would, with the sha1s each
+// may match given as one colon-separated string (possibly empty).
+// The files are hashed in parallel.  Returns "t" if every file passes.
+Value* ApplyPatchCheckBatchFn(const char* name, State* state,
+                              int argc, Expr* argv[]) {
+    if (argc < 2 || (argc % 2) != 0) {
+        return ErrorAbort(state, "%s(): expected a nonzero even number "
+                          "of args, got %d", name, argc);
+    }
+
+    char** args = ReadVarArgs(state, argc, argv);
+    if (args == NULL) {
+        return NULL;
+    }
+
+    int count = argc / 2;
+    CheckEntry* entries = calloc(count, sizeof(CheckEntry));
+    int checking = 0;
+    int i, j;
+    if (entries == NULL) {
+        goto alloc_failed;
+    }
+    for (i = 0; i < count; ++i) {
+        char* filename = args[i*2];
+        char* sha1s = args[i*2+1];
+
+        /* Skip files listed in the backup table */
+        for (j = 0; j < totalbaks; j++) {
+            if (!strncmp(filename, bakfiles[j], PATH_MAX)) break;
+        }
+        if (j < totalbaks) continue;
+
+        CheckEntry* e = entries + checking++;
+        e->filename = filename;
+        e->num_patches = 0;
+        if (*sha1s != '\0') {
+            char* p;
+            e->num_patches = 1;
+            for (p = sha1s; *p; ++p) {
+                if (*p == ':') ++e->num_patches;
+            }
+            e->patch_sha1_str = malloc(e->num_patches * sizeof(char*));
+            if (e->patch_sha1_str == NULL) {
+                goto alloc_failed;
+            }
+            for (j = 0; j < e->num_patches; ++j) {
+                e->patch_sha1_str[j] = strsep(&sha1s, ":");
+            }
+        }
+    }
+
+    applypatch_check_batch(entries, checking);
+
+    int failed = 0;
+    for (i = 0; i < checking; ++i) {
+        if (entries[i].result == -ENOENT && totalbaks) {
+            /* As in apply_patch_check(): a file that's gone on a system
+               with CM backup tool modifications is skippable later */
+            sprintf(bakfiles[totalbaks++], "%s", entries[i].filename);
+            entries[i].result = 0;
+        }
+        if (entries[i].result != 0) {
+            printf("%s(): \"%s\" failed check\n", name, entries[i].filename);
+            ++failed;
+        }
+        free(entries[i].patch_sha1_str);
+    }
+    free(entries);
+
+    for (i = 0; i < argc; ++i) {
+        free(args[i]);
+    }
+    free(args);
+
+    return StringValue(strdup(failed == 0 ? "t" : ""));
+
+alloc_failed:
+    for (i = 0; entries != NULL && i < checking; ++i) {
+        free(entries[i].patch_sha1_str);
+    }
+    free(entries);
+    for (i = 0; i < argc; ++i) {
+        free(args[i]);
+    }
+    free(args);
+    return ErrorAbort(state, "%s(): out of memory for %d files", name, count);
+}
+
 Value* UIPrintFn(const char* name, State* state, int argc, Expr* argv[]) {
     char** args = ReadVarArgs(state, argc, argv);
     if (args == NULL) {
@@ -2131,6 +2253,7 @@ void RegisterInstallFunctions() {
 
     RegisterFunction("apply_patch", ApplyPatchFn);
     RegisterFunction("apply_patch_check", ApplyPatchCheckFn);
+    RegisterFunction("apply_patch_check_batch", ApplyPatchCheckBatchFn);
     RegisterFunction("apply_patch_space", ApplyPatchSpaceFn);
 
     RegisterFunction("read_file", ReadFileFn);